@@ -0,0 +1,35 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "kernel.h"
+
+// Benchmark sample collection. Each operation is timed with the TSC;
+// reports give the rate, the mean and latency percentiles, either as a
+// table row or as one "BENCH key=value ..." line for scripts.
+typedef struct bench {
+    const char *suite;
+    const char *name;
+    u32 *samples;    // Cycles per operation
+    u32 count;
+    u32 capacity;
+    u32 errors;      // Failed operations, counted by the caller
+    u64 total;       // Cycles across all samples
+    u64 start;
+} bench_t;
+
+int bench_init(bench_t *b, const char *suite, const char *name, u32 capacity);
+void bench_free(bench_t *b);
+void bench_record(bench_t *b, u64 cycles);
+u32 bench_percentile(bench_t *b, u32 percent);
+void bench_header(int machine);
+void bench_report(bench_t *b, int machine);
+
+static inline void bench_begin(bench_t *b) {
+    b->start = timer_read_tsc();
+}
+
+static inline void bench_end(bench_t *b) {
+    bench_record(b, timer_read_tsc() - b->start);
+}
+
+#endif // BENCH_H
@@ -0,0 +1,112 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "kernel.h"
+
+#define BLOCK_SECTOR_SIZE  512
+#define BLOCK_MAX_DEVICES  8
+
+// Request status values
+#define BLOCK_REQ_DONE     0
+#define BLOCK_REQ_PENDING  1
+#define BLOCK_REQ_ERROR   -1
+
+struct block_device;
+
+// A single transfer of 'count' sectors starting at 'lba'. Requests are
+// queued per device and completed by the driver, usually from its IRQ
+// handler, which then calls 'done' if one is set.
+//
+// While queued, a request that continues another one on disk is merged
+// behind it: the driver receives the head request and transfers every
+// request on its 'merged' chain as one scatter-gather command.
+typedef struct block_request {
+    struct block_device *dev;
+    u32 lba;
+    u32 count;
+    u8 *buffer;
+    u8 write;
+    volatile s32 status;
+    void (*done)(struct block_request *req);
+    void *private;
+    struct block_request *next;
+
+    // Merge state, valid on the head request
+    struct block_request *merged;
+    struct block_request *merged_tail;
+    u32 total_count;
+    u32 segments;
+} block_request_t;
+
+// A block device registered by a driver
+typedef struct block_device {
+    char name[8];
+    u32 sector_count;
+    u32 max_sectors;   // largest single request the driver accepts
+    u32 max_segments;  // buffers per request; 1 disables merging
+    u32 queue_depth;   // requests the driver can have in flight
+
+    // Driver hooks: start hands a request to the hardware; commit is
+    // called once after a batch of starts (may be NULL), so drivers can
+    // ring their doorbell once; poll drives completion when interrupts
+    // are disabled (may be NULL)
+    void (*start)(struct block_device *dev, block_request_t *req);
+    void (*commit)(struct block_device *dev);
+    void (*poll)(struct block_device *dev);
+    void *driver_data;
+
+    // Request queue (owned by the block layer)
+    block_request_t *queue_head;
+    block_request_t *queue_tail;
+    u32 in_flight;
+    u8 dispatching;
+    u8 plugged;
+
+    // Readahead state (owned by the page cache)
+    u32 ra_last;
+    u32 ra_next;
+    u32 ra_window;
+
+    // Statistics
+    u32 reads;
+    u32 writes;
+    u32 sectors_read;
+    u32 sectors_written;
+    u32 errors;
+    u32 merges;
+    u32 max_in_flight;
+} block_device_t;
+
+// Device registry
+int block_register(block_device_t *dev);
+block_device_t *block_get(const char *name);
+void block_list_devices(void);
+
+// Request interface
+int block_submit(block_request_t *req);
+void block_plug(block_device_t *dev);
+void block_unplug(block_device_t *dev);
+void block_complete(block_request_t *req, int ok);
+int block_wait(block_request_t *req);
+int block_read(block_device_t *dev, u32 lba, u32 count, void *buffer);
+int block_write(block_device_t *dev, u32 lba, u32 count, const void *buffer);
+
+// Page cache between file systems and block devices
+#define PAGECACHE_PAGES    32
+#define PAGECACHE_HASH     64
+#define PAGECACHE_RA_MAX   8
+#define PAGECACHE_SECTORS  (PAGE_SIZE / BLOCK_SECTOR_SIZE)
+
+// Cached page handle for callers that parse device data in place
+typedef struct cache_page cache_page_t;
+
+void pagecache_init(void);
+cache_page_t *pagecache_get(block_device_t *dev, u32 index);
+void pagecache_put(cache_page_t *page);
+u8 *pagecache_data(cache_page_t *page);
+int pagecache_read(block_device_t *dev, u32 offset, void *buffer, u32 size);
+int pagecache_write(block_device_t *dev, u32 offset, const void *buffer, u32 size);
+void pagecache_invalidate(block_device_t *dev);
+void pagecache_stats(void);
+
+#endif // BLOCK_H
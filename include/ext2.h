@@ -0,0 +1,16 @@
+#ifndef EXT2_H
+#define EXT2_H
+
+#include "kernel.h"
+#include "block.h"
+
+// Read-only ext2 volume, reached through absolute paths ("/dir/file")
+int ext2_mount(block_device_t *dev);
+void ext2_unmount(void);
+int ext2_is_mounted(void);
+int ext2_read(const char *path, u32 offset, void *buffer, u32 size);
+int ext2_file_size(const char *path);
+int ext2_list_dir(const char *path);
+void ext2_stats(void);
+
+#endif // EXT2_H
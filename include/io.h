@@ -0,0 +1,80 @@
+#ifndef IO_H
+#define IO_H
+
+#include "kernel.h"
+
+// Port I/O helpers
+static inline void outb(u16 port, u8 val) {
+    __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline u8 inb(u16 port) {
+    u8 val;
+    __asm__ volatile ("inb %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+static inline void outw(u16 port, u16 val) {
+    __asm__ volatile ("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline u16 inw(u16 port) {
+    u16 val;
+    __asm__ volatile ("inw %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+static inline void outl(u16 port, u32 val) {
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline u32 inl(u16 port) {
+    u32 val;
+    __asm__ volatile ("inl %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+// Read/write 'count' 16-bit words from/to a data port
+static inline void insw(u16 port, void *addr, u32 count) {
+    __asm__ volatile ("rep insw" : "+D"(addr), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(u16 port, const void *addr, u32 count) {
+    __asm__ volatile ("rep outsw" : "+S"(addr), "+c"(count) : "d"(port) : "memory");
+}
+
+// Short delay: a write to an unused port takes roughly 1us
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
+
+// Compiler barrier for memory shared with devices. x86 does not reorder
+// stores with other stores, so this is enough for descriptor rings.
+#define barrier() __asm__ volatile ("" : : : "memory")
+
+// Full barrier: x86 may let a load pass an earlier store, which matters
+// when a store must be visible before reading what the device wrote
+// (virtqueue event indexes). A locked add is cheaper than mfence.
+#define mb() __asm__ volatile ("lock; addl $0, 0(%%esp)" : : : "memory", "cc")
+
+// Interrupt state helpers. irq_save disables interrupts and returns the
+// previous EFLAGS, which irq_restore uses to re-enable them if needed.
+static inline u32 irq_save(void) {
+    u32 flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(u32 flags) {
+    if (flags & 0x200) {
+        __asm__ volatile ("sti" : : : "memory");
+    }
+}
+
+static inline int irq_enabled(void) {
+    u32 flags;
+    __asm__ volatile ("pushf; pop %0" : "=r"(flags));
+    return (flags & 0x200) != 0;
+}
+
+#endif // IO_H
@@ -39,6 +39,14 @@ struct multiboot_info {
     u16 vbe_interface_len;
 };
 
+// Multiboot module descriptor
+struct multiboot_module {
+    u32 mod_start;
+    u32 mod_end;
+    u32 string;
+    u32 reserved;
+};
+
 // System constants
 #define KERNEL_VIRTUAL_BASE 0xC0000000
 #define KERNEL_PAGE_NUMBER  (KERNEL_VIRTUAL_BASE >> 22)
@@ -47,6 +55,7 @@ struct multiboot_info {
 #define PAGE_SIZE 4096
 #define HEAP_START 0x00100000
 #define HEAP_INITIAL_SIZE 0x00100000
+#define HEAP_MAX_SIZE     0x00800000  // Used when the machine has the memory
 
 // Process states
 typedef enum {
@@ -84,10 +93,22 @@ void keyboard_init(void);
 void timer_init(void);
 void shell_init(void);
 void network_init(void);
+void pci_init(void);
+void block_init(void);
+void ata_init(void);
+void virtio_blk_init(void);
+void e1000_init(void);
+void virtio_net_init(void);
+void ext2_init(void);
+void initramfs_init(struct multiboot_info *mbi);
 
 // Memory management functions
 void *kmalloc(u32 size);
+void *kmalloc_aligned(u32 size, u32 align);
+int memory_map_region(u32 start, u32 size);
+int memory_map_device(u32 start, u32 size);
 void kfree(void *ptr);
+void kshrink(void *ptr, u32 size);
 void memory_stats(void);
 
 // Process management functions
@@ -100,10 +121,38 @@ void terminate_process(u32 pid);
 // File system functions
 int fs_create_file(const char *name, const char *content, u32 size);
 int fs_read_file(const char *name, char *buffer, u32 buffer_size);
+int fs_read_at(const char *name, u32 offset, char *buffer, u32 size);
 int fs_delete_file(const char *name);
 void fs_list_files(void);
+int fs_list_dir(const char *path);
 int fs_write_file(const char *name, const char *content, u32 size);
+int fs_write_at(const char *name, u32 offset, const char *content, u32 size);
+int fs_append(const char *name, const char *content, u32 size);
+int fs_set_log_mode(const char *name, int enable);
+void fs_log_clean_now(void);
+int fs_clone_file(const char *src_name, const char *dst_name);
+int fs_register_external(const char *name, const u8 *data, u32 size);
 void fs_stats(void);
+void fs_set_compress_interval(u32 seconds);
+u32 fs_get_compress_interval(void);
+int fs_set_compression(const char *name, int enable);
+void fs_compress_now(void);
+void fs_set_big_lock(int enable);
+void fs_lock_stats(u32 *read_waits, u32 *write_waits, u32 *retries);
+void fs_stress(u32 threads, u32 iterations);
+int fs_readdir(u32 index, char *name, u32 name_size, u32 *size);
+void fs_bench(u32 file_count, u32 file_size, int machine);
+
+// A referenced piece of a file page, for sending without a copy
+typedef struct fs_page_ref {
+    const u8 *data;
+    u32 len;
+    void *page;  // Released with fs_put_page
+} fs_page_ref_t;
+
+int fs_get_pages(const char *name, u32 offset, u32 size, fs_page_ref_t *refs, u32 max_refs);
+void fs_get_page(void *page);
+void fs_put_page(void *page);
 
 // Timer functions
 u32 timer_get_ticks(void);
@@ -111,6 +160,32 @@ u32 timer_get_uptime(void);
 void timer_sleep(u32 ticks);
 void timer_sleep_ms(u32 ms);
 void timer_set_frequency(u32 frequency);
+u32 timer_get_frequency(void);
+u64 timer_read_tsc(void);
+u32 timer_tsc_khz(void);
+u32 timer_cycles_to_ns(u64 cycles);
+u32 timer_cycles_to_us(u64 cycles);
+
+// Serial port (COM1), output only
+void serial_init(void);
+int serial_present(void);
+void serial_write(const void *data, u32 len);
+
+// Kernel thread functions
+int kthread_create(void (*fn)(void *), void *arg);
+void kthread_yield(void);
+void kthread_preempt_point(void);
+void kthread_tick(void);
+void kthread_set_interleave(int enable);
+void kthread_join(void);
+u32 kthread_self(void);
+
+// Deferred work functions
+int work_register(const char *name, void (*fn)(void), u32 period_ms);
+void work_raise(int id);
+void work_run(void);
+int work_pending(void);
+void work_list(void);
 
 // Keyboard functions
 char keyboard_getchar(void);
@@ -119,15 +194,19 @@ int keyboard_readline(char *buffer, int max_len);
 
 // Network functions
 void network_list_interfaces(void);
-int network_ping(u32 target_ip);
+int network_ping(u32 target_ip, u32 count);
 void network_stats(void);
 int network_socket(int domain, int type, int protocol);
 int network_bind(int sockfd, u32 addr, u16 port);
 int network_listen(int sockfd, int backlog);
+int network_sendto(int sockfd, const void *buf, u32 len, int flags, u32 addr, u16 port);
+int network_recvfrom(int sockfd, void *buf, u32 len, int flags, u32 *addr, u16 *port);
+int network_close(int sockfd);
 void network_test_receive(void);
 
 // Interrupt functions
 void register_interrupt_handler(u8 n, void (*handler)(void));
+int register_irq_handler(u8 irq, void (*handler)(void));
 void idt_set_gate(u8 num, u32 base, u16 sel, u8 flags);
 
 // System call dispatcher
@@ -142,5 +221,6 @@ int strcmp(const char *s1, const char *s2);
 char *strcpy(char *dest, const char *src);
 char *strcat(char *dest, const char *src);
 int snprintf(char *str, size_t size, const char *format, ...);
+u32 udiv64(u64 n, u32 d);
 
 #endif // KERNEL_H
\ No newline at end of file
@@ -0,0 +1,12 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "kernel.h"
+
+// LZ4 block format (no frame header). lz4_compress returns the
+// compressed size, or 0 if the result does not fit in 'dst_cap' bytes.
+// lz4_decompress returns the decompressed size, or -1 on corrupt input.
+u32 lz4_compress(const u8 *src, u32 src_len, u8 *dst, u32 dst_cap);
+int lz4_decompress(const u8 *src, u32 src_len, u8 *dst, u32 dst_cap);
+
+#endif // LZ4_H
@@ -0,0 +1,343 @@
+#ifndef NET_H
+#define NET_H
+
+#include "kernel.h"
+#include "ring.h"
+
+#define NET_MAX_INTERFACES 4
+#define NET_ETH_HEADER     14
+#define NET_ETH_MTU        1500
+#define NET_ETH_FRAME_MAX  (NET_ETH_HEADER + NET_ETH_MTU)
+
+// Received frames wait in a per-interface ring until the deferred RX
+// job runs; beyond this many further frames are dropped
+#define NET_RX_RING_SIZE   256
+
+// Receive polling: frames a device may hand up per poll, by default
+// and at most (the ring must have room for a full poll)
+#define NET_RX_BUDGET      64
+#define NET_RX_BUDGET_MAX  NET_RX_RING_SIZE
+
+// Ethernet protocol types
+#define PROTO_ARP  0x0806
+#define PROTO_IP   0x0800
+
+// IP protocol numbers
+#define PROTO_ICMP 0x01
+#define PROTO_TCP  0x06
+#define PROTO_UDP  0x11
+
+#define IP_LOOPBACK  0x7F000001  // 127.0.0.1
+#define IP_BROADCAST 0xFFFFFFFF
+
+// Addresses and ports are kept in host byte order; these convert to and
+// from the big-endian wire format
+static inline u16 net_htons(u16 x) {
+    return (u16)((x << 8) | (x >> 8));
+}
+
+static inline u32 net_htonl(u32 x) {
+    return (x << 24) | ((x & 0xFF00) << 8) | ((x >> 8) & 0xFF00) | (x >> 24);
+}
+
+#define net_ntohs net_htons
+#define net_ntohl net_htonl
+
+typedef struct eth_header {
+    u8 dst[6];
+    u8 src[6];
+    u16 type;
+} __attribute__((packed)) eth_header_t;
+
+typedef struct ip_header {
+    u8 version_ihl;
+    u8 tos;
+    u16 total_length;
+    u16 id;
+    u16 frag_offset;   // Flags in the top three bits
+    u8 ttl;
+    u8 protocol;
+    u16 checksum;
+    u32 src;
+    u32 dst;
+} __attribute__((packed)) ip_header_t;
+
+#define IP_FLAG_DF      0x4000
+#define IP_FLAG_MF      0x2000
+#define IP_OFFSET_MASK  0x1FFF
+#define IP_DEFAULT_TTL  64
+
+typedef struct icmp_header {
+    u8 type;
+    u8 code;
+    u16 checksum;
+    u16 id;
+    u16 sequence;
+} __attribute__((packed)) icmp_header_t;
+
+#define ICMP_ECHO_REPLY   0
+#define ICMP_ECHO_REQUEST 8
+
+typedef struct udp_header {
+    u16 src_port;
+    u16 dst_port;
+    u16 length;
+    u16 checksum;
+} __attribute__((packed)) udp_header_t;
+
+// Largest UDP payload that fits in one Ethernet frame
+#define UDP_MAX_PAYLOAD (NET_ETH_MTU - sizeof(ip_header_t) - sizeof(udp_header_t))
+
+typedef struct tcp_header {
+    u16 src_port;
+    u16 dst_port;
+    u32 seq;
+    u32 ack;
+    u8 data_offset;              // Header length in words, in the high nibble
+    u8 flags;
+    u16 window;
+    u16 checksum;
+    u16 urgent;
+} __attribute__((packed)) tcp_header_t;
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+
+// Largest TCP payload that fits in one Ethernet frame without options
+#define TCP_MSS_MAX (NET_ETH_MTU - sizeof(ip_header_t) - sizeof(tcp_header_t))
+
+// Packet buffers. Each has a fixed data area with headroom reserved in
+// front, so protocol headers can be pushed and pulled in place, and
+// room behind for appending. Buffers come from a preallocated pool and
+// are reference counted: whoever holds a reference may read the data,
+// and a buffer shared by several holders must not be modified.
+//
+// An outgoing packet may also end in fragments: memory outside the
+// buffer, such as file pages, that follows the data and is sent without
+// being copied. The buffer holds a reference on whatever owns each
+// fragment and drops it, through the fragment's release hook, when the
+// buffer is freed. Received packets never have fragments.
+#define NETBUF_HEADROOM   64
+#define NETBUF_DATA_SIZE  2048
+#define NETBUF_POOL_SIZE  512
+#define NETBUF_MAX_FRAGS  2      // A full-sized segment spans at most two pages
+
+typedef struct netbuf_frag {
+    const u8 *data;
+    u32 len;
+    void *owner;                 // Kept alive while the buffer is
+    void (*release)(void *owner);
+} netbuf_frag_t;
+
+// Buffer flags
+#define NETBUF_LOCAL 0x01        // Looped back; carries no checksums to verify
+
+typedef struct netbuf {
+    u8 *data;                    // Start of valid data
+    u32 len;                     // Bytes of valid data
+    volatile u32 refcount;
+    u16 protocol;                // Ethernet type, set on receive
+    u8 flags;
+    struct network_interface *iface;
+    struct netbuf *next;         // Queue link for the current owner
+    union {
+        struct {
+            u32 peer_addr;       // Sender, once queued on a UDP socket
+            u16 peer_port;
+        };
+        u32 seq;                 // TCP sequence number of data[0]
+    };
+    u32 frag_count;
+    u32 frag_len;                // Bytes in fragments, after the data
+    netbuf_frag_t frags[NETBUF_MAX_FRAGS];
+    u8 buffer[NETBUF_HEADROOM + NETBUF_DATA_SIZE] __attribute__((aligned(16)));
+} netbuf_t;
+
+void netbuf_init(void);
+netbuf_t *netbuf_alloc(void);
+void netbuf_get(netbuf_t *nb);
+void netbuf_put(netbuf_t *nb);
+void netbuf_reset(netbuf_t *nb);
+u8 *netbuf_push(netbuf_t *nb, u32 len);
+u8 *netbuf_pull(netbuf_t *nb, u32 len);
+u8 *netbuf_append(netbuf_t *nb, u32 len);
+int netbuf_attach(netbuf_t *nb, const u8 *data, u32 len, void *owner, void (*release)(void *owner));
+int netbuf_linearize(netbuf_t *nb);
+void netbuf_stats(void);
+
+static inline u32 netbuf_headroom(netbuf_t *nb) {
+    return nb->data - nb->buffer;
+}
+
+static inline u32 netbuf_tailroom(netbuf_t *nb) {
+    return nb->buffer + sizeof(nb->buffer) - (nb->data + nb->len);
+}
+
+// Length of the whole packet, fragments included
+static inline u32 netbuf_total_len(netbuf_t *nb) {
+    return nb->len + nb->frag_len;
+}
+
+// A network interface. Drivers register one per device and fill in the
+// hooks; the loopback interface has none.
+typedef struct network_interface {
+    char name[16];
+    u8 mac_address[6];
+    u32 ip_address;
+    u32 netmask;
+    u32 gateway;
+    u8 active;
+
+    // Driver hooks: transmit places one Ethernet frame on the device's
+    // ring (returning -1 if it is full), taking its own reference to the
+    // buffer until the device is done with it; commit is called once
+    // after a batch of transmits so the driver can ring its doorbell
+    // once; stats prints driver-specific counters (may be NULL). Buffers
+    // with fragments reach transmit only if the driver sets gather; the
+    // others get them flattened first.
+    int (*transmit)(struct network_interface *iface, netbuf_t *nb);
+    void (*commit)(struct network_interface *iface);
+    void (*stats)(struct network_interface *iface);
+    void *driver_data;
+    u8 gather;
+    u8 capture;           // Frames go to capture_packet (see capture.c)
+
+    // Receive polling hooks. A driver's RX interrupt masks itself and
+    // calls network_schedule_poll; the net-rx job then calls poll, which
+    // hands up at most 'budget' frames and returns how many it did. Once
+    // a poll comes in under budget the ring is empty and poll_done
+    // unmasks the interrupt, returning non-zero if frames arrived in the
+    // meantime. set_coalesce sets the device's interrupt delay in
+    // microseconds (may be NULL).
+    u32 (*poll)(struct network_interface *iface, u32 budget);
+    int (*poll_done)(struct network_interface *iface);
+    void (*set_coalesce)(struct network_interface *iface, u32 usecs);
+    volatile u8 poll_scheduled;
+
+    // Statistics
+    u32 rx_packets;
+    u32 rx_bytes;
+    u32 rx_dropped;
+    u32 tx_packets;
+    u32 tx_bytes;
+    u32 tx_dropped;
+    u32 tx_doorbells;
+    u32 tx_linearized;    // Fragmented buffers copied for a driver that cannot gather
+    u32 interrupts;
+    u32 polls;
+    u32 polls_exhausted;  // Polls that used their whole budget
+
+    // Received frames. The driver's poll routine is the only producer
+    // and the net-rx job the only consumer; loopback has no ring.
+    spsc_ring_t rx_ring;
+    void *rx_slots[NET_RX_RING_SIZE];
+} network_interface_t;
+
+// Interface registry. A NULL name picks the next free "ethN".
+network_interface_t *network_register_interface(const char *name, const u8 *mac);
+network_interface_t *network_get_interface(const char *name);
+u32 network_interface_count(void);
+network_interface_t *network_interface_at(u32 index);
+
+// Hand a received Ethernet frame to the stack; callable from IRQ
+// handlers. network_receive_netbuf takes over the caller's reference;
+// network_receive copies the frame into a new buffer.
+void network_receive_netbuf(network_interface_t *iface, netbuf_t *nb);
+void network_receive(network_interface_t *iface, const u8 *frame, u32 len);
+
+// Send a packet whose payload starts at nb->data to hardware address
+// 'dst' on 'iface', adding the Ethernet header. Takes over the caller's
+// reference. The loopback interface has no device and drops the frame;
+// IP to our own addresses goes through network_loopback instead.
+int network_output(network_interface_t *iface, const u8 *dst, u16 type, netbuf_t *nb);
+
+// Loopback fast path for IP packets to our own addresses: no Ethernet
+// header and no receive ring. network_loopback takes over the reference
+// and holds the packet until network_loopback_flush hands it to
+// ip_input, in the same thread, once the protocol call that sent it has
+// returned. Socket calls flush before they return; the net-rx job
+// catches anything else.
+void network_loopback(netbuf_t *nb);
+void network_loopback_flush(void);
+
+// Parse a dotted-quad address; returns -1 if it is malformed
+int net_parse_ip(const char *str, u32 *ip);
+
+// ARP: handle a received ARP packet, and send an IP packet to a next
+// hop on an Ethernet interface, queueing it while the address resolves
+void arp_init(void);
+void arp_input(network_interface_t *iface, netbuf_t *nb);
+int arp_output(network_interface_t *iface, u32 next_hop, netbuf_t *nb);
+void arp_list(void);
+void arp_stats(void);
+
+// Routing table with longest-prefix match. A zero gateway means the
+// destination is on the interface's own network.
+int route_add(u32 prefix, u32 bits, u32 gateway, network_interface_t *iface);
+int route_delete(u32 prefix, u32 bits);
+network_interface_t *route_lookup(u32 dst, u32 *next_hop);
+u32 route_mask_len(u32 netmask);
+void route_list(void);
+void route_bench(u32 count, int machine);
+
+// Packet capture into a ring, exported as pcap over the serial port.
+// The receive and transmit paths call capture_packet only for
+// interfaces with 'capture' set; 'link' is 0 for loopback packets,
+// which have no Ethernet header.
+int capture_start(network_interface_t *iface, u32 snaplen, int argc, char **argv);
+void capture_stop(void);
+void capture_packet(netbuf_t *nb, int link);
+int capture_dump(void);
+void capture_status(void);
+void capture_print_filter(void);
+
+// Internet checksum, with the summing loop picked for the CPU at boot.
+// The update helpers patch a checksum after a field changes (RFC 1624).
+void checksum_init(void);
+const char *checksum_impl_name(void);
+u16 ip_checksum(const void *data, u32 len);
+u32 ip_checksum_add(u32 sum, const void *data, u32 len);
+u16 ip_checksum_fold(u32 sum);
+u16 ip_checksum_update16(u16 check, u16 old_word, u16 new_word);
+u16 ip_checksum_update32(u16 check, u32 old_value, u32 new_value);
+void checksum_bench(u32 size, u32 iterations, int machine);
+
+// IPv4. Input handlers take over the packet's reference, with nb->data
+// at the start of their header.
+u16 ip_pseudo_checksum(u32 src, u32 dst, u8 protocol, const void *data, u32 len);
+u16 ip_pseudo_checksum_netbuf(u32 src, u32 dst, u8 protocol, netbuf_t *nb);
+int ip_is_local(u32 ip);
+network_interface_t *ip_route(u32 dst, u32 *next_hop);
+void ip_input(network_interface_t *iface, netbuf_t *nb);
+int ip_output(netbuf_t *nb, u32 src, u32 dst, u8 protocol);
+void icmp_input(netbuf_t *nb, ip_header_t *ip);
+void udp_input(netbuf_t *nb, ip_header_t *ip);
+void tcp_init(void);
+void tcp_input(netbuf_t *nb, ip_header_t *ip);
+void ip_stats(void);
+
+// Ask the net-rx job to poll an interface; callable from IRQ handlers
+void network_schedule_poll(network_interface_t *iface);
+
+// Polling knobs: frames per poll, and the interrupt delay applied to
+// every device that supports one
+void network_set_rx_budget(u32 budget);
+u32 network_get_rx_budget(void);
+void network_set_rx_coalesce(u32 usecs);
+u32 network_get_rx_coalesce(void);
+void network_poll_stats(void);
+
+// Send Ethernet frames; network_commit flushes a batch to the device.
+// network_transmit_netbuf leaves the caller's reference alone.
+int network_transmit_netbuf(network_interface_t *iface, netbuf_t *nb);
+int network_transmit(network_interface_t *iface, const u8 *frame, u32 len);
+void network_commit(network_interface_t *iface);
+
+// Transmit throughput test: 'count' broadcast frames of 'size' bytes
+void network_tx_test(const char *name, u32 count, u32 size);
+
+#endif // NET_H
@@ -0,0 +1,60 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include "kernel.h"
+
+// PCI configuration space access ports
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Configuration space registers
+#define PCI_VENDOR_ID      0x00
+#define PCI_DEVICE_ID      0x02
+#define PCI_COMMAND        0x04
+#define PCI_STATUS         0x06
+#define PCI_PROG_IF        0x09
+#define PCI_SUBCLASS       0x0A
+#define PCI_CLASS          0x0B
+#define PCI_HEADER_TYPE    0x0E
+#define PCI_BAR0           0x10
+#define PCI_INTERRUPT_LINE 0x3C
+
+// Command register bits
+#define PCI_COMMAND_IO     0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_MASTER 0x0004
+
+#define PCI_MAX_DEVICES 32
+
+// A discovered PCI function
+typedef struct pci_device {
+    u8 bus;
+    u8 slot;
+    u8 func;
+    u16 vendor_id;
+    u16 device_id;
+    u8 class_code;
+    u8 subclass;
+    u8 prog_if;
+    u8 irq_line;
+    u32 bar[6];
+} pci_device_t;
+
+// Configuration space access
+u32 pci_config_read(pci_device_t *dev, u8 offset);
+u16 pci_config_read16(pci_device_t *dev, u8 offset);
+void pci_config_write(pci_device_t *dev, u8 offset, u32 value);
+void pci_config_write16(pci_device_t *dev, u8 offset, u16 value);
+
+// Device lookup
+pci_device_t *pci_find_class(u8 class_code, u8 subclass);
+pci_device_t *pci_find_device(u16 vendor_id, u16 device_id);
+
+// BAR helpers
+int pci_bar_is_io(pci_device_t *dev, int bar);
+u32 pci_bar_address(pci_device_t *dev, int bar);
+
+void pci_enable_bus_master(pci_device_t *dev);
+void pci_list_devices(void);
+
+#endif // PCI_H
@@ -0,0 +1,64 @@
+#ifndef POLL_H
+#define POLL_H
+
+#include "kernel.h"
+#include "sync.h"
+
+// Readiness notification. Everything a thread can wait on (a socket, a
+// pipe end, the keyboard) has a poll head: a wait queue for threads
+// blocked on it directly, and the epoll items watching it. The owner
+// calls poll_wake when its state changes, which moves the matching items
+// onto their epoll's ready list, so epoll_wait only ever looks at
+// descriptors that became ready.
+
+#define POLLIN   0x001        // Data to read, a connection to accept, or end of stream
+#define POLLOUT  0x004        // Room to write
+#define POLLERR  0x008        // Error; reported whether asked for or not
+#define POLLHUP  0x010        // Other end gone; reported whether asked for or not
+#define EPOLLET  0x80000000   // Edge-triggered: report each change once
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define STDIN_FD 0            // The keyboard
+
+typedef struct epoll_event {
+    u32 events;
+    u32 data;                 // Returned as given to epoll_ctl
+} epoll_event_t;
+
+// epoll_ctl and epoll_wait take four arguments, one more than fits in
+// the syscall registers, so the rest travel in one of these
+typedef struct epoll_msg {
+    int fd;                   // epoll_ctl: descriptor to watch
+    epoll_event_t *events;    // epoll_ctl: the interest; epoll_wait: filled in
+    u32 max_events;           // epoll_wait
+    int timeout_ms;           // epoll_wait: -1 waits forever, 0 not at all
+} epoll_msg_t;
+
+typedef struct poll_head {
+    wait_queue_t wait;
+    struct epoll_item *items;
+} poll_head_t;
+
+void poll_wake(poll_head_t *head, u32 events);
+void poll_release(poll_head_t *head);
+
+int epoll_create(void);
+int epoll_ctl(int epfd, int op, int fd, const epoll_event_t *event);
+int epoll_wait(int epfd, epoll_event_t *events, u32 max_events, int timeout_ms);
+int epoll_close(int epfd);
+void epoll_bench(u32 fds, u32 iterations, int machine);
+
+// Pipes
+int pipe_create(int fds[2]);
+int pipe_read(int fd, void *buf, u32 len, int flags);
+int pipe_write(int fd, const void *buf, u32 len, int flags);
+int pipe_close(int fd);
+poll_head_t *pipe_poll(int fd, u32 *events);
+
+// Keyboard
+poll_head_t *keyboard_poll(u32 *events);
+
+#endif // POLL_H
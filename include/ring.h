@@ -0,0 +1,93 @@
+#ifndef RING_H
+#define RING_H
+
+#include "kernel.h"
+#include "io.h"
+
+// Single-producer/single-consumer ring of pointers. Exactly one context
+// may enqueue (typically an interrupt handler) and one may dequeue, and
+// neither needs a lock or has to disable interrupts. head and tail run
+// freely and are masked on use, so the fill level is always tail - head.
+// The producer and consumer indexes sit on separate cache lines so the
+// two sides do not keep stealing each other's line.
+
+#define RING_CACHE_LINE 64
+
+typedef struct spsc_ring {
+    // Consumer side
+    volatile u32 head __attribute__((aligned(RING_CACHE_LINE)));
+    u32 dequeued;
+
+    // Producer side
+    volatile u32 tail __attribute__((aligned(RING_CACHE_LINE)));
+    u32 enqueued;
+    u32 drops;        // Items refused because the ring was full
+    u32 high_water;   // Highest fill level seen
+
+    // Shared, read-only after init
+    void **slots __attribute__((aligned(RING_CACHE_LINE)));
+    u32 mask;
+} spsc_ring_t;
+
+// 'size' must be a power of two; 'slots' holds 'size' pointers
+static inline void spsc_ring_init(spsc_ring_t *ring, void **slots, u32 size) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dequeued = 0;
+    ring->enqueued = 0;
+    ring->drops = 0;
+    ring->high_water = 0;
+    ring->slots = slots;
+    ring->mask = size - 1;
+}
+
+static inline u32 spsc_ring_count(spsc_ring_t *ring) {
+    return ring->tail - ring->head;
+}
+
+static inline u32 spsc_ring_capacity(spsc_ring_t *ring) {
+    return ring->mask + 1;
+}
+
+// Producer: returns -1 (and counts a drop) if the ring is full
+static inline int spsc_ring_enqueue(spsc_ring_t *ring, void *item) {
+    u32 tail = ring->tail;
+    u32 used = tail - ring->head;
+    if (used > ring->mask) {
+        ring->drops++;
+        return -1;
+    }
+
+    ring->slots[tail & ring->mask] = item;
+    // x86 keeps stores in order; only the compiler must not move the
+    // slot write past the index that publishes it
+    barrier();
+    ring->tail = tail + 1;
+
+    ring->enqueued++;
+    if (used + 1 > ring->high_water) ring->high_water = used + 1;
+    return 0;
+}
+
+// Consumer: move up to 'max' items into 'items', returning how many
+static inline u32 spsc_ring_dequeue_batch(spsc_ring_t *ring, void **items, u32 max) {
+    u32 head = ring->head;
+    u32 count = ring->tail - head;
+    barrier();  // Read the slots only after seeing the tail
+    if (count > max) count = max;
+
+    for (u32 i = 0; i < count; i++) {
+        items[i] = ring->slots[(head + i) & ring->mask];
+    }
+    barrier();  // Finish reading the slots before handing them back
+    ring->head = head + count;
+    ring->dequeued += count;
+    return count;
+}
+
+static inline void *spsc_ring_dequeue(spsc_ring_t *ring) {
+    void *item;
+    return spsc_ring_dequeue_batch(ring, &item, 1) ? item : NULL;
+}
+
+#endif // RING_H
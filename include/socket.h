@@ -0,0 +1,181 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include "kernel.h"
+#include "net.h"
+#include "poll.h"
+
+// BSD-style sockets. Addresses and ports are in host byte order, like
+// everywhere else in the stack.
+
+#define AF_INET       2
+
+#define SOCK_STREAM   1
+#define SOCK_DGRAM    2
+#define SOCK_NONBLOCK 0x800   // Or'ed into the type
+
+#define MSG_DONTWAIT  0x40    // Per-call non-blocking
+
+// Socket options
+#define SO_NONBLOCK   1       // Non-zero for non-blocking
+#define SO_RCVTIMEO   2       // Receive, accept and connect timeout in ms, 0 to wait forever
+#define SO_RCVBUF     3       // Datagrams the receive queue may hold
+#define SO_SNDTIMEO   4       // Send timeout in ms, 0 to wait forever
+
+// Errors, returned negated. Pipes and epoll use them too.
+#define NET_ENOENT        2
+#define NET_EBADF         9
+#define NET_EAGAIN        11
+#define NET_ENOMEM        12
+#define NET_EEXIST        17
+#define NET_ENODEV        19
+#define NET_EINVAL        22
+#define NET_EMFILE        24
+#define NET_EPIPE         32
+#define NET_EDESTADDRREQ  89
+#define NET_EMSGSIZE      90
+#define NET_EPROTONOSUPPORT 93
+#define NET_EOPNOTSUPP    95
+#define NET_EAFNOSUPPORT  97
+#define NET_EADDRINUSE    98
+#define NET_EADDRNOTAVAIL 99
+#define NET_ENETUNREACH   101
+#define NET_ECONNRESET    104
+#define NET_EISCONN       106
+#define NET_ENOTCONN      107
+#define NET_ETIMEDOUT     110
+#define NET_ECONNREFUSED  111
+#define NET_EALREADY      114
+#define NET_EINPROGRESS   115
+
+typedef struct sockaddr_in {
+    u16 family;
+    u16 port;
+    u32 addr;
+} sockaddr_in_t;
+
+// sendto and recvfrom take more arguments than fit in the three syscall
+// registers, so the buffer and address travel in one of these
+typedef struct socket_msg {
+    void *buf;
+    u32 len;
+    sockaddr_in_t *addr;
+} socket_msg_t;
+
+// sendfile's file and range; the offset is advanced past what was sent
+typedef struct sendfile_msg {
+    const char *name;
+    u32 offset;
+    u32 count;
+} sendfile_msg_t;
+
+#define SOCKET_RCVBUF_DEFAULT 64
+#define SOCKET_RCVBUF_MAX     NETBUF_POOL_SIZE
+
+typedef struct socket {
+    u8 used;
+    u8 type;
+    u8 nonblocking;
+    u32 local_addr;             // 0 for any local address
+    u16 local_port;             // 0 until bound
+    struct socket *hash_next;   // Protocol demultiplexing chain
+
+    // Received datagrams, oldest first, with the sender in each buffer
+    netbuf_t *rx_head;
+    netbuf_t *rx_tail;
+    u32 rx_count;
+    u32 rx_limit;
+    u32 rx_timeout_ms;
+    u32 tx_timeout_ms;
+
+    struct tcp_cb *tcb;         // Stream sockets, once listening or connecting
+    poll_head_t poll;           // Woken when data, room or a connection arrives
+
+    // Statistics
+    u32 rx_datagrams;
+    u32 rx_drops;               // Refused because the queue was full
+    u32 tx_datagrams;
+} socket_t;
+
+socket_t *socket_get(int fd);
+int socket_alloc(int type);
+int socket_block(socket_t *sock, int flags, u32 timeout_ms, int (*ready)(socket_t *sock));
+int socket_deliver(socket_t *sock, netbuf_t *nb, u32 addr, u16 port);
+u32 socket_poll(socket_t *sock);
+void socket_list(void);
+
+int network_setsockopt(int sockfd, int option, u32 value);
+int network_accept(int sockfd, u32 *addr, u16 *port);
+int network_connect(int sockfd, u32 addr, u16 port);
+int network_send(int sockfd, const void *buf, u32 len, int flags);
+int network_recv(int sockfd, void *buf, u32 len, int flags);
+int network_sendfile(int sockfd, const char *name, u32 offset, u32 count, int flags);
+
+// UDP
+int udp_bind(socket_t *sock, u32 addr, u16 port);
+void udp_unbind(socket_t *sock);
+int udp_sendto(socket_t *sock, const void *buf, u32 len, u32 addr, u16 port);
+void udp_stats(void);
+void udp_bench(u32 count, u32 size, int machine);
+
+// TCP
+typedef enum {
+    TCP_CLOSED,
+    TCP_LISTEN,
+    TCP_SYN_SENT,
+    TCP_SYN_RECEIVED,
+    TCP_ESTABLISHED,
+    TCP_FIN_WAIT_1,
+    TCP_FIN_WAIT_2,
+    TCP_CLOSE_WAIT,
+    TCP_CLOSING,
+    TCP_LAST_ACK,
+    TCP_TIME_WAIT,
+} tcp_state_t;
+
+// Connection state and counters, for tuning
+typedef struct tcp_info {
+    u32 state;
+    u32 mss;
+    u32 cwnd;                   // Bytes
+    u32 ssthresh;
+    u32 srtt_us;
+    u32 rttvar_us;
+    u32 rto_ms;
+    u32 snd_wnd;                // Peer's window, scaled
+    u32 rcv_wnd;
+    u8 snd_wscale;
+    u8 rcv_wscale;
+    u8 sack_ok;
+    u32 unacked;                // Bytes sent and not yet acknowledged
+    u32 segs_in;
+    u32 segs_out;
+    u32 bytes_acked;
+    u32 bytes_received;
+    u32 retransmits;            // Segments sent again, for any reason
+    u32 fast_retransmits;
+    u32 timeouts;
+    u32 dup_acks;
+    u32 sack_blocks;            // Received from the peer
+    u32 ooo_segments;           // Received out of order
+} tcp_info_t;
+
+int tcp_bind(socket_t *sock, u32 addr, u16 port);
+int tcp_listen(socket_t *sock, u32 backlog);
+int tcp_accept_ready(socket_t *sock);
+int tcp_accept(socket_t *listener, socket_t *sock, u32 *addr, u16 *port);
+int tcp_connect(socket_t *sock, u32 addr, u16 port);
+int tcp_send(socket_t *sock, const void *buf, u32 len, int flags);
+int tcp_sendfile(socket_t *sock, const char *name, u32 offset, u32 count, int flags);
+int tcp_recv(socket_t *sock, void *buf, u32 len, int flags);
+void tcp_close(socket_t *sock);
+u32 tcp_poll(socket_t *sock);
+int tcp_get_info(socket_t *sock, tcp_info_t *info);
+void tcp_stats(void);
+void tcp_list(void);
+void tcp_bench(u32 kbytes, u32 addr, u16 port, const char *file, int machine);
+
+// Traffic generator
+void netperf_run(int tcp, u32 size, u32 count, u32 rate, u32 addr, u16 port, int receive, int machine);
+
+#endif // SOCKET_H
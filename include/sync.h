@@ -0,0 +1,151 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "kernel.h"
+#include "io.h"
+
+// Atomic operations. The lock prefix keeps them correct on SMP too.
+static inline u32 atomic_add(volatile u32 *ptr, u32 val) {
+    __asm__ volatile ("lock xaddl %0, %1" : "+r"(val), "+m"(*ptr) : : "memory");
+    return val;  // Previous value
+}
+
+static inline void atomic_inc(volatile u32 *ptr) {
+    __asm__ volatile ("lock incl %0" : "+m"(*ptr) : : "memory");
+}
+
+// Returns non-zero if the value dropped to zero
+static inline int atomic_dec_and_test(volatile u32 *ptr) {
+    u8 zero;
+    __asm__ volatile ("lock decl %0; setz %1" : "+m"(*ptr), "=q"(zero) : : "memory");
+    return zero;
+}
+
+static inline u32 atomic_cmpxchg(volatile u32 *ptr, u32 old, u32 val) {
+    u32 prev;
+    __asm__ volatile ("lock cmpxchgl %2, %1"
+                      : "=a"(prev), "+m"(*ptr) : "r"(val), "0"(old) : "memory");
+    return prev;
+}
+
+// Spinlock. A contended lock yields to other kernel threads instead of
+// spinning, since without SMP the holder can only run if we let it.
+typedef struct spinlock {
+    volatile u32 locked;
+    u32 contended;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0, 0 }
+
+static inline int spin_trylock(spinlock_t *lock) {
+    return atomic_cmpxchg(&lock->locked, 0, 1) == 0;
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    if (spin_trylock(lock)) return;
+    lock->contended++;
+    while (!spin_trylock(lock)) {
+        kthread_yield();
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    barrier();
+    lock->locked = 0;
+}
+
+// Reader-writer lock: the low bits of 'state' count readers, or the
+// state is RW_WRITER while a writer holds it. A waiting writer sets
+// RW_WAITING, which holds off new readers so that a steady stream of
+// them cannot starve it.
+#define RW_WRITER  0x80000000
+#define RW_WAITING 0x40000000
+
+typedef struct rwlock {
+    volatile u32 state;
+} rwlock_t;
+
+#define RWLOCK_INIT { 0 }
+
+static inline int read_trylock(rwlock_t *lock) {
+    u32 state = lock->state;
+    return !(state & (RW_WRITER | RW_WAITING)) &&
+           atomic_cmpxchg(&lock->state, state, state + 1) == state;
+}
+
+static inline void read_lock(rwlock_t *lock) {
+    while (!read_trylock(lock)) {
+        kthread_yield();
+    }
+}
+
+static inline void read_unlock(rwlock_t *lock) {
+    atomic_add(&lock->state, (u32)-1);
+}
+
+static inline int write_trylock(rwlock_t *lock) {
+    return atomic_cmpxchg(&lock->state, 0, RW_WRITER) == 0;
+}
+
+static inline void write_lock(rwlock_t *lock) {
+    while (!write_trylock(lock)) {
+        u32 state = lock->state;
+        if (state == RW_WAITING) {
+            if (atomic_cmpxchg(&lock->state, RW_WAITING, RW_WRITER) == RW_WAITING) return;
+        } else if (!(state & (RW_WRITER | RW_WAITING))) {
+            atomic_cmpxchg(&lock->state, state, state | RW_WAITING);
+        }
+        kthread_yield();
+    }
+}
+
+static inline void write_unlock(rwlock_t *lock) {
+    barrier();
+    lock->state = 0;
+}
+
+// Sequence counter: lock-free readers retry if a writer ran meanwhile.
+// Writers must be serialized by a lock of their own.
+typedef struct seqcount {
+    volatile u32 sequence;
+} seqcount_t;
+
+static inline u32 read_seqbegin(seqcount_t *sc) {
+    u32 seq;
+    while ((seq = sc->sequence) & 1) {
+        kthread_yield();
+    }
+    barrier();
+    return seq;
+}
+
+static inline int read_seqretry(seqcount_t *sc, u32 seq) {
+    barrier();
+    return sc->sequence != seq;
+}
+
+static inline void write_seqbegin(seqcount_t *sc) {
+    sc->sequence++;
+    barrier();
+}
+
+static inline void write_seqend(seqcount_t *sc) {
+    barrier();
+    sc->sequence++;
+}
+
+// Wait queue: a count of wakeups. A waiter samples the count, checks its
+// condition, and sleeps until the count moves, so the condition is only
+// evaluated again once something may have changed it. Waking is a single
+// atomic increment, safe from interrupt handlers.
+typedef struct wait_queue {
+    volatile u32 wakeups;
+} wait_queue_t;
+
+static inline void wait_wake(wait_queue_t *wq) {
+    atomic_inc(&wq->wakeups);
+}
+
+int wait_event(wait_queue_t *wq, int (*ready)(void *arg), void *arg, u32 timeout_ms);
+
+#endif // SYNC_H
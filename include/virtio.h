@@ -0,0 +1,117 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "kernel.h"
+#include "pci.h"
+
+#define VIRTIO_VENDOR_ID 0x1AF4
+
+// Legacy virtio PCI register layout (I/O BAR0)
+#define VIRTIO_REG_DEVICE_FEATURES 0x00
+#define VIRTIO_REG_GUEST_FEATURES  0x04
+#define VIRTIO_REG_QUEUE_ADDRESS   0x08
+#define VIRTIO_REG_QUEUE_SIZE      0x0C
+#define VIRTIO_REG_QUEUE_SELECT    0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY    0x10
+#define VIRTIO_REG_DEVICE_STATUS   0x12
+#define VIRTIO_REG_ISR_STATUS      0x13
+#define VIRTIO_REG_CONFIG          0x14  // Device config, without MSI-X
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+// Transport feature bits
+#define VIRTIO_F_RING_INDIRECT_DESC (1 << 28)
+#define VIRTIO_F_RING_EVENT_IDX     (1 << 29)
+
+// Avail ring flag: the driver does not need interrupts
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+// Longest chain placed in an indirect table
+#define VIRTQ_INDIRECT_MAX 18
+
+// Split virtqueue layout shared with the device
+typedef struct virtq_desc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct virtq_avail {
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct virtq_used_elem {
+    u32 id;
+    u32 len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct virtq_used {
+    u16 flags;
+    u16 idx;
+    virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+// One scatter-gather element handed to virtqueue_add
+typedef struct virtq_buf {
+    void *addr;
+    u32 len;
+} virtq_buf_t;
+
+typedef struct virtio_device {
+    pci_device_t *pci;
+    u16 io_base;
+    u32 features;  // Negotiated feature bits
+} virtio_device_t;
+
+typedef struct virtqueue {
+    virtio_device_t *vdev;
+    u16 index;
+    u16 size;
+    virtq_desc_t *desc;
+    virtq_avail_t *avail;
+    virtq_used_t *used;
+    u16 free_head;
+    u16 num_free;
+    u16 avail_idx;   // Next avail slot; published to the device on kick
+    u16 last_used;   // Next used entry to consume
+    u16 pending;     // Buffers added since the last kick
+    u8 indirect;
+    u8 event_idx;    // Notifications are suppressed with event indexes
+    volatile u16 *used_event;   // Driver: interrupt once used->idx passes this
+    volatile u16 *avail_event;  // Device: notify once avail->idx passes this
+    u32 notifications;
+    u32 notifications_suppressed;
+    void **cookies;  // Caller cookie per head descriptor
+    virtq_desc_t *indirect_tables;
+} virtqueue_t;
+
+// Device setup
+int virtio_init_device(virtio_device_t *vdev, pci_device_t *pci, u32 wanted_features);
+void virtio_driver_ok(virtio_device_t *vdev);
+u8 virtio_read_isr(virtio_device_t *vdev);
+u8 virtio_config_read8(virtio_device_t *vdev, u32 offset);
+u16 virtio_config_read16(virtio_device_t *vdev, u32 offset);
+u32 virtio_config_read32(virtio_device_t *vdev, u32 offset);
+
+// Virtqueues
+int virtqueue_init(virtio_device_t *vdev, virtqueue_t *vq, u16 index);
+int virtqueue_add(virtqueue_t *vq, virtq_buf_t *bufs, u32 out_count, u32 in_count, void *cookie);
+int virtqueue_kick(virtqueue_t *vq);
+void virtqueue_disable_cb(virtqueue_t *vq);
+int virtqueue_enable_cb(virtqueue_t *vq);
+int virtqueue_has_used(virtqueue_t *vq);
+void *virtqueue_get(virtqueue_t *vq, u32 *len);
+
+#endif // VIRTIO_H
@@ -0,0 +1,319 @@
+#include "kernel.h"
+#include "vga.h"
+#include "net.h"
+
+// ARP resolver. Entries live in a hash table keyed by IP address, so a
+// lookup costs the same with ten neighbours as with hundreds. While an
+// address is being resolved, packets for it wait on its entry and only
+// the first of them sends a request; the periodic aging job retries
+// requests, gives up on silent hosts, and expires old mappings.
+
+#define ARP_HASH_BITS      6
+#define ARP_HASH_SIZE      (1 << ARP_HASH_BITS)
+#define ARP_MAX_ENTRIES    256
+#define ARP_MAX_PENDING    16    // Packets queued per unresolved address
+#define ARP_RETRIES        3     // Requests before giving up
+#define ARP_RETRY_MS       1000
+#define ARP_REACHABLE_MS   60000 // Lifetime of a resolved entry
+#define ARP_AGE_PERIOD_MS  1000
+
+#define ARP_HW_ETHERNET 1
+#define ARP_OP_REQUEST  1
+#define ARP_OP_REPLY    2
+
+// ARP packet for IPv4 over Ethernet
+typedef struct arp_packet {
+    u16 hw_type;
+    u16 proto_type;
+    u8 hw_len;
+    u8 proto_len;
+    u16 op;
+    u8 sender_mac[6];
+    u32 sender_ip;
+    u8 target_mac[6];
+    u32 target_ip;
+} __attribute__((packed)) arp_packet_t;
+
+typedef enum {
+    ARP_FREE,
+    ARP_INCOMPLETE,  // Request sent, no reply yet
+    ARP_REACHABLE,
+} arp_state_t;
+
+typedef struct arp_entry {
+    u32 ip;
+    u8 mac[6];
+    u8 state;
+    u8 requests;                 // Requests sent while incomplete
+    network_interface_t *iface;
+    u32 updated;                 // Tick of the last request or reply
+    netbuf_t *pending;           // Packets waiting for the address
+    netbuf_t *pending_tail;
+    u32 pending_count;
+    struct arp_entry *next;      // Hash chain, or free list
+} arp_entry_t;
+
+static arp_entry_t arp_entries[ARP_MAX_ENTRIES];
+static arp_entry_t *arp_hash[ARP_HASH_SIZE];
+static arp_entry_t *arp_free = NULL;
+static u32 arp_count = 0;
+
+static const u8 eth_broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+static const u8 eth_zero[6] = { 0, 0, 0, 0, 0, 0 };
+
+// Statistics
+static u32 arp_lookups = 0;
+static u32 arp_misses = 0;
+static u32 arp_requests_sent = 0;
+static u32 arp_replies_sent = 0;
+static u32 arp_queued = 0;
+static u32 arp_dropped = 0;
+static u32 arp_timeouts = 0;
+static u32 arp_expired = 0;
+static u32 arp_table_full = 0;
+
+static void arp_age_work(void);
+
+// Fibonacci hashing spreads consecutive addresses across the buckets
+static inline u32 arp_bucket(u32 ip) {
+    return (ip * 2654435761u) >> (32 - ARP_HASH_BITS);
+}
+
+static u32 arp_ms_to_ticks(u32 ms) {
+    return ms * timer_get_frequency() / 1000;
+}
+
+void arp_init(void) {
+    memset(arp_entries, 0, sizeof(arp_entries));
+    memset(arp_hash, 0, sizeof(arp_hash));
+    arp_free = NULL;
+    for (u32 i = ARP_MAX_ENTRIES; i-- > 0; ) {
+        arp_entries[i].next = arp_free;
+        arp_free = &arp_entries[i];
+    }
+    arp_count = 0;
+
+    work_register("arp-age", arp_age_work, ARP_AGE_PERIOD_MS);
+}
+
+static arp_entry_t *arp_lookup(u32 ip) {
+    arp_lookups++;
+    for (arp_entry_t *entry = arp_hash[arp_bucket(ip)]; entry; entry = entry->next) {
+        if (entry->ip == ip) return entry;
+    }
+    arp_misses++;
+    return NULL;
+}
+
+static arp_entry_t *arp_create(network_interface_t *iface, u32 ip) {
+    arp_entry_t *entry = arp_free;
+    if (!entry) {
+        arp_table_full++;
+        return NULL;
+    }
+    arp_free = entry->next;
+
+    memset(entry, 0, sizeof(arp_entry_t));
+    entry->ip = ip;
+    entry->iface = iface;
+    entry->state = ARP_INCOMPLETE;
+    entry->updated = timer_get_ticks();
+
+    u32 bucket = arp_bucket(ip);
+    entry->next = arp_hash[bucket];
+    arp_hash[bucket] = entry;
+    arp_count++;
+    return entry;
+}
+
+// Unlink an entry, dropping any packets still waiting on it
+static void arp_remove(arp_entry_t *entry) {
+    arp_entry_t **link = &arp_hash[arp_bucket(entry->ip)];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+
+    while (entry->pending) {
+        netbuf_t *nb = entry->pending;
+        entry->pending = nb->next;
+        netbuf_put(nb);
+        arp_dropped++;
+    }
+
+    entry->state = ARP_FREE;
+    entry->next = arp_free;
+    arp_free = entry;
+    arp_count--;
+}
+
+static void arp_send(network_interface_t *iface, u16 op, const u8 *target_mac, u32 target_ip) {
+    netbuf_t *nb = netbuf_alloc();
+    if (!nb) return;
+
+    arp_packet_t *arp = (arp_packet_t *)netbuf_append(nb, sizeof(arp_packet_t));
+    arp->hw_type = net_htons(ARP_HW_ETHERNET);
+    arp->proto_type = net_htons(PROTO_IP);
+    arp->hw_len = 6;
+    arp->proto_len = 4;
+    arp->op = net_htons(op);
+    memcpy(arp->sender_mac, iface->mac_address, 6);
+    arp->sender_ip = net_htonl(iface->ip_address);
+    memcpy(arp->target_mac, op == ARP_OP_REPLY ? target_mac : eth_zero, 6);
+    arp->target_ip = net_htonl(target_ip);
+
+    if (op == ARP_OP_REPLY) {
+        arp_replies_sent++;
+    } else {
+        arp_requests_sent++;
+    }
+    network_output(iface, op == ARP_OP_REPLY ? target_mac : eth_broadcast, PROTO_ARP, nb);
+}
+
+// Record a resolved address and send everything that waited for it
+static void arp_resolved(arp_entry_t *entry, const u8 *mac) {
+    memcpy(entry->mac, mac, 6);
+    entry->state = ARP_REACHABLE;
+    entry->updated = timer_get_ticks();
+
+    netbuf_t *nb = entry->pending;
+    entry->pending = NULL;
+    entry->pending_tail = NULL;
+    entry->pending_count = 0;
+    while (nb) {
+        netbuf_t *next = nb->next;
+        network_output(entry->iface, entry->mac, PROTO_IP, nb);
+        nb = next;
+    }
+}
+
+// Learn from every ARP packet that mentions an address we already track
+// or that is aimed at us (RFC 826), and answer requests for our address
+void arp_input(network_interface_t *iface, netbuf_t *nb) {
+    arp_packet_t *arp = (arp_packet_t *)nb->data;
+    if (nb->len < sizeof(arp_packet_t) ||
+        arp->hw_type != net_htons(ARP_HW_ETHERNET) || arp->proto_type != net_htons(PROTO_IP) ||
+        arp->hw_len != 6 || arp->proto_len != 4) {
+        netbuf_put(nb);
+        return;
+    }
+
+    u32 sender_ip = net_ntohl(arp->sender_ip);
+    u32 target_ip = net_ntohl(arp->target_ip);
+    int for_us = iface->ip_address && target_ip == iface->ip_address;
+
+    if (sender_ip) {
+        arp_entry_t *entry = arp_lookup(sender_ip);
+        if (!entry && for_us) entry = arp_create(iface, sender_ip);
+        if (entry) {
+            entry->iface = iface;
+            arp_resolved(entry, arp->sender_mac);
+        }
+    }
+
+    if (for_us && arp->op == net_htons(ARP_OP_REQUEST)) {
+        arp_send(iface, ARP_OP_REPLY, arp->sender_mac, sender_ip);
+    }
+    netbuf_put(nb);
+}
+
+// Send an IP packet to 'next_hop' on 'iface', resolving its hardware
+// address first if needed. Takes over the caller's reference; a packet
+// for an unresolved address is queued and sent when the reply arrives.
+// Returns -1 only if the packet had to be dropped.
+int arp_output(network_interface_t *iface, u32 next_hop, netbuf_t *nb) {
+    if (next_hop == IP_BROADCAST || next_hop == (iface->ip_address | ~iface->netmask)) {
+        return network_output(iface, eth_broadcast, PROTO_IP, nb);
+    }
+
+    arp_entry_t *entry = arp_lookup(next_hop);
+    if (entry && entry->state == ARP_REACHABLE) {
+        return network_output(iface, entry->mac, PROTO_IP, nb);
+    }
+
+    int first = !entry;
+    if (!entry) {
+        entry = arp_create(iface, next_hop);
+        if (!entry) {
+            netbuf_put(nb);
+            arp_dropped++;
+            return -1;
+        }
+    }
+
+    if (entry->pending_count >= ARP_MAX_PENDING) {
+        netbuf_put(nb);
+        arp_dropped++;
+        return -1;
+    }
+    nb->next = NULL;
+    if (entry->pending_tail) {
+        entry->pending_tail->next = nb;
+    } else {
+        entry->pending = nb;
+    }
+    entry->pending_tail = nb;
+    entry->pending_count++;
+    arp_queued++;
+
+    // Only the packet that created the entry asks; later ones just wait
+    if (first) {
+        entry->requests = 1;
+        arp_send(iface, ARP_OP_REQUEST, NULL, next_hop);
+    }
+    return 0;
+}
+
+// Periodic job: retry or give up on incomplete entries, and expire
+// resolved ones so a host that changed its address is asked again
+static void arp_age_work(void) {
+    u32 now = timer_get_ticks();
+    u32 retry = arp_ms_to_ticks(ARP_RETRY_MS);
+    u32 lifetime = arp_ms_to_ticks(ARP_REACHABLE_MS);
+
+    for (u32 i = 0; i < ARP_MAX_ENTRIES; i++) {
+        arp_entry_t *entry = &arp_entries[i];
+        u32 age = now - entry->updated;
+
+        if (entry->state == ARP_INCOMPLETE && age >= retry) {
+            if (entry->requests >= ARP_RETRIES) {
+                arp_timeouts++;
+                arp_remove(entry);
+            } else {
+                entry->requests++;
+                entry->updated = now;
+                arp_send(entry->iface, ARP_OP_REQUEST, NULL, entry->ip);
+            }
+        } else if (entry->state == ARP_REACHABLE && age >= lifetime) {
+            arp_expired++;
+            arp_remove(entry);
+        }
+    }
+}
+
+// Show the cache, like arp -a
+void arp_list(void) {
+    u32 now = timer_get_ticks();
+    u32 frequency = timer_get_frequency();
+
+    vga_printf("Address\t\tHWaddress\t\tIface\tAge\n");
+    for (u32 bucket = 0; bucket < ARP_HASH_SIZE; bucket++) {
+        for (arp_entry_t *entry = arp_hash[bucket]; entry; entry = entry->next) {
+            u32 ip = entry->ip;
+            vga_printf("%d.%d.%d.%d\t", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF,
+                       (ip >> 8) & 0xFF, ip & 0xFF);
+            if (entry->state == ARP_REACHABLE) {
+                vga_printf("%02x:%02x:%02x:%02x:%02x:%02x\t", entry->mac[0], entry->mac[1],
+                           entry->mac[2], entry->mac[3], entry->mac[4], entry->mac[5]);
+            } else {
+                vga_printf("(incomplete)\t\t");
+            }
+            vga_printf("%s\t%us\n", entry->iface->name, (now - entry->updated) / frequency);
+        }
+    }
+}
+
+void arp_stats(void) {
+    vga_printf("  ARP: %u entries, %u lookups (%u misses), %u requests, %u replies sent\n",
+               arp_count, arp_lookups, arp_misses, arp_requests_sent, arp_replies_sent);
+    vga_printf("       %u packets queued, %u dropped, %u timeouts, %u expired, %u table full\n",
+               arp_queued, arp_dropped, arp_timeouts, arp_expired, arp_table_full);
+}
@@ -0,0 +1,374 @@
+#include "kernel.h"
+#include "vga.h"
+#include "io.h"
+#include "pci.h"
+#include "block.h"
+
+// ATA task file registers (offsets from the channel I/O base)
+#define ATA_REG_DATA       0x00
+#define ATA_REG_ERROR      0x01
+#define ATA_REG_FEATURES   0x01
+#define ATA_REG_SECCOUNT   0x02
+#define ATA_REG_LBA_LO     0x03
+#define ATA_REG_LBA_MID    0x04
+#define ATA_REG_LBA_HI     0x05
+#define ATA_REG_DRIVE      0x06
+#define ATA_REG_STATUS     0x07
+#define ATA_REG_COMMAND    0x07
+
+// Status register bits
+#define ATA_SR_ERR  0x01
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_DF   0x20
+#define ATA_SR_BSY  0x80
+
+// Commands
+#define ATA_CMD_READ_PIO   0x20
+#define ATA_CMD_WRITE_PIO  0x30
+#define ATA_CMD_READ_DMA   0xC8
+#define ATA_CMD_WRITE_DMA  0xCA
+#define ATA_CMD_FLUSH      0xE7
+#define ATA_CMD_IDENTIFY   0xEC
+
+// Bus master IDE registers (offsets from the channel's BMIDE base)
+#define BM_REG_COMMAND 0x00
+#define BM_REG_STATUS  0x02
+#define BM_REG_PRDT    0x04
+
+#define BM_CMD_START   0x01
+#define BM_CMD_READ    0x08  // Device to memory
+#define BM_SR_ERR      0x02
+#define BM_SR_IRQ      0x04
+
+// Physical region descriptor table
+#define ATA_PRD_ENTRIES 8
+#define ATA_PRD_EOT     0x8000
+
+typedef struct ata_prd {
+    u32 address;
+    u16 byte_count;  // 0 means 64KB
+    u16 flags;
+} __attribute__((packed)) ata_prd_t;
+
+// Largest request: 128 sectors (64KB) always fits the PRD table
+#define ATA_MAX_SECTORS 128
+
+// An IDE channel. Master and slave share the task file, so the channel
+// serializes their requests.
+typedef struct ata_channel {
+    u16 io_base;
+    u16 ctrl_base;
+    u16 bm_base;        // 0 if bus mastering is unavailable
+    ata_prd_t *prdt;
+    block_request_t *active;
+    block_request_t *wait_head;
+    block_request_t *wait_tail;
+    u8 dma_active;
+} ata_channel_t;
+
+typedef struct ata_drive {
+    block_device_t dev;
+    ata_channel_t *channel;
+    u8 slave;
+    u8 dma;
+    char model[41];
+} ata_drive_t;
+
+static ata_channel_t ata_channels[2];
+static ata_drive_t ata_drives[4];
+
+// Wait for BSY to clear; returns the final status
+static u8 ata_wait_busy(ata_channel_t *ch) {
+    u8 status;
+    u32 timeout = 1000000;
+    do {
+        status = inb(ch->io_base + ATA_REG_STATUS);
+    } while ((status & ATA_SR_BSY) && --timeout);
+    return status;
+}
+
+// 400ns settle delay after selecting a drive
+static void ata_delay(ata_channel_t *ch) {
+    for (int i = 0; i < 4; i++) {
+        inb(ch->ctrl_base);
+    }
+}
+
+// Program the task file for an LBA28 transfer
+static void ata_setup_lba(ata_drive_t *drive, u32 lba, u32 count) {
+    ata_channel_t *ch = drive->channel;
+
+    outb(ch->io_base + ATA_REG_DRIVE, 0xE0 | (drive->slave << 4) | ((lba >> 24) & 0x0F));
+    ata_delay(ch);
+    outb(ch->io_base + ATA_REG_FEATURES, 0);
+    outb(ch->io_base + ATA_REG_SECCOUNT, (u8)count);  // 256 is written as 0
+    outb(ch->io_base + ATA_REG_LBA_LO, lba & 0xFF);
+    outb(ch->io_base + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
+    outb(ch->io_base + ATA_REG_LBA_HI, (lba >> 16) & 0xFF);
+}
+
+// Write the drive's cache out so completed writes are durable. The
+// drive is already selected by the write; its interrupt arrives with no
+// DMA active and is acknowledged as a stray.
+static int ata_flush(ata_channel_t *ch) {
+    outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_FLUSH);
+    return !(ata_wait_busy(ch) & (ATA_SR_ERR | ATA_SR_DF));
+}
+
+// Programmed I/O transfer, done synchronously
+static int ata_pio_transfer(ata_drive_t *drive, block_request_t *req) {
+    ata_channel_t *ch = drive->channel;
+    u8 *buffer = req->buffer;
+
+    ata_wait_busy(ch);
+    ata_setup_lba(drive, req->lba, req->count);
+    outb(ch->io_base + ATA_REG_COMMAND, req->write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO);
+
+    for (u32 i = 0; i < req->count; i++) {
+        ata_delay(ch);
+        u8 status = ata_wait_busy(ch);
+        if (status & (ATA_SR_ERR | ATA_SR_DF) || !(status & ATA_SR_DRQ)) {
+            return 0;
+        }
+
+        if (req->write) {
+            outsw(ch->io_base + ATA_REG_DATA, buffer, 256);
+        } else {
+            insw(ch->io_base + ATA_REG_DATA, buffer, 256);
+        }
+        buffer += BLOCK_SECTOR_SIZE;
+    }
+
+    return !req->write || ata_flush(ch);
+}
+
+// Fill the PRD table for a buffer. The heap is identity mapped, so
+// virtual addresses are physical; entries must not cross 64KB.
+static void ata_build_prdt(ata_channel_t *ch, u8 *buffer, u32 bytes) {
+    u32 addr = (u32)buffer;
+    int i = 0;
+
+    while (bytes > 0 && i < ATA_PRD_ENTRIES) {
+        u32 boundary = (addr & 0xFFFF0000) + 0x10000;
+        u32 chunk = boundary - addr;
+        if (chunk > bytes) chunk = bytes;
+
+        ch->prdt[i].address = addr;
+        ch->prdt[i].byte_count = (u16)chunk;
+        ch->prdt[i].flags = 0;
+        addr += chunk;
+        bytes -= chunk;
+        i++;
+    }
+    ch->prdt[i - 1].flags = ATA_PRD_EOT;
+}
+
+// Start a bus master DMA transfer; it completes in the IRQ handler
+static void ata_dma_start(ata_drive_t *drive, block_request_t *req) {
+    ata_channel_t *ch = drive->channel;
+
+    ata_build_prdt(ch, req->buffer, req->count * BLOCK_SECTOR_SIZE);
+
+    outb(ch->bm_base + BM_REG_COMMAND, 0);
+    outl(ch->bm_base + BM_REG_PRDT, (u32)ch->prdt);
+    outb(ch->bm_base + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);  // Write 1 to clear
+
+    ata_wait_busy(ch);
+    ata_setup_lba(drive, req->lba, req->count);
+    outb(ch->io_base + ATA_REG_COMMAND, req->write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+
+    ch->dma_active = 1;
+    outb(ch->bm_base + BM_REG_COMMAND, BM_CMD_START | (req->write ? 0 : BM_CMD_READ));
+}
+
+// Issue a request on an idle channel
+static void ata_issue(ata_channel_t *ch, block_request_t *req) {
+    ata_drive_t *drive = (ata_drive_t *)req->dev->driver_data;
+
+    // DMA needs an even buffer address
+    if (drive->dma && !((u32)req->buffer & 1)) {
+        ch->active = req;
+        ata_dma_start(drive, req);
+        return;
+    }
+
+    ch->active = req;
+    int ok = ata_pio_transfer(drive, req);
+    ch->active = NULL;
+    block_complete(req, ok);
+}
+
+// Start the next request waiting on a channel, if any
+static void ata_issue_next(ata_channel_t *ch) {
+    while (!ch->active && ch->wait_head) {
+        block_request_t *req = ch->wait_head;
+        ch->wait_head = req->next;
+        if (!ch->wait_head) ch->wait_tail = NULL;
+        req->next = NULL;
+        ata_issue(ch, req);
+    }
+}
+
+// Block layer hook: queue on the channel if it is busy with the other drive
+static void ata_start(block_device_t *dev, block_request_t *req) {
+    ata_channel_t *ch = ((ata_drive_t *)dev->driver_data)->channel;
+
+    if (ch->active) {
+        if (ch->wait_tail) {
+            ch->wait_tail->next = req;
+        } else {
+            ch->wait_head = req;
+        }
+        ch->wait_tail = req;
+        return;
+    }
+    ata_issue(ch, req);
+    ata_issue_next(ch);
+}
+
+// Finish a DMA transfer if the controller reports one done
+static void ata_dma_finish(ata_channel_t *ch) {
+    if (!ch->dma_active) {
+        inb(ch->io_base + ATA_REG_STATUS);  // Acknowledge stray interrupts
+        return;
+    }
+
+    u8 bm_status = inb(ch->bm_base + BM_REG_STATUS);
+    if (!(bm_status & BM_SR_IRQ)) return;
+
+    outb(ch->bm_base + BM_REG_COMMAND, 0);
+    u8 status = inb(ch->io_base + ATA_REG_STATUS);
+    outb(ch->bm_base + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+
+    block_request_t *req = ch->active;
+    ch->dma_active = 0;
+    ch->active = NULL;
+
+    int ok = !(bm_status & BM_SR_ERR) && !(status & (ATA_SR_ERR | ATA_SR_DF));
+    if (ok && req->write) ok = ata_flush(ch);  // As the PIO path does
+    block_complete(req, ok);
+    ata_issue_next(ch);
+}
+
+// IRQ 14 and 15 handlers
+static void ata_primary_irq(void) {
+    ata_dma_finish(&ata_channels[0]);
+}
+
+static void ata_secondary_irq(void) {
+    ata_dma_finish(&ata_channels[1]);
+}
+
+// Block layer hook used when interrupts are disabled
+static void ata_poll(block_device_t *dev) {
+    ata_dma_finish(((ata_drive_t *)dev->driver_data)->channel);
+}
+
+// Identify a drive and register it as a block device
+static void ata_probe(ata_channel_t *ch, u8 slave, int index) {
+    ata_drive_t *drive = &ata_drives[index];
+    u16 identify[256];
+
+    outb(ch->io_base + ATA_REG_DRIVE, 0xA0 | (slave << 4));
+    ata_delay(ch);
+    outb(ch->io_base + ATA_REG_SECCOUNT, 0);
+    outb(ch->io_base + ATA_REG_LBA_LO, 0);
+    outb(ch->io_base + ATA_REG_LBA_MID, 0);
+    outb(ch->io_base + ATA_REG_LBA_HI, 0);
+    outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+
+    u8 status = inb(ch->io_base + ATA_REG_STATUS);
+    if (status == 0 || status == 0xFF) return; // No drive
+
+    status = ata_wait_busy(ch);
+    if (status & ATA_SR_BSY) return;
+
+    // ATAPI and SATA devices report a signature here; skip them
+    if (inb(ch->io_base + ATA_REG_LBA_MID) || inb(ch->io_base + ATA_REG_LBA_HI)) return;
+
+    u32 timeout = 1000000;
+    while (!(status & (ATA_SR_DRQ | ATA_SR_ERR)) && --timeout) {
+        status = inb(ch->io_base + ATA_REG_STATUS);
+    }
+    if (!(status & ATA_SR_DRQ)) return;
+
+    insw(ch->io_base + ATA_REG_DATA, identify, 256);
+
+    memset(drive, 0, sizeof(ata_drive_t));
+    drive->channel = ch;
+    drive->slave = slave;
+    drive->dma = ch->bm_base && (identify[49] & (1 << 8));
+
+    // Model string is stored as byte-swapped words
+    for (int i = 0; i < 20; i++) {
+        drive->model[i * 2] = identify[27 + i] >> 8;
+        drive->model[i * 2 + 1] = identify[27 + i] & 0xFF;
+    }
+    drive->model[40] = 0;
+    for (int i = 39; i >= 0 && drive->model[i] == ' '; i--) {
+        drive->model[i] = 0;
+    }
+
+    block_device_t *dev = &drive->dev;
+    strcpy(dev->name, "hda");
+    dev->name[2] = 'a' + index;
+    dev->sector_count = identify[60] | ((u32)identify[61] << 16);
+    dev->max_sectors = ATA_MAX_SECTORS;
+    dev->queue_depth = 1;
+    dev->start = ata_start;
+    dev->poll = ata_poll;
+    dev->driver_data = drive;
+
+    if (dev->sector_count == 0) return;
+
+    vga_printf("ATA %s: %s (%s)\n", dev->name, drive->model, drive->dma ? "DMA" : "PIO");
+    block_register(dev);
+}
+
+// Initialize ATA driver: find the IDE controller, probe all four drives
+void ata_init(void) {
+    memset(ata_channels, 0, sizeof(ata_channels));
+
+    // Legacy compatibility ports
+    ata_channels[0].io_base = 0x1F0;
+    ata_channels[0].ctrl_base = 0x3F6;
+    ata_channels[1].io_base = 0x170;
+    ata_channels[1].ctrl_base = 0x376;
+
+    // Bus mastering needs the PCI IDE controller's BAR4
+    pci_device_t *ide = pci_find_class(0x01, 0x01);
+    if (ide) {
+        // Channels in native mode report their ports in BAR0-3
+        if ((ide->prog_if & 0x01) && pci_bar_address(ide, 0)) {
+            ata_channels[0].io_base = pci_bar_address(ide, 0);
+            ata_channels[0].ctrl_base = pci_bar_address(ide, 1) + 2;
+        }
+        if ((ide->prog_if & 0x04) && pci_bar_address(ide, 2)) {
+            ata_channels[1].io_base = pci_bar_address(ide, 2);
+            ata_channels[1].ctrl_base = pci_bar_address(ide, 3) + 2;
+        }
+
+        u32 bm_base = pci_bar_address(ide, 4);
+        if ((ide->prog_if & 0x80) && bm_base && pci_bar_is_io(ide, 4)) {
+            pci_enable_bus_master(ide);
+            ata_channels[0].bm_base = bm_base;
+            ata_channels[1].bm_base = bm_base + 8;
+        }
+    }
+
+    for (int c = 0; c < 2; c++) {
+        if (ata_channels[c].bm_base) {
+            // 64 bytes aligned to 64 can never cross a 64KB boundary
+            ata_channels[c].prdt = (ata_prd_t *)kmalloc_aligned(sizeof(ata_prd_t) * ATA_PRD_ENTRIES, 64);
+            if (!ata_channels[c].prdt) ata_channels[c].bm_base = 0;
+        }
+    }
+
+    register_interrupt_handler(46, ata_primary_irq);
+    register_interrupt_handler(47, ata_secondary_irq);
+
+    ata_probe(&ata_channels[0], 0, 0);
+    ata_probe(&ata_channels[0], 1, 1);
+    ata_probe(&ata_channels[1], 0, 2);
+    ata_probe(&ata_channels[1], 1, 3);
+}
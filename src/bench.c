@@ -0,0 +1,86 @@
+#include "kernel.h"
+#include "vga.h"
+#include "bench.h"
+
+// Allocate room for 'capacity' samples
+int bench_init(bench_t *b, const char *suite, const char *name, u32 capacity) {
+    b->suite = suite;
+    b->name = name;
+    b->count = 0;
+    b->capacity = capacity;
+    b->errors = 0;
+    b->total = 0;
+    b->samples = (u32 *)kmalloc(sizeof(u32) * (capacity ? capacity : 1));
+    return b->samples ? 0 : -4; // Out of memory
+}
+
+void bench_free(bench_t *b) {
+    kfree(b->samples);
+    b->samples = NULL;
+}
+
+// Samples beyond the capacity still count towards the total and rate
+void bench_record(bench_t *b, u64 cycles) {
+    u32 sample = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (u32)cycles;
+    if (b->count < b->capacity) {
+        b->samples[b->count] = sample;
+    }
+    b->count++;
+    b->total += cycles;
+}
+
+// Shell sort; sample counts are small enough that this beats anything
+// needing extra memory
+static void bench_sort(u32 *samples, u32 count) {
+    for (u32 gap = count / 2; gap > 0; gap /= 2) {
+        for (u32 i = gap; i < count; i++) {
+            u32 value = samples[i];
+            u32 j = i;
+            while (j >= gap && samples[j - gap] > value) {
+                samples[j] = samples[j - gap];
+                j -= gap;
+            }
+            samples[j] = value;
+        }
+    }
+}
+
+// Latency in nanoseconds below which 'percent' of the samples fall
+u32 bench_percentile(bench_t *b, u32 percent) {
+    u32 count = b->count < b->capacity ? b->count : b->capacity;
+    if (count == 0) return 0;
+
+    bench_sort(b->samples, count);
+    u32 index = (count * percent + 99) / 100;
+    if (index > 0) index--;
+    if (index >= count) index = count - 1;
+    return timer_cycles_to_ns(b->samples[index]);
+}
+
+void bench_header(int machine) {
+    if (machine) return;
+    vga_printf("%-8s %8s %10s %8s %8s %8s %8s (ns)\n",
+               "op", "ops", "ops/s", "avg", "p50", "p99", "max");
+}
+
+void bench_report(bench_t *b, int machine) {
+    u32 total_us = timer_cycles_to_us(b->total);
+    u32 rate = total_us ? udiv64((u64)b->count * 1000000, total_us) : 0;
+    u32 avg = b->count ? timer_cycles_to_ns(udiv64(b->total, b->count)) : 0;
+    u32 p50 = bench_percentile(b, 50);
+    u32 p90 = bench_percentile(b, 90);
+    u32 p99 = bench_percentile(b, 99);
+    u32 max = bench_percentile(b, 100);
+
+    if (machine) {
+        vga_printf("BENCH suite=%s op=%s ops=%u total_us=%u ops_per_sec=%u "
+                   "avg_ns=%u p50_ns=%u p90_ns=%u p99_ns=%u max_ns=%u errors=%u\n",
+                   b->suite, b->name, b->count, total_us, rate,
+                   avg, p50, p90, p99, max, b->errors);
+    } else {
+        vga_printf("%-8s %8u %10u %8u %8u %8u %8u",
+                   b->name, b->count, rate, avg, p50, p99, max);
+        if (b->errors) vga_printf("  %u errors", b->errors);
+        vga_printf("\n");
+    }
+}
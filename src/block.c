@@ -0,0 +1,241 @@
+#include "kernel.h"
+#include "vga.h"
+#include "io.h"
+#include "block.h"
+
+// Registered block devices
+static block_device_t *block_devices[BLOCK_MAX_DEVICES];
+static u32 block_device_count = 0;
+
+// Initialize the block layer
+void block_init(void) {
+    memset(block_devices, 0, sizeof(block_devices));
+    block_device_count = 0;
+
+    pagecache_init();
+}
+
+// Register a block device with the block layer
+int block_register(block_device_t *dev) {
+    if (block_device_count >= BLOCK_MAX_DEVICES) return -1;
+
+    dev->queue_head = NULL;
+    dev->queue_tail = NULL;
+    dev->in_flight = 0;
+    dev->dispatching = 0;
+    dev->plugged = 0;
+    dev->ra_last = 0xFFFFFFFF;
+    dev->ra_next = 0;
+    dev->ra_window = 0;
+    if (dev->queue_depth == 0) dev->queue_depth = 1;
+    if (dev->max_segments == 0) dev->max_segments = 1;
+
+    block_devices[block_device_count++] = dev;
+    vga_printf("Block device %s: %d sectors (%d KB)\n",
+               dev->name, dev->sector_count, dev->sector_count / 2);
+    return 0;
+}
+
+// Look up a device by name
+block_device_t *block_get(const char *name) {
+    for (u32 i = 0; i < block_device_count; i++) {
+        if (strcmp(block_devices[i]->name, name) == 0) {
+            return block_devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Hand queued requests to the driver while it has room. Drivers that
+// complete synchronously call back into block_complete from start, so
+// the dispatching flag keeps this from recursing.
+static void block_dispatch(block_device_t *dev) {
+    if (dev->dispatching || dev->plugged) return;
+    dev->dispatching = 1;
+
+    u32 started = 0;
+    while (dev->queue_head && dev->in_flight < dev->queue_depth) {
+        block_request_t *req = dev->queue_head;
+        dev->queue_head = req->next;
+        if (!dev->queue_head) dev->queue_tail = NULL;
+        req->next = NULL;
+
+        dev->in_flight++;
+        if (dev->in_flight > dev->max_in_flight) dev->max_in_flight = dev->in_flight;
+        dev->start(dev, req);
+        started++;
+    }
+
+    if (started && dev->commit) {
+        dev->commit(dev);
+    }
+
+    dev->dispatching = 0;
+}
+
+// Try to append a request to a queued request that ends where it
+// starts. Only back merges are done; the queue is short.
+static int block_try_merge(block_device_t *dev, block_request_t *req) {
+    if (dev->max_segments < 2) return 0;
+
+    for (block_request_t *head = dev->queue_head; head; head = head->next) {
+        if (head->write == req->write &&
+            head->lba + head->total_count == req->lba &&
+            head->segments < dev->max_segments &&
+            head->total_count + req->count <= dev->max_sectors) {
+            if (head->merged_tail) {
+                head->merged_tail->merged = req;
+            } else {
+                head->merged = req;
+            }
+            head->merged_tail = req;
+            head->total_count += req->count;
+            head->segments++;
+            dev->merges++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Queue a request on its device
+int block_submit(block_request_t *req) {
+    block_device_t *dev = req->dev;
+    if (!dev || req->count == 0) return -1;
+    if (req->lba + req->count > dev->sector_count) return -2; // Out of range
+    if (req->count > dev->max_sectors) return -3; // Too large
+
+    req->status = BLOCK_REQ_PENDING;
+    req->next = NULL;
+    req->merged = NULL;
+    req->merged_tail = NULL;
+    req->total_count = req->count;
+    req->segments = 1;
+
+    u32 flags = irq_save();
+    if (!block_try_merge(dev, req)) {
+        if (dev->queue_tail) {
+            dev->queue_tail->next = req;
+        } else {
+            dev->queue_head = req;
+        }
+        dev->queue_tail = req;
+    }
+    block_dispatch(dev);
+    irq_restore(flags);
+    return 0;
+}
+
+// Hold back dispatch while a batch of requests is submitted, so that
+// adjacent requests can be merged and the driver notified once
+void block_plug(block_device_t *dev) {
+    dev->plugged = 1;
+}
+
+void block_unplug(block_device_t *dev) {
+    u32 flags = irq_save();
+    dev->plugged = 0;
+    block_dispatch(dev);
+    irq_restore(flags);
+}
+
+// Called by drivers when a request (and everything merged behind it)
+// finishes
+void block_complete(block_request_t *req, int ok) {
+    block_device_t *dev = req->dev;
+
+    dev->in_flight--;
+    while (req) {
+        block_request_t *next = req->merged;
+
+        if (!ok) {
+            dev->errors++;
+        } else if (req->write) {
+            dev->writes++;
+            dev->sectors_written += req->count;
+        } else {
+            dev->reads++;
+            dev->sectors_read += req->count;
+        }
+
+        req->status = ok ? BLOCK_REQ_DONE : BLOCK_REQ_ERROR;
+        if (req->done) {
+            req->done(req);
+        }
+        req = next;
+    }
+
+    block_dispatch(dev);
+}
+
+// Wait for a request to finish. With interrupts enabled the CPU sleeps
+// until the completion interrupt; otherwise the driver is polled.
+int block_wait(block_request_t *req) {
+    block_device_t *dev = req->dev;
+
+    while (req->status == BLOCK_REQ_PENDING) {
+        if (dev->poll) {
+            u32 flags = irq_save();
+            dev->poll(dev);
+            irq_restore(flags);
+        }
+
+        if (irq_enabled()) {
+            // sti takes effect after hlt, so a completion cannot slip in
+            // between the check and the halt
+            __asm__ volatile ("cli");
+            if (req->status == BLOCK_REQ_PENDING) {
+                __asm__ volatile ("sti; hlt");
+            } else {
+                __asm__ volatile ("sti");
+            }
+        }
+    }
+
+    return req->status == BLOCK_REQ_DONE ? 0 : -1;
+}
+
+// Synchronous transfer helper, split into driver-sized requests
+static int block_transfer(block_device_t *dev, u32 lba, u32 count, u8 *buffer, u8 write) {
+    while (count > 0) {
+        block_request_t req;
+        memset(&req, 0, sizeof(req));
+        req.dev = dev;
+        req.lba = lba;
+        req.count = count < dev->max_sectors ? count : dev->max_sectors;
+        req.buffer = buffer;
+        req.write = write;
+
+        if (block_submit(&req) != 0 || block_wait(&req) != 0) {
+            return -1;
+        }
+
+        lba += req.count;
+        buffer += req.count * BLOCK_SECTOR_SIZE;
+        count -= req.count;
+    }
+    return 0;
+}
+
+int block_read(block_device_t *dev, u32 lba, u32 count, void *buffer) {
+    return block_transfer(dev, lba, count, (u8 *)buffer, 0);
+}
+
+int block_write(block_device_t *dev, u32 lba, u32 count, const void *buffer) {
+    return block_transfer(dev, lba, count, (u8 *)buffer, 1);
+}
+
+// List block devices and their I/O counters
+void block_list_devices(void) {
+    vga_printf("Block Devices:\n");
+    vga_printf("Name\tSize (KB)\tReads\tWrites\tErrors\tMerges\tDepth\n");
+    vga_printf("----\t---------\t-----\t------\t------\t------\t-----\n");
+
+    for (u32 i = 0; i < block_device_count; i++) {
+        block_device_t *dev = block_devices[i];
+        vga_printf("%s\t%d\t\t%d\t%d\t%d\t%d\t%d/%d\n", dev->name, dev->sector_count / 2,
+                   dev->reads, dev->writes, dev->errors, dev->merges,
+                   dev->max_in_flight, dev->queue_depth);
+    }
+    vga_printf("Total: %d devices\n", block_device_count);
+}
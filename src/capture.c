@@ -0,0 +1,488 @@
+#include "kernel.h"
+#include "vga.h"
+#include "net.h"
+#include "socket.h"
+
+// Packet capture. Frames that pass the filter are copied, up to the
+// snap length, into fixed-size slots of a ring allocated once, each
+// stamped with the TSC. When the ring is full the oldest slot is reused,
+// so it always holds the latest traffic. Only interfaces being captured
+// have their 'capture' flag set, and the hooks in the receive and
+// transmit paths test that flag before anything else, so every other
+// packet costs one branch. Hooks run in thread context only, as the
+// rest of the protocol code does.
+//
+// Filters are small programs in the classic BPF instruction set, run
+// against the Ethernet frame. The compiler takes a tcpdump-like
+// expression: a list of primitives that must all match. capture_dump
+// writes the ring as a pcap file to the serial port, oldest frame first.
+
+#define CAPTURE_RING_BYTES  (128 * 1024)
+#define CAPTURE_FILTER_MAX  64
+#define CAPTURE_TEXT_MAX    64
+
+// Classic BPF opcodes, the subset the compiler emits
+#define BPF_LD    0x00
+#define BPF_LDX   0x01
+#define BPF_ALU   0x04
+#define BPF_JMP   0x05
+#define BPF_RET   0x06
+#define BPF_W     0x00
+#define BPF_H     0x08
+#define BPF_B     0x10
+#define BPF_ABS   0x20
+#define BPF_IND   0x40
+#define BPF_LEN   0x80
+#define BPF_MSH   0xA0
+#define BPF_AND   0x50
+#define BPF_JA    0x00
+#define BPF_JEQ   0x10
+#define BPF_JGT   0x20
+#define BPF_JGE   0x30
+#define BPF_JSET  0x40
+#define BPF_K     0x00
+#define BPF_A     0x10
+
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_SIZE(code)  ((code) & 0x18)
+#define BPF_MODE(code)  ((code) & 0xE0)
+
+// Jump targets the compiler fills in once it knows where they are
+#define CAPTURE_JUMP_NEXT   0xFE   // The next primitive
+#define CAPTURE_JUMP_REJECT 0xFF   // Drop the packet
+
+#define PCAP_MAGIC_NSEC     0xA1B23C4D
+#define PCAP_LINKTYPE_ETH   1
+
+typedef struct capture_insn {
+    u16 code;
+    u8 jt;
+    u8 jf;
+    u32 k;
+} capture_insn_t;
+
+typedef struct capture_record {
+    u64 tsc;
+    u16 len;          // Bytes on the wire
+    u16 caplen;       // Bytes kept, which follow
+    u32 reserved;
+} capture_record_t;
+
+// A frame as the filter sees it: a made-up Ethernet header for packets
+// that never had one, then the buffer's own bytes
+typedef struct capture_frame {
+    const u8 *link;
+    u32 link_len;
+    netbuf_t *nb;
+} capture_frame_t;
+
+typedef struct capture_builder {
+    capture_insn_t *insns;
+    u32 len;
+    u32 start;        // First instruction of the current primitive
+    int overflow;
+} capture_builder_t;
+
+typedef struct pcap_file_header {
+    u32 magic;
+    u16 version_major;
+    u16 version_minor;
+    s32 thiszone;
+    u32 sigfigs;
+    u32 snaplen;
+    u32 linktype;
+} pcap_file_header_t;
+
+typedef struct pcap_record_header {
+    u32 ts_sec;
+    u32 ts_nsec;
+    u32 incl_len;
+    u32 orig_len;
+} pcap_record_header_t;
+
+static const u8 capture_loopback_link[NET_ETH_HEADER] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x08, 0x00   // IPv4, no addresses
+};
+
+static u8 *ring = NULL;
+static u32 slot_size = 0;
+static u32 slot_count = 0;
+static u32 ring_head = 0;         // Next slot to fill
+static u32 ring_used = 0;
+static u32 snaplen = 0;
+static u64 start_tsc = 0;
+static u8 running = 0;
+static network_interface_t *capture_iface = NULL;   // NULL for all
+
+static capture_insn_t filter[CAPTURE_FILTER_MAX];
+static u32 filter_len = 0;
+static char filter_text[CAPTURE_TEXT_MAX];
+
+static u32 frames_seen = 0;
+static u32 frames_captured = 0;
+static u32 frames_rejected = 0;
+static u32 frames_overwritten = 0;
+
+// Big-endian load of 'size' bytes at 'offset', as BPF does; -1 past the
+// end of the linear part, where a filter has no business looking
+static int capture_load(const capture_frame_t *frame, u32 offset, u32 size, u32 *value) {
+    u32 result = 0;
+    for (u32 i = 0; i < size; i++) {
+        u32 at = offset + i;
+        u8 byte;
+        if (at < frame->link_len) {
+            byte = frame->link[at];
+        } else if (at - frame->link_len < frame->nb->len) {
+            byte = frame->nb->data[at - frame->link_len];
+        } else {
+            return -1;
+        }
+        result = (result << 8) | byte;
+    }
+    *value = result;
+    return 0;
+}
+
+// Run the filter; returns how many bytes to keep, 0 to skip the frame.
+// Jumps only go forward, so every program ends.
+static u32 capture_run(const capture_frame_t *frame, u32 wire_len) {
+    u32 a = 0;
+    u32 x = 0;
+
+    for (u32 pc = 0; pc < filter_len; pc++) {
+        const capture_insn_t *insn = &filter[pc];
+        u32 size = BPF_SIZE(insn->code) == BPF_W ? 4 : BPF_SIZE(insn->code) == BPF_H ? 2 : 1;
+
+        switch (BPF_CLASS(insn->code)) {
+            case BPF_LD:
+                if (BPF_MODE(insn->code) == BPF_LEN) {
+                    a = wire_len;
+                } else if (BPF_MODE(insn->code) == BPF_ABS) {
+                    if (capture_load(frame, insn->k, size, &a) != 0) return 0;
+                } else if (BPF_MODE(insn->code) == BPF_IND) {
+                    if (capture_load(frame, x + insn->k, size, &a) != 0) return 0;
+                } else {
+                    return 0;
+                }
+                break;
+            case BPF_LDX:
+                // Only the IPv4 header length idiom: 4 * (byte & 0xF)
+                if (insn->code != (BPF_LDX | BPF_B | BPF_MSH)) return 0;
+                if (capture_load(frame, insn->k, 1, &x) != 0) return 0;
+                x = (x & 0xF) * 4;
+                break;
+            case BPF_ALU:
+                if (insn->code != (BPF_ALU | BPF_AND | BPF_K)) return 0;
+                a &= insn->k;
+                break;
+            case BPF_JMP:
+                switch (insn->code & 0xF0) {
+                    case BPF_JA:   pc += insn->k; break;
+                    case BPF_JEQ:  pc += a == insn->k ? insn->jt : insn->jf; break;
+                    case BPF_JGT:  pc += a > insn->k ? insn->jt : insn->jf; break;
+                    case BPF_JGE:  pc += a >= insn->k ? insn->jt : insn->jf; break;
+                    case BPF_JSET: pc += a & insn->k ? insn->jt : insn->jf; break;
+                    default:       return 0;
+                }
+                break;
+            case BPF_RET:
+                return (insn->code & BPF_A) ? a : insn->k;
+            default:
+                return 0;
+        }
+    }
+    return 0;
+}
+
+static void capture_emit(capture_builder_t *b, u16 code, u32 k, u8 jt, u8 jf) {
+    if (b->len >= CAPTURE_FILTER_MAX - 2) {   // Room for the two returns
+        b->overflow = 1;
+        return;
+    }
+    capture_insn_t *insn = &b->insns[b->len++];
+    insn->code = code;
+    insn->jt = jt;
+    insn->jf = jf;
+    insn->k = k;
+}
+
+// Point the current primitive's "matched" jumps past its end
+static void capture_end_primitive(capture_builder_t *b) {
+    for (u32 i = b->start; i < b->len; i++) {
+        if (b->insns[i].jt == CAPTURE_JUMP_NEXT) b->insns[i].jt = b->len - (i + 1);
+        if (b->insns[i].jf == CAPTURE_JUMP_NEXT) b->insns[i].jf = b->len - (i + 1);
+    }
+    b->start = b->len;
+}
+
+static void capture_emit_ethertype(capture_builder_t *b, u16 type) {
+    capture_emit(b, BPF_LD | BPF_H | BPF_ABS, 12, 0, 0);
+    capture_emit(b, BPF_JMP | BPF_JEQ | BPF_K, type, 0, CAPTURE_JUMP_REJECT);
+}
+
+static void capture_emit_protocol(capture_builder_t *b, u8 protocol) {
+    capture_emit_ethertype(b, PROTO_IP);
+    capture_emit(b, BPF_LD | BPF_B | BPF_ABS, NET_ETH_HEADER + 9, 0, 0);
+    capture_emit(b, BPF_JMP | BPF_JEQ | BPF_K, protocol, 0, CAPTURE_JUMP_REJECT);
+}
+
+// Compare the value at each of 'offsets' (an IPv4 address or a port);
+// any match will do
+static void capture_emit_either(capture_builder_t *b, u16 load, const u32 *offsets, u32 count,
+                                u32 value) {
+    for (u32 i = 0; i < count; i++) {
+        capture_emit(b, load, offsets[i], 0, 0);
+        capture_emit(b, BPF_JMP | BPF_JEQ | BPF_K, value, CAPTURE_JUMP_NEXT,
+                     i + 1 < count ? 0 : CAPTURE_JUMP_REJECT);
+    }
+}
+
+static int capture_parse_port(const char *text, u32 *port) {
+    u32 value = 0;
+    if (!*text) return -1;
+    for (; *text; text++) {
+        if (*text < '0' || *text > '9') return -1;
+        value = value * 10 + (*text - '0');
+        if (value > 0xFFFF) return -1;
+    }
+    *port = value;
+    return 0;
+}
+
+// Compile "[src|dst] host A", "[src|dst] port P", "ip", "arp", "icmp",
+// "tcp" and "udp", optionally joined by "and"; an empty expression
+// takes everything. Returns the program length, or -1.
+static int capture_compile(int argc, char **argv, u32 keep, capture_insn_t *insns) {
+    capture_builder_t b = { insns, 0, 0, 0 };
+
+    for (int i = 0; i < argc; i++) {
+        const char *word = argv[i];
+        u32 dir = 0;   // 0 either, 1 source, 2 destination
+        if (strcmp(word, "and") == 0) continue;
+        if (strcmp(word, "src") == 0 || strcmp(word, "dst") == 0) {
+            dir = word[0] == 's' ? 1 : 2;
+            if (++i >= argc) return -1;
+            word = argv[i];
+            if (strcmp(word, "host") != 0 && strcmp(word, "port") != 0) return -1;
+        }
+
+        if (strcmp(word, "ip") == 0) {
+            capture_emit_ethertype(&b, PROTO_IP);
+        } else if (strcmp(word, "arp") == 0) {
+            capture_emit_ethertype(&b, PROTO_ARP);
+        } else if (strcmp(word, "icmp") == 0) {
+            capture_emit_protocol(&b, PROTO_ICMP);
+        } else if (strcmp(word, "tcp") == 0) {
+            capture_emit_protocol(&b, PROTO_TCP);
+        } else if (strcmp(word, "udp") == 0) {
+            capture_emit_protocol(&b, PROTO_UDP);
+        } else if (strcmp(word, "host") == 0) {
+            u32 addr;
+            if (i + 1 >= argc || net_parse_ip(argv[++i], &addr) != 0) return -1;
+            u32 offsets[2] = { NET_ETH_HEADER + 12, NET_ETH_HEADER + 16 };   // Source, destination
+            capture_emit_ethertype(&b, PROTO_IP);
+            capture_emit_either(&b, BPF_LD | BPF_W | BPF_ABS, offsets + (dir == 2),
+                                dir ? 1 : 2, addr);
+        } else if (strcmp(word, "port") == 0) {
+            u32 port;
+            if (i + 1 >= argc || capture_parse_port(argv[++i], &port) != 0) return -1;
+            u32 offsets[2] = { NET_ETH_HEADER, NET_ETH_HEADER + 2 };   // Plus X, the IP header length
+            capture_emit_ethertype(&b, PROTO_IP);
+            capture_emit(&b, BPF_LD | BPF_B | BPF_ABS, NET_ETH_HEADER + 9, 0, 0);
+            capture_emit(&b, BPF_JMP | BPF_JEQ | BPF_K, PROTO_TCP, 1, 0);
+            capture_emit(&b, BPF_JMP | BPF_JEQ | BPF_K, PROTO_UDP, 0, CAPTURE_JUMP_REJECT);
+            // Later fragments have no ports
+            capture_emit(&b, BPF_LD | BPF_H | BPF_ABS, NET_ETH_HEADER + 6, 0, 0);
+            capture_emit(&b, BPF_JMP | BPF_JSET | BPF_K, 0x1FFF, CAPTURE_JUMP_REJECT, 0);
+            capture_emit(&b, BPF_LDX | BPF_B | BPF_MSH, NET_ETH_HEADER, 0, 0);
+            capture_emit_either(&b, BPF_LD | BPF_H | BPF_IND, offsets + (dir == 2),
+                                dir ? 1 : 2, port);
+        } else {
+            return -1;
+        }
+        capture_end_primitive(&b);
+        if (b.overflow) return -1;
+    }
+
+    // Everything that got this far matched
+    b.insns[b.len++] = (capture_insn_t){ BPF_RET | BPF_K, 0, 0, keep };
+    b.insns[b.len++] = (capture_insn_t){ BPF_RET | BPF_K, 0, 0, 0 };
+    u32 reject = b.len - 1;
+    for (u32 i = 0; i < b.len; i++) {
+        if (b.insns[i].jt == CAPTURE_JUMP_REJECT) b.insns[i].jt = reject - (i + 1);
+        if (b.insns[i].jf == CAPTURE_JUMP_REJECT) b.insns[i].jf = reject - (i + 1);
+    }
+    return b.len;
+}
+
+// Set or clear the hook flag on the interfaces being captured
+static void capture_enable(int on) {
+    for (u32 i = 0; i < network_interface_count(); i++) {
+        network_interface_t *iface = network_interface_at(i);
+        iface->capture = on && (!capture_iface || iface == capture_iface);
+    }
+}
+
+// Start capturing on 'iface' (NULL for all) the frames matching the
+// filter expression in argv, up to 'keep' bytes of each. Clears what
+// an earlier capture left in the ring.
+int capture_start(network_interface_t *iface, u32 keep, int argc, char **argv) {
+    capture_insn_t program[CAPTURE_FILTER_MAX];
+
+    if (keep < NET_ETH_HEADER) keep = NET_ETH_HEADER;
+    if (keep > NET_ETH_FRAME_MAX) keep = NET_ETH_FRAME_MAX;
+    int len = capture_compile(argc, argv, keep, program);
+    if (len < 0) return -NET_EINVAL;
+    if (!ring && !(ring = (u8 *)kmalloc(CAPTURE_RING_BYTES))) return -NET_ENOMEM;
+
+    capture_enable(0);
+    memcpy(filter, program, sizeof(capture_insn_t) * len);
+    filter_len = len;
+    filter_text[0] = '\0';
+    u32 used = 0;
+    for (int i = 0; i < argc; i++) {
+        u32 word = strlen(argv[i]);
+        if (used + word + 2 > CAPTURE_TEXT_MAX) break;
+        if (used) filter_text[used++] = ' ';
+        memcpy(filter_text + used, argv[i], word + 1);
+        used += word;
+    }
+
+    snaplen = keep;
+    slot_size = (sizeof(capture_record_t) + keep + 7) & ~7;
+    slot_count = CAPTURE_RING_BYTES / slot_size;
+    ring_head = 0;
+    ring_used = 0;
+    frames_seen = 0;
+    frames_captured = 0;
+    frames_rejected = 0;
+    frames_overwritten = 0;
+    capture_iface = iface;
+    start_tsc = timer_read_tsc();
+    running = 1;
+    capture_enable(1);
+    return 0;
+}
+
+// Stop adding frames; the ring keeps what it has
+void capture_stop(void) {
+    running = 0;
+    capture_enable(0);
+}
+
+// Called for each frame on an interface with 'capture' set. 'link' is 0
+// for loopback packets, which have no Ethernet header.
+void capture_packet(netbuf_t *nb, int link) {
+    capture_frame_t frame = { NULL, 0, nb };
+    if (!link) {
+        frame.link = capture_loopback_link;
+        frame.link_len = NET_ETH_HEADER;
+    }
+    u32 wire_len = frame.link_len + netbuf_total_len(nb);
+
+    frames_seen++;
+    u32 keep = capture_run(&frame, wire_len);
+    if (!keep) {
+        frames_rejected++;
+        return;
+    }
+    if (keep > snaplen) keep = snaplen;
+    if (keep > wire_len) keep = wire_len;
+
+    capture_record_t *record = (capture_record_t *)(ring + ring_head * slot_size);
+    record->tsc = timer_read_tsc();
+    record->len = wire_len;
+    record->caplen = keep;
+
+    // The made-up header, the buffer, then its fragments
+    u8 *out = (u8 *)(record + 1);
+    u32 left = keep;
+    u32 part = frame.link_len < left ? frame.link_len : left;
+    memcpy(out, frame.link, part);
+    out += part;
+    left -= part;
+    part = nb->len < left ? nb->len : left;
+    memcpy(out, nb->data, part);
+    out += part;
+    left -= part;
+    for (u32 i = 0; i < nb->frag_count && left; i++) {
+        part = nb->frags[i].len < left ? nb->frags[i].len : left;
+        memcpy(out, nb->frags[i].data, part);
+        out += part;
+        left -= part;
+    }
+
+    ring_head = ring_head + 1 < slot_count ? ring_head + 1 : 0;
+    if (ring_used < slot_count) {
+        ring_used++;
+    } else {
+        frames_overwritten++;
+    }
+    frames_captured++;
+}
+
+// Time since the capture started, from the TSC
+static void capture_time(u64 tsc, u32 *sec, u32 *nsec) {
+    u32 khz = timer_tsc_khz();
+    u64 cycles = tsc - start_tsc;
+    if (!khz) {
+        *sec = 0;
+        *nsec = 0;
+        return;
+    }
+    u32 ms = udiv64(cycles, khz);
+    u32 rest = (u32)(cycles - (u64)ms * khz);
+    *sec = ms / 1000;
+    *nsec = (ms % 1000) * 1000000 + udiv64((u64)rest * 1000000, khz);
+}
+
+// Write the ring to the serial port as a pcap file. Capturing pauses
+// meanwhile, so the ring does not change under the writer. Returns the
+// number of frames written.
+int capture_dump(void) {
+    if (!ring || !ring_used) return 0;
+    if (!serial_present()) return -NET_ENODEV;
+
+    capture_enable(0);
+    pcap_file_header_t header = {
+        PCAP_MAGIC_NSEC, 2, 4, 0, 0, snaplen, PCAP_LINKTYPE_ETH
+    };
+    serial_write(&header, sizeof(header));
+
+    u32 slot = (ring_head + slot_count - ring_used) % slot_count;
+    for (u32 i = 0; i < ring_used; i++) {
+        capture_record_t *record = (capture_record_t *)(ring + slot * slot_size);
+        pcap_record_header_t out;
+        capture_time(record->tsc, &out.ts_sec, &out.ts_nsec);
+        out.incl_len = record->caplen;
+        out.orig_len = record->len;
+        serial_write(&out, sizeof(out));
+        serial_write(record + 1, record->caplen);
+        slot = slot + 1 < slot_count ? slot + 1 : 0;
+    }
+    capture_enable(running);
+    return ring_used;
+}
+
+void capture_status(void) {
+    if (!ring) {
+        vga_puts("Capture: never started\n");
+        return;
+    }
+    vga_printf("Capture: %s on %s, filter '%s', snaplen %u\n",
+               running ? "running" : "stopped",
+               capture_iface ? capture_iface->name : "all interfaces",
+               filter_text, snaplen);
+    vga_printf("  %u seen, %u captured, %u filtered out, %u overwritten; %u of %u slots in use\n",
+               frames_seen, frames_captured, frames_rejected, frames_overwritten,
+               ring_used, slot_count);
+}
+
+// The compiled filter, one instruction per line, like tcpdump -d
+void capture_print_filter(void) {
+    for (u32 i = 0; i < filter_len; i++) {
+        capture_insn_t *insn = &filter[i];
+        vga_printf("(%03u) code 0x%02x jt %u jf %u k 0x%x\n",
+                   i, insn->code, insn->jt, insn->jf, insn->k);
+    }
+}
@@ -0,0 +1,359 @@
+#include "kernel.h"
+#include "vga.h"
+#include "net.h"
+#include "bench.h"
+
+// Internet checksum (RFC 1071). Summing the words as they sit in memory
+// gives the same result on either byte order, so the value can be
+// stored into a header as is. Over data that includes a valid checksum
+// the result is 0. Only the last block of a running sum may have an
+// odd length.
+//
+// There are three ways to add up a block: a word at a time, 32 bits at
+// a time into a 64-bit sum, and 64 bytes at a time with SSE2. The sum
+// of 32-bit words folds down to the same 16-bit sum, since 2^16 is 1 in
+// ones' complement. checksum_init picks the fastest the CPU has. The
+// kernel is built without SSE, so nothing else touches the XMM registers
+// and none of them need saving when threads switch; the SSE2 loop never
+// gives up the CPU half way.
+
+#define CPUID_EFLAGS_ID   0x00200000
+#define CPUID_EDX_FXSR    (1 << 24)
+#define CPUID_EDX_SSE2    (1 << 26)
+#define CR0_MP            (1 << 1)
+#define CR0_EM            (1 << 2)
+#define CR4_OSFXSR        (1 << 9)
+#define CR4_OSXMMEXCPT    (1 << 10)
+
+// 64-byte blocks the SSE2 loop takes before emptying its lanes: each
+// block adds at most 4 * 0xFFFF to a lane, and 16384 of those still fit
+#define CHECKSUM_SSE2_BLOCKS 16384
+
+#define CHECKSUM_BENCH_MAX   65536
+#define CHECKSUM_BENCH_ITERS 100000
+#define CHECKSUM_SWEEP_LEN   256      // Every length up to this...
+#define CHECKSUM_SWEEP_OFF   16       // ...at every offset up to this
+
+typedef struct checksum_impl {
+    const char *name;
+    u32 (*add)(const void *data, u32 len);   // Sum of at most 0xFFFF
+} checksum_impl_t;
+
+typedef u32 checksum_vec_t __attribute__((vector_size(16)));
+typedef u32 checksum_uvec_t __attribute__((vector_size(16), aligned(1)));
+
+static u32 checksum_add_words(const void *data, u32 len);
+static u32 checksum_add_unrolled(const void *data, u32 len);
+static u32 checksum_add_sse2(const void *data, u32 len);
+
+static const checksum_impl_t checksum_impls[] = {
+    { "words", checksum_add_words },
+    { "unrolled", checksum_add_unrolled },
+    { "sse2", checksum_add_sse2 },
+};
+
+#define CHECKSUM_IMPLS (sizeof(checksum_impls) / sizeof(checksum_impls[0]))
+
+static const checksum_impl_t *checksum_active = &checksum_impls[1];
+static u8 checksum_have_sse2 = 0;
+
+static u32 checksum_fold32(u32 sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (sum & 0xFFFF) + (sum >> 16);
+}
+
+static u32 checksum_fold64(u64 sum) {
+    u32 low = (u32)sum;
+    u32 folded = low + (u32)(sum >> 32);
+    if (folded < low) folded++;   // End-around carry
+    return checksum_fold32(folded);
+}
+
+// The plain loop, for CPUs and comparisons that need it
+static u32 checksum_add_words(const void *data, u32 len) {
+    const u16 *words = (const u16 *)data;
+    u32 sum = 0;
+
+    while (len > 1) {
+        sum += *words++;
+        len -= 2;
+        if (sum & 0x80000000) sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    if (len) sum += *(const u8 *)words;
+    return checksum_fold32(sum);
+}
+
+// Any i386 can do this. x86 does not mind unaligned loads.
+static u32 checksum_add_unrolled(const void *data, u32 len) {
+    const u32 *words = (const u32 *)data;
+    u64 sum = 0;
+
+    while (len >= 32) {
+        sum += words[0];
+        sum += words[1];
+        sum += words[2];
+        sum += words[3];
+        sum += words[4];
+        sum += words[5];
+        sum += words[6];
+        sum += words[7];
+        words += 8;
+        len -= 32;
+    }
+    while (len >= 4) {
+        sum += *words++;
+        len -= 4;
+    }
+
+    const u8 *bytes = (const u8 *)words;
+    if (len >= 2) {
+        sum += *(const u16 *)bytes;
+        bytes += 2;
+        len -= 2;
+    }
+    if (len) sum += *bytes;
+    return checksum_fold64(sum);
+}
+
+// Split each 32-bit lane into its two 16-bit words and sum those into
+// separate lanes, so nothing carries out of a lane. The stack is
+// realigned on entry because the caller may not keep it 16-byte aligned.
+__attribute__((target("sse2"), force_align_arg_pointer))
+static u32 checksum_add_sse2(const void *data, u32 len) {
+    const u8 *bytes = (const u8 *)data;
+    const checksum_vec_t mask = { 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF };
+    u64 sum = 0;
+
+    while (len >= 64) {
+        checksum_vec_t low = { 0, 0, 0, 0 };
+        checksum_vec_t high = { 0, 0, 0, 0 };
+        u32 blocks = len / 64;
+        if (blocks > CHECKSUM_SSE2_BLOCKS) blocks = CHECKSUM_SSE2_BLOCKS;
+        len -= blocks * 64;
+
+        while (blocks--) {
+            const checksum_uvec_t *block = (const checksum_uvec_t *)bytes;
+            checksum_vec_t a = block[0];
+            checksum_vec_t b = block[1];
+            checksum_vec_t c = block[2];
+            checksum_vec_t d = block[3];
+            low += (a & mask) + (b & mask) + (c & mask) + (d & mask);
+            high += (a >> 16) + (b >> 16) + (c >> 16) + (d >> 16);
+            bytes += 64;
+        }
+        for (int i = 0; i < 4; i++) {
+            sum += (u64)low[i] + high[i];
+        }
+    }
+    return checksum_fold64(sum + checksum_add_unrolled(bytes, len));
+}
+
+static int cpu_has_cpuid(void) {
+    u32 before, after;
+    __asm__ volatile ("pushfl\n\t"
+                      "pushfl\n\t"
+                      "popl %0\n\t"
+                      "movl %0, %1\n\t"
+                      "xorl %2, %1\n\t"
+                      "pushl %1\n\t"
+                      "popfl\n\t"
+                      "pushfl\n\t"
+                      "popl %1\n\t"
+                      "popfl"
+                      : "=&r"(before), "=&r"(after) : "i"(CPUID_EFLAGS_ID));
+    return ((before ^ after) & CPUID_EFLAGS_ID) != 0;
+}
+
+static u32 cpuid_features(void) {
+    u32 eax = 1, ebx, ecx = 0, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return edx;
+}
+
+// Let SSE instructions run: no FPU emulation, and the OS saves (here:
+// never needs to save) the XMM state
+static void cpu_enable_sse(void) {
+    u32 cr0, cr4;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~CR0_EM) | CR0_MP;
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+}
+
+void checksum_init(void) {
+    u32 needed = CPUID_EDX_FXSR | CPUID_EDX_SSE2;
+    if (cpu_has_cpuid() && (cpuid_features() & needed) == needed) {
+        cpu_enable_sse();
+        checksum_have_sse2 = 1;
+        checksum_active = &checksum_impls[2];
+    }
+}
+
+const char *checksum_impl_name(void) {
+    return checksum_active->name;
+}
+
+u32 ip_checksum_add(u32 sum, const void *data, u32 len) {
+    return checksum_fold32(sum) + checksum_active->add(data, len);
+}
+
+u16 ip_checksum_fold(u32 sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (u16)~sum;
+}
+
+u16 ip_checksum(const void *data, u32 len) {
+    return ip_checksum_fold(checksum_active->add(data, len));
+}
+
+// Incremental update (RFC 1624, eqn. 3): the checksum after one 16-bit
+// word of the data changes from 'old_word' to 'new_word', both as they
+// sit in memory. Unlike the older HC - m + m' form, this never gives
+// 0xFFFF (-0) for data whose full checksum is 0.
+u16 ip_checksum_update16(u16 check, u16 old_word, u16 new_word) {
+    return ip_checksum_fold((u16)~check + (u16)~old_word + new_word);
+}
+
+// The same for a 32-bit field such as an address
+u16 ip_checksum_update32(u16 check, u32 old_value, u32 new_value) {
+    u32 sum = (u16)~check;
+    sum += (u16)~old_value + (u16)~(old_value >> 16);
+    sum += (new_value & 0xFFFF) + (new_value >> 16);
+    return ip_checksum_fold(sum);
+}
+
+static u32 checksum_bench_seed;
+
+static u32 checksum_bench_random(void) {
+    checksum_bench_seed = checksum_bench_seed * 1103515245 + 12345;
+    return checksum_bench_seed >> 8;
+}
+
+// Patch random words and addresses of an IPv4 header with the update
+// helpers, checking each result against a full recompute
+static void checksum_bench_update(bench_t *b, u32 iterations) {
+    u16 header[10];
+    for (u32 i = 0; i < 10; i++) {
+        header[i] = (u16)checksum_bench_random();
+    }
+    header[5] = 0;
+    header[5] = ip_checksum(header, sizeof(header));
+
+    for (u32 i = 0; i < iterations; i++) {
+        u16 check;
+        if (i & 1) {
+            u32 *addr = (u32 *)&header[6 + (i & 2)];  // Source or destination
+            u32 value = checksum_bench_random() ^ (checksum_bench_random() << 16);
+            bench_begin(b);
+            check = ip_checksum_update32(header[5], *addr, value);
+            bench_end(b);
+            *addr = value;
+        } else {
+            u32 word = checksum_bench_random() % 9;
+            if (word >= 5) word++;                    // Not the checksum itself
+            u16 value = (u16)checksum_bench_random();
+            bench_begin(b);
+            check = ip_checksum_update16(header[5], header[word], value);
+            bench_end(b);
+            header[word] = value;
+        }
+        header[5] = 0;
+        if (ip_checksum(header, sizeof(header)) != check) b->errors++;
+        header[5] = check;
+    }
+}
+
+// Time each implementation over 'size' bytes at offsets 0 to 3, after
+// checking it against the word loop at every short length and offset
+void checksum_bench(u32 size, u32 iterations, int machine) {
+    if (size < 1) size = 1;
+    if (size > CHECKSUM_BENCH_MAX) size = CHECKSUM_BENCH_MAX;
+    if (iterations < 1) iterations = 1;
+    if (iterations > CHECKSUM_BENCH_ITERS) iterations = CHECKSUM_BENCH_ITERS;
+
+    u32 impl_count = checksum_have_sse2 ? CHECKSUM_IMPLS : CHECKSUM_IMPLS - 1;
+    u32 buffer_size = (size > CHECKSUM_SWEEP_LEN ? size : CHECKSUM_SWEEP_LEN) + CHECKSUM_SWEEP_OFF;
+    u8 *buffer = (u8 *)kmalloc(buffer_size);
+
+    bench_t results[CHECKSUM_IMPLS + 1];
+    u32 result_count = impl_count + 1;
+    memset(results, 0, sizeof(results));
+
+    int ok = buffer != NULL;
+    for (u32 i = 0; i < impl_count; i++) {
+        ok = ok && bench_init(&results[i], "checksum", checksum_impls[i].name, iterations) == 0;
+    }
+    ok = ok && bench_init(&results[impl_count], "checksum", "update", iterations) == 0;
+    if (!ok) {
+        vga_printf("checksum: Out of memory\n");
+        for (u32 i = 0; i < result_count; i++) {
+            bench_free(&results[i]);
+        }
+        if (buffer) kfree(buffer);
+        return;
+    }
+
+    checksum_bench_seed = 0x2545F491;
+    for (u32 i = 0; i < buffer_size; i++) {
+        buffer[i] = (u8)checksum_bench_random();
+    }
+
+    if (machine) {
+        vga_printf("BENCH-CONFIG suite=checksum size=%u iterations=%u impl=%s tsc_khz=%u\n",
+                   size, iterations, checksum_active->name, timer_tsc_khz());
+    } else {
+        vga_printf("checksum bench: %u bytes x %u, using %s, TSC %u MHz\n",
+                   size, iterations, checksum_active->name, timer_tsc_khz() / 1000);
+    }
+    bench_header(machine);
+
+    u16 expected[4];
+    for (u32 offset = 0; offset < 4; offset++) {
+        expected[offset] = ip_checksum_fold(checksum_add_words(buffer + offset, size));
+    }
+
+    for (u32 i = 0; i < impl_count; i++) {
+        const checksum_impl_t *impl = &checksum_impls[i];
+        bench_t *b = &results[i];
+
+        for (u32 offset = 0; offset < CHECKSUM_SWEEP_OFF; offset++) {
+            for (u32 len = 0; len <= CHECKSUM_SWEEP_LEN; len++) {
+                if (ip_checksum_fold(impl->add(buffer + offset, len)) !=
+                    ip_checksum_fold(checksum_add_words(buffer + offset, len))) {
+                    b->errors++;
+                }
+            }
+        }
+
+        for (u32 n = 0; n < iterations; n++) {
+            u32 offset = n & 3;
+            bench_begin(b);
+            u32 sum = impl->add(buffer + offset, size);
+            bench_end(b);
+            if (ip_checksum_fold(sum) != expected[offset]) b->errors++;
+        }
+    }
+    checksum_bench_update(&results[impl_count], iterations);
+
+    for (u32 i = 0; i < result_count; i++) {
+        bench_report(&results[i], machine);
+    }
+
+    // Bytes per microsecond is MB/s
+    if (!machine) {
+        for (u32 i = 0; i < impl_count; i++) {
+            u32 total_us = timer_cycles_to_us(results[i].total);
+            u32 rate = total_us ? udiv64((u64)results[i].count * size, total_us) : 0;
+            vga_printf("%-8s %u MB/s\n", checksum_impls[i].name, rate);
+        }
+    }
+
+    for (u32 i = 0; i < result_count; i++) {
+        bench_free(&results[i]);
+    }
+    kfree(buffer);
+}
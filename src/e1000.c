@@ -0,0 +1,431 @@
+#include "kernel.h"
+#include "vga.h"
+#include "io.h"
+#include "pci.h"
+#include "net.h"
+
+// Intel 8254x (e1000) PCI Ethernet driver. QEMU emulates the 82540EM.
+// Receive and transmit use descriptor rings in DMA memory whose
+// descriptors point straight at packet buffers, so frames are never
+// copied: a filled RX buffer is handed to the stack and replaced with a
+// fresh one, and a TX descriptor holds a reference to the sender's
+// buffer until the device is done with it. Receive interrupts only
+// start a poll: they stay masked while the net-rx job drains the ring.
+
+#define E1000_VENDOR_ID 0x8086
+
+static const u16 e1000_device_ids[] = {
+    0x100E,  // 82540EM (QEMU default)
+    0x100F,  // 82545EM
+    0x1004,  // 82543GC
+    0x10D3,  // 82574L
+};
+
+// Register offsets
+#define E1000_CTRL   0x0000
+#define E1000_STATUS 0x0008
+#define E1000_EERD   0x0014
+#define E1000_ICR    0x00C0
+#define E1000_IMS    0x00D0
+#define E1000_ITR    0x00C4
+#define E1000_IMC    0x00D8
+#define E1000_RCTL   0x0100
+#define E1000_TCTL   0x0400
+#define E1000_TIPG   0x0410
+#define E1000_RDBAL  0x2800
+#define E1000_RDBAH  0x2804
+#define E1000_RDLEN  0x2808
+#define E1000_RDH    0x2810
+#define E1000_RDT    0x2818
+#define E1000_TDBAL  0x3800
+#define E1000_TDBAH  0x3804
+#define E1000_TDLEN  0x3808
+#define E1000_TDH    0x3810
+#define E1000_TDT    0x3818
+#define E1000_MTA    0x5200
+#define E1000_RAL0   0x5400
+#define E1000_RAH0   0x5404
+
+#define E1000_MMIO_SIZE 0x20000
+
+// CTRL bits
+#define E1000_CTRL_ASDE (1 << 5)
+#define E1000_CTRL_SLU  (1 << 6)
+#define E1000_CTRL_RST  (1 << 26)
+
+// STATUS bits
+#define E1000_STATUS_LU (1 << 1)
+
+// Interrupt causes
+#define E1000_ICR_TXDW   (1 << 0)
+#define E1000_ICR_LSC    (1 << 2)
+#define E1000_ICR_RXDMT0 (1 << 4)
+#define E1000_ICR_RXO    (1 << 6)
+#define E1000_ICR_RXT0   (1 << 7)
+#define E1000_ICR_RX     (E1000_ICR_RXT0 | E1000_ICR_RXDMT0 | E1000_ICR_RXO)
+
+// ITR counts in 256 ns units
+#define E1000_ITR_MAX    0xFFFF
+
+// RCTL bits; BSIZE 00 selects 2048-byte buffers
+#define E1000_RCTL_EN    (1 << 1)
+#define E1000_RCTL_BAM   (1 << 15)
+#define E1000_RCTL_SECRC (1 << 26)
+
+// TCTL bits
+#define E1000_TCTL_EN      (1 << 1)
+#define E1000_TCTL_PSP     (1 << 3)
+#define E1000_TCTL_CT      (0x10 << 4)
+#define E1000_TCTL_COLD    (0x40 << 12)
+
+// Inter-packet gap recommended for 802.3 copper
+#define E1000_TIPG_DEFAULT 0x0060200A
+
+// Descriptor bits
+#define E1000_RXD_STAT_DD  0x01
+#define E1000_RXD_STAT_EOP 0x02
+#define E1000_TXD_CMD_EOP  0x01
+#define E1000_TXD_CMD_IFCS 0x02
+#define E1000_TXD_CMD_RS   0x08
+#define E1000_TXD_STAT_DD  0x01
+
+// Ring sizes: the ring length in bytes must be a multiple of 128
+#define E1000_RX_DESCS  128
+#define E1000_TX_DESCS  128
+
+typedef struct e1000_rx_desc {
+    u64 addr;
+    u16 length;
+    u16 checksum;
+    u8 status;
+    u8 errors;
+    u16 special;
+} __attribute__((packed)) e1000_rx_desc_t;
+
+typedef struct e1000_tx_desc {
+    u64 addr;
+    u16 length;
+    u8 cso;
+    u8 cmd;
+    u8 status;
+    u8 css;
+    u16 special;
+} __attribute__((packed)) e1000_tx_desc_t;
+
+typedef struct e1000 {
+    network_interface_t *iface;
+    volatile u8 *mmio;
+    e1000_rx_desc_t *rx_ring;
+    e1000_tx_desc_t *tx_ring;
+    netbuf_t *rx_buffers[E1000_RX_DESCS];
+    netbuf_t *tx_buffers[E1000_TX_DESCS];
+    u32 rx_next;      // Next RX descriptor the device will fill
+    u32 tx_tail;      // Next free TX descriptor
+    u32 tx_clean;     // Oldest TX descriptor not yet reclaimed
+    u32 tx_pending;   // Descriptors filled since the last doorbell
+    u8 link_up;
+} e1000_t;
+
+static e1000_t nic;
+static u8 nic_present = 0;
+
+static inline u32 e1000_read(e1000_t *dev, u32 reg) {
+    return *(volatile u32 *)(dev->mmio + reg);
+}
+
+static inline void e1000_write(e1000_t *dev, u32 reg, u32 value) {
+    *(volatile u32 *)(dev->mmio + reg) = value;
+}
+
+// Read a 16-bit word from the EEPROM
+static u16 e1000_eeprom_read(e1000_t *dev, u8 address) {
+    e1000_write(dev, E1000_EERD, 1 | ((u32)address << 8));
+    for (u32 i = 0; i < 100000; i++) {
+        u32 value = e1000_read(dev, E1000_EERD);
+        if (value & (1 << 4)) return value >> 16;
+    }
+    return 0;
+}
+
+// The MAC address is in receive address register 0 once the EEPROM has
+// been loaded; fall back to reading the EEPROM directly
+static void e1000_read_mac(e1000_t *dev, u8 *mac) {
+    u32 ral = e1000_read(dev, E1000_RAL0);
+    u32 rah = e1000_read(dev, E1000_RAH0);
+
+    if (rah & 0x80000000) {
+        for (int i = 0; i < 4; i++) mac[i] = ral >> (i * 8);
+        mac[4] = rah;
+        mac[5] = rah >> 8;
+        return;
+    }
+
+    for (u8 i = 0; i < 3; i++) {
+        u16 word = e1000_eeprom_read(dev, i);
+        mac[i * 2] = word & 0xFF;
+        mac[i * 2 + 1] = word >> 8;
+    }
+    e1000_write(dev, E1000_RAL0, mac[0] | (mac[1] << 8) | (mac[2] << 16) | ((u32)mac[3] << 24));
+    e1000_write(dev, E1000_RAH0, mac[4] | (mac[5] << 8) | 0x80000000);
+}
+
+static int e1000_rx_init(e1000_t *dev) {
+    dev->rx_ring = (e1000_rx_desc_t *)kmalloc_aligned(sizeof(e1000_rx_desc_t) * E1000_RX_DESCS, 128);
+    if (!dev->rx_ring) return -4; // Out of memory
+
+    // RCTL.BSIZE 00 means the device may write 2048 bytes per buffer
+    for (u32 i = 0; i < E1000_RX_DESCS; i++) {
+        dev->rx_buffers[i] = netbuf_alloc();
+        if (!dev->rx_buffers[i]) return -4;
+        memset(&dev->rx_ring[i], 0, sizeof(e1000_rx_desc_t));
+        dev->rx_ring[i].addr = (u32)dev->rx_buffers[i]->data;
+    }
+    dev->rx_next = 0;
+
+    e1000_write(dev, E1000_RDBAL, (u32)dev->rx_ring);
+    e1000_write(dev, E1000_RDBAH, 0);
+    e1000_write(dev, E1000_RDLEN, sizeof(e1000_rx_desc_t) * E1000_RX_DESCS);
+    e1000_write(dev, E1000_RDH, 0);
+    e1000_write(dev, E1000_RDT, E1000_RX_DESCS - 1);
+    e1000_write(dev, E1000_RCTL, E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_SECRC);
+    return 0;
+}
+
+static int e1000_tx_init(e1000_t *dev) {
+    dev->tx_ring = (e1000_tx_desc_t *)kmalloc_aligned(sizeof(e1000_tx_desc_t) * E1000_TX_DESCS, 128);
+    if (!dev->tx_ring) return -4; // Out of memory
+
+    // Every descriptor starts out done, i.e. free
+    for (u32 i = 0; i < E1000_TX_DESCS; i++) {
+        memset(&dev->tx_ring[i], 0, sizeof(e1000_tx_desc_t));
+        dev->tx_ring[i].status = E1000_TXD_STAT_DD;
+        dev->tx_buffers[i] = NULL;
+    }
+    dev->tx_tail = 0;
+    dev->tx_clean = 0;
+    dev->tx_pending = 0;
+
+    e1000_write(dev, E1000_TDBAL, (u32)dev->tx_ring);
+    e1000_write(dev, E1000_TDBAH, 0);
+    e1000_write(dev, E1000_TDLEN, sizeof(e1000_tx_desc_t) * E1000_TX_DESCS);
+    e1000_write(dev, E1000_TDH, 0);
+    e1000_write(dev, E1000_TDT, 0);
+    e1000_write(dev, E1000_TIPG, E1000_TIPG_DEFAULT);
+    e1000_write(dev, E1000_TCTL, E1000_TCTL_EN | E1000_TCTL_PSP | E1000_TCTL_CT | E1000_TCTL_COLD);
+    return 0;
+}
+
+// Reclaim TX descriptors the device has finished with, dropping their
+// buffer references
+static void e1000_tx_reclaim(e1000_t *dev) {
+    while (dev->tx_clean != dev->tx_tail &&
+           (dev->tx_ring[dev->tx_clean].status & E1000_TXD_STAT_DD)) {
+        netbuf_put(dev->tx_buffers[dev->tx_clean]);
+        dev->tx_buffers[dev->tx_clean] = NULL;
+        dev->tx_clean = (dev->tx_clean + 1) % E1000_TX_DESCS;
+    }
+}
+
+static inline u32 e1000_tx_free(e1000_t *dev) {
+    return (dev->tx_clean + E1000_TX_DESCS - dev->tx_tail - 1) % E1000_TX_DESCS;
+}
+
+// Interface hook: point TX descriptors at the frame, one for the buffer
+// and one per fragment, with end-of-packet on the last. The buffer is
+// referenced from the last descriptor, so it outlives the DMA of every
+// piece. The device is told about the frame in e1000_commit, once per
+// batch.
+static int e1000_transmit(network_interface_t *iface, netbuf_t *nb) {
+    e1000_t *dev = (e1000_t *)iface->driver_data;
+    u32 count = 1 + nb->frag_count;
+
+    u32 flags = irq_save();
+    if (e1000_tx_free(dev) < count) {
+        e1000_tx_reclaim(dev);
+        if (e1000_tx_free(dev) < count) {
+            irq_restore(flags);
+            return -1; // Ring full
+        }
+    }
+
+    netbuf_get(nb);
+    for (u32 i = 0; i < count; i++) {
+        e1000_tx_desc_t *desc = &dev->tx_ring[dev->tx_tail];
+        int last = i == count - 1;
+        dev->tx_buffers[dev->tx_tail] = last ? nb : NULL;
+        desc->addr = i ? (u32)nb->frags[i - 1].data : (u32)nb->data;
+        desc->length = i ? nb->frags[i - 1].len : nb->len;
+        desc->cso = 0;
+        desc->css = 0;
+        desc->special = 0;
+        desc->status = 0;
+        desc->cmd = E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS | (last ? E1000_TXD_CMD_EOP : 0);
+        dev->tx_tail = (dev->tx_tail + 1) % E1000_TX_DESCS;
+    }
+
+    dev->tx_pending++;
+    irq_restore(flags);
+    return 0;
+}
+
+// Interface hook: one tail register write for every frame queued since
+// the last commit
+static void e1000_commit(network_interface_t *iface) {
+    e1000_t *dev = (e1000_t *)iface->driver_data;
+    if (!dev->tx_pending) return;
+
+    barrier();
+    e1000_write(dev, E1000_TDT, dev->tx_tail);
+    dev->tx_pending = 0;
+    iface->tx_doorbells++;
+}
+
+// Pass up to 'budget' completed RX buffers to the stack, refill the
+// descriptors with fresh buffers, then give them back to the device with
+// a single tail update. When the pool is empty the frame is dropped and
+// its buffer stays on the ring. Returns the descriptors consumed.
+static u32 e1000_rx_drain(e1000_t *dev, u32 budget) {
+    u32 last = E1000_RX_DESCS;
+    u32 done = 0;
+
+    while (done < budget && (dev->rx_ring[dev->rx_next].status & E1000_RXD_STAT_DD)) {
+        e1000_rx_desc_t *desc = &dev->rx_ring[dev->rx_next];
+
+        // Frames never span buffers: the MTU fits in one
+        netbuf_t *fresh = NULL;
+        if ((desc->status & E1000_RXD_STAT_EOP) && !desc->errors) {
+            fresh = netbuf_alloc();
+        }
+        if (fresh) {
+            netbuf_t *nb = dev->rx_buffers[dev->rx_next];
+            nb->len = desc->length;
+            network_receive_netbuf(dev->iface, nb);
+            dev->rx_buffers[dev->rx_next] = fresh;
+            desc->addr = (u32)fresh->data;
+        } else {
+            dev->iface->rx_dropped++;
+        }
+
+        desc->status = 0;
+        last = dev->rx_next;
+        dev->rx_next = (dev->rx_next + 1) % E1000_RX_DESCS;
+        done++;
+    }
+
+    if (last != E1000_RX_DESCS) {
+        barrier();
+        e1000_write(dev, E1000_RDT, last);
+    }
+    return done;
+}
+
+// Interface hook: receive from the net-rx job with RX interrupts masked
+static u32 e1000_poll(network_interface_t *iface, u32 budget) {
+    return e1000_rx_drain((e1000_t *)iface->driver_data, budget);
+}
+
+// Interface hook: the ring is empty, so unmask RX interrupts. A frame
+// completed just before that would not raise one; report it instead.
+static int e1000_poll_done(network_interface_t *iface) {
+    e1000_t *dev = (e1000_t *)iface->driver_data;
+
+    e1000_write(dev, E1000_IMS, E1000_ICR_RX);
+    if (dev->rx_ring[dev->rx_next].status & E1000_RXD_STAT_DD) {
+        e1000_write(dev, E1000_IMC, E1000_ICR_RX);
+        return 1;
+    }
+    return 0;
+}
+
+// Interface hook: limit the interrupt rate to one per 'usecs'
+static void e1000_set_coalesce(network_interface_t *iface, u32 usecs) {
+    e1000_t *dev = (e1000_t *)iface->driver_data;
+    u32 itr = udiv64((u64)usecs * 1000, 256);
+    e1000_write(dev, E1000_ITR, itr > E1000_ITR_MAX ? E1000_ITR_MAX : itr);
+}
+
+// Interrupt handler; the line may be shared with other PCI devices
+static void e1000_irq(void) {
+    if (!nic_present) return;
+
+    // Reading ICR acknowledges every pending cause
+    u32 cause = e1000_read(&nic, E1000_ICR);
+    if (!cause) return;
+
+    nic.iface->interrupts++;
+    if (cause & E1000_ICR_LSC) {
+        nic.link_up = (e1000_read(&nic, E1000_STATUS) & E1000_STATUS_LU) != 0;
+    }
+    if (cause & E1000_ICR_RXO) {
+        nic.iface->rx_dropped++;
+    }
+    if (cause & E1000_ICR_RX) {
+        // Mask receive interrupts until a poll finds the ring empty
+        e1000_write(&nic, E1000_IMC, E1000_ICR_RX);
+        network_schedule_poll(nic.iface);
+    }
+    if (cause & E1000_ICR_TXDW) {
+        e1000_tx_reclaim(&nic);
+    }
+}
+
+// Initialize the e1000 driver
+void e1000_init(void) {
+    pci_device_t *pci = NULL;
+    for (u32 i = 0; i < sizeof(e1000_device_ids) / sizeof(e1000_device_ids[0]) && !pci; i++) {
+        pci = pci_find_device(E1000_VENDOR_ID, e1000_device_ids[i]);
+    }
+    if (!pci || pci_bar_is_io(pci, 0)) return;
+
+    memset(&nic, 0, sizeof(nic));
+    u32 base = pci_bar_address(pci, 0);
+    if (memory_map_device(base, E1000_MMIO_SIZE) != 0) {
+        vga_printf("e1000: cannot map registers at 0x%x\n", base);
+        return;
+    }
+    nic.mmio = (volatile u8 *)base;
+    pci_enable_bus_master(pci);
+
+    // Reset, then mask every interrupt until the rings are ready
+    e1000_write(&nic, E1000_IMC, 0xFFFFFFFF);
+    e1000_write(&nic, E1000_CTRL, e1000_read(&nic, E1000_CTRL) | E1000_CTRL_RST);
+    for (u32 i = 0; i < 100000 && (e1000_read(&nic, E1000_CTRL) & E1000_CTRL_RST); i++) {
+        // Wait for the reset to complete
+    }
+    e1000_write(&nic, E1000_IMC, 0xFFFFFFFF);
+    e1000_read(&nic, E1000_ICR);
+
+    e1000_write(&nic, E1000_CTRL, e1000_read(&nic, E1000_CTRL) | E1000_CTRL_SLU | E1000_CTRL_ASDE);
+    for (u32 i = 0; i < 128; i++) {
+        e1000_write(&nic, E1000_MTA + i * 4, 0);
+    }
+
+    u8 mac[6];
+    e1000_read_mac(&nic, mac);
+
+    if (e1000_rx_init(&nic) != 0 || e1000_tx_init(&nic) != 0) {
+        vga_printf("e1000: out of memory for descriptor rings\n");
+        return;
+    }
+
+    network_interface_t *iface = network_register_interface(NULL, mac);
+    if (!iface) return;
+    iface->transmit = e1000_transmit;
+    iface->gather = 1;
+    iface->commit = e1000_commit;
+    iface->poll = e1000_poll;
+    iface->poll_done = e1000_poll_done;
+    iface->set_coalesce = e1000_set_coalesce;
+    iface->driver_data = &nic;
+    nic.iface = iface;
+    nic.link_up = (e1000_read(&nic, E1000_STATUS) & E1000_STATUS_LU) != 0;
+
+    nic_present = 1;
+    register_irq_handler(pci->irq_line, e1000_irq);
+    e1000_set_coalesce(iface, network_get_rx_coalesce());
+    e1000_write(&nic, E1000_IMS, E1000_ICR_RX | E1000_ICR_LSC | E1000_ICR_TXDW);
+
+    vga_printf("e1000 %s: %02x:%02x:%02x:%02x:%02x:%02x, irq %d, link %s\n",
+               iface->name, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+               pci->irq_line, nic.link_up ? "up" : "down");
+}
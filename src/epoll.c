@@ -0,0 +1,362 @@
+#include "kernel.h"
+#include "vga.h"
+#include "poll.h"
+#include "socket.h"
+#include "bench.h"
+
+// epoll. An instance holds its interest set, hashed by descriptor, and a
+// ready list. Each watched source keeps the items watching it on its
+// poll head and hands them to poll_wake when its state changes, so
+// epoll_wait only visits ready items: its cost follows the number of
+// ready descriptors, not the number watched.
+//
+// A reported item is checked against its source first, since whatever
+// woke it may have been consumed already. Level-triggered items then go
+// back on the ready list, and stay there until a wait finds them no
+// longer ready; edge-triggered ones are reported once per wakeup.
+//
+// Like sockets and the network stack, this runs in thread context only;
+// interrupt handlers raise deferred work rather than wake items directly.
+// Descriptors start at EPOLL_FD_BASE, above the socket and pipe ones.
+
+#define MAX_EPOLL       16
+#define EPOLL_FD_BASE   256
+#define EPOLL_HASH_SIZE 16
+#define EPOLL_ALWAYS    (POLLERR | POLLHUP)
+
+typedef struct epoll_item {
+    struct epoll *ep;
+    int fd;
+    u32 events;                    // Interest, with EPOLLET
+    u32 data;
+    poll_head_t *head;
+    struct epoll_item *hash_next;  // In the interest set
+    struct epoll_item *head_next;  // On the source's poll head
+    struct epoll_item *ready_next;
+    u8 ready;                      // On the ready list
+} epoll_item_t;
+
+typedef struct epoll {
+    u8 used;
+    u32 count;                     // Descriptors watched
+    epoll_item_t *hash[EPOLL_HASH_SIZE];
+    epoll_item_t *ready_head;
+    epoll_item_t *ready_tail;
+    wait_queue_t wait;
+} epoll_t;
+
+static epoll_t epolls[MAX_EPOLL];
+
+static epoll_t *epoll_get(int epfd) {
+    if (epfd < EPOLL_FD_BASE || epfd >= EPOLL_FD_BASE + MAX_EPOLL) return NULL;
+    epoll_t *ep = &epolls[epfd - EPOLL_FD_BASE];
+    return ep->used ? ep : NULL;
+}
+
+// The poll head and current events of a descriptor; NULL if it is not
+// one that can be watched
+static poll_head_t *poll_source(int fd, u32 *events) {
+    if (fd == STDIN_FD) return keyboard_poll(events);
+
+    socket_t *sock = socket_get(fd);
+    if (sock) {
+        *events = socket_poll(sock);
+        return &sock->poll;
+    }
+    return pipe_poll(fd, events);
+}
+
+static void epoll_queue(epoll_item_t *item) {
+    if (item->ready) return;
+
+    epoll_t *ep = item->ep;
+    item->ready = 1;
+    item->ready_next = NULL;
+    if (ep->ready_tail) {
+        ep->ready_tail->ready_next = item;
+    } else {
+        ep->ready_head = item;
+    }
+    ep->ready_tail = item;
+}
+
+static void epoll_unqueue(epoll_item_t *item) {
+    if (!item->ready) return;
+
+    epoll_t *ep = item->ep;
+    epoll_item_t *prev = NULL;
+    for (epoll_item_t *cursor = ep->ready_head; cursor != item; cursor = cursor->ready_next) {
+        prev = cursor;
+    }
+    if (prev) {
+        prev->ready_next = item->ready_next;
+    } else {
+        ep->ready_head = item->ready_next;
+    }
+    if (ep->ready_tail == item) ep->ready_tail = prev;
+    item->ready = 0;
+}
+
+// The source's state changed: queue the items interested in 'events'
+// and wake the threads waiting on it or on their epoll instances
+void poll_wake(poll_head_t *head, u32 events) {
+    wait_wake(&head->wait);
+    for (epoll_item_t *item = head->items; item; item = item->head_next) {
+        if (!((item->events | EPOLL_ALWAYS) & events) || item->ready) continue;
+        epoll_queue(item);
+        wait_wake(&item->ep->wait);
+    }
+}
+
+// Remove an item from the interest set, the ready list and, unless the
+// source is dropping all of them, the source's list; then free it
+static void epoll_item_free(epoll_item_t *item, int unlink_head) {
+    epoll_t *ep = item->ep;
+    epoll_item_t **link = &ep->hash[item->fd % EPOLL_HASH_SIZE];
+    while (*link != item) link = &(*link)->hash_next;
+    *link = item->hash_next;
+    ep->count--;
+    epoll_unqueue(item);
+
+    if (unlink_head) {
+        link = &item->head->items;
+        while (*link != item) link = &(*link)->head_next;
+        *link = item->head_next;
+    }
+    kfree(item);
+}
+
+// The source is going away, taking its descriptor with it: stop watching
+// it everywhere, and wake its waiters so they notice
+void poll_release(poll_head_t *head) {
+    while (head->items) {
+        epoll_item_t *item = head->items;
+        head->items = item->head_next;
+        epoll_item_free(item, 0);
+    }
+    wait_wake(&head->wait);
+}
+
+int epoll_create(void) {
+    for (int i = 0; i < MAX_EPOLL; i++) {
+        epoll_t *ep = &epolls[i];
+        if (ep->used) continue;
+
+        memset(ep, 0, sizeof(epoll_t));
+        ep->used = 1;
+        return i + EPOLL_FD_BASE;
+    }
+    return -NET_EMFILE;
+}
+
+static epoll_item_t *epoll_find(epoll_t *ep, int fd) {
+    for (epoll_item_t *item = ep->hash[fd % EPOLL_HASH_SIZE]; item; item = item->hash_next) {
+        if (item->fd == fd) return item;
+    }
+    return NULL;
+}
+
+// Add, change or remove the interest in a descriptor. A descriptor that
+// is already ready is reported by the next wait, in either mode.
+int epoll_ctl(int epfd, int op, int fd, const epoll_event_t *event) {
+    epoll_t *ep = epoll_get(epfd);
+    if (!ep) return -NET_EBADF;
+
+    u32 events;
+    poll_head_t *head = fd >= 0 ? poll_source(fd, &events) : NULL;
+    if (!head) return -NET_EBADF;
+
+    epoll_item_t *item = epoll_find(ep, fd);
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            if (!event) return -NET_EINVAL;
+            if (item) return -NET_EEXIST;
+            item = (epoll_item_t *)kmalloc(sizeof(epoll_item_t));
+            if (!item) return -NET_ENOMEM;
+
+            memset(item, 0, sizeof(epoll_item_t));
+            item->ep = ep;
+            item->fd = fd;
+            item->head = head;
+            item->hash_next = ep->hash[fd % EPOLL_HASH_SIZE];
+            ep->hash[fd % EPOLL_HASH_SIZE] = item;
+            item->head_next = head->items;
+            head->items = item;
+            ep->count++;
+            break;
+        case EPOLL_CTL_MOD:
+            if (!event) return -NET_EINVAL;
+            if (!item) return -NET_ENOENT;
+            break;
+        case EPOLL_CTL_DEL:
+            if (!item) return -NET_ENOENT;
+            epoll_item_free(item, 1);
+            return 0;
+        default:
+            return -NET_EINVAL;
+    }
+
+    item->events = event->events;
+    item->data = event->data;
+    if ((item->events | EPOLL_ALWAYS) & events) epoll_queue(item);
+    return 0;
+}
+
+// Report ready items, up to 'max'
+static int epoll_collect(epoll_t *ep, epoll_event_t *events, u32 max) {
+    epoll_item_t *again_head = NULL, *again_tail = NULL;
+    u32 count = 0;
+
+    while (ep->ready_head && count < max) {
+        epoll_item_t *item = ep->ready_head;
+        ep->ready_head = item->ready_next;
+        if (!ep->ready_head) ep->ready_tail = NULL;
+        item->ready = 0;
+
+        u32 current;
+        poll_source(item->fd, &current);
+        current &= item->events | EPOLL_ALWAYS;
+        if (!current) continue;
+
+        events[count].events = current;
+        events[count].data = item->data;
+        count++;
+
+        // Level-triggered: report it again until it is no longer ready
+        if (!(item->events & EPOLLET)) {
+            item->ready_next = NULL;
+            if (again_tail) {
+                again_tail->ready_next = item;
+            } else {
+                again_head = item;
+            }
+            again_tail = item;
+        }
+    }
+
+    for (epoll_item_t *item = again_head; item; ) {
+        epoll_item_t *next = item->ready_next;
+        epoll_queue(item);
+        item = next;
+    }
+    return count;
+}
+
+static int epoll_has_ready(void *arg) {
+    epoll_t *ep = (epoll_t *)arg;
+    return !ep->used || ep->ready_head != NULL;
+}
+
+// Wait for events on the watched descriptors; returns how many were
+// stored, 0 if the timeout passed first
+int epoll_wait(int epfd, epoll_event_t *events, u32 max_events, int timeout_ms) {
+    epoll_t *ep = epoll_get(epfd);
+    if (!ep) return -NET_EBADF;
+    if (!events || !max_events) return -NET_EINVAL;
+
+    u32 start = timer_get_ticks();
+    if (!ep->ready_head) work_run();  // Deliver what has already arrived
+    for (;;) {
+        int count = epoll_collect(ep, events, max_events);
+        if (count > 0 || timeout_ms == 0) return count;
+
+        u32 wait_ms = 0;  // Forever
+        if (timeout_ms > 0) {
+            u32 elapsed_ms = (timer_get_ticks() - start) * 1000 / timer_get_frequency();
+            if (elapsed_ms >= (u32)timeout_ms) return 0;
+            wait_ms = timeout_ms - elapsed_ms;
+        }
+        if (wait_event(&ep->wait, epoll_has_ready, ep, wait_ms) != 0) return 0;
+        if (!ep->used) return -NET_EBADF;  // Closed by another thread
+    }
+}
+
+int epoll_close(int epfd) {
+    epoll_t *ep = epoll_get(epfd);
+    if (!ep) return -NET_EBADF;
+
+    for (int i = 0; i < EPOLL_HASH_SIZE; i++) {
+        while (ep->hash[i]) epoll_item_free(ep->hash[i], 1);
+    }
+    ep->used = 0;
+    wait_wake(&ep->wait);
+    return 0;
+}
+
+// Benchmark: the cost of a wait that finds one ready descriptor, with one
+// pipe watched and then with many. With a ready list it should not grow
+// with the number watched.
+
+#define EPOLL_BENCH_MAX_FDS 32
+
+static int epoll_bench_run(bench_t *b, int epfd, int (*pipes)[2], u32 fds, u32 iterations) {
+    for (u32 i = 0; i < fds; i++) {
+        epoll_event_t event = { POLLIN, i };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, pipes[i][0], &event) != 0) return -1;
+    }
+
+    for (u32 i = 0; i < iterations; i++) {
+        u32 which = i % fds;
+        epoll_event_t events[4];
+        u8 byte = (u8)i;
+        pipe_write(pipes[which][1], &byte, 1, 0);
+
+        bench_begin(b);
+        int count = epoll_wait(epfd, events, 4, 0);
+        bench_end(b);
+        if (count != 1 || events[0].data != which) b->errors++;
+        pipe_read(pipes[which][0], &byte, 1, 0);
+    }
+
+    for (u32 i = 0; i < fds; i++) epoll_ctl(epfd, EPOLL_CTL_DEL, pipes[i][0], NULL);
+    return 0;
+}
+
+void epoll_bench(u32 fds, u32 iterations, int machine) {
+    if (fds < 1) fds = 1;
+    if (fds > EPOLL_BENCH_MAX_FDS) fds = EPOLL_BENCH_MAX_FDS;
+    if (iterations < 1) iterations = 1;
+
+    int pipes[EPOLL_BENCH_MAX_FDS][2];
+    u32 created = 0;
+    bench_t one, many;
+    memset(&one, 0, sizeof(bench_t));
+    memset(&many, 0, sizeof(bench_t));
+
+    int epfd = epoll_create();
+    int result = epfd < 0 ? epfd : 0;
+    while (result == 0 && created < fds) {
+        result = pipe_create(pipes[created]);
+        if (result == 0) created++;
+    }
+    if (result == 0 && (bench_init(&one, "epoll", "wait_1_watched", iterations) != 0 ||
+                        bench_init(&many, "epoll", "wait_n_watched", iterations) != 0)) {
+        result = -NET_ENOMEM;
+    }
+    if (result != 0) {
+        vga_printf("epollbench: Cannot set up (error %d)\n", -result);
+        goto out;
+    }
+
+    if (machine) {
+        vga_printf("BENCH-CONFIG suite=epoll fds=%u iterations=%u tsc_khz=%u\n",
+                   fds, iterations, timer_tsc_khz());
+    } else {
+        vga_printf("epoll bench: %u waits with 1 and with %u pipes watched, one ready each time, "
+                   "TSC %u MHz\n", iterations, fds, timer_tsc_khz() / 1000);
+    }
+    bench_header(machine);
+    epoll_bench_run(&one, epfd, pipes, 1, iterations);
+    bench_report(&one, machine);
+    epoll_bench_run(&many, epfd, pipes, fds, iterations);
+    bench_report(&many, machine);
+
+out:
+    bench_free(&one);
+    bench_free(&many);
+    for (u32 i = 0; i < created; i++) {
+        pipe_close(pipes[i][0]);
+        pipe_close(pipes[i][1]);
+    }
+    if (epfd >= 0) epoll_close(epfd);
+}
@@ -0,0 +1,463 @@
+#include "kernel.h"
+#include "vga.h"
+#include "block.h"
+#include "ext2.h"
+
+// Read-only ext2 driver on top of the block layer. All metadata and file
+// data are read through the page cache; indirect blocks additionally go
+// through a small hashed cache of decoded block pointer tables.
+
+#define EXT2_SUPERBLOCK_OFFSET 1024
+#define EXT2_MAGIC             0xEF53
+#define EXT2_ROOT_INODE        2
+#define EXT2_NDIR_BLOCKS       12
+#define EXT2_IND_BLOCK         12
+#define EXT2_DIND_BLOCK        13
+#define EXT2_TIND_BLOCK        14
+#define EXT2_BLOCK_ERROR       0xFFFFFFFF  // From bmap: an indirect block was unreadable
+
+#define EXT2_S_IFMT  0xF000
+#define EXT2_S_IFDIR 0x4000
+#define EXT2_S_IFREG 0x8000
+
+// Indirect block cache
+#define EXT2_IND_CACHE_SIZE 16
+#define EXT2_IND_HASH       32
+
+// On-disk superblock (leading fields only)
+typedef struct ext2_superblock {
+    u32 s_inodes_count;
+    u32 s_blocks_count;
+    u32 s_r_blocks_count;
+    u32 s_free_blocks_count;
+    u32 s_free_inodes_count;
+    u32 s_first_data_block;
+    u32 s_log_block_size;
+    u32 s_log_frag_size;
+    u32 s_blocks_per_group;
+    u32 s_frags_per_group;
+    u32 s_inodes_per_group;
+    u32 s_mtime;
+    u32 s_wtime;
+    u16 s_mnt_count;
+    u16 s_max_mnt_count;
+    u16 s_magic;
+    u16 s_state;
+    u16 s_errors;
+    u16 s_minor_rev_level;
+    u32 s_lastcheck;
+    u32 s_checkinterval;
+    u32 s_creator_os;
+    u32 s_rev_level;
+    u16 s_def_resuid;
+    u16 s_def_resgid;
+    u32 s_first_ino;
+    u16 s_inode_size;
+} __attribute__((packed)) ext2_superblock_t;
+
+typedef struct ext2_group_desc {
+    u32 bg_block_bitmap;
+    u32 bg_inode_bitmap;
+    u32 bg_inode_table;
+    u16 bg_free_blocks_count;
+    u16 bg_free_inodes_count;
+    u16 bg_used_dirs_count;
+    u16 bg_pad;
+    u32 bg_reserved[3];
+} __attribute__((packed)) ext2_group_desc_t;
+
+typedef struct ext2_inode {
+    u16 i_mode;
+    u16 i_uid;
+    u32 i_size;
+    u32 i_atime;
+    u32 i_ctime;
+    u32 i_mtime;
+    u32 i_dtime;
+    u16 i_gid;
+    u16 i_links_count;
+    u32 i_blocks;
+    u32 i_flags;
+    u32 i_osd1;
+    u32 i_block[15];
+} __attribute__((packed)) ext2_inode_t;
+
+typedef struct ext2_dirent {
+    u32 inode;
+    u16 rec_len;
+    u8 name_len;
+    u8 file_type;
+    char name[];
+} __attribute__((packed)) ext2_dirent_t;
+
+// A decoded indirect block
+typedef struct ext2_ind_entry {
+    u32 block;      // 0 if unused
+    u32 last_use;
+    u32 *ptrs;
+    struct ext2_ind_entry *hash_next;
+} ext2_ind_entry_t;
+
+// Mounted volume state
+typedef struct ext2_fs {
+    block_device_t *dev;
+    u32 block_size;
+    u32 ptrs_per_block;
+    u32 inodes_count;
+    u32 blocks_count;
+    u32 inodes_per_group;
+    u32 inode_size;
+    u32 group_count;
+    u32 gdt_block;
+} ext2_fs_t;
+
+static ext2_fs_t ext2;
+static u8 ext2_mounted = 0;
+
+static ext2_ind_entry_t ind_cache[EXT2_IND_CACHE_SIZE];
+static ext2_ind_entry_t *ind_hash[EXT2_IND_HASH];
+static u32 ind_clock = 0;
+static u32 ind_hits = 0;
+static u32 ind_misses = 0;
+
+// Map a filesystem block into memory. The block lies inside one cached
+// page because the block size divides the page size; the page stays
+// pinned until pagecache_put.
+static u8 *ext2_block_get(u32 block, cache_page_t **page) {
+    u32 offset = block * ext2.block_size;
+    *page = pagecache_get(ext2.dev, offset / PAGE_SIZE);
+    if (!*page) return NULL;
+    return pagecache_data(*page) + offset % PAGE_SIZE;
+}
+
+// Reset the indirect block cache, dropping every entry
+static void ext2_ind_reset(void) {
+    memset(ind_hash, 0, sizeof(ind_hash));
+    for (u32 i = 0; i < EXT2_IND_CACHE_SIZE; i++) {
+        ind_cache[i].block = 0;
+        ind_cache[i].hash_next = NULL;
+    }
+}
+
+static void ext2_ind_unhash(ext2_ind_entry_t *entry) {
+    ext2_ind_entry_t **link = &ind_hash[entry->block % EXT2_IND_HASH];
+    while (*link) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            return;
+        }
+        link = &(*link)->hash_next;
+    }
+}
+
+// Entry 'index' of indirect block 'block', through the indirect cache;
+// EXT2_BLOCK_ERROR if it cannot be read
+static u32 ext2_ind_lookup(u32 block, u32 index) {
+    if (block == 0) return 0; // Hole
+    if (block == EXT2_BLOCK_ERROR) return EXT2_BLOCK_ERROR;
+
+    ext2_ind_entry_t *entry = ind_hash[block % EXT2_IND_HASH];
+    while (entry && entry->block != block) {
+        entry = entry->hash_next;
+    }
+
+    if (entry) {
+        ind_hits++;
+    } else {
+        ind_misses++;
+
+        // Replace the least recently used entry
+        entry = &ind_cache[0];
+        for (u32 i = 1; i < EXT2_IND_CACHE_SIZE; i++) {
+            if (ind_cache[i].last_use < entry->last_use) entry = &ind_cache[i];
+        }
+        if (entry->block) ext2_ind_unhash(entry);
+
+        entry->block = 0;
+        if (pagecache_read(ext2.dev, block * ext2.block_size, entry->ptrs, ext2.block_size) !=
+            (int)ext2.block_size) {
+            return EXT2_BLOCK_ERROR;
+        }
+        entry->block = block;
+        entry->hash_next = ind_hash[block % EXT2_IND_HASH];
+        ind_hash[block % EXT2_IND_HASH] = entry;
+    }
+
+    entry->last_use = ++ind_clock;
+    return entry->ptrs[index];
+}
+
+// Map a logical file block to a filesystem block (0 for holes,
+// EXT2_BLOCK_ERROR if an indirect block cannot be read)
+static u32 ext2_bmap(ext2_inode_t *inode, u32 lblock) {
+    u32 ppb = ext2.ptrs_per_block;
+
+    if (lblock < EXT2_NDIR_BLOCKS) {
+        return inode->i_block[lblock];
+    }
+    lblock -= EXT2_NDIR_BLOCKS;
+
+    if (lblock < ppb) {
+        return ext2_ind_lookup(inode->i_block[EXT2_IND_BLOCK], lblock);
+    }
+    lblock -= ppb;
+
+    if (lblock < ppb * ppb) {
+        u32 ind = ext2_ind_lookup(inode->i_block[EXT2_DIND_BLOCK], lblock / ppb);
+        return ext2_ind_lookup(ind, lblock % ppb);
+    }
+    lblock -= ppb * ppb;
+
+    u32 dind = ext2_ind_lookup(inode->i_block[EXT2_TIND_BLOCK], lblock / (ppb * ppb));
+    u32 ind = ext2_ind_lookup(dind, (lblock / ppb) % ppb);
+    return ext2_ind_lookup(ind, lblock % ppb);
+}
+
+// Read an inode from its group's inode table
+static int ext2_read_inode(u32 ino, ext2_inode_t *inode) {
+    if (ino == 0 || ino > ext2.inodes_count) return -1;
+
+    u32 group = (ino - 1) / ext2.inodes_per_group;
+    u32 index = (ino - 1) % ext2.inodes_per_group;
+
+    ext2_group_desc_t desc;
+    u32 desc_offset = ext2.gdt_block * ext2.block_size + group * sizeof(ext2_group_desc_t);
+    if (pagecache_read(ext2.dev, desc_offset, &desc, sizeof(desc)) != sizeof(desc)) return -1;
+
+    u32 offset = desc.bg_inode_table * ext2.block_size + index * ext2.inode_size;
+    if (pagecache_read(ext2.dev, offset, inode, sizeof(ext2_inode_t)) != sizeof(ext2_inode_t)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Read 'size' bytes of an inode's data starting at 'offset'
+static int ext2_read_data(ext2_inode_t *inode, u32 offset, u8 *buffer, u32 size) {
+    if (offset >= inode->i_size) return 0;
+    if (size > inode->i_size - offset) size = inode->i_size - offset;
+
+    u32 done = 0;
+    while (done < size) {
+        u32 lblock = (offset + done) / ext2.block_size;
+        u32 block_offset = (offset + done) % ext2.block_size;
+        u32 chunk = ext2.block_size - block_offset;
+        if (chunk > size - done) chunk = size - done;
+
+        u32 block = ext2_bmap(inode, lblock);
+        if (block == EXT2_BLOCK_ERROR) {
+            return done ? (int)done : -1;
+        } else if (block == 0) {
+            memset(buffer + done, 0, chunk);
+        } else {
+            u32 disk_offset = block * ext2.block_size + block_offset;
+            if (pagecache_read(ext2.dev, disk_offset, buffer + done, chunk) != (int)chunk) {
+                return done ? (int)done : -1;
+            }
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+// Call 'visit' for each entry of a directory; stops when it returns
+// nonzero and passes that value back
+static int ext2_walk_dir(ext2_inode_t *dir, int (*visit)(ext2_dirent_t *entry, void *arg), void *arg) {
+    if ((dir->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) return -1;
+
+    for (u32 lblock = 0; lblock * ext2.block_size < dir->i_size; lblock++) {
+        u32 block = ext2_bmap(dir, lblock);
+        if (block == EXT2_BLOCK_ERROR) return -1;
+        if (block == 0) continue;
+
+        cache_page_t *page;
+        u8 *data = ext2_block_get(block, &page);
+        if (!data) return -1;
+
+        u32 pos = 0;
+        while (pos + sizeof(ext2_dirent_t) <= ext2.block_size) {
+            ext2_dirent_t *entry = (ext2_dirent_t *)(data + pos);
+            // A corrupt entry could send the visitor past the block;
+            // skip the rest of it
+            if (entry->rec_len < sizeof(ext2_dirent_t) || entry->rec_len % 4 != 0 ||
+                pos + entry->rec_len > ext2.block_size ||
+                sizeof(ext2_dirent_t) + entry->name_len > entry->rec_len) {
+                break;
+            }
+
+            if (entry->inode) {
+                int result = visit(entry, arg);
+                if (result) {
+                    pagecache_put(page);
+                    return result;
+                }
+            }
+            pos += entry->rec_len;
+        }
+        pagecache_put(page);
+    }
+    return 0;
+}
+
+// Directory search state for ext2_lookup_visit
+typedef struct ext2_lookup_state {
+    const char *name;
+    u32 name_len;
+    u32 ino;
+} ext2_lookup_state_t;
+
+static int ext2_lookup_visit(ext2_dirent_t *entry, void *arg) {
+    ext2_lookup_state_t *state = (ext2_lookup_state_t *)arg;
+    if (entry->name_len == state->name_len &&
+        memcmp(entry->name, state->name, state->name_len) == 0) {
+        state->ino = entry->inode;
+        return 1;
+    }
+    return 0;
+}
+
+// Resolve an absolute path to an inode
+static int ext2_namei(const char *path, ext2_inode_t *inode) {
+    if (ext2_read_inode(EXT2_ROOT_INODE, inode) != 0) return -1;
+
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+
+        const char *end = path;
+        while (*end && *end != '/') end++;
+
+        ext2_lookup_state_t state;
+        state.name = path;
+        state.name_len = end - path;
+        state.ino = 0;
+        if (ext2_walk_dir(inode, ext2_lookup_visit, &state) != 1) return -1;
+        if (ext2_read_inode(state.ino, inode) != 0) return -1;
+
+        path = end;
+    }
+    return 0;
+}
+
+// Mount the ext2 volume on a block device
+int ext2_mount(block_device_t *dev) {
+    ext2_superblock_t sb;
+    if (pagecache_read(dev, EXT2_SUPERBLOCK_OFFSET, &sb, sizeof(sb)) != sizeof(sb)) return -1;
+    if (sb.s_magic != EXT2_MAGIC) return -2; // Not ext2
+    if (sb.s_log_block_size > 2) return -3;  // Blocks larger than a page
+
+    u32 block_size = 1024 << sb.s_log_block_size;
+    u32 inode_size = sb.s_rev_level >= 1 ? sb.s_inode_size : 128;
+    if (sb.s_blocks_per_group == 0 || sb.s_inodes_per_group == 0 ||
+        inode_size == 0 || inode_size > block_size) {
+        return -5; // Corrupt superblock
+    }
+
+    // Pointer tables for the indirect cache, sized for the new volume
+    for (u32 i = 0; i < EXT2_IND_CACHE_SIZE; i++) {
+        if (ind_cache[i].ptrs) kfree(ind_cache[i].ptrs);
+        ind_cache[i].ptrs = (u32 *)kmalloc(block_size);
+        ind_cache[i].last_use = 0;
+        if (!ind_cache[i].ptrs) {
+            ext2_mounted = 0;
+            return -4; // Out of memory
+        }
+    }
+    ext2_ind_reset();
+
+    ext2.dev = dev;
+    ext2.block_size = block_size;
+    ext2.ptrs_per_block = block_size / sizeof(u32);
+    ext2.inodes_count = sb.s_inodes_count;
+    ext2.blocks_count = sb.s_blocks_count;
+    ext2.inodes_per_group = sb.s_inodes_per_group;
+    ext2.inode_size = inode_size;
+    ext2.group_count = (sb.s_blocks_count - sb.s_first_data_block + sb.s_blocks_per_group - 1) /
+                       sb.s_blocks_per_group;
+    ext2.gdt_block = sb.s_first_data_block + 1;
+    ext2_mounted = 1;
+
+    vga_printf("ext2: mounted %s (%d KB blocks, %d inodes, %d groups)\n",
+               dev->name, block_size / 1024, ext2.inodes_count, ext2.group_count);
+    return 0;
+}
+
+void ext2_unmount(void) {
+    ext2_mounted = 0;
+    ext2_ind_reset();
+}
+
+int ext2_is_mounted(void) {
+    return ext2_mounted;
+}
+
+// Try to mount an ext2 volume from the first disk that has one
+void ext2_init(void) {
+    static const char *candidates[] = {"vda", "hda", "hdb", "hdc", "hdd", NULL};
+
+    for (int i = 0; candidates[i]; i++) {
+        block_device_t *dev = block_get(candidates[i]);
+        if (dev && ext2_mount(dev) == 0) return;
+    }
+}
+
+// Read up to 'size' bytes from 'offset' of a regular file
+int ext2_read(const char *path, u32 offset, void *buffer, u32 size) {
+    if (!ext2_mounted) return -1;
+
+    ext2_inode_t inode;
+    if (ext2_namei(path, &inode) != 0) return -1; // File not found
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) return -2; // Not a file
+
+    return ext2_read_data(&inode, offset, (u8 *)buffer, size);
+}
+
+// Size of a file, or -1 if it does not exist
+int ext2_file_size(const char *path) {
+    if (!ext2_mounted) return -1;
+
+    ext2_inode_t inode;
+    if (ext2_namei(path, &inode) != 0) return -1;
+    return inode.i_size;
+}
+
+static int ext2_list_visit(ext2_dirent_t *entry, void *arg) {
+    char name[256];
+    (void)arg;
+
+    memcpy(name, entry->name, entry->name_len);
+    name[entry->name_len] = 0;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+
+    ext2_inode_t inode;
+    if (ext2_read_inode(entry->inode, &inode) != 0) return 0;
+
+    if ((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        vga_printf("%s/\t\t\t<dir>\n", name);
+    } else {
+        vga_printf("%s\t\t\t%d\n", name, inode.i_size);
+    }
+    return 0;
+}
+
+// List a directory of the mounted volume
+int ext2_list_dir(const char *path) {
+    if (!ext2_mounted) return -1;
+
+    ext2_inode_t inode;
+    if (ext2_namei(path, &inode) != 0) return -1;
+    return ext2_walk_dir(&inode, ext2_list_visit, NULL) < 0 ? -2 : 0;
+}
+
+// Display mount information and indirect cache statistics
+void ext2_stats(void) {
+    if (!ext2_mounted) {
+        vga_printf("No ext2 volume mounted\n");
+        return;
+    }
+
+    vga_printf("ext2 on %s (read-only):\n", ext2.dev->name);
+    vga_printf("  Block size: %d bytes\n", ext2.block_size);
+    vga_printf("  Blocks: %d, inodes: %d, groups: %d\n",
+               ext2.blocks_count, ext2.inodes_count, ext2.group_count);
+    vga_printf("  Indirect cache: %d hits, %d misses\n", ind_hits, ind_misses);
+}
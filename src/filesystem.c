@@ -1,100 +1,1145 @@
 #include "kernel.h"
 #include "vga.h"
+#include "ext2.h"
+#include "lz4.h"
+#include "sync.h"
 
 // Simple in-memory file system
 #define MAX_FILES 64
 #define MAX_FILENAME 32
-#define MAX_FILE_SIZE 4096
+#define MAX_FILE_SIZE 65536
+#define FS_PAGE_SIZE PAGE_SIZE
+#define FS_MAX_PAGES (MAX_FILE_SIZE / FS_PAGE_SIZE)
 
+// Cold file compression: pages of files idle for the interval are LZ4
+// compressed in the background; reads go through a small cache of
+// decompressed pages
+#define FS_COMPRESS_INTERVAL  30   // Seconds; 0 disables compression
+#define FS_COMPRESS_PERIOD_MS 1000
+#define FS_COMPRESS_BUDGET    16   // Pages compressed per background run
+#define FS_COMPRESS_MAX       (FS_PAGE_SIZE * 3 / 4)
+#define FS_DCACHE_PAGES       8
+
+// Log-structured mode: appends are packed into large segments shared
+// by all log-mode files, and each file keeps an index of extents. The
+// cleaner moves live data out of sealed segments that are mostly dead.
+#define FS_SEGMENT_SIZE      16384
+#define FS_MAX_SEGMENTS      64
+#define FS_CLEAN_LIVE_PCT    50   // Clean sealed segments below this
+#define FS_CLEAN_PERIOD_MS   2000
+#define FS_LOG_MIN_EXTENTS   8
+
+// Buckets of the lock-free name index
+#define FS_NAME_BUCKETS 64
+
+// Page flags
+#define FS_PAGE_EXTERNAL       0x01  // Data lives outside the heap (boot module)
+#define FS_PAGE_COMPRESSED     0x02  // Data holds 'stored' bytes of LZ4
+#define FS_PAGE_INCOMPRESSIBLE 0x04  // Compression was tried and did not pay
+
+// File flags
+#define FS_FILE_NOCOMPRESS 0x01
+
+// A page of file data. Pages are reference counted so that clones can
+// share them; a shared page is copied only when one side writes to it.
+// External pages borrow memory that is never freed or written, and
+// compressed pages cannot be written in place, so both are always
+// copied on write.
+typedef struct fs_page {
+    volatile u32 refcount;
+    u16 flags;
+    u16 length;  // Valid bytes of file data
+    u32 stored;  // Compressed bytes at 'data'
+    u8 *data;
+} fs_page_t;
+
+// The page map of a file. Clones share the whole map until the first
+// write, which makes fs_clone_file O(1) in both time and memory.
+typedef struct fs_map {
+    volatile u32 refcount;
+    u32 page_count;
+    u32 capacity;
+    fs_page_t *pages[];
+} fs_map_t;
+
+// A piece of a log-mode file: 'length' bytes at 'offset' in a segment,
+// holding the file's bytes from 'file_offset' on
+typedef struct fs_extent {
+    u32 segment;
+    u32 offset;
+    u32 length;
+    u32 file_offset;
+} fs_extent_t;
+
+// Extent index of a log-mode file, in file offset order
+typedef struct fs_log {
+    u32 count;
+    u32 capacity;
+    fs_extent_t extents[];
+} fs_log_t;
+
+typedef struct fs_segment {
+    u8 *data;
+    u32 used;  // Bytes written; the head segment is the only one growing
+    u32 live;  // Bytes still referenced by some file's extents
+} fs_segment_t;
+
+// Locking: 'lock' protects a file's map, log, size and contents. Slots
+// are never freed, so lock-free lookups may land on a slot that is being
+// deleted or reused; they recheck the name once they hold the lock.
+// Creating, cloning and deleting files take index_lock.
 typedef struct file {
     char name[MAX_FILENAME];
-    u8 *data;
+    fs_map_t *map;    // Page map; empty while the file is in log mode
+    fs_log_t *log;    // Extent index in log mode, NULL otherwise
     u32 size;
-    u8 used;
+    u32 last_access;  // Uptime in seconds
+    u8 flags;
+    volatile u8 used;
+    s32 hash_next;    // Next slot in the name index bucket, or -1
+    rwlock_t lock;
 } file_t;
 
 static file_t files[MAX_FILES];
 static u32 file_count = 0;
 
+// Name index. Lookups take no lock; they retry if a writer changed the
+// index while they walked it.
+static s32 name_buckets[FS_NAME_BUCKETS];
+static seqcount_t index_seq;
+static spinlock_t index_lock = SPINLOCK_INIT;
+
+// Locks for state shared by all files; taken after any file lock
+static spinlock_t log_lock = SPINLOCK_INIT;
+static spinlock_t dcache_lock = SPINLOCK_INIT;
+static spinlock_t compress_lock = SPINLOCK_INIT;
+
+// Big-lock mode replaces every file lock with one exclusive lock, as a
+// baseline for the stress test
+static u8 big_lock_mode = 0;
+static rwlock_t big_lock = RWLOCK_INIT;
+
+// Lock statistics
+static u32 lock_read_waits = 0;
+static u32 lock_write_waits = 0;
+static u32 lookup_retries = 0;
+
+// Copy-on-write statistics
+static u32 cow_page_copies = 0;
+static u32 cow_map_copies = 0;
+
+// Pages borrowed from boot modules
+static u32 external_pages = 0;
+
+// Heap bytes holding file data, compressed or not
+static u32 physical_bytes = 0;
+
+// Compression state and statistics
+static u32 compress_interval = FS_COMPRESS_INTERVAL;
+static u32 compressed_pages = 0;
+static u32 compress_runs = 0;
+static u8 compress_buffer[FS_COMPRESS_MAX];
+
+// Decompressed page cache, replaced least recently used first
+typedef struct fs_dcache_entry {
+    fs_page_t *page;
+    u32 last_use;
+    u8 data[FS_PAGE_SIZE];
+} fs_dcache_entry_t;
+
+static fs_dcache_entry_t dcache[FS_DCACHE_PAGES];
+static u32 dcache_clock = 0;
+static u32 dcache_hits = 0;
+static u32 dcache_misses = 0;
+
+// Log segments and statistics
+static fs_segment_t segments[FS_MAX_SEGMENTS];
+static s32 log_head = -1;
+static u32 log_appends = 0;
+static u32 log_bytes_appended = 0;
+static u32 segments_cleaned = 0;
+static u32 bytes_relocated = 0;
+
+// Allocate a zeroed page with a single reference
+static fs_page_t *fs_page_alloc(void) {
+    fs_page_t *page = (fs_page_t *)kmalloc(sizeof(fs_page_t) + FS_PAGE_SIZE);
+    if (!page) return NULL;
+
+    page->refcount = 1;
+    page->flags = 0;
+    page->length = FS_PAGE_SIZE;
+    page->stored = FS_PAGE_SIZE;
+    page->data = (u8 *)(page + 1);
+    memset(page->data, 0, FS_PAGE_SIZE);
+    atomic_add(&physical_bytes, FS_PAGE_SIZE);
+    return page;
+}
+
+// Wrap 'length' bytes of memory that the file system does not own
+static fs_page_t *fs_page_borrow(const u8 *data, u32 length) {
+    fs_page_t *page = (fs_page_t *)kmalloc(sizeof(fs_page_t));
+    if (!page) return NULL;
+
+    page->refcount = 1;
+    page->flags = FS_PAGE_EXTERNAL;
+    page->length = length;
+    page->stored = 0;
+    page->data = (u8 *)data;
+    atomic_inc(&external_pages);
+    return page;
+}
+
+// Forget any decompressed copy of a page
+static void fs_dcache_drop(fs_page_t *page) {
+    spin_lock(&dcache_lock);
+    for (u32 i = 0; i < FS_DCACHE_PAGES; i++) {
+        if (dcache[i].page == page) {
+            dcache[i].page = NULL;
+        }
+    }
+    spin_unlock(&dcache_lock);
+}
+
+// Drop a reference to a page, freeing it with the last one. Only the
+// header of an external page is freed.
+static void fs_page_put(fs_page_t *page) {
+    if (page && atomic_dec_and_test(&page->refcount)) {
+        if (page->flags & FS_PAGE_EXTERNAL) {
+            atomic_add(&external_pages, (u32)-1);
+        } else {
+            atomic_add(&physical_bytes, -page->stored);
+        }
+        if (page->flags & FS_PAGE_COMPRESSED) {
+            atomic_add(&compressed_pages, (u32)-1);
+            fs_dcache_drop(page);
+        }
+        kfree(page);
+    }
+}
+
+// Compress a page in place and give the rest of its allocation back to
+// the heap. Pages that do not shrink enough are left alone.
+static int fs_page_compress(fs_page_t *page) {
+    u32 size = lz4_compress(page->data, page->length, compress_buffer, FS_COMPRESS_MAX);
+    if (size == 0) {
+        page->flags |= FS_PAGE_INCOMPRESSIBLE;
+        return -1;
+    }
+
+    memcpy(page->data, compress_buffer, size);
+    kshrink(page, sizeof(fs_page_t) + size);
+    atomic_add(&physical_bytes, size - page->stored);
+    page->stored = size;
+    page->flags |= FS_PAGE_COMPRESSED;
+    atomic_inc(&compressed_pages);
+    return 0;
+}
+
+// Decompress a page into 'buffer'
+static void fs_page_inflate(fs_page_t *page, u8 *buffer) {
+    int size = lz4_decompress(page->data, page->stored, buffer, FS_PAGE_SIZE);
+    if (size < 0) {
+        kernel_panic("fs: corrupt compressed page");
+    }
+    memset(buffer + size, 0, FS_PAGE_SIZE - size);
+}
+
+// Copy 'size' bytes from 'offset' of a page; compressed pages are
+// served from the decompressed page cache
+static void fs_page_copy_out(fs_page_t *page, u32 offset, u8 *buffer, u32 size) {
+    if (!(page->flags & FS_PAGE_COMPRESSED)) {
+        memcpy(buffer, page->data + offset, size);
+        return;
+    }
+
+    spin_lock(&dcache_lock);
+    fs_dcache_entry_t *entry = NULL;
+    fs_dcache_entry_t *victim = &dcache[0];
+    for (u32 i = 0; i < FS_DCACHE_PAGES && !entry; i++) {
+        if (dcache[i].page == page) {
+            entry = &dcache[i];
+        } else if (!dcache[i].page) {
+            victim = &dcache[i];
+            victim->last_use = 0;
+        } else if (dcache[i].last_use < victim->last_use) {
+            victim = &dcache[i];
+        }
+    }
+
+    if (entry) {
+        dcache_hits++;
+    } else {
+        dcache_misses++;
+        entry = victim;
+        fs_page_inflate(page, entry->data);
+        entry->page = page;
+    }
+    entry->last_use = ++dcache_clock;
+    memcpy(buffer, entry->data + offset, size);
+    spin_unlock(&dcache_lock);
+}
+
+// Allocate an empty page map with a single reference and room for
+// 'capacity' pages
+static fs_map_t *fs_map_alloc(u32 capacity) {
+    if (capacity < FS_MAX_PAGES) capacity = FS_MAX_PAGES;
+
+    u32 bytes = sizeof(fs_map_t) + capacity * sizeof(fs_page_t *);
+    fs_map_t *map = (fs_map_t *)kmalloc(bytes);
+    if (!map) return NULL;
+
+    memset(map, 0, bytes);
+    map->refcount = 1;
+    map->capacity = capacity;
+    return map;
+}
+
+// Drop a reference to a page map and, with the last one, to its pages
+static void fs_map_put(fs_map_t *map) {
+    if (!map || !atomic_dec_and_test(&map->refcount)) return;
+
+    for (u32 i = 0; i < map->page_count; i++) {
+        fs_page_put(map->pages[i]);
+    }
+    kfree(map);
+}
+
+// Give a file a private page map. The pages themselves stay shared;
+// only the page pointers are duplicated.
+static int fs_map_unshare(file_t *file) {
+    fs_map_t *old = file->map;
+    if (old->refcount == 1) return 0;
+
+    fs_map_t *map = fs_map_alloc(old->capacity);
+    if (!map) return -4; // Out of memory
+
+    map->page_count = old->page_count;
+    for (u32 i = 0; i < old->page_count; i++) {
+        map->pages[i] = old->pages[i];
+        atomic_inc(&map->pages[i]->refcount);
+    }
+
+    // Another sharer may have unshared at the same time, leaving this
+    // the last reference
+    fs_map_put(old);
+    file->map = map;
+    atomic_inc(&cow_map_copies);
+    return 0;
+}
+
+// Make page 'index' of a privately mapped file writable, copying it if
+// it is still shared with another file
+static fs_page_t *fs_page_writable(fs_map_t *map, u32 index) {
+    fs_page_t *page = map->pages[index];
+    if (page->refcount == 1 && !(page->flags & (FS_PAGE_EXTERNAL | FS_PAGE_COMPRESSED))) {
+        page->flags &= ~FS_PAGE_INCOMPRESSIBLE;
+        return page;
+    }
+
+    fs_page_t *copy = fs_page_alloc();
+    if (!copy) return NULL;
+
+    if (page->flags & FS_PAGE_COMPRESSED) {
+        fs_page_inflate(page, copy->data);
+    } else {
+        memcpy(copy->data, page->data, page->length);
+    }
+    if (page->refcount > 1 || !(page->flags & FS_PAGE_COMPRESSED)) {
+        atomic_inc(&cow_page_copies);
+    }
+    fs_page_put(page);
+    map->pages[index] = copy;
+    return copy;
+}
+
+// Grow or shrink a privately mapped file to hold 'size' bytes
+static int fs_map_resize(fs_map_t *map, u32 size) {
+    u32 needed = (size + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE;
+    if (needed > map->capacity) return -2; // Too large
+
+    while (map->page_count > needed) {
+        fs_page_put(map->pages[--map->page_count]);
+        map->pages[map->page_count] = NULL;
+    }
+    while (map->page_count < needed) {
+        fs_page_t *page = fs_page_alloc();
+        if (!page) return -4; // Out of memory
+        map->pages[map->page_count++] = page;
+    }
+    return 0;
+}
+
+// Copy 'size' bytes into a private map at 'offset', breaking sharing
+// only on the pages that are actually touched
+static int fs_map_write(fs_map_t *map, u32 offset, const u8 *content, u32 size) {
+    while (size > 0) {
+        u32 index = offset / FS_PAGE_SIZE;
+        u32 page_offset = offset % FS_PAGE_SIZE;
+        u32 chunk = FS_PAGE_SIZE - page_offset;
+        if (chunk > size) chunk = size;
+
+        fs_page_t *page = fs_page_writable(map, index);
+        if (!page) return -4; // Out of memory
+
+        memcpy(page->data + page_offset, content, chunk);
+        content += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+static u32 fs_name_hash(const char *name) {
+    u32 hash = 2166136261U;
+    while (*name) {
+        hash = (hash ^ (u8)*name++) * 16777619U;
+    }
+    return hash % FS_NAME_BUCKETS;
+}
+
+// Find a used file slot by name without taking any lock. The result is
+// only a hint until it is confirmed under the file's lock (fs_get).
+static file_t *fs_find(const char *name) {
+    u32 bucket = fs_name_hash(name);
+
+    for (;;) {
+        u32 seq = read_seqbegin(&index_seq);
+
+        // Bounded in case a concurrent update sends us round a cycle
+        s32 i = name_buckets[bucket];
+        for (u32 steps = 0; i >= 0 && steps < MAX_FILES; steps++) {
+            file_t *file = &files[i];
+            if (file->used && strcmp(file->name, name) == 0) {
+                return file;
+            }
+            i = file->hash_next;
+        }
+
+        if (!read_seqretry(&index_seq, seq)) return NULL;
+        atomic_inc(&lookup_retries);
+    }
+}
+
+// Add a slot to / remove it from the name index; index_lock held
+static void fs_index_link(file_t *file) {
+    u32 bucket = fs_name_hash(file->name);
+    write_seqbegin(&index_seq);
+    file->hash_next = name_buckets[bucket];
+    name_buckets[bucket] = file - files;
+    write_seqend(&index_seq);
+}
+
+static void fs_index_unlink(file_t *file) {
+    s32 *link = &name_buckets[fs_name_hash(file->name)];
+    s32 index = file - files;
+
+    write_seqbegin(&index_seq);
+    while (*link >= 0) {
+        if (*link == index) {
+            *link = file->hash_next;
+            break;
+        }
+        link = &files[*link].hash_next;
+    }
+    write_seqend(&index_seq);
+}
+
+// Lock a file for reading or writing and return the lock taken, which
+// is the single global lock in big-lock mode
+static rwlock_t *fs_file_lock(file_t *file, int write) {
+    if (big_lock_mode) {
+        if (!write_trylock(&big_lock)) {
+            atomic_inc(write ? &lock_write_waits : &lock_read_waits);
+            write_lock(&big_lock);
+        }
+        return &big_lock;
+    }
+
+    if (write) {
+        if (!write_trylock(&file->lock)) {
+            atomic_inc(&lock_write_waits);
+            write_lock(&file->lock);
+        }
+    } else {
+        if (!read_trylock(&file->lock)) {
+            atomic_inc(&lock_read_waits);
+            read_lock(&file->lock);
+        }
+    }
+    return &file->lock;
+}
+
+static void fs_file_unlock(rwlock_t *lock, int write) {
+    if (write || lock == &big_lock) {
+        write_unlock(lock);
+    } else {
+        read_unlock(lock);
+    }
+}
+
+// Look up a file and lock it, retrying if the slot was deleted or
+// reused between the lookup and the lock
+static file_t *fs_get(const char *name, int write, rwlock_t **lock) {
+    for (;;) {
+        file_t *file = fs_find(name);
+        if (!file) return NULL;
+
+        *lock = fs_file_lock(file, write);
+        if (file->used && strcmp(file->name, name) == 0) return file;
+
+        fs_file_unlock(*lock, write);
+        atomic_inc(&lookup_retries);
+    }
+}
+
+// Find a free file slot
+static file_t *fs_find_free(void) {
+    for (u32 i = 0; i < MAX_FILES; i++) {
+        if (!files[i].used) {
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+// Compress up to 'budget' pages of a file; returns the pages tried.
+// Only pages private to the file are compressed, since readers of other
+// files sharing a page do not hold this file's lock.
+static u32 fs_compress_file(file_t *file, u32 budget) {
+    u32 tried = 0;
+    fs_map_t *map = file->map;
+    if (map->refcount > 1) return 0;
+
+    for (u32 i = 0; i < map->page_count && tried < budget; i++) {
+        fs_page_t *page = map->pages[i];
+        if (page->refcount > 1 ||
+            (page->flags & (FS_PAGE_EXTERNAL | FS_PAGE_COMPRESSED | FS_PAGE_INCOMPRESSIBLE))) {
+            continue;
+        }
+        fs_page_compress(page);
+        tried++;
+    }
+    return tried;
+}
+
+// Compress files idle for at least 'age' seconds, a bounded number of
+// pages at a time
+static void fs_compress_cold(u32 age, u32 budget) {
+    u32 now = timer_get_uptime();
+
+    spin_lock(&compress_lock);
+    for (u32 i = 0; i < MAX_FILES && budget > 0; i++) {
+        file_t *file = &files[i];
+        if (!file->used || (file->flags & FS_FILE_NOCOMPRESS)) continue;
+        if (now - file->last_access < age) continue;
+
+        // Files in use are not cold; skip them rather than wait
+        if (big_lock_mode || !write_trylock(&file->lock)) continue;
+        if (file->used) {
+            budget -= fs_compress_file(file, budget);
+        }
+        write_unlock(&file->lock);
+    }
+    spin_unlock(&compress_lock);
+}
+
+// Background job
+static void fs_compress_work(void) {
+    if (compress_interval == 0) return;
+    compress_runs++;
+    fs_compress_cold(compress_interval, FS_COMPRESS_BUDGET);
+}
+
+// Free a segment once nothing references it
+static void fs_segment_release(u32 index, u32 bytes) {
+    fs_segment_t *seg = &segments[index];
+    seg->live -= bytes;
+    if (seg->live == 0 && (s32)index != log_head) {
+        kfree(seg->data);
+        seg->data = NULL;
+        seg->used = 0;
+        atomic_add(&physical_bytes, -FS_SEGMENT_SIZE);
+    }
+}
+
+// Segment that appends go to, sealing the current one and opening a
+// new one when it is full
+static fs_segment_t *fs_log_head(void) {
+    if (log_head >= 0 && segments[log_head].used < FS_SEGMENT_SIZE) {
+        return &segments[log_head];
+    }
+
+    for (u32 i = 0; i < FS_MAX_SEGMENTS; i++) {
+        if (segments[i].data) continue;
+
+        u8 *data = (u8 *)kmalloc(FS_SEGMENT_SIZE);
+        if (!data) return NULL;
+
+        // The sealed head may already be entirely dead
+        s32 old = log_head;
+        log_head = i;
+        if (old >= 0) {
+            fs_segment_release(old, 0);
+        }
+
+        segments[i].data = data;
+        segments[i].used = 0;
+        segments[i].live = 0;
+        atomic_add(&physical_bytes, FS_SEGMENT_SIZE);
+        return &segments[i];
+    }
+    return NULL;
+}
+
+// Make room for 'extra' more extents in a file's index
+static int fs_log_reserve(file_t *file, u32 extra) {
+    fs_log_t *log = file->log;
+    if (log && log->count + extra <= log->capacity) return 0;
+
+    u32 capacity = log ? log->capacity * 2 : FS_LOG_MIN_EXTENTS;
+    while (capacity < (log ? log->count : 0) + extra) capacity *= 2;
+
+    fs_log_t *grown = (fs_log_t *)kmalloc(sizeof(fs_log_t) + capacity * sizeof(fs_extent_t));
+    if (!grown) return -4; // Out of memory
+
+    grown->count = 0;
+    grown->capacity = capacity;
+    if (log) {
+        grown->count = log->count;
+        memcpy(grown->extents, log->extents, log->count * sizeof(fs_extent_t));
+        kfree(log);
+    }
+    file->log = grown;
+    return 0;
+}
+
+// Drop all of a log-mode file's extents
+static void fs_log_truncate(file_t *file) {
+    fs_log_t *log = file->log;
+    spin_lock(&log_lock);
+    for (u32 i = 0; i < log->count; i++) {
+        fs_segment_release(log->extents[i].segment, log->extents[i].length);
+    }
+    spin_unlock(&log_lock);
+    log->count = 0;
+    file->size = 0;
+}
+
+// Take back the bytes appended past 'old_size', newest first, after an
+// append that could not finish
+static void fs_log_unwind(file_t *file, u32 old_size) {
+    fs_log_t *log = file->log;
+    while (file->size > old_size) {
+        fs_extent_t *last = &log->extents[log->count - 1];
+        u32 undo = file->size - old_size;
+        if (undo > last->length) undo = last->length;
+
+        // Space at the end of the head can be written again
+        fs_segment_t *seg = &segments[last->segment];
+        if ((s32)last->segment == log_head && last->offset + last->length == seg->used) {
+            seg->used -= undo;
+        }
+        last->length -= undo;
+        file->size -= undo;
+        fs_segment_release(last->segment, undo);
+        if (last->length == 0) log->count--;
+    }
+}
+
+// Append to a log-mode file. Only the new bytes are copied; a write
+// that continues the file's last extent just extends it. A write that
+// runs out of segments leaves the file as it was.
+static int fs_log_append(file_t *file, const u8 *data, u32 size) {
+    if (fs_log_reserve(file, size / FS_SEGMENT_SIZE + 2) != 0) return -4;
+
+    fs_log_t *log = file->log;
+    u32 old_size = file->size;
+    int result = 0;
+
+    spin_lock(&log_lock);
+    log_appends++;
+    log_bytes_appended += size;
+    while (size > 0) {
+        fs_segment_t *seg = fs_log_head();
+        if (!seg) {
+            fs_log_unwind(file, old_size);
+            result = -4; // Out of memory
+            break;
+        }
+
+        u32 chunk = FS_SEGMENT_SIZE - seg->used;
+        if (chunk > size) chunk = size;
+        memcpy(seg->data + seg->used, data, chunk);
+
+        fs_extent_t *last = log->count ? &log->extents[log->count - 1] : NULL;
+        if (last && last->segment == (u32)log_head && last->offset + last->length == seg->used) {
+            last->length += chunk;
+        } else {
+            fs_extent_t *extent = &log->extents[log->count++];
+            extent->segment = log_head;
+            extent->offset = seg->used;
+            extent->length = chunk;
+            extent->file_offset = file->size;
+        }
+
+        seg->used += chunk;
+        seg->live += chunk;
+        file->size += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    spin_unlock(&log_lock);
+    return result;
+}
+
+// Copy 'size' bytes from 'offset' of a log-mode file
+static void fs_log_read(file_t *file, u32 offset, u8 *buffer, u32 size) {
+    fs_log_t *log = file->log;
+
+    // Binary search for the extent holding 'offset'
+    u32 lo = 0, hi = log->count;
+    while (hi - lo > 1) {
+        u32 mid = (lo + hi) / 2;
+        if (log->extents[mid].file_offset <= offset) lo = mid;
+        else hi = mid;
+    }
+
+    for (u32 i = lo; i < log->count && size > 0; i++) {
+        fs_extent_t *extent = &log->extents[i];
+        u32 skip = offset - extent->file_offset;
+        u32 chunk = extent->length - skip;
+        if (chunk > size) chunk = size;
+
+        memcpy(buffer, segments[extent->segment].data + extent->offset + skip, chunk);
+        buffer += chunk;
+        offset += chunk;
+        size -= chunk;
+        kthread_preempt_point();
+    }
+}
+
+// Move a page-mode file's contents into the log
+static int fs_log_enable(file_t *file) {
+    if (file->log) return 0;
+
+    fs_map_t *empty = fs_map_alloc(0);
+    u8 *buffer = (u8 *)kmalloc(FS_PAGE_SIZE);
+    if (!empty || !buffer || fs_log_reserve(file, FS_LOG_MIN_EXTENTS) != 0) {
+        kfree(empty);
+        kfree(buffer);
+        return -4; // Out of memory
+    }
+
+    fs_map_t *map = file->map;
+    u32 size = file->size;
+    file->size = 0;
+    for (u32 i = 0; i < map->page_count; i++) {
+        u32 chunk = size - i * FS_PAGE_SIZE;
+        if (chunk > FS_PAGE_SIZE) chunk = FS_PAGE_SIZE;
+        fs_page_copy_out(map->pages[i], 0, buffer, chunk);
+        if (fs_log_append(file, buffer, chunk) != 0) {
+            fs_log_truncate(file);
+            kfree(file->log);
+            file->log = NULL;
+            file->size = size;
+            kfree(empty);
+            kfree(buffer);
+            return -4; // Out of memory
+        }
+    }
+
+    kfree(buffer);
+    fs_map_put(map);
+    file->map = empty;
+    return 0;
+}
+
+// Move a log-mode file's contents back into private pages
+static int fs_log_disable(file_t *file) {
+    if (!file->log) return 0;
+
+    u32 pages = (file->size + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE;
+    fs_map_t *map = fs_map_alloc(pages);
+    if (!map) return -4; // Out of memory
+
+    if (fs_map_resize(map, file->size) != 0) {
+        fs_map_put(map);
+        return -4; // Out of memory
+    }
+    for (u32 i = 0; i < pages; i++) {
+        u32 chunk = file->size - i * FS_PAGE_SIZE;
+        if (chunk > FS_PAGE_SIZE) chunk = FS_PAGE_SIZE;
+        fs_log_read(file, i * FS_PAGE_SIZE, map->pages[i]->data, chunk);
+    }
+
+    u32 size = file->size;
+    fs_log_truncate(file);
+    kfree(file->log);
+    file->log = NULL;
+    fs_map_put(file->map);
+    file->map = map;
+    file->size = size;
+    return 0;
+}
+
+// Relocate the live extents of sealed, mostly dead segments to the head
+// so that their memory can be freed. Files that are busy are skipped;
+// their segments are retried on the next run.
+static void fs_log_clean(void) {
+    for (u32 s = 0; s < FS_MAX_SEGMENTS; s++) {
+        fs_segment_t *victim = &segments[s];
+        if (!victim->data || (s32)s == log_head) continue;
+        if (victim->live * 100 >= victim->used * FS_CLEAN_LIVE_PCT) continue;
+
+        for (u32 f = 0; f < MAX_FILES && victim->data; f++) {
+            file_t *file = &files[f];
+            if (!file->used || !file->log) continue;
+            if (big_lock_mode || !write_trylock(&file->lock)) continue;
+            if (!file->used || !file->log) {
+                write_unlock(&file->lock);
+                continue;
+            }
+
+            spin_lock(&log_lock);
+            fs_log_t *log = file->log;
+            u32 count = victim->data && (s32)s != log_head ? log->count : 0;
+            for (u32 i = 0; i < count; i++) {
+                fs_extent_t *extent = &log->extents[i];
+                if (extent->segment != s) continue;
+
+                // Extents never exceed a segment, so a fresh head fits one
+                fs_segment_t *head = fs_log_head();
+                if (head && FS_SEGMENT_SIZE - head->used < extent->length) {
+                    head->used = FS_SEGMENT_SIZE;
+                    head = fs_log_head();
+                }
+                if (!head) break;
+
+                memcpy(head->data + head->used, victim->data + extent->offset, extent->length);
+                extent->segment = log_head;
+                extent->offset = head->used;
+                head->used += extent->length;
+                head->live += extent->length;
+                bytes_relocated += extent->length;
+                fs_segment_release(s, extent->length);
+            }
+            spin_unlock(&log_lock);
+            write_unlock(&file->lock);
+        }
+        if (!victim->data) segments_cleaned++;
+    }
+}
+
+// Background job
+static void fs_log_clean_work(void) {
+    fs_log_clean();
+}
+
+// Run the cleaner now
+void fs_log_clean_now(void) {
+    fs_log_clean();
+}
+
 // Initialize file system
 void filesystem_init(void) {
     for (int i = 0; i < MAX_FILES; i++) {
         files[i].used = 0;
-        files[i].data = NULL;
+        files[i].map = NULL;
+        files[i].log = NULL;
         files[i].size = 0;
+        files[i].flags = 0;
+        files[i].hash_next = -1;
+        files[i].lock.state = 0;
         memset(files[i].name, 0, MAX_FILENAME);
     }
-    
+    for (int i = 0; i < FS_NAME_BUCKETS; i++) {
+        name_buckets[i] = -1;
+    }
+
+    work_register("fs-compress", fs_compress_work, FS_COMPRESS_PERIOD_MS);
+    work_register("fs-log-clean", fs_log_clean_work, FS_CLEAN_PERIOD_MS);
+
     // Create some default files
     fs_create_file("readme.txt", "Welcome to the comprehensive kernel!\nThis is a simple in-memory file system.\n", 77);
     fs_create_file("version.txt", "Kernel Version 1.0\nBuilt with love and assembly!\n", 50);
     fs_create_file("help.txt", "Available commands:\nls - list files\ncat <file> - show file contents\nps - list processes\nmeminfo - memory stats\n", 113);
-    
+
     vga_printf("File system initialized with %d files\n", file_count);
 }
 
+// Publish a new file with the given contents; index_lock held. The slot
+// is filled under its own lock, since a stale lookup may still be
+// waiting on it.
+static int fs_install(const char *name, fs_map_t *map, fs_log_t *log, u32 size, u8 flags) {
+    if (file_count >= MAX_FILES) return -1;
+    if (fs_find(name)) return -3; // File exists
+
+    file_t *file = fs_find_free();
+    if (!file) return -5; // No free slots
+
+    write_lock(&file->lock);
+    strcpy(file->name, name);
+    file->size = size;
+    file->map = map;
+    file->log = log;
+    file->flags = flags;
+    file->last_access = timer_get_uptime();
+    file->used = 1;
+    fs_index_link(file);
+    write_unlock(&file->lock);
+
+    file_count++;
+    return 0;
+}
+
 // Create a new file
 int fs_create_file(const char *name, const char *content, u32 size) {
-    if (file_count >= MAX_FILES) return -1;
+    if (name[0] == '/') return -6; // Mounted volume is read-only
+    if (strlen(name) >= MAX_FILENAME) return -2;
     if (size > MAX_FILE_SIZE) return -2;
-    
+
     // Check if file already exists
-    for (u32 i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 0) {
-            return -3; // File exists
+    if (fs_find(name)) {
+        return -3; // File exists
+    }
+
+    fs_map_t *map = fs_map_alloc(0);
+    if (!map) return -4; // Out of memory
+
+    if (fs_map_resize(map, size) != 0 ||
+        fs_map_write(map, 0, (const u8 *)content, size) != 0) {
+        fs_map_put(map);
+        return -4; // Out of memory
+    }
+
+    spin_lock(&index_lock);
+    int result = fs_install(name, map, NULL, size, 0);
+    spin_unlock(&index_lock);
+
+    if (result != 0) fs_map_put(map);
+    return result;
+}
+
+// Clone a file. The clone shares the source's data pages; a page is
+// duplicated only when either file later writes to it.
+int fs_clone_file(const char *src_name, const char *dst_name) {
+    if (dst_name[0] == '/') return -6; // Mounted volume is read-only
+    if (strlen(dst_name) >= MAX_FILENAME) return -2;
+
+    spin_lock(&index_lock);
+
+    rwlock_t *lock;
+    file_t *src = fs_get(src_name, 0, &lock);
+    if (!src) {
+        spin_unlock(&index_lock);
+        return -1; // File not found
+    }
+
+    // Log-mode clones get their own index over the same segment data
+    fs_log_t *log = NULL;
+    if (src->log) {
+        log = (fs_log_t *)kmalloc(sizeof(fs_log_t) + src->log->capacity * sizeof(fs_extent_t));
+        if (!log) {
+            fs_file_unlock(lock, 0);
+            spin_unlock(&index_lock);
+            return -4; // Out of memory
         }
+        log->count = src->log->count;
+        log->capacity = src->log->capacity;
+        memcpy(log->extents, src->log->extents, src->log->count * sizeof(fs_extent_t));
     }
-    
-    // Find free slot
-    for (u32 i = 0; i < MAX_FILES; i++) {
-        if (!files[i].used) {
-            files[i].used = 1;
-            strcpy(files[i].name, name);
-            files[i].size = size;
-            files[i].data = (u8 *)kmalloc(size + 1);
-            
-            if (files[i].data) {
-                memcpy(files[i].data, content, size);
-                files[i].data[size] = 0; // Null terminate
-                file_count++;
-                return 0;
-            } else {
-                files[i].used = 0;
-                return -4; // Out of memory
+
+    int result = fs_install(dst_name, src->map, log, src->size, src->flags);
+    if (result == 0) {
+        atomic_inc(&src->map->refcount);
+        if (log) {
+            spin_lock(&log_lock);
+            for (u32 i = 0; i < log->count; i++) {
+                segments[log->extents[i].segment].live += log->extents[i].length;
             }
+            spin_unlock(&log_lock);
+        }
+    } else {
+        kfree(log);
+    }
+
+    fs_file_unlock(lock, 0);
+    spin_unlock(&index_lock);
+    return result;
+}
+
+// Register a file whose pages point straight into memory the file
+// system does not own, such as an initramfs module. Nothing is copied
+// until the file is written.
+int fs_register_external(const char *name, const u8 *data, u32 size) {
+    if (strlen(name) >= MAX_FILENAME) return -2;
+    if (fs_find(name)) return -3; // File exists
+
+    u32 pages = (size + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE;
+    fs_map_t *map = fs_map_alloc(pages);
+    if (!map) return -4; // Out of memory
+
+    for (u32 i = 0; i < pages; i++) {
+        u32 length = size - i * FS_PAGE_SIZE;
+        if (length > FS_PAGE_SIZE) length = FS_PAGE_SIZE;
+
+        fs_page_t *page = fs_page_borrow(data + i * FS_PAGE_SIZE, length);
+        if (!page) {
+            fs_map_put(map);
+            return -4; // Out of memory
         }
+        map->pages[map->page_count++] = page;
     }
-    
-    return -5; // No free slots
+
+    spin_lock(&index_lock);
+    int result = fs_install(name, map, NULL, size, 0);
+    spin_unlock(&index_lock);
+
+    if (result != 0) fs_map_put(map);
+    return result;
 }
 
 // Read a file
 int fs_read_file(const char *name, char *buffer, u32 buffer_size) {
-    for (u32 i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 0) {
-            u32 copy_size = files[i].size < buffer_size ? files[i].size : buffer_size - 1;
-            memcpy(buffer, files[i].data, copy_size);
-            buffer[copy_size] = 0;
-            return copy_size;
+    // Absolute paths refer to the mounted ext2 volume
+    if (name[0] == '/') {
+        int result = ext2_read(name, 0, buffer, buffer_size - 1);
+        if (result < 0) return -1; // File not found
+        buffer[result] = 0;
+        return result;
+    }
+
+    rwlock_t *lock;
+    file_t *file = fs_get(name, 0, &lock);
+    if (!file) return -1; // File not found
+
+    file->last_access = timer_get_uptime();
+
+    u32 copy_size = file->size < buffer_size ? file->size : buffer_size - 1;
+    if (file->log) {
+        fs_log_read(file, 0, (u8 *)buffer, copy_size);
+    } else {
+        u32 done = 0;
+        while (done < copy_size) {
+            u32 chunk = copy_size - done;
+            if (chunk > FS_PAGE_SIZE) chunk = FS_PAGE_SIZE;
+            fs_page_copy_out(file->map->pages[done / FS_PAGE_SIZE], 0, (u8 *)buffer + done, chunk);
+            done += chunk;
+            kthread_preempt_point();
         }
     }
-    return -1; // File not found
+
+    fs_file_unlock(lock, 0);
+    buffer[copy_size] = 0;
+    return copy_size;
+}
+
+// Read 'size' bytes from 'offset' of a file; returns the bytes read,
+// which stop at the end of the file, or -1 if there is no such file
+int fs_read_at(const char *name, u32 offset, char *buffer, u32 size) {
+    if (name[0] == '/') {
+        int result = ext2_read(name, offset, buffer, size);
+        return result < 0 ? -1 : result;
+    }
+
+    rwlock_t *lock;
+    file_t *file = fs_get(name, 0, &lock);
+    if (!file) return -1;
+
+    file->last_access = timer_get_uptime();
+    u32 count = offset < file->size ? file->size - offset : 0;
+    if (count > size) count = size;
+    if (file->log) {
+        fs_log_read(file, offset, (u8 *)buffer, count);
+    } else {
+        for (u32 done = 0; done < count; ) {
+            u32 page_offset = (offset + done) % FS_PAGE_SIZE;
+            u32 chunk = FS_PAGE_SIZE - page_offset;
+            if (chunk > count - done) chunk = count - done;
+            fs_page_copy_out(file->map->pages[(offset + done) / FS_PAGE_SIZE], page_offset,
+                             (u8 *)buffer + done, chunk);
+            done += chunk;
+        }
+    }
+
+    fs_file_unlock(lock, 0);
+    return count;
+}
+
+// Take references to the pages holding 'size' bytes of a file from
+// 'offset', so they can be sent without being copied. A referenced page
+// does not change: writers copy a shared page before writing and the
+// compressor leaves it alone. Returns how many references were filled
+// in, stopping early at the end of the file and at data that has no
+// plain page to reference (compressed pages, log-mode files and the
+// ext2 volume), which fs_read_at can copy instead; -1 if there is no
+// such file.
+int fs_get_pages(const char *name, u32 offset, u32 size, fs_page_ref_t *refs, u32 max_refs) {
+    if (name[0] == '/') return 0;
+
+    rwlock_t *lock;
+    file_t *file = fs_get(name, 0, &lock);
+    if (!file) return -1;
+
+    file->last_access = timer_get_uptime();
+    u32 end = offset + size < file->size ? offset + size : file->size;
+    u32 count = 0;
+    while (!file->log && offset < end && count < max_refs) {
+        fs_page_t *page = file->map->pages[offset / FS_PAGE_SIZE];
+        if (page->flags & FS_PAGE_COMPRESSED) break;
+
+        u32 page_offset = offset % FS_PAGE_SIZE;
+        u32 chunk = FS_PAGE_SIZE - page_offset;
+        if (chunk > end - offset) chunk = end - offset;
+        atomic_inc(&page->refcount);
+        refs[count].data = page->data + page_offset;
+        refs[count].len = chunk;
+        refs[count].page = page;
+        count++;
+        offset += chunk;
+    }
+
+    fs_file_unlock(lock, 0);
+    return count;
+}
+
+// Take another reference to a page from fs_get_pages
+void fs_get_page(void *page) {
+    atomic_inc(&((fs_page_t *)page)->refcount);
+}
+
+// Drop a reference taken by fs_get_pages or fs_get_page
+void fs_put_page(void *page) {
+    fs_page_put((fs_page_t *)page);
 }
 
 // Delete a file
 int fs_delete_file(const char *name) {
-    for (u32 i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 0) {
-            kfree(files[i].data);
-            files[i].used = 0;
-            files[i].data = NULL;
-            files[i].size = 0;
-            memset(files[i].name, 0, MAX_FILENAME);
-            file_count--;
-            return 0;
-        }
+    spin_lock(&index_lock);
+
+    rwlock_t *lock;
+    file_t *file = fs_get(name, 1, &lock);
+    if (!file) {
+        spin_unlock(&index_lock);
+        return -1; // File not found
+    }
+
+    fs_index_unlink(file);
+    if (file->log) {
+        fs_log_truncate(file);
+        kfree(file->log);
+        file->log = NULL;
     }
-    return -1; // File not found
+    fs_map_put(file->map);
+    file->used = 0;
+    file->map = NULL;
+    file->size = 0;
+    memset(file->name, 0, MAX_FILENAME);
+    file_count--;
+
+    fs_file_unlock(lock, 1);
+    spin_unlock(&index_lock);
+    return 0;
 }
 
 // List all files
@@ -102,62 +1147,282 @@ void fs_list_files(void) {
     vga_printf("Files in system:\n");
     vga_printf("Name\t\t\tSize (bytes)\n");
     vga_printf("----\t\t\t------------\n");
-    
+
+    spin_lock(&index_lock);
     for (u32 i = 0; i < MAX_FILES; i++) {
         if (files[i].used) {
             vga_printf("%-20s\t%d\n", files[i].name, files[i].size);
         }
     }
     vga_printf("Total: %d files\n", file_count);
+    spin_unlock(&index_lock);
+
+    if (ext2_is_mounted()) {
+        vga_printf("Mounted volume (/):\n");
+        ext2_list_dir("/");
+    }
+}
+
+// Walk the file table without printing: copies out the first file at or
+// after slot 'index' and returns the slot to continue from, or -1 when
+// there are no more files
+int fs_readdir(u32 index, char *name, u32 name_size, u32 *size) {
+    int next = -1;
+
+    spin_lock(&index_lock);
+    for (u32 i = index; i < MAX_FILES; i++) {
+        if (files[i].used) {
+            u32 len = strlen(files[i].name);
+            if (len >= name_size) len = name_size - 1;
+            memcpy(name, files[i].name, len);
+            name[len] = 0;
+            *size = files[i].size;
+            next = i + 1;
+            break;
+        }
+    }
+    spin_unlock(&index_lock);
+    return next;
+}
+
+// List a directory; absolute paths refer to the mounted ext2 volume
+int fs_list_dir(const char *path) {
+    if (path[0] != '/') {
+        fs_list_files();
+        return 0;
+    }
+    return ext2_list_dir(path);
 }
 
 // Get file info
 file_t *fs_get_file_info(const char *name) {
-    for (u32 i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 0) {
-            return &files[i];
+    return fs_find(name);
+}
+
+// Write part of a locked file in place, extending it if needed. Only
+// the pages covered by the write are unshared from any clones.
+static int fs_write_locked(file_t *file, u32 offset, const char *content, u32 size) {
+    file->last_access = timer_get_uptime();
+
+    // Log-mode files take appends; anything else goes back to pages
+    if (file->log) {
+        if (offset == file->size) {
+            return fs_log_append(file, (const u8 *)content, size);
         }
+        if (fs_log_disable(file) != 0) return -4; // Out of memory
     }
-    return NULL;
+    if (offset + size > file->map->capacity * FS_PAGE_SIZE) return -2;
+
+    if (fs_map_unshare(file) != 0) return -4; // Out of memory
+
+    // Extending a file from a boot module zero-fills its partial last
+    // page, which therefore needs a private copy first
+    u32 new_size = offset + size > file->size ? offset + size : file->size;
+    if (new_size > file->size && file->size % FS_PAGE_SIZE &&
+        !fs_page_writable(file->map, file->map->page_count - 1)) {
+        return -4; // Out of memory
+    }
+    if (fs_map_resize(file->map, new_size) != 0 ||
+        fs_map_write(file->map, offset, (const u8 *)content, size) != 0) {
+        return -4; // Out of memory
+    }
+
+    file->size = new_size;
+    return 0;
+}
+
+// Write part of a file in place, extending it if needed
+int fs_write_at(const char *name, u32 offset, const char *content, u32 size) {
+    if (offset + size < offset) return -2;
+
+    rwlock_t *lock;
+    file_t *file = fs_get(name, 1, &lock);
+    if (!file) return -1; // File not found
+
+    int result = fs_write_locked(file, offset, content, size);
+    fs_file_unlock(lock, 1);
+    return result;
 }
 
 // Write to file (overwrite)
 int fs_write_file(const char *name, const char *content, u32 size) {
     if (size > MAX_FILE_SIZE) return -2;
-    
-    for (u32 i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 0) {
-            // File exists, update it
-            kfree(files[i].data);
-            files[i].data = (u8 *)kmalloc(size + 1);
-            if (files[i].data) {
-                memcpy(files[i].data, content, size);
-                files[i].data[size] = 0;
-                files[i].size = size;
-                return 0;
-            } else {
-                files[i].used = 0;
-                file_count--;
-                return -4; // Out of memory
-            }
+
+    rwlock_t *lock;
+    file_t *file;
+    while (!(file = fs_get(name, 1, &lock))) {
+        // File doesn't exist, create it
+        int result = fs_create_file(name, content, size);
+        if (result != -3) return result;
+    }
+    file->last_access = timer_get_uptime();
+
+    int result = 0;
+    if (file->log) {
+        fs_log_truncate(file);
+        result = fs_log_append(file, (const u8 *)content, size);
+        fs_file_unlock(lock, 1);
+        return result;
+    }
+
+    // A shared map is simply dropped: every page is rewritten anyway
+    if (file->map->refcount > 1) {
+        fs_map_t *map = fs_map_alloc(0);
+        if (!map) {
+            fs_file_unlock(lock, 1);
+            return -4; // Out of memory
         }
+        fs_map_put(file->map);
+        file->map = map;
+        file->size = 0;
+    }
+
+    if (fs_map_resize(file->map, size) != 0 ||
+        fs_map_write(file->map, 0, (const u8 *)content, size) != 0) {
+        result = -4; // Out of memory
+    } else {
+        // Clear the tail of the last page so a later extension reads zeros
+        if (size % FS_PAGE_SIZE) {
+            fs_page_t *last = file->map->pages[file->map->page_count - 1];
+            memset(last->data + size % FS_PAGE_SIZE, 0, FS_PAGE_SIZE - size % FS_PAGE_SIZE);
+        }
+        file->size = size;
+    }
+
+    fs_file_unlock(lock, 1);
+    return result;
+}
+
+// Append to a file, creating it in log mode if it does not exist
+int fs_append(const char *name, const char *content, u32 size) {
+    rwlock_t *lock;
+    file_t *file;
+    int created = 0;
+
+    while (!(file = fs_get(name, 1, &lock))) {
+        int result = fs_create_file(name, "", 0);
+        if (result != 0 && result != -3) return result;
+        created = result == 0;
+    }
+
+    int result = 0;
+    if (created && !file->log && file->size == 0) {
+        result = fs_log_enable(file);
+    }
+    if (result == 0) {
+        result = fs_write_locked(file, file->size, content, size);
     }
-    
-    // File doesn't exist, create it
-    return fs_create_file(name, content, size);
+
+    fs_file_unlock(lock, 1);
+    return result;
+}
+
+// Switch a file between log mode and page mode
+int fs_set_log_mode(const char *name, int enable) {
+    rwlock_t *lock;
+    file_t *file = fs_get(name, 1, &lock);
+    if (!file) return -1; // File not found
+
+    int result = enable ? fs_log_enable(file) : fs_log_disable(file);
+    fs_file_unlock(lock, 1);
+    return result;
 }
 
 // Get file system statistics
 void fs_stats(void) {
     u32 total_size = 0;
+    u32 mapped_pages = 0;
+    u32 shared_pages = 0;
+    u32 log_files = 0;
+
+    spin_lock(&index_lock);
     for (u32 i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            total_size += files[i].size;
+        if (!files[i].used) continue;
+
+        rwlock_t *lock = fs_file_lock(&files[i], 0);
+        total_size += files[i].size;
+        if (files[i].log) log_files++;
+        mapped_pages += files[i].map->page_count;
+        for (u32 p = 0; p < files[i].map->page_count; p++) {
+            if (files[i].map->refcount > 1 || files[i].map->pages[p]->refcount > 1) {
+                shared_pages++;
+            }
         }
+        fs_file_unlock(lock, 0);
     }
-    
+    spin_unlock(&index_lock);
+
     vga_printf("File System Statistics:\n");
     vga_printf("  Files: %d / %d\n", file_count, MAX_FILES);
-    vga_printf("  Total size: %d bytes\n", total_size);
+    vga_printf("  Logical size: %d bytes\n", total_size);
+    vga_printf("  Physical size: %d bytes in heap\n", physical_bytes);
     vga_printf("  Max file size: %d bytes\n", MAX_FILE_SIZE);
-}
\ No newline at end of file
+    vga_printf("  Mapped pages: %d (%d shared)\n", mapped_pages, shared_pages);
+    vga_printf("  COW copies: %d pages, %d maps\n", cow_page_copies, cow_map_copies);
+    vga_printf("  Module-backed pages: %d\n", external_pages);
+    vga_printf("  Compressed pages: %d (interval %d s, %d runs)\n",
+               compressed_pages, compress_interval, compress_runs);
+    vga_printf("  Decompressed cache: %d hits, %d misses\n", dcache_hits, dcache_misses);
+
+    u32 segment_count = 0, segment_used = 0, segment_live = 0;
+    spin_lock(&log_lock);
+    for (u32 i = 0; i < FS_MAX_SEGMENTS; i++) {
+        if (segments[i].data) {
+            segment_count++;
+            segment_used += segments[i].used;
+            segment_live += segments[i].live;
+        }
+    }
+    spin_unlock(&log_lock);
+    vga_printf("  Log files: %d, %d appends (%d bytes)\n", log_files, log_appends, log_bytes_appended);
+    vga_printf("  Log segments: %d x %d KB, %d bytes written, %d live\n",
+               segment_count, FS_SEGMENT_SIZE / 1024, segment_used, segment_live);
+    vga_printf("  Cleaner: %d segments freed, %d bytes moved\n", segments_cleaned, bytes_relocated);
+    vga_printf("  Lock waits: %d read, %d write; lookup retries: %d\n",
+               lock_read_waits, lock_write_waits, lookup_retries);
+}
+
+// Set how long a file must be idle before it is compressed; 0 disables
+// background compression
+void fs_set_compress_interval(u32 seconds) {
+    compress_interval = seconds;
+}
+
+u32 fs_get_compress_interval(void) {
+    return compress_interval;
+}
+
+// Enable or disable compression for one file. Disabling it does not
+// decompress pages that are already compressed.
+int fs_set_compression(const char *name, int enable) {
+    rwlock_t *lock;
+    file_t *file = fs_get(name, 1, &lock);
+    if (!file) return -1; // File not found
+
+    if (enable) {
+        file->flags &= ~FS_FILE_NOCOMPRESS;
+    } else {
+        file->flags |= FS_FILE_NOCOMPRESS;
+    }
+    fs_file_unlock(lock, 1);
+    return 0;
+}
+
+// Compress every eligible file now, regardless of age
+void fs_compress_now(void) {
+    fs_compress_cold(0, MAX_FILES * FS_MAX_PAGES);
+}
+
+// Use one exclusive lock for every file instead of per-file locks. Only
+// switch while no file operation is in progress.
+void fs_set_big_lock(int enable) {
+    big_lock_mode = enable != 0;
+}
+
+// Lock contention counters: waits for a file lock and lock-free
+// lookups that had to be repeated
+void fs_lock_stats(u32 *read_waits, u32 *write_waits, u32 *retries) {
+    *read_waits = lock_read_waits;
+    *write_waits = lock_write_waits;
+    *retries = lookup_retries;
+}
@@ -0,0 +1,136 @@
+#include "kernel.h"
+#include "vga.h"
+#include "bench.h"
+
+// File system micro-benchmarks: create, read, write, append, list and
+// delete across a set of files, each operation timed with the TSC
+
+#define FSBENCH_MAX_FILES   48
+#define FSBENCH_MAX_SIZE    65536
+#define FSBENCH_READ_PASSES 4
+#define FSBENCH_LIST_PASSES 16
+#define FSBENCH_RECORD_SIZE 64
+#define FSBENCH_LOG_BYTES   32768
+#define FSBENCH_NAME_SIZE   32
+
+// "bench<index>.dat"
+static void fsbench_name(char *name, u32 index) {
+    char digits[12];
+    u32 len = 0;
+    do {
+        digits[len++] = '0' + index % 10;
+        index /= 10;
+    } while (index);
+
+    strcpy(name, "bench");
+    char *p = name + 5;
+    while (len) *p++ = digits[--len];
+    strcpy(p, ".dat");
+}
+
+void fs_bench(u32 file_count, u32 file_size, int machine) {
+    if (file_count < 1) file_count = 1;
+    if (file_count > FSBENCH_MAX_FILES) file_count = FSBENCH_MAX_FILES;
+    if (file_size > FSBENCH_MAX_SIZE) file_size = FSBENCH_MAX_SIZE;
+
+    u32 appends = file_count * FSBENCH_READ_PASSES;
+    if (appends > FSBENCH_LOG_BYTES / FSBENCH_RECORD_SIZE) {
+        appends = FSBENCH_LOG_BYTES / FSBENCH_RECORD_SIZE;
+    }
+
+    bench_t create, read, write, append, list, del;
+    bench_t *results[] = { &create, &read, &write, &append, &list, &del };
+    u32 result_count = sizeof(results) / sizeof(results[0]);
+    for (u32 i = 0; i < result_count; i++) {
+        memset(results[i], 0, sizeof(bench_t));
+    }
+
+    char *data = (char *)kmalloc(file_size + 1);
+    int ok = data != NULL;
+    ok = ok && bench_init(&create, "fsbench", "create", file_count) == 0;
+    ok = ok && bench_init(&read, "fsbench", "read", file_count * FSBENCH_READ_PASSES) == 0;
+    ok = ok && bench_init(&write, "fsbench", "write", file_count) == 0;
+    ok = ok && bench_init(&append, "fsbench", "append", appends) == 0;
+    ok = ok && bench_init(&list, "fsbench", "list", FSBENCH_LIST_PASSES) == 0;
+    ok = ok && bench_init(&del, "fsbench", "delete", file_count) == 0;
+    if (!ok) {
+        vga_printf("fsbench: Out of memory\n");
+        for (u32 i = 0; i < result_count; i++) {
+            bench_free(results[i]);
+        }
+        kfree(data);
+        return;
+    }
+
+    for (u32 i = 0; i < file_size; i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    if (machine) {
+        vga_printf("BENCH-CONFIG suite=fsbench files=%u size=%u tsc_khz=%u\n",
+                   file_count, file_size, timer_tsc_khz());
+    } else {
+        vga_printf("fsbench: %u files of %u bytes, TSC %u MHz\n",
+                   file_count, file_size, timer_tsc_khz() / 1000);
+    }
+    bench_header(machine);
+
+    char name[FSBENCH_NAME_SIZE];
+    for (u32 i = 0; i < file_count; i++) {
+        fsbench_name(name, i);
+        bench_begin(&create);
+        int result = fs_create_file(name, data, file_size);
+        bench_end(&create);
+        if (result != 0) create.errors++;
+    }
+
+    for (u32 pass = 0; pass < FSBENCH_READ_PASSES; pass++) {
+        for (u32 i = 0; i < file_count; i++) {
+            fsbench_name(name, i);
+            bench_begin(&read);
+            int result = fs_read_file(name, data, file_size + 1);
+            bench_end(&read);
+            if (result != (int)file_size) read.errors++;
+        }
+    }
+
+    for (u32 i = 0; i < file_count; i++) {
+        fsbench_name(name, i);
+        bench_begin(&write);
+        int result = fs_write_at(name, 0, data, file_size);
+        bench_end(&write);
+        if (result != 0) write.errors++;
+    }
+
+    for (u32 i = 0; i < appends; i++) {
+        bench_begin(&append);
+        int result = fs_append("bench.log", data, FSBENCH_RECORD_SIZE);
+        bench_end(&append);
+        if (result != 0) append.errors++;
+    }
+
+    for (u32 pass = 0; pass < FSBENCH_LIST_PASSES; pass++) {
+        u32 size;
+        int index = 0;
+        bench_begin(&list);
+        while ((index = fs_readdir(index, name, sizeof(name), &size)) >= 0) {
+            // Visit every file
+        }
+        bench_end(&list);
+    }
+
+    for (u32 i = 0; i < file_count; i++) {
+        fsbench_name(name, i);
+        bench_begin(&del);
+        int result = fs_delete_file(name);
+        bench_end(&del);
+        if (result != 0) del.errors++;
+    }
+    fs_delete_file("bench.log");
+
+    for (u32 i = 0; i < result_count; i++) {
+        bench_report(results[i], machine);
+        bench_free(results[i]);
+    }
+    kfree(data);
+}
@@ -0,0 +1,154 @@
+#include "kernel.h"
+#include "vga.h"
+
+// Multithreaded file system stress test. Worker threads read (and in the
+// mixed phase, write) files while yielding at every preemption point, so
+// they hold file locks across each other's operations. Each phase runs
+// once with per-file locks and once with a single big lock to show how
+// much readers wait on each other.
+
+#define STRESS_MAX_THREADS 8
+#define STRESS_FILE_SIZE   16384
+#define STRESS_WRITE_SIZE  512
+#define STRESS_NAME_SIZE   16
+
+typedef struct stress_worker {
+    char name[STRESS_NAME_SIZE];
+    u32 iterations;
+    u8 writer;
+    u8 *buffer;
+    u32 ops;
+    u32 errors;
+} stress_worker_t;
+
+static stress_worker_t workers[STRESS_MAX_THREADS];
+
+static void stress_thread(void *arg) {
+    stress_worker_t *worker = (stress_worker_t *)arg;
+
+    for (u32 i = 0; i < worker->iterations; i++) {
+        int result;
+        if (worker->writer) {
+            u32 offset = (i * STRESS_WRITE_SIZE) % STRESS_FILE_SIZE;
+            result = fs_write_at(worker->name, offset, (const char *)worker->buffer, STRESS_WRITE_SIZE);
+        } else {
+            result = fs_read_file(worker->name, (char *)worker->buffer, STRESS_FILE_SIZE + 1);
+        }
+
+        if (result < 0) {
+            worker->errors++;
+        } else {
+            worker->ops++;
+        }
+        kthread_yield();
+    }
+}
+
+static void stress_name(char *name, u32 index) {
+    strcpy(name, "stress0.dat");
+    name[6] = '0' + index;
+}
+
+// Run one phase and print a result line. Readers use their own file
+// unless 'shared' is set; with 'writer' set the last thread writes to
+// the shared file instead of reading it.
+static void stress_phase(const char *label, u32 threads, u32 iterations, int shared, int writer, int big_lock) {
+    u32 read_waits, write_waits, retries;
+    u32 start_read_waits, start_write_waits, start_retries;
+
+    fs_set_big_lock(big_lock);
+    for (u32 i = 0; i < threads; i++) {
+        stress_worker_t *worker = &workers[i];
+        stress_name(worker->name, shared ? 0 : i);
+        worker->iterations = iterations;
+        worker->writer = writer && i == threads - 1;
+        worker->ops = 0;
+        worker->errors = 0;
+        if (worker->writer) stress_name(worker->name, 0);
+    }
+
+    fs_lock_stats(&start_read_waits, &start_write_waits, &start_retries);
+    u32 start = timer_get_ticks();
+
+    for (u32 i = 0; i < threads; i++) {
+        kthread_create(stress_thread, &workers[i]);
+    }
+    kthread_join();
+
+    u32 ticks = timer_get_ticks() - start;
+    fs_lock_stats(&read_waits, &write_waits, &retries);
+    fs_set_big_lock(0);
+
+    u32 ops = 0, errors = 0;
+    for (u32 i = 0; i < threads; i++) {
+        ops += workers[i].ops;
+        errors += workers[i].errors;
+    }
+
+    u32 ms = ticks * 1000 / timer_get_frequency();
+    u32 rate = ms ? ops * 1000 / ms : 0;
+    vga_printf("%-8s %-8s %d  %d ops %d ms  %d ops/s  waits %d/%d  retries %d",
+               label, big_lock ? "big" : "per-file", threads, ops, ms, rate,
+               read_waits - start_read_waits, write_waits - start_write_waits,
+               retries - start_retries);
+    if (errors) vga_printf("  errors %d", errors);
+    vga_printf("\n");
+}
+
+// Run every phase with one thread and with 'threads' threads
+void fs_stress(u32 threads, u32 iterations) {
+    if (threads < 1) threads = 1;
+    if (threads > STRESS_MAX_THREADS) threads = STRESS_MAX_THREADS;
+
+    // One file per thread, filled with a recognizable pattern
+    u8 *pattern = (u8 *)kmalloc(STRESS_FILE_SIZE);
+    if (!pattern) {
+        vga_printf("fsstress: Out of memory\n");
+        return;
+    }
+    for (u32 i = 0; i < STRESS_FILE_SIZE; i++) {
+        pattern[i] = 'a' + i % 26;
+    }
+
+    u32 ready = 0;
+    for (u32 i = 0; i < threads; i++) {
+        workers[i].buffer = (u8 *)kmalloc(STRESS_FILE_SIZE + 1);
+        if (!workers[i].buffer) break;
+        memcpy(workers[i].buffer, pattern, STRESS_WRITE_SIZE);
+
+        stress_worker_t *worker = &workers[i];
+        stress_name(worker->name, i);
+        if (fs_write_file(worker->name, (const char *)pattern, STRESS_FILE_SIZE) != 0) {
+            kfree(workers[i].buffer);
+            break;
+        }
+        ready++;
+    }
+    kfree(pattern);
+
+    if (ready < threads) {
+        vga_printf("fsstress: Out of memory\n");
+    } else {
+        vga_printf("fsstress: %d threads, %d iterations, %d KB files\n",
+                   threads, iterations, STRESS_FILE_SIZE / 1024);
+        vga_printf("phase    locks    thr\n");
+
+        kthread_set_interleave(1);
+        for (int big_lock = 0; big_lock <= 1; big_lock++) {
+            stress_phase("private", 1, iterations, 0, 0, big_lock);
+            stress_phase("private", threads, iterations, 0, 0, big_lock);
+            stress_phase("shared", threads, iterations, 1, 0, big_lock);
+            if (threads > 1) {
+                stress_phase("mixed", threads, iterations, 1, 1, big_lock);
+            }
+        }
+        kthread_set_interleave(0);
+    }
+
+    for (u32 i = 0; i < ready; i++) {
+        char name[STRESS_NAME_SIZE];
+        stress_name(name, i);
+        fs_delete_file(name);
+        kfree(workers[i].buffer);
+    }
+}
@@ -42,6 +42,11 @@ typedef void (*interrupt_handler_t)(void);
 // Interrupt handlers array
 static interrupt_handler_t interrupt_handlers[256];
 
+// Additional handlers for IRQ lines shared by several PCI devices. Each
+// handler checks whether its own device raised the interrupt.
+#define IRQ_SHARED_MAX 4
+static interrupt_handler_t irq_shared_handlers[16][IRQ_SHARED_MAX];
+
 // Set up an IDT entry
 void idt_set_gate(u8 num, u32 base, u16 sel, u8 flags) {
     idt_entries[num].base_lo = base & 0xFFFF;
@@ -58,6 +63,7 @@ void idt_init(void) {
 
     memset(&idt_entries, 0, sizeof(struct idt_entry) * 256);
     memset(&interrupt_handlers, 0, sizeof(interrupt_handler_t) * 256);
+    memset(&irq_shared_handlers, 0, sizeof(irq_shared_handlers));
 
     // Remap the IRQ table
     // Initialize PIC
@@ -141,6 +147,19 @@ void register_interrupt_handler(u8 n, interrupt_handler_t handler) {
     interrupt_handlers[n] = handler;
 }
 
+// Register a handler on a hardware IRQ line that other devices may share
+int register_irq_handler(u8 irq, interrupt_handler_t handler) {
+    if (irq >= 16) return -1;
+
+    for (int i = 0; i < IRQ_SHARED_MAX; i++) {
+        if (!irq_shared_handlers[irq][i]) {
+            irq_shared_handlers[irq][i] = handler;
+            return 0;
+        }
+    }
+    return -1; // Line full
+}
+
 // Common ISR handler
 void isr_handler(u32 interrupt_number, u32 error_code) {
     if (interrupt_handlers[interrupt_number] != 0) {
@@ -161,4 +180,10 @@ void irq_handler(u32 interrupt_number) {
     if (interrupt_handlers[interrupt_number] != 0) {
         interrupt_handlers[interrupt_number]();
     }
+
+    if (interrupt_number >= 32 && interrupt_number < 48) {
+        for (int i = 0; i < IRQ_SHARED_MAX && irq_shared_handlers[interrupt_number - 32][i]; i++) {
+            irq_shared_handlers[interrupt_number - 32][i]();
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "kernel.h"
+#include "vga.h"
+
+// Initial RAM file system loaded as a multiboot module (GRUB 'module'
+// or 'qemu -initrd'). Both cpio (newc) and ustar archives are accepted.
+// File data is not copied: each file's pages point into the module.
+
+#define CPIO_HEADER_SIZE 110
+#define CPIO_MODE_TYPE   0170000
+#define CPIO_MODE_FILE   0100000
+
+#define TAR_BLOCK_SIZE   512
+
+static u32 initramfs_files = 0;
+static u32 initramfs_bytes = 0;
+static u32 initramfs_skipped = 0;
+
+// Parse a fixed-width ASCII number in the given base
+static u32 parse_number(const char *str, u32 len, u32 base) {
+    u32 value = 0;
+    for (u32 i = 0; i < len; i++) {
+        char c = str[i];
+        u32 digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else break;  // Tar fields end in a space or NUL
+        if (digit >= base) break;
+        value = value * base + digit;
+    }
+    return value;
+}
+
+// Register one archive member under its name with any leading "./"
+// or "/" removed; absolute names belong to the mounted volume
+static void initramfs_add(const char *name, const u8 *data, u32 size) {
+    while (name[0] == '.' && name[1] == '/') name += 2;
+    while (name[0] == '/') name++;
+    if (!name[0]) return;
+
+    if (fs_register_external(name, data, size) != 0) {
+        initramfs_skipped++;
+        return;
+    }
+    initramfs_files++;
+    initramfs_bytes += size;
+}
+
+// "newc" magic, with or without checksums; the older odc format
+// ("070707") has a different header and is not accepted
+static int cpio_is_newc(const void *hdr) {
+    return memcmp(hdr, "070701", 6) == 0 || memcmp(hdr, "070702", 6) == 0;
+}
+
+// cpio "newc" format: 110-byte ASCII header, name, data, each padded
+// to 4 bytes
+static void initramfs_parse_cpio(const u8 *start, const u8 *end) {
+    const u8 *p = start;
+    char name[260];
+
+    while (p + CPIO_HEADER_SIZE <= end) {
+        const char *hdr = (const char *)p;
+        if (!cpio_is_newc(hdr)) break;
+
+        u32 mode = parse_number(hdr + 14, 8, 16);
+        u32 file_size = parse_number(hdr + 54, 8, 16);
+        u32 name_size = parse_number(hdr + 94, 8, 16);
+
+        const u8 *name_ptr = p + CPIO_HEADER_SIZE;
+        if (name_size == 0 || name_size > (u32)(end - name_ptr)) break;
+        const u8 *data = start + ((name_ptr + name_size - start + 3) & ~3);
+        if (data > end || file_size > (u32)(end - data)) break;
+
+        u32 len = name_size < sizeof(name) ? name_size : sizeof(name) - 1;
+        memcpy(name, name_ptr, len);
+        name[len] = 0;
+        if (strcmp(name, "TRAILER!!!") == 0) break;
+
+        if ((mode & CPIO_MODE_TYPE) == CPIO_MODE_FILE) {
+            initramfs_add(name, data, file_size);
+        }
+        p = start + ((data + file_size - start + 3) & ~3);
+    }
+}
+
+// ustar format: 512-byte headers, data padded to 512 bytes, terminated
+// by an all-zero block
+static void initramfs_parse_tar(const u8 *start, const u8 *end) {
+    const u8 *p = start;
+    char name[260];
+
+    while (p + TAR_BLOCK_SIZE <= end) {
+        const char *hdr = (const char *)p;
+        if (hdr[0] == 0) break;
+
+        u32 file_size = parse_number(hdr + 124, 12, 8);
+        char type = hdr[156];
+        const u8 *data = p + TAR_BLOCK_SIZE;
+        if (file_size > (u32)(end - data)) break;
+
+        // Long names are split into a prefix and a name field
+        u32 len = 0;
+        if (hdr[345]) {
+            while (len < 155 && hdr[345 + len]) {
+                name[len] = hdr[345 + len];
+                len++;
+            }
+            name[len++] = '/';
+        }
+        for (u32 i = 0; i < 100 && hdr[i]; i++) {
+            name[len++] = hdr[i];
+        }
+        name[len] = 0;
+
+        if (type == '0' || type == 0) {
+            initramfs_add(name, data, file_size);
+        }
+        p = data + ((file_size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1));
+    }
+}
+
+// Register the files of every archive passed as a boot module
+void initramfs_init(struct multiboot_info *mbi) {
+    if (!(mbi->flags & (1 << 3)) || mbi->mods_count == 0) return;
+
+    struct multiboot_module *mods = (struct multiboot_module *)mbi->mods_addr;
+    for (u32 i = 0; i < mbi->mods_count; i++) {
+        const u8 *start = (const u8 *)mods[i].mod_start;
+        const u8 *end = (const u8 *)mods[i].mod_end;
+        u32 size = mods[i].mod_end - mods[i].mod_start;
+
+        if (size >= CPIO_HEADER_SIZE && cpio_is_newc(start)) {
+            initramfs_parse_cpio(start, end);
+        } else if (size >= TAR_BLOCK_SIZE && memcmp(start + 257, "ustar", 5) == 0) {
+            initramfs_parse_tar(start, end);
+        } else {
+            vga_printf("initramfs: module %d is not a newc cpio or tar archive\n", i);
+        }
+    }
+
+    vga_printf("initramfs: %d files, %d KB in place", initramfs_files, initramfs_bytes / 1024);
+    if (initramfs_skipped) {
+        vga_printf(", %d skipped", initramfs_skipped);
+    }
+    vga_printf("\n");
+}
@@ -0,0 +1,362 @@
+#include "kernel.h"
+#include "vga.h"
+#include "net.h"
+
+// IPv4 and ICMP. Received packets arrive from the net-rx job with the
+// Ethernet header stripped; outgoing ones are routed to an interface
+// through the routing table and handed to network_output. Fragments
+// are not reassembled, and packets not addressed to us are dropped
+// rather than forwarded. Packets to our own addresses take the loopback
+// fast path, which skips the header checksum both ways.
+
+#define PING_DATA_SIZE  56
+#define PING_TIMEOUT_MS 1000
+
+typedef struct ip_counters {
+    u32 in_receives;
+    u32 in_header_errors;
+    u32 in_checksum_errors;
+    u32 in_address_errors;
+    u32 in_fragments;
+    u32 in_unknown_protocols;
+    u32 in_delivers;
+    u32 out_requests;
+    u32 out_no_routes;
+    u32 out_unresolved;
+    u32 icmp_errors;
+    u32 icmp_in_echo_requests;
+    u32 icmp_in_echo_replies;
+    u32 icmp_out_echo_requests;
+    u32 icmp_out_echo_replies;
+} ip_counters_t;
+
+static ip_counters_t counters;
+static u16 ip_next_id = 1;
+
+// The outstanding ping probe, matched by identifier and sequence
+typedef struct ping_probe {
+    u16 id;
+    u16 sequence;
+    volatile u8 replied;
+    u8 ttl;
+    u64 reply_tsc;
+} ping_probe_t;
+
+static ping_probe_t probe;
+
+// Sum of the pseudo-header that UDP and TCP checksums also cover: the
+// addresses, protocol and length
+static u32 ip_pseudo_sum(u32 src, u32 dst, u8 protocol, u32 len) {
+    struct {
+        u32 src;
+        u32 dst;
+        u8 zero;
+        u8 protocol;
+        u16 length;
+    } __attribute__((packed)) pseudo = {
+        net_htonl(src), net_htonl(dst), 0, protocol, net_htons(len)
+    };
+
+    return ip_checksum_add(0, &pseudo, sizeof(pseudo));
+}
+
+// Checksum for UDP and TCP
+u16 ip_pseudo_checksum(u32 src, u32 dst, u8 protocol, const void *data, u32 len) {
+    u32 sum = ip_pseudo_sum(src, dst, protocol, len);
+    return ip_checksum_fold(ip_checksum_add(sum, data, len));
+}
+
+// The same over a buffer with fragments. The data's length is even, but
+// a fragment may start at an odd offset; its bytes then sit in the other
+// halves of the words, so its sum is byte-swapped before it is added.
+u16 ip_pseudo_checksum_netbuf(u32 src, u32 dst, u8 protocol, netbuf_t *nb) {
+    u32 sum = ip_pseudo_sum(src, dst, protocol, netbuf_total_len(nb));
+    sum = ip_checksum_add(sum, nb->data, nb->len);
+
+    u32 offset = nb->len;
+    for (u32 i = 0; i < nb->frag_count; i++) {
+        u32 part = (u16)~ip_checksum(nb->frags[i].data, nb->frags[i].len);
+        if (offset & 1) part = ((part & 0xFF) << 8) | (part >> 8);
+        sum += part;
+        offset += nb->frags[i].len;
+    }
+    return ip_checksum_fold(sum);
+}
+
+// 127.0.0.0/8 and the addresses of our interfaces
+int ip_is_local(u32 ip) {
+    if ((ip >> 24) == 127) return 1;
+
+    u32 count = network_interface_count();
+    for (u32 i = 1; i < count; i++) {
+        network_interface_t *iface = network_interface_at(i);
+        if (iface->active && iface->ip_address && iface->ip_address == ip) return 1;
+    }
+    return 0;
+}
+
+// Pick the interface for 'dst' and the address to send to on it. Our
+// own addresses always go to loopback and the limited broadcast to the
+// first Ethernet interface; everything else follows the routing table.
+network_interface_t *ip_route(u32 dst, u32 *next_hop) {
+    if (ip_is_local(dst)) {
+        *next_hop = dst;
+        return network_interface_at(0);
+    }
+
+    if (dst == IP_BROADCAST) {
+        network_interface_t *iface = network_interface_at(1);
+        *next_hop = dst;
+        return iface && iface->active ? iface : NULL;
+    }
+
+    return route_lookup(dst, next_hop);
+}
+
+static void ip_drop(netbuf_t *nb, u32 *counter) {
+    (*counter)++;
+    netbuf_put(nb);
+}
+
+// Validate a received packet and hand its payload to the protocol
+void ip_input(network_interface_t *iface, netbuf_t *nb) {
+    ip_header_t *ip = (ip_header_t *)nb->data;
+    counters.in_receives++;
+
+    if (nb->len < sizeof(ip_header_t)) {
+        ip_drop(nb, &counters.in_header_errors);
+        return;
+    }
+
+    u32 header_len = (ip->version_ihl & 0x0F) * 4;
+    u32 total_len = net_ntohs(ip->total_length);
+    if ((ip->version_ihl >> 4) != 4 || header_len < sizeof(ip_header_t) ||
+        header_len > nb->len || total_len < header_len || total_len > nb->len) {
+        ip_drop(nb, &counters.in_header_errors);
+        return;
+    }
+    if (!(nb->flags & NETBUF_LOCAL) && ip_checksum(ip, header_len) != 0) {
+        ip_drop(nb, &counters.in_checksum_errors);
+        return;
+    }
+    if (net_ntohs(ip->frag_offset) & (IP_FLAG_MF | IP_OFFSET_MASK)) {
+        ip_drop(nb, &counters.in_fragments);
+        return;
+    }
+
+    u32 dst = net_ntohl(ip->dst);
+    u32 subnet_broadcast = iface->ip_address | ~iface->netmask;
+    if (!ip_is_local(dst) && dst != IP_BROADCAST && dst != subnet_broadcast) {
+        ip_drop(nb, &counters.in_address_errors);
+        return;
+    }
+
+    // Drop Ethernet padding, then the header
+    nb->len = total_len;
+    netbuf_pull(nb, header_len);
+
+    switch (ip->protocol) {
+        case PROTO_ICMP:
+            counters.in_delivers++;
+            icmp_input(nb, ip);
+            break;
+        case PROTO_UDP:
+            counters.in_delivers++;
+            udp_input(nb, ip);
+            break;
+        case PROTO_TCP:
+            counters.in_delivers++;
+            tcp_input(nb, ip);
+            break;
+        default:
+            ip_drop(nb, &counters.in_unknown_protocols);
+            break;
+    }
+}
+
+// Prepend an IPv4 header to the payload at nb->data and send it. A zero
+// 'src' picks the outgoing interface's address. Takes over the caller's
+// reference; returns -1 if the packet could not be sent.
+int ip_output(netbuf_t *nb, u32 src, u32 dst, u8 protocol) {
+    u32 next_hop;
+    network_interface_t *iface = ip_route(dst, &next_hop);
+    if (!iface) {
+        ip_drop(nb, &counters.out_no_routes);
+        return -1;
+    }
+
+    if (!src) src = iface->transmit ? iface->ip_address : dst;
+
+    ip_header_t *ip = (ip_header_t *)netbuf_push(nb, sizeof(ip_header_t));
+    if (!ip) {
+        netbuf_put(nb);
+        return -1;
+    }
+    ip->version_ihl = 0x45;
+    ip->tos = 0;
+    ip->total_length = net_htons(netbuf_total_len(nb));
+    ip->id = net_htons(ip_next_id++);
+    ip->frag_offset = net_htons(IP_FLAG_DF);
+    ip->ttl = IP_DEFAULT_TTL;
+    ip->protocol = protocol;
+    ip->checksum = 0;
+    ip->src = net_htonl(src);
+    ip->dst = net_htonl(dst);
+
+    counters.out_requests++;
+    if (!iface->transmit) {
+        network_loopback(nb);
+        return 0;
+    }
+    ip->checksum = ip_checksum(ip, sizeof(ip_header_t));
+    if (arp_output(iface, next_hop, nb) != 0) {
+        counters.out_unresolved++;
+        return -1;
+    }
+    return 0;
+}
+
+// Answer echo requests in place and match echo replies to the
+// outstanding ping probe
+void icmp_input(netbuf_t *nb, ip_header_t *ip) {
+    icmp_header_t *icmp = (icmp_header_t *)nb->data;
+    if (nb->len < sizeof(icmp_header_t) || ip_checksum(icmp, nb->len) != 0) {
+        ip_drop(nb, &counters.icmp_errors);
+        return;
+    }
+
+    switch (icmp->type) {
+        case ICMP_ECHO_REQUEST: {
+            counters.icmp_in_echo_requests++;
+            u32 src = net_ntohl(ip->dst);
+            u32 dst = net_ntohl(ip->src);
+            if (!ip_is_local(src)) src = 0;  // Broadcast: reply from our own address
+
+            // Only the type changes, so patch the checksum rather than
+            // summing the whole payload again
+            u16 old_word = *(u16 *)icmp;
+            icmp->type = ICMP_ECHO_REPLY;
+            icmp->checksum = ip_checksum_update16(icmp->checksum, old_word, *(u16 *)icmp);
+            counters.icmp_out_echo_replies++;
+            ip_output(nb, src, dst, PROTO_ICMP);
+            return;
+        }
+        case ICMP_ECHO_REPLY:
+            counters.icmp_in_echo_replies++;
+            if (!probe.replied && icmp->id == net_htons(probe.id) &&
+                icmp->sequence == net_htons(probe.sequence)) {
+                probe.reply_tsc = timer_read_tsc();
+                probe.ttl = ip->ttl;
+                probe.replied = 1;
+            }
+            break;
+    }
+    netbuf_put(nb);
+}
+
+static void ip_print_ms(u32 ns) {
+    vga_printf("%u.%03u", ns / 1000000, ns / 1000 % 1000);
+}
+
+// Send 'count' echo requests, one at a time, waiting up to a second for
+// each reply. Round-trip times come from the cycle counter: the reply is
+// stamped when the net-rx job processes it. Returns the replies received.
+int network_ping(u32 target_ip, u32 count) {
+    u32 next_hop;
+    network_interface_t *iface = ip_route(target_ip, &next_hop);
+    if (!iface) {
+        vga_printf("ping: Network is unreachable\n");
+        return 0;
+    }
+
+    vga_printf("PING %d.%d.%d.%d via %s: %d data bytes\n",
+               (target_ip >> 24) & 0xFF, (target_ip >> 16) & 0xFF,
+               (target_ip >> 8) & 0xFF, target_ip & 0xFF,
+               iface->name, PING_DATA_SIZE);
+
+    probe.id++;
+    u32 sent = 0, received = 0;
+    u32 min_ns = 0xFFFFFFFF, max_ns = 0;
+    u64 total_ns = 0;
+
+    for (u32 seq = 1; seq <= count; seq++) {
+        netbuf_t *nb = netbuf_alloc();
+        if (!nb) {
+            vga_printf("ping: Out of packet buffers\n");
+            break;
+        }
+
+        icmp_header_t *icmp = (icmp_header_t *)netbuf_append(nb, sizeof(icmp_header_t) + PING_DATA_SIZE);
+        icmp->type = ICMP_ECHO_REQUEST;
+        icmp->code = 0;
+        icmp->id = net_htons(probe.id);
+        icmp->sequence = net_htons(seq);
+        u8 *data = (u8 *)(icmp + 1);
+        for (u32 i = 0; i < PING_DATA_SIZE; i++) {
+            data[i] = i;
+        }
+        icmp->checksum = 0;
+        icmp->checksum = ip_checksum(icmp, nb->len);
+
+        probe.sequence = seq;
+        probe.replied = 0;
+        u32 deadline = timer_get_ticks() + PING_TIMEOUT_MS * timer_get_frequency() / 1000;
+        counters.icmp_out_echo_requests++;
+        sent++;
+
+        u64 start = timer_read_tsc();
+        ip_output(nb, 0, target_ip, PROTO_ICMP);
+        while (!probe.replied && (s32)(timer_get_ticks() - deadline) < 0) {
+            work_run();
+        }
+
+        if (!probe.replied) {
+            vga_printf("Request timeout for icmp_seq %u\n", seq);
+            continue;
+        }
+
+        u32 ns = timer_cycles_to_ns(probe.reply_tsc - start);
+        received++;
+        total_ns += ns;
+        if (ns < min_ns) min_ns = ns;
+        if (ns > max_ns) max_ns = ns;
+
+        vga_printf("%d bytes from %d.%d.%d.%d: icmp_seq=%u ttl=%u time=",
+                   (int)(sizeof(icmp_header_t) + PING_DATA_SIZE),
+                   (target_ip >> 24) & 0xFF, (target_ip >> 16) & 0xFF,
+                   (target_ip >> 8) & 0xFF, target_ip & 0xFF, seq, probe.ttl);
+        ip_print_ms(ns);
+        vga_printf(" ms\n");
+    }
+
+    vga_printf("--- %d.%d.%d.%d ping statistics ---\n",
+               (target_ip >> 24) & 0xFF, (target_ip >> 16) & 0xFF,
+               (target_ip >> 8) & 0xFF, target_ip & 0xFF);
+    vga_printf("%u packets transmitted, %u received, %u%% packet loss\n",
+               sent, received, sent ? (sent - received) * 100 / sent : 0);
+    if (received) {
+        vga_printf("rtt min/avg/max = ");
+        ip_print_ms(min_ns);
+        vga_printf("/");
+        ip_print_ms(udiv64(total_ns, received));
+        vga_printf("/");
+        ip_print_ms(max_ns);
+        vga_printf(" ms\n");
+    }
+    return received;
+}
+
+void ip_stats(void) {
+    vga_printf("  Checksum: %s\n", checksum_impl_name());
+    vga_printf("  IP in: %u received, %u delivered, %u header errors, %u bad checksums\n",
+               counters.in_receives, counters.in_delivers,
+               counters.in_header_errors, counters.in_checksum_errors);
+    vga_printf("         %u not for us, %u fragments, %u unknown protocols\n",
+               counters.in_address_errors, counters.in_fragments, counters.in_unknown_protocols);
+    vga_printf("  IP out: %u sent, %u no route, %u unresolved\n",
+               counters.out_requests, counters.out_no_routes, counters.out_unresolved);
+    vga_printf("  ICMP: echo requests %u in %u out, echo replies %u in %u out, %u errors\n",
+               counters.icmp_in_echo_requests, counters.icmp_out_echo_requests,
+               counters.icmp_in_echo_replies, counters.icmp_out_echo_replies,
+               counters.icmp_errors);
+}
@@ -70,6 +70,18 @@ char *strcat(char *dest, const char *src) {
     return orig_dest;
 }
 
+// Divide a 64-bit value by a 32-bit one without libgcc, saturating
+// at 0xFFFFFFFF if the quotient does not fit
+u32 udiv64(u64 n, u32 d) {
+    u32 hi = (u32)(n >> 32);
+    u32 lo = (u32)n;
+    if (hi >= d) return 0xFFFFFFFF;
+
+    u32 q, r;
+    __asm__ ("divl %4" : "=a"(q), "=d"(r) : "a"(lo), "d"(hi), "rm"(d));
+    return q;
+}
+
 int snprintf(char *str, size_t size, const char *format, ...) {
     // Simple implementation for basic format strings
     (void)size;  // Ignore size for simplicity (unsafe but minimal)
@@ -156,6 +168,10 @@ void kernel_main(u32 multiboot_magic, struct multiboot_info *mbi) {
     memory_init(mbi);
     vga_puts("OK\n");
 
+    vga_puts("Initializing PCI Bus... ");
+    pci_init();
+    vga_puts("OK\n");
+
     vga_puts("Initializing Process Management... ");
     process_init();
     vga_puts("OK\n");
@@ -166,6 +182,7 @@ void kernel_main(u32 multiboot_magic, struct multiboot_info *mbi) {
 
     vga_puts("Initializing File System... ");
     filesystem_init();
+    initramfs_init(mbi);
     vga_puts("OK\n");
 
     vga_puts("Initializing Keyboard Driver... ");
@@ -176,8 +193,28 @@ void kernel_main(u32 multiboot_magic, struct multiboot_info *mbi) {
     timer_init();
     vga_puts("OK\n");
 
+    vga_puts("Initializing Serial Port... ");
+    serial_init();
+    vga_puts(serial_present() ? "OK\n" : "none\n");
+
     vga_puts("Initializing Network Stack... ");
     network_init();
+    e1000_init();
+    virtio_net_init();
+    vga_puts("OK\n");
+
+    vga_puts("Initializing Block Devices... ");
+    block_init();
+    ata_init();
+    virtio_blk_init();
+    vga_puts("OK\n");
+
+    // All interrupt handlers are registered; drivers rely on completion
+    // interrupts from here on
+    __asm__ volatile ("sti");
+
+    vga_puts("Mounting File Systems... ");
+    ext2_init();
     vga_puts("OK\n");
 
     vga_puts("Initializing Shell... ");
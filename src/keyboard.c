@@ -1,5 +1,6 @@
 #include "kernel.h"
 #include "vga.h"
+#include "poll.h"
 
 // Keyboard scan codes
 static char scancode_to_ascii[128] = {
@@ -25,6 +26,11 @@ static int buffer_start = 0;
 static int buffer_end = 0;
 static int buffer_count = 0;
 
+// Readers waiting for input. The interrupt handler raises a job to wake
+// them, since epoll's lists are only touched in thread context.
+static poll_head_t keyboard_poll_head;
+static int keyboard_work = -1;
+
 // External function declarations
 extern void register_interrupt_handler(u8 n, void (*handler)(void));
 
@@ -34,9 +40,25 @@ static void keyboard_buffer_add(char c) {
         keyboard_buffer[buffer_end] = c;
         buffer_end = (buffer_end + 1) % KEYBOARD_BUFFER_SIZE;
         buffer_count++;
+        work_raise(keyboard_work);
     }
 }
 
+static void keyboard_wake(void) {
+    poll_wake(&keyboard_poll_head, POLLIN);
+}
+
+// The poll head and current events of the keyboard, for epoll
+poll_head_t *keyboard_poll(u32 *events) {
+    *events = buffer_count ? POLLIN : 0;
+    return &keyboard_poll_head;
+}
+
+static int keyboard_ready(void *arg) {
+    (void)arg;
+    return buffer_count > 0;
+}
+
 // Get character from keyboard buffer
 char keyboard_getchar(void) {
     if (buffer_count == 0) return 0;
@@ -150,6 +172,7 @@ void keyboard_init(void) {
     
     // Register keyboard interrupt handler (IRQ1 = interrupt 33)
     register_interrupt_handler(33, keyboard_handler);
+    keyboard_work = work_register("keyboard", keyboard_wake, 0);
     
     vga_printf("Keyboard driver initialized\n");
 }
@@ -159,25 +182,22 @@ int keyboard_readline(char *buffer, int max_len) {
     int pos = 0;
     
     while (pos < max_len - 1) {
-        if (keyboard_has_data()) {
-            char c = keyboard_getchar();
-            
-            if (c == '\n' || c == '\r') {
-                buffer[pos] = 0;
-                vga_putchar('\n');
-                return pos;
-            } else if (c == '\b') {
-                if (pos > 0) {
-                    pos--;
-                    vga_putchar('\b');
-                }
-            } else if (c >= 32 && c <= 126) { // Printable characters
-                buffer[pos++] = c;
-                vga_putchar(c);
+        // Sleep until a key arrives; background work runs meanwhile
+        wait_event(&keyboard_poll_head.wait, keyboard_ready, NULL, 0);
+        char c = keyboard_getchar();
+
+        if (c == '\n' || c == '\r') {
+            buffer[pos] = 0;
+            vga_putchar('\n');
+            return pos;
+        } else if (c == '\b') {
+            if (pos > 0) {
+                pos--;
+                vga_putchar('\b');
             }
-        } else {
-            // Yield CPU while waiting for input
-            __asm__ volatile ("hlt");
+        } else if (c >= 32 && c <= 126) { // Printable characters
+            buffer[pos++] = c;
+            vga_putchar(c);
         }
     }
     
@@ -0,0 +1,182 @@
+#include "kernel.h"
+#include "vga.h"
+#include "sync.h"
+
+// Cooperative kernel threads. The context that calls kthread_join (the
+// shell) is thread 0; workers run until they return, switching at
+// kthread_yield and at preemption points in long-running kernel code.
+
+#define KTHREAD_MAX        8
+#define KTHREAD_STACK_SIZE 8192
+
+typedef enum {
+    KTHREAD_UNUSED,
+    KTHREAD_RUNNABLE,
+    KTHREAD_DONE
+} kthread_state_t;
+
+typedef struct kthread {
+    u32 esp;
+    u8 *stack;
+    void (*fn)(void *);
+    void *arg;
+    kthread_state_t state;
+    u32 switches;
+} kthread_t;
+
+static kthread_t threads[KTHREAD_MAX + 1];
+static u32 current_thread = 0;
+static u32 live_threads = 0;
+
+// Set by the timer; preemption points yield when it is set
+static volatile u8 need_resched = 0;
+
+// Yield at every preemption point, to interleave threads finely
+static u8 interleave = 0;
+
+// Save callee-saved registers and the stack pointer to *old_esp, then
+// resume the context whose stack pointer is new_esp
+void kthread_switch(u32 *old_esp, u32 new_esp);
+__asm__ (
+    ".globl kthread_switch\n"
+    "kthread_switch:\n"
+    "    movl 4(%esp), %eax\n"
+    "    movl 8(%esp), %edx\n"
+    "    pushl %ebp\n"
+    "    pushl %ebx\n"
+    "    pushl %esi\n"
+    "    pushl %edi\n"
+    "    movl %esp, (%eax)\n"
+    "    movl %edx, %esp\n"
+    "    popl %edi\n"
+    "    popl %esi\n"
+    "    popl %ebx\n"
+    "    popl %ebp\n"
+    "    ret\n"
+);
+
+// First code run on a new thread's stack
+static void kthread_entry(void) {
+    kthread_t *thread = &threads[current_thread];
+    thread->fn(thread->arg);
+
+    thread->state = KTHREAD_DONE;
+    live_threads--;
+    while (1) {
+        kthread_yield();
+    }
+}
+
+// Create a worker thread; it first runs at the next yield
+int kthread_create(void (*fn)(void *), void *arg) {
+    threads[0].state = KTHREAD_RUNNABLE;
+
+    for (u32 i = 1; i <= KTHREAD_MAX; i++) {
+        kthread_t *thread = &threads[i];
+        if (thread->state != KTHREAD_UNUSED) continue;
+
+        thread->stack = (u8 *)kmalloc(KTHREAD_STACK_SIZE);
+        if (!thread->stack) return -4; // Out of memory
+
+        // Initial frame for kthread_switch: four saved registers, then
+        // the return address
+        u32 *sp = (u32 *)(thread->stack + KTHREAD_STACK_SIZE);
+        *--sp = 0;                     // Fake return address of kthread_entry
+        *--sp = (u32)kthread_entry;
+        for (int r = 0; r < 4; r++) {
+            *--sp = 0;
+        }
+
+        thread->esp = (u32)sp;
+        thread->fn = fn;
+        thread->arg = arg;
+        thread->state = KTHREAD_RUNNABLE;
+        thread->switches = 0;
+        live_threads++;
+        return i;
+    }
+    return -1; // No free threads
+}
+
+// Switch to the next runnable thread, round robin
+void kthread_yield(void) {
+    if (live_threads == 0) return;
+
+    u32 next = current_thread;
+    do {
+        next = (next + 1) % (KTHREAD_MAX + 1);
+    } while (threads[next].state != KTHREAD_RUNNABLE);
+
+    if (next == current_thread) return;
+
+    u32 prev = current_thread;
+    current_thread = next;
+    threads[next].switches++;
+    kthread_switch(&threads[prev].esp, threads[next].esp);
+}
+
+// Called from code that may run for a while, such as file copies
+void kthread_preempt_point(void) {
+    if (current_thread != 0 && (interleave || need_resched)) {
+        need_resched = 0;
+        kthread_yield();
+    }
+}
+
+// Timer hook: ask the running worker to yield
+void kthread_tick(void) {
+    if (live_threads) need_resched = 1;
+}
+
+void kthread_set_interleave(int enable) {
+    interleave = enable != 0;
+}
+
+// Run the workers until all of them have returned, then free them
+void kthread_join(void) {
+    while (live_threads) {
+        kthread_yield();
+    }
+
+    for (u32 i = 1; i <= KTHREAD_MAX; i++) {
+        if (threads[i].state == KTHREAD_DONE) {
+            kfree(threads[i].stack);
+            threads[i].stack = NULL;
+            threads[i].state = KTHREAD_UNUSED;
+        }
+    }
+}
+
+// Current thread id; 0 outside of workers
+u32 kthread_self(void) {
+    return current_thread;
+}
+
+// Sleep until 'ready' holds, checking it again only after a wakeup on
+// 'wq'. Wakeups come from deferred work, which runs here since nothing
+// else would while we wait, and from interrupt handlers. Workers let
+// other threads run meanwhile; thread 0 halts until the next interrupt
+// (sti only takes effect after hlt, so no wakeup is missed). Returns -1
+// if a non-zero timeout passes first, 0 otherwise.
+int wait_event(wait_queue_t *wq, int (*ready)(void *arg), void *arg, u32 timeout_ms) {
+    u32 start = timer_get_ticks();
+    u32 timeout = (timeout_ms * timer_get_frequency() + 999) / 1000;
+
+    for (;;) {
+        u32 seen = wq->wakeups;
+        if (ready(arg)) return 0;
+
+        work_run();
+        while (wq->wakeups == seen) {
+            if (timeout && timer_get_ticks() - start >= timeout) return -1;
+            if (current_thread != 0) {
+                kthread_yield();
+            } else {
+                u32 irq = irq_save();
+                if (wq->wakeups == seen && !work_pending()) __asm__ volatile ("sti; hlt");
+                irq_restore(irq);
+            }
+            work_run();
+        }
+    }
+}
@@ -0,0 +1,145 @@
+#include "kernel.h"
+#include "lz4.h"
+
+// Block format limits: the last 5 bytes are always literals and the
+// last match starts at least 12 bytes before the end
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT       12
+#define LZ4_MAX_OFFSET    65535
+
+#define LZ4_HASH_BITS 12
+#define LZ4_HASH_SIZE (1 << LZ4_HASH_BITS)
+
+// Positions + 1 of recently seen 4-byte sequences; 0 means empty
+static u32 lz4_table[LZ4_HASH_SIZE];
+
+static inline u32 lz4_read32(const u8 *p) {
+    return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static inline u32 lz4_hash(u32 sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Emit one sequence: literals, then a match unless 'match_len' is 0
+static u8 *lz4_emit(u8 *op, u8 *oend, const u8 *literals, u32 lit_len,
+                    u32 offset, u32 match_len) {
+    // Worst case: token, length bytes, literals, offset, length bytes
+    u32 worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if (worst > (u32)(oend - op)) return NULL;
+
+    u8 *token = op++;
+    u32 ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+    *token = (u8)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+
+    if (lit_len >= 15) {
+        u32 len = lit_len - 15;
+        for (; len >= 255; len -= 255) *op++ = 255;
+        *op++ = (u8)len;
+    }
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len) {
+        *op++ = (u8)offset;
+        *op++ = (u8)(offset >> 8);
+        if (ml >= 15) {
+            u32 len = ml - 15;
+            for (; len >= 255; len -= 255) *op++ = 255;
+            *op++ = (u8)len;
+        }
+    }
+    return op;
+}
+
+u32 lz4_compress(const u8 *src, u32 src_len, u8 *dst, u32 dst_cap) {
+    u8 *op = dst;
+    u8 *oend = dst + dst_cap;
+    u32 anchor = 0;
+    u32 ip = 0;
+
+    memset(lz4_table, 0, sizeof(lz4_table));
+
+    while (ip + LZ4_MFLIMIT <= src_len) {
+        u32 sequence = lz4_read32(src + ip);
+        u32 h = lz4_hash(sequence);
+        u32 ref = lz4_table[h];
+        lz4_table[h] = ip + 1;
+
+        if (!ref || ip - (ref - 1) > LZ4_MAX_OFFSET || lz4_read32(src + ref - 1) != sequence) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        u32 match_len = LZ4_MIN_MATCH;
+        while (ip + match_len < src_len - LZ4_LAST_LITERALS &&
+               src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+
+        op = lz4_emit(op, oend, src + anchor, ip - anchor, ip - ref, match_len);
+        if (!op) return 0;
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = lz4_emit(op, oend, src + anchor, src_len - anchor, 0, 0);
+    if (!op) return 0;
+    return (u32)(op - dst);
+}
+
+int lz4_decompress(const u8 *src, u32 src_len, u8 *dst, u32 dst_cap) {
+    const u8 *ip = src;
+    const u8 *iend = src + src_len;
+    u8 *op = dst;
+    u8 *oend = dst + dst_cap;
+
+    while (ip < iend) {
+        u8 token = *ip++;
+
+        u32 lit_len = token >> 4;
+        if (lit_len == 15) {
+            u8 b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (lit_len > (u32)(iend - ip) || lit_len > (u32)(oend - op)) return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // The final sequence has no match part
+        if (ip >= iend) break;
+
+        if (iend - ip < 2) return -1;
+        u32 offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (u32)(op - dst)) return -1;
+
+        u32 match_len = token & 15;
+        if (match_len == 15) {
+            u8 b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (u32)(oend - op)) return -1;
+
+        // Matches may overlap their own output, so copy bytewise
+        const u8 *match = op - offset;
+        for (u32 i = 0; i < match_len; i++) {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+    return (int)(op - dst);
+}
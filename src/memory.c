@@ -1,5 +1,9 @@
 #include "kernel.h"
 #include "vga.h"
+#include "sync.h"
+
+// End of the kernel image, provided by the linker script
+extern u8 _kernel_end[];
 
 // Memory management structures
 static u32 *heap_start = (u32 *)HEAP_START;
@@ -15,12 +19,56 @@ typedef struct mem_block {
 
 static mem_block_t *first_block = NULL;
 
+// Serializes heap updates between kernel threads and interrupt handlers
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
 // Page directory and tables (simplified)
 static u32 page_directory[1024] __attribute__((aligned(4096)));
 static u32 page_table[1024] __attribute__((aligned(4096)));
 
+// Page tables for identity mapping regions above the first 4MB, such
+// as large boot modules. Each table covers another 4MB.
+#define EXTRA_PAGE_TABLES 8
+static u32 extra_page_tables[EXTRA_PAGE_TABLES][1024] __attribute__((aligned(4096)));
+static u32 extra_tables_used = 0;
+
+// Highest address used by the boot modules and their descriptors
+static u32 modules_end(struct multiboot_info *mbi) {
+    if (!(mbi->flags & (1 << 3)) || mbi->mods_count == 0) return 0;
+
+    struct multiboot_module *mods = (struct multiboot_module *)mbi->mods_addr;
+    u32 end = mbi->mods_addr + mbi->mods_count * sizeof(struct multiboot_module);
+    for (u32 i = 0; i < mbi->mods_count; i++) {
+        if (mods[i].mod_end > end) end = mods[i].mod_end;
+    }
+    return end;
+}
+
 // Initialize memory management
 void memory_init(struct multiboot_info *mbi) {
+    // Keep the heap clear of the kernel image, which is also loaded at 1MB
+    if ((u32)_kernel_end > (u32)heap_start) {
+        heap_start = (u32 *)(((u32)_kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    }
+
+    // Boot modules are placed after the kernel and are used in place,
+    // so the heap has to start beyond them too
+    u32 mods_end = modules_end(mbi);
+    if (mods_end > (u32)heap_start) {
+        heap_start = (u32 *)((mods_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    }
+
+    // Grow the heap into upper memory when the boot loader reports
+    // enough of it (mem_upper counts the KB above 1MB)
+    if (mbi->flags & 1) {
+        u32 upper_kb = mbi->mem_upper < 0x300000 ? mbi->mem_upper : 0x300000;
+        u32 memory_end = 0x100000 + upper_kb * 1024;
+        u32 available = memory_end > (u32)heap_start ? memory_end - (u32)heap_start : 0;
+        if (available > heap_size) {
+            heap_size = available < HEAP_MAX_SIZE ? available & ~(PAGE_SIZE - 1) : HEAP_MAX_SIZE;
+        }
+    }
+
     // Initialize heap
     first_block = (mem_block_t *)heap_start;
     first_block->size = heap_size - sizeof(mem_block_t);
@@ -38,6 +86,12 @@ void memory_init(struct multiboot_info *mbi) {
     }
     
     page_directory[0] = ((u32)page_table) | 3; // Present, writable
+
+    // The heap and the modules may extend past the first 4MB
+    memory_map_region((u32)heap_start, heap_size);
+    if (mods_end) {
+        memory_map_region(0, mods_end);
+    }
     
     // Load page directory
     __asm__ volatile("mov %0, %%cr3" :: "r"(&page_directory));
@@ -54,6 +108,56 @@ void memory_init(struct multiboot_info *mbi) {
                (u32)heap_start, heap_size / 1024);
 }
 
+// Identity map [start, start + size) with the given page flags. Page
+// tables for memory above the first 4MB come from a small static pool.
+static int memory_map_pages(u32 start, u32 size, u32 flags) {
+    u32 addr = start & ~(PAGE_SIZE - 1);
+    u32 end = start + size;
+
+    for (; addr < end; addr += PAGE_SIZE) {
+        u32 pde = addr >> 22;
+        if (!(page_directory[pde] & 1)) {
+            if (extra_tables_used >= EXTRA_PAGE_TABLES) return -1;
+            u32 *table = extra_page_tables[extra_tables_used++];
+            memset(table, 0, sizeof(extra_page_tables[0]));
+            page_directory[pde] = ((u32)table) | 3; // Present, writable
+        }
+
+        u32 *table = (u32 *)(page_directory[pde] & ~(PAGE_SIZE - 1));
+        table[(addr >> 12) & 0x3FF] = addr | flags;
+    }
+
+    // Reloading CR3 flushes stale translations
+    __asm__ volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" ::: "eax", "memory");
+    return 0;
+}
+
+int memory_map_region(u32 start, u32 size) {
+    return memory_map_pages(start, size, 3); // Present, writable
+}
+
+// Map device registers (a PCI memory BAR) uncached
+int memory_map_device(u32 start, u32 size) {
+    return memory_map_pages(start, size, 0x13); // Present, writable, cache disabled
+}
+
+// Mark a free block used, splitting off any remainder as a new free block
+static void *block_claim(mem_block_t *current, u32 size) {
+    // Split block if necessary
+    if (current->size > size + sizeof(mem_block_t)) {
+        mem_block_t *new_block = (mem_block_t *)((u8 *)current + sizeof(mem_block_t) + size);
+        new_block->size = current->size - size - sizeof(mem_block_t);
+        new_block->used = 0;
+        new_block->next = current->next;
+        current->next = new_block;
+        current->size = size;
+    }
+    
+    current->used = 1;
+    heap_used += current->size;
+    return (void *)((u8 *)current + sizeof(mem_block_t));
+}
+
 // Simple malloc implementation
 void *kmalloc(u32 size) {
     if (size == 0) return NULL;
@@ -61,34 +165,81 @@ void *kmalloc(u32 size) {
     // Align size to 4 bytes
     size = (size + 3) & ~3;
     
+    u32 flags = irq_save();
+    spin_lock(&heap_lock);
+
+    void *ptr = NULL;
     mem_block_t *current = first_block;
     
     while (current) {
         if (!current->used && current->size >= size) {
-            // Split block if necessary
-            if (current->size > size + sizeof(mem_block_t)) {
-                mem_block_t *new_block = (mem_block_t *)((u8 *)current + sizeof(mem_block_t) + size);
-                new_block->size = current->size - size - sizeof(mem_block_t);
-                new_block->used = 0;
-                new_block->next = current->next;
-                current->next = new_block;
-                current->size = size;
+            ptr = block_claim(current, size);
+            break;
+        }
+        current = current->next;
+    }
+    
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
+    return ptr; // NULL if out of memory
+}
+
+// Allocate memory aligned to 'align' bytes (a power of two). Used for DMA
+// structures that hardware requires at aligned physical addresses; the
+// heap is identity mapped, so the returned address is also physical.
+// The result is released with kfree as usual.
+void *kmalloc_aligned(u32 size, u32 align) {
+    if (size == 0) return NULL;
+    if (align < 4) align = 4;
+    
+    size = (size + 3) & ~3;
+    
+    u32 flags = irq_save();
+    spin_lock(&heap_lock);
+
+    void *ptr = NULL;
+    mem_block_t *current = first_block;
+    
+    while (current) {
+        if (!current->used) {
+            u32 data = (u32)current + sizeof(mem_block_t);
+            u32 aligned = (data + align - 1) & ~(align - 1);
+            
+            // A misaligned start needs room for a free block in front
+            while (aligned != data && aligned - data < sizeof(mem_block_t)) {
+                aligned += align;
             }
             
-            current->used = 1;
-            heap_used += size;
-            return (void *)((u8 *)current + sizeof(mem_block_t));
+            u32 lead = aligned - data;
+            if (current->size >= lead + size) {
+                if (lead) {
+                    mem_block_t *block = (mem_block_t *)(aligned - sizeof(mem_block_t));
+                    block->size = current->size - lead;
+                    block->used = 0;
+                    block->next = current->next;
+                    current->next = block;
+                    current->size = lead - sizeof(mem_block_t);
+                    current = block;
+                }
+                ptr = block_claim(current, size);
+                break;
+            }
         }
         current = current->next;
     }
     
-    return NULL; // Out of memory
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
+    return ptr; // NULL if out of memory
 }
 
 // Simple free implementation
 void kfree(void *ptr) {
     if (!ptr) return;
     
+    u32 flags = irq_save();
+    spin_lock(&heap_lock);
+
     mem_block_t *block = (mem_block_t *)((u8 *)ptr - sizeof(mem_block_t));
     block->used = 0;
     heap_used -= block->size;
@@ -109,6 +260,43 @@ void kfree(void *ptr) {
         current->size += sizeof(mem_block_t) + block->size;
         current->next = block->next;
     }
+
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
+}
+
+// Shrink an allocation in place, returning its tail to the heap
+void kshrink(void *ptr, u32 size) {
+    if (!ptr) return;
+
+    mem_block_t *block = (mem_block_t *)((u8 *)ptr - sizeof(mem_block_t));
+    size = (size + 3) & ~3;
+
+    u32 flags = irq_save();
+    spin_lock(&heap_lock);
+    if (block->size <= size + sizeof(mem_block_t)) {
+        spin_unlock(&heap_lock);
+        irq_restore(flags);
+        return;
+    }
+
+    mem_block_t *tail = (mem_block_t *)((u8 *)ptr + size);
+    tail->size = block->size - size - sizeof(mem_block_t);
+    tail->used = 0;
+    tail->next = block->next;
+
+    // Merge with next block if possible
+    if (tail->next && !tail->next->used) {
+        tail->size += sizeof(mem_block_t) + tail->next->size;
+        tail->next = tail->next->next;
+    }
+
+    heap_used -= block->size - size;
+    block->size = size;
+    block->next = tail;
+
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
 }
 
 // Get memory usage statistics
@@ -0,0 +1,151 @@
+#include "kernel.h"
+#include "vga.h"
+#include "io.h"
+#include "sync.h"
+#include "net.h"
+
+// Packet buffer pool. All buffers are allocated once at boot and kept
+// on a free list, so allocating and freeing never touch the heap and
+// are safe from interrupt handlers.
+
+static netbuf_t *pool = NULL;
+static netbuf_t *free_list = NULL;
+static u32 free_count = 0;
+
+// Statistics
+static u32 allocations = 0;
+static u32 alloc_failures = 0;
+static u32 min_free = NETBUF_POOL_SIZE;
+
+void netbuf_init(void) {
+    pool = (netbuf_t *)kmalloc_aligned(sizeof(netbuf_t) * NETBUF_POOL_SIZE, 64);
+    if (!pool) {
+        vga_printf("netbuf: cannot allocate the buffer pool\n");
+        return;
+    }
+
+    for (u32 i = 0; i < NETBUF_POOL_SIZE; i++) {
+        pool[i].refcount = 0;
+        pool[i].frag_count = 0;
+        pool[i].frag_len = 0;
+        pool[i].next = free_list;
+        free_list = &pool[i];
+    }
+    free_count = NETBUF_POOL_SIZE;
+    min_free = free_count;
+}
+
+// Drop the buffer's references to its fragments
+static void netbuf_release_frags(netbuf_t *nb) {
+    for (u32 i = 0; i < nb->frag_count; i++) {
+        nb->frags[i].release(nb->frags[i].owner);
+    }
+    nb->frag_count = 0;
+    nb->frag_len = 0;
+}
+
+// Empty the buffer, leaving the standard headroom in front
+void netbuf_reset(netbuf_t *nb) {
+    netbuf_release_frags(nb);
+    nb->data = nb->buffer + NETBUF_HEADROOM;
+    nb->len = 0;
+    nb->protocol = 0;
+    nb->flags = 0;
+    nb->iface = NULL;
+    nb->next = NULL;
+}
+
+// Take an empty buffer with one reference; NULL if the pool is empty
+netbuf_t *netbuf_alloc(void) {
+    u32 flags = irq_save();
+    netbuf_t *nb = free_list;
+    if (nb) {
+        free_list = nb->next;
+        free_count--;
+        if (free_count < min_free) min_free = free_count;
+        allocations++;
+    } else {
+        alloc_failures++;
+    }
+    irq_restore(flags);
+
+    if (nb) {
+        netbuf_reset(nb);
+        nb->refcount = 1;
+    }
+    return nb;
+}
+
+void netbuf_get(netbuf_t *nb) {
+    atomic_inc(&nb->refcount);
+}
+
+// Drop a reference, returning the buffer to the pool with the last one
+void netbuf_put(netbuf_t *nb) {
+    if (!nb || !atomic_dec_and_test(&nb->refcount)) return;
+
+    netbuf_release_frags(nb);
+    u32 flags = irq_save();
+    nb->next = free_list;
+    free_list = nb;
+    free_count++;
+    irq_restore(flags);
+}
+
+// Prepend 'len' bytes of header space; NULL if the headroom is used up
+u8 *netbuf_push(netbuf_t *nb, u32 len) {
+    if (len > netbuf_headroom(nb)) return NULL;
+    nb->data -= len;
+    nb->len += len;
+    return nb->data;
+}
+
+// Strip 'len' bytes from the front, returning the new start of data
+u8 *netbuf_pull(netbuf_t *nb, u32 len) {
+    if (len > nb->len) return NULL;
+    nb->data += len;
+    nb->len -= len;
+    return nb->data;
+}
+
+// Extend the data by 'len' bytes at the end, returning where they go
+u8 *netbuf_append(netbuf_t *nb, u32 len) {
+    if (len > netbuf_tailroom(nb)) return NULL;
+    u8 *tail = nb->data + nb->len;
+    nb->len += len;
+    return tail;
+}
+
+// Add 'len' bytes of outside memory to the end of the packet, taking
+// over the caller's reference on 'owner'. Fails, leaving the reference
+// with the caller, once the buffer has all the fragments it can take.
+int netbuf_attach(netbuf_t *nb, const u8 *data, u32 len, void *owner, void (*release)(void *owner)) {
+    if (nb->frag_count >= NETBUF_MAX_FRAGS) return -1;
+
+    netbuf_frag_t *frag = &nb->frags[nb->frag_count++];
+    frag->data = data;
+    frag->len = len;
+    frag->owner = owner;
+    frag->release = release;
+    nb->frag_len += len;
+    return 0;
+}
+
+// Copy the fragments into the buffer's tail room, for paths that need
+// the whole packet in one piece; -1 if they do not fit
+int netbuf_linearize(netbuf_t *nb) {
+    if (!nb->frag_count) return 0;
+    if (nb->frag_len > netbuf_tailroom(nb)) return -1;
+
+    for (u32 i = 0; i < nb->frag_count; i++) {
+        memcpy(nb->data + nb->len, nb->frags[i].data, nb->frags[i].len);
+        nb->len += nb->frags[i].len;
+    }
+    netbuf_release_frags(nb);
+    return 0;
+}
+
+void netbuf_stats(void) {
+    vga_printf("  Buffers: %u of %u free (low %u), %u allocations, %u failures\n",
+               free_count, NETBUF_POOL_SIZE, min_free, allocations, alloc_failures);
+}
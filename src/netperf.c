@@ -0,0 +1,336 @@
+#include "kernel.h"
+#include "vga.h"
+#include "net.h"
+#include "socket.h"
+#include "bench.h"
+
+// netperf: traffic generator and sink. The sender writes messages of a
+// fixed size, each starting with a sequence number and the TSC at the
+// moment it was sent, as fast as it can or paced to a rate. The
+// receiver counts them, finds losses and reordering from the sequence
+// numbers and, when both ends share this machine's TSC, takes one-way
+// latency from the timestamps. Over loopback the two ends run here as
+// kernel threads. Given a peer address only the sender runs, and
+// "netperf -l" on the peer runs only the receiver. A UDP datagram
+// carries one message; TCP carries them back to back on one stream.
+
+#define NETPERF_PORT       5002
+#define NETPERF_MAGIC      0x4E505246     // "NPRF"
+#define NETPERF_TCP_MAX    65536          // Largest TCP message
+#define NETPERF_COUNT_MAX  10000000
+#define NETPERF_SAMPLES    100000         // Latency samples kept
+#define NETPERF_BATCH      16             // Sends between running deferred work
+#define NETPERF_IDLE_MS    2000           // Receiver stops after this long without data
+#define NETPERF_WAIT_MS    60000          // ...or this long for the first message
+
+typedef struct netperf_msg {
+    u32 magic;
+    u32 seq;
+    u64 tsc;
+} netperf_msg_t;
+
+typedef struct netperf {
+    // Configuration
+    u8 tcp;
+    u8 local;          // Both ends here
+    u32 size;
+    u32 count;
+    u32 rate;          // Messages per second, 0 for no limit
+    u32 addr;
+    u16 port;
+
+    // Sender
+    int tx_fd;
+    u8 *tx_buf;
+    u32 sent;
+    u32 tx_errors;
+    u8 unreachable;    // Gave up: nothing could be sent for NETPERF_IDLE_MS
+    u64 tx_start;
+    u64 tx_end;
+    volatile u8 tx_done;
+
+    // Receiver
+    int listen_fd;
+    int rx_fd;
+    u8 *rx_buf;
+    u32 received;
+    u32 lost;          // Sequence numbers skipped
+    u32 reordered;     // Arrived after a later one
+    u32 bad;           // Not a netperf message
+    u32 socket_drops;  // Dropped by a full receive queue
+    u64 rx_first;
+    u64 rx_last;
+    bench_t latency;
+} netperf_t;
+
+static netperf_t perf;
+
+static void netperf_sender(void *arg) {
+    netperf_t *np = (netperf_t *)arg;
+    netperf_msg_t *msg = (netperf_msg_t *)np->tx_buf;
+    u32 interval = np->rate ? udiv64((u64)timer_tsc_khz() * 1000, np->rate) : 0;
+    u64 patience = (u64)timer_tsc_khz() * NETPERF_IDLE_MS;
+
+    if (np->tcp && network_connect(np->tx_fd, np->addr, np->port) != 0) {
+        np->tx_errors++;
+        np->tx_done = 1;
+        return;
+    }
+
+    np->tx_start = timer_read_tsc();
+    u64 last_sent = np->tx_start;
+    for (u32 i = 0; i < np->count; i++) {
+        // UDP sends never block, so nothing else runs the net-rx job
+        // (ARP replies among its packets) or lets the local receiver in
+        if (interval) {
+            u64 due = np->tx_start + (u64)i * interval;
+            while (timer_read_tsc() < due) {
+                work_run();
+                kthread_yield();
+            }
+        } else if (i % NETPERF_BATCH == 0) {
+            work_run();
+            kthread_yield();
+        }
+
+        msg->magic = NETPERF_MAGIC;
+        msg->seq = i;
+        msg->tsc = timer_read_tsc();
+        int result = network_sendto(np->tx_fd, np->tx_buf, np->size, 0, np->addr, np->port);
+
+        // A datagram fails while ARP already holds as many as it queues
+        // for the address, or the buffers run out; try again once the
+        // stack has caught up. If nothing at all has gone out for as long
+        // as a receiver would wait, the peer is not there.
+        while (!np->tcp && result != (int)np->size && timer_read_tsc() - last_sent < patience) {
+            work_run();
+            kthread_yield();
+            msg->tsc = timer_read_tsc();
+            result = network_sendto(np->tx_fd, np->tx_buf, np->size, 0, np->addr, np->port);
+        }
+        if (result == (int)np->size) {
+            np->sent++;
+            last_sent = timer_read_tsc();
+        } else {
+            np->tx_errors++;
+            if (!np->tcp) np->unreachable = 1;
+            break;   // The stream is gone, or the peer cannot be reached
+        }
+        kthread_preempt_point();
+    }
+    np->tx_end = timer_read_tsc();
+
+    // End of stream for the TCP receiver
+    if (np->tcp) {
+        network_close(np->tx_fd);
+        np->tx_fd = -1;
+    }
+    np->tx_done = 1;
+}
+
+static void netperf_count(netperf_t *np, const netperf_msg_t *msg, u32 len, u32 *expected) {
+    u64 now = timer_read_tsc();
+    if (len < sizeof(netperf_msg_t) || msg->magic != NETPERF_MAGIC) {
+        np->bad++;
+        return;
+    }
+
+    if (msg->seq >= *expected) {
+        np->lost += msg->seq - *expected;
+        *expected = msg->seq + 1;
+    } else {
+        np->reordered++;
+        if (np->lost) np->lost--;   // Counted as lost when it was skipped
+    }
+    if (!np->received) np->rx_first = now;
+    np->rx_last = now;
+    np->received++;
+    if (np->local) bench_record(&np->latency, now - msg->tsc);
+}
+
+// Count messages until the sender is done, 'count' have arrived or the
+// line goes quiet
+static void netperf_receiver(void *arg) {
+    netperf_t *np = (netperf_t *)arg;
+    u32 expected = 0;
+    u32 have = 0;   // TCP: bytes of the current message so far
+
+    if (np->tcp) {
+        np->rx_fd = network_accept(np->listen_fd, NULL, NULL);
+        if (np->rx_fd < 0) return;
+    }
+
+    while (np->received + np->lost < np->count) {
+        network_setsockopt(np->rx_fd, SO_RCVTIMEO, np->received ? NETPERF_IDLE_MS : NETPERF_WAIT_MS);
+        int flags = np->local && np->tx_done ? MSG_DONTWAIT : 0;
+        int len = np->tcp ? np->size - have : UDP_MAX_PAYLOAD;
+        u16 port;
+        u32 addr;
+        int result = network_recvfrom(np->rx_fd, np->rx_buf + have, len, flags, &addr, &port);
+        if (result <= 0) break;   // End of stream, quiet, or nothing left
+
+        if (!np->tcp) {
+            netperf_count(np, (netperf_msg_t *)np->rx_buf, result, &expected);
+        } else if ((have += result) == np->size) {
+            netperf_count(np, (netperf_msg_t *)np->rx_buf, have, &expected);
+            have = 0;
+        }
+    }
+
+    if (!np->tcp) np->socket_drops = socket_get(np->rx_fd)->rx_drops;
+}
+
+// Rates over 'us': messages per second and kbit/s of payload
+static void netperf_rates(u32 messages, u32 size, u32 us, u32 *pps, u32 *kbps) {
+    *pps = us ? udiv64((u64)messages * 1000000, us) : 0;
+    *kbps = us ? udiv64((u64)messages * size * 8000, us) : 0;
+}
+
+static void netperf_report(netperf_t *np, int sender, int receiver, int machine) {
+    const char *proto = np->tcp ? "tcp" : "udp";
+    u32 pps, kbps;
+
+    if (sender) {
+        u32 us = timer_cycles_to_us(np->tx_end - np->tx_start);
+        netperf_rates(np->sent, np->size, us, &pps, &kbps);
+        if (machine) {
+            vga_printf("BENCH suite=netperf op=%s-send sent=%u errors=%u unreachable=%u total_us=%u "
+                       "pps=%u kbit_per_sec=%u\n", proto, np->sent, np->tx_errors, np->unreachable,
+                       us, pps, kbps);
+        } else {
+            vga_printf("sender:   %u sent, %u errors in %u us: %u pps, %u.%03u Gbit/s\n",
+                       np->sent, np->tx_errors, us, pps, kbps / 1000000, kbps / 1000 % 1000);
+            if (np->unreachable) {
+                vga_printf("sender:   stopped, nothing could be sent for %u ms (peer unreachable?)\n",
+                           NETPERF_IDLE_MS);
+            }
+        }
+    }
+    if (!receiver) return;
+
+    // Losses at the end of the run show up only against what was sent
+    u32 dropped = np->lost;
+    if (np->local && np->sent > np->received + np->lost) dropped = np->sent - np->received;
+    u32 us = timer_cycles_to_us(np->rx_last - np->rx_first);
+    netperf_rates(np->received, np->size, us, &pps, &kbps);
+    u32 p50 = bench_percentile(&np->latency, 50);
+    u32 p90 = bench_percentile(&np->latency, 90);
+    u32 p99 = bench_percentile(&np->latency, 99);
+    u32 max = bench_percentile(&np->latency, 100);
+
+    if (machine) {
+        vga_printf("BENCH suite=netperf op=%s-recv received=%u dropped=%u socket_drops=%u "
+                   "reordered=%u bad=%u total_us=%u pps=%u kbit_per_sec=%u",
+                   proto, np->received, dropped, np->socket_drops, np->reordered, np->bad,
+                   us, pps, kbps);
+        if (np->local) {
+            vga_printf(" p50_ns=%u p90_ns=%u p99_ns=%u max_ns=%u", p50, p90, p99, max);
+        }
+        vga_printf("\n");
+    } else {
+        vga_printf("receiver: %u received, %u dropped (%u by the socket queue), %u reordered, "
+                   "%u bad in %u us: %u pps, %u.%03u Gbit/s\n",
+                   np->received, dropped, np->socket_drops, np->reordered, np->bad,
+                   us, pps, kbps / 1000000, kbps / 1000 % 1000);
+        if (np->local) {
+            vga_printf("latency:  p50 %u ns, p90 %u ns, p99 %u ns, max %u ns\n", p50, p90, p99, max);
+        }
+    }
+}
+
+static void netperf_print_rate(u32 rate) {
+    if (rate) {
+        vga_printf("%u/s", rate);
+    } else {
+        vga_printf("unlimited");
+    }
+}
+
+// Send 'count' messages of 'size' bytes to addr:port, 0 for loopback,
+// at 'rate' per second (0 for as fast as possible); with 'receive' set,
+// count them here instead of sending (addr is then ignored)
+void netperf_run(int tcp, u32 size, u32 count, u32 rate, u32 addr, u16 port, int receive, int machine) {
+    netperf_t *np = &perf;
+    memset(np, 0, sizeof(netperf_t));
+    np->tcp = tcp != 0;
+    np->local = !receive && (!addr || ip_is_local(addr));
+    np->addr = addr ? addr : IP_LOOPBACK;
+    np->port = port ? port : NETPERF_PORT;
+    np->count = count < 1 ? 1 : count > NETPERF_COUNT_MAX ? NETPERF_COUNT_MAX : count;
+    np->rate = rate;
+    u32 max_size = tcp ? NETPERF_TCP_MAX : UDP_MAX_PAYLOAD;
+    np->size = size < sizeof(netperf_msg_t) ? sizeof(netperf_msg_t) : size > max_size ? max_size : size;
+    np->tx_fd = np->rx_fd = np->listen_fd = -1;
+
+    int sender = !receive;
+    int receiver = receive || np->local;
+    int type = tcp ? SOCK_STREAM : SOCK_DGRAM;
+    int result = 0;
+
+    if (sender) {
+        np->tx_buf = (u8 *)kmalloc(np->size);
+        np->tx_fd = network_socket(AF_INET, type, 0);
+        if (!np->tx_buf) result = -NET_ENOMEM;
+        else if (np->tx_fd < 0) result = np->tx_fd;
+        else network_setsockopt(np->tx_fd, SO_SNDTIMEO, NETPERF_IDLE_MS);
+        for (u32 i = sizeof(netperf_msg_t); result == 0 && i < np->size; i++) {
+            np->tx_buf[i] = (u8)i;
+        }
+    }
+    if (result == 0 && receiver) {
+        u32 samples = np->count < NETPERF_SAMPLES ? np->count : NETPERF_SAMPLES;
+        np->rx_buf = (u8 *)kmalloc(tcp ? np->size : UDP_MAX_PAYLOAD);
+        int fd = network_socket(AF_INET, type, 0);
+        if (!np->rx_buf || bench_init(&np->latency, "netperf", "latency", samples) != 0) {
+            result = -NET_ENOMEM;
+        } else if (fd < 0) {
+            result = fd;
+        } else {
+            if (tcp) {
+                np->listen_fd = fd;
+                network_setsockopt(fd, SO_RCVTIMEO, np->local ? NETPERF_IDLE_MS : NETPERF_WAIT_MS);
+            } else {
+                np->rx_fd = fd;
+                network_setsockopt(fd, SO_RCVBUF, SOCKET_RCVBUF_MAX);
+            }
+            result = network_bind(fd, 0, np->port);
+            if (result == 0 && tcp) result = network_listen(fd, 1);
+        }
+    }
+    if (result != 0) {
+        vga_printf("netperf: Cannot set up sockets (error %d)\n", -result);
+        goto out;
+    }
+
+    u32 ip = np->addr;
+    if (machine) {
+        vga_printf("BENCH-CONFIG suite=netperf proto=%s mode=%s peer=%d.%d.%d.%d:%u size=%u "
+                   "count=%u rate=%u tsc_khz=%u\n", tcp ? "tcp" : "udp",
+                   receive ? "receive" : np->local ? "loopback" : "send",
+                   (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF,
+                   np->port, np->size, np->count, np->rate, timer_tsc_khz());
+    } else if (receive) {
+        vga_printf("netperf: waiting for %s messages on port %u\n", tcp ? "tcp" : "udp", np->port);
+    } else {
+        vga_printf("netperf: %u %s messages of %u bytes to %d.%d.%d.%d:%u, rate ",
+                   np->count, tcp ? "tcp" : "udp", np->size,
+                   (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, np->port);
+        netperf_print_rate(np->rate);
+        vga_printf("\n");
+    }
+
+    if ((receiver && kthread_create(netperf_receiver, np) < 0) ||
+        (sender && kthread_create(netperf_sender, np) < 0)) {
+        vga_printf("netperf: Cannot start threads\n");
+    }
+    kthread_join();
+    netperf_report(np, sender, receiver, machine);
+
+out:
+    bench_free(&np->latency);
+    if (np->tx_fd >= 0) network_close(np->tx_fd);
+    if (np->rx_fd >= 0) network_close(np->rx_fd);
+    if (np->listen_fd >= 0) network_close(np->listen_fd);
+    if (np->tx_buf) kfree(np->tx_buf);
+    if (np->rx_buf) kfree(np->rx_buf);
+}
@@ -0,0 +1,323 @@
+#include "kernel.h"
+#include "vga.h"
+#include "block.h"
+
+// Cache page flags
+#define PAGE_VALID     0x01
+#define PAGE_LOCKED    0x02  // I/O in flight
+#define PAGE_ERROR     0x04
+#define PAGE_READAHEAD 0x08  // Brought in by readahead, not yet used
+
+// A cached 4KB page of a block device
+typedef struct cache_page {
+    block_device_t *dev;
+    u32 index;  // Page number on the device
+    u8 *data;
+    volatile u32 flags;
+    u32 pincount;
+    struct cache_page *hash_next;
+    struct cache_page *lru_prev;
+    struct cache_page *lru_next;
+    block_request_t req;
+} cache_page_t;
+
+static cache_page_t cache_pages[PAGECACHE_PAGES];
+static cache_page_t *cache_hash[PAGECACHE_HASH];
+
+// LRU list: head is most recently used, tail is the eviction candidate
+static cache_page_t *lru_head = NULL;
+static cache_page_t *lru_tail = NULL;
+
+// Statistics
+static u32 cache_hits = 0;
+static u32 cache_misses = 0;
+static u32 cache_evictions = 0;
+static u32 readahead_pages = 0;
+static u32 readahead_hits = 0;
+
+static u32 pagecache_hash(block_device_t *dev, u32 index) {
+    return (((u32)dev >> 4) ^ (index * 2654435761u)) % PAGECACHE_HASH;
+}
+
+static void lru_unlink(cache_page_t *page) {
+    if (page->lru_prev) page->lru_prev->lru_next = page->lru_next;
+    else lru_head = page->lru_next;
+    if (page->lru_next) page->lru_next->lru_prev = page->lru_prev;
+    else lru_tail = page->lru_prev;
+    page->lru_prev = NULL;
+    page->lru_next = NULL;
+}
+
+static void lru_push_head(cache_page_t *page) {
+    page->lru_prev = NULL;
+    page->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = page;
+    lru_head = page;
+    if (!lru_tail) lru_tail = page;
+}
+
+static void hash_insert(cache_page_t *page) {
+    u32 bucket = pagecache_hash(page->dev, page->index);
+    page->hash_next = cache_hash[bucket];
+    cache_hash[bucket] = page;
+}
+
+static void hash_remove(cache_page_t *page) {
+    cache_page_t **link = &cache_hash[pagecache_hash(page->dev, page->index)];
+    while (*link) {
+        if (*link == page) {
+            *link = page->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    page->hash_next = NULL;
+}
+
+static cache_page_t *hash_lookup(block_device_t *dev, u32 index) {
+    cache_page_t *page = cache_hash[pagecache_hash(dev, index)];
+    while (page) {
+        if (page->dev == dev && page->index == index) return page;
+        page = page->hash_next;
+    }
+    return NULL;
+}
+
+// Initialize the page cache
+void pagecache_init(void) {
+    memset(cache_pages, 0, sizeof(cache_pages));
+    memset(cache_hash, 0, sizeof(cache_hash));
+    lru_head = NULL;
+    lru_tail = NULL;
+
+    for (u32 i = 0; i < PAGECACHE_PAGES; i++) {
+        cache_pages[i].data = (u8 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+        if (!cache_pages[i].data) break;
+        lru_push_head(&cache_pages[i]);
+    }
+}
+
+// Take the least recently used idle page out of the cache
+static cache_page_t *pagecache_evict(void) {
+    for (cache_page_t *page = lru_tail; page; page = page->lru_prev) {
+        if (page->pincount == 0 && !(page->flags & PAGE_LOCKED)) {
+            if (page->dev) {
+                hash_remove(page);
+                if (page->flags & PAGE_VALID) cache_evictions++;
+            }
+            page->dev = NULL;
+            page->flags = 0;
+            return page;
+        }
+    }
+    return NULL;
+}
+
+// Read completion, called from the driver's interrupt handler
+static void pagecache_read_done(block_request_t *req) {
+    cache_page_t *page = (cache_page_t *)req->private;
+    u32 flags = page->flags & ~PAGE_LOCKED;
+    page->flags = req->status == BLOCK_REQ_DONE ? flags | PAGE_VALID : flags | PAGE_ERROR;
+}
+
+// Start reading a page from its device
+static int pagecache_start_read(cache_page_t *page) {
+    block_device_t *dev = page->dev;
+    u32 lba = page->index * PAGECACHE_SECTORS;
+    u32 count = dev->sector_count - lba;
+    if (count > PAGECACHE_SECTORS) count = PAGECACHE_SECTORS;
+
+    // The tail of the last page on the device reads as zeros
+    if (count < PAGECACHE_SECTORS) {
+        memset(page->data, 0, PAGE_SIZE);
+    }
+
+    memset(&page->req, 0, sizeof(block_request_t));
+    page->req.dev = dev;
+    page->req.lba = lba;
+    page->req.count = count;
+    page->req.buffer = page->data;
+    page->req.done = pagecache_read_done;
+    page->req.private = page;
+
+    page->flags |= PAGE_LOCKED;
+    if (block_submit(&page->req) != 0) {
+        page->flags = PAGE_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+// Issue asynchronous reads for the pages after a sequential access. The
+// window doubles on each sequential hit up to PAGECACHE_RA_MAX pages.
+static void pagecache_readahead(block_device_t *dev, u32 index) {
+    if (index == dev->ra_last + 1) {
+        dev->ra_window = dev->ra_window ? dev->ra_window * 2 : 2;
+        if (dev->ra_window > PAGECACHE_RA_MAX) dev->ra_window = PAGECACHE_RA_MAX;
+    } else {
+        dev->ra_window = 0;
+        dev->ra_next = index + 1;
+    }
+    dev->ra_last = index;
+
+    u32 last_page = (dev->sector_count - 1) / PAGECACHE_SECTORS;
+    u32 start = dev->ra_next > index + 1 ? dev->ra_next : index + 1;
+    u32 end = index + dev->ra_window;
+    if (end > last_page) end = last_page;
+
+    // Plug the queue so adjacent pages merge into few large requests
+    block_plug(dev);
+    for (u32 i = start; i <= end && dev->ra_window; i++) {
+        dev->ra_next = i + 1;
+        if (hash_lookup(dev, i)) continue;
+
+        cache_page_t *page = pagecache_evict();
+        if (!page) break;
+
+        page->dev = dev;
+        page->index = i;
+        page->flags = PAGE_READAHEAD;
+        hash_insert(page);
+        lru_unlink(page);
+        lru_push_head(page);
+
+        if (pagecache_start_read(page) != 0) break;
+        readahead_pages++;
+    }
+    block_unplug(dev);
+}
+
+// Get a pinned, up-to-date page. Release it with pagecache_put.
+cache_page_t *pagecache_get(block_device_t *dev, u32 index) {
+    cache_page_t *page = hash_lookup(dev, index);
+
+    if (page) {
+        cache_hits++;
+        if (page->flags & PAGE_READAHEAD) {
+            page->flags &= ~PAGE_READAHEAD;
+            readahead_hits++;
+        }
+    } else {
+        cache_misses++;
+        page = pagecache_evict();
+        if (!page) return NULL;
+
+        page->dev = dev;
+        page->index = index;
+        hash_insert(page);
+        if (pagecache_start_read(page) != 0) {
+            hash_remove(page);
+            page->dev = NULL;
+            return NULL;
+        }
+    }
+
+    lru_unlink(page);
+    lru_push_head(page);
+    page->pincount++;
+
+    pagecache_readahead(dev, index);
+
+    if (page->flags & PAGE_LOCKED) {
+        block_wait(&page->req);
+    }
+    if (!(page->flags & PAGE_VALID)) {
+        // Drop failed pages so the next access retries the read
+        page->pincount--;
+        hash_remove(page);
+        page->dev = NULL;
+        page->flags = 0;
+        return NULL;
+    }
+    return page;
+}
+
+void pagecache_put(cache_page_t *page) {
+    page->pincount--;
+}
+
+// Contents of a pinned page
+u8 *pagecache_data(cache_page_t *page) {
+    return page->data;
+}
+
+// Read bytes from a device through the cache
+int pagecache_read(block_device_t *dev, u32 offset, void *buffer, u32 size) {
+    u8 *dst = (u8 *)buffer;
+    u32 done = 0;
+
+    while (done < size) {
+        u32 index = (offset + done) / PAGE_SIZE;
+        u32 page_offset = (offset + done) % PAGE_SIZE;
+        u32 chunk = PAGE_SIZE - page_offset;
+        if (chunk > size - done) chunk = size - done;
+
+        cache_page_t *page = pagecache_get(dev, index);
+        if (!page) return done ? (int)done : -1;
+
+        memcpy(dst + done, page->data + page_offset, chunk);
+        pagecache_put(page);
+        done += chunk;
+    }
+    return done;
+}
+
+// Write bytes to a device through the cache (write-through)
+int pagecache_write(block_device_t *dev, u32 offset, const void *buffer, u32 size) {
+    const u8 *src = (const u8 *)buffer;
+    u32 done = 0;
+
+    while (done < size) {
+        u32 index = (offset + done) / PAGE_SIZE;
+        u32 page_offset = (offset + done) % PAGE_SIZE;
+        u32 chunk = PAGE_SIZE - page_offset;
+        if (chunk > size - done) chunk = size - done;
+
+        cache_page_t *page = pagecache_get(dev, index);
+        if (!page) return done ? (int)done : -1;
+
+        memcpy(page->data + page_offset, src + done, chunk);
+
+        // Write back only the sectors that changed
+        u32 first = page_offset / BLOCK_SECTOR_SIZE;
+        u32 last = (page_offset + chunk - 1) / BLOCK_SECTOR_SIZE;
+        int result = block_write(dev, index * PAGECACHE_SECTORS + first, last - first + 1,
+                                 page->data + first * BLOCK_SECTOR_SIZE);
+        pagecache_put(page);
+        if (result != 0) return done ? (int)done : -1;
+
+        done += chunk;
+    }
+    return done;
+}
+
+// Drop every idle cached page of a device
+void pagecache_invalidate(block_device_t *dev) {
+    for (u32 i = 0; i < PAGECACHE_PAGES; i++) {
+        cache_page_t *page = &cache_pages[i];
+        if (page->dev == dev && page->pincount == 0 && !(page->flags & PAGE_LOCKED)) {
+            hash_remove(page);
+            page->dev = NULL;
+            page->flags = 0;
+        }
+    }
+    dev->ra_last = 0xFFFFFFFF;
+    dev->ra_window = 0;
+}
+
+// Display page cache statistics
+void pagecache_stats(void) {
+    u32 cached = 0;
+    for (u32 i = 0; i < PAGECACHE_PAGES; i++) {
+        if (cache_pages[i].dev && (cache_pages[i].flags & PAGE_VALID)) cached++;
+    }
+
+    u32 lookups = cache_hits + cache_misses;
+    vga_printf("Page Cache Statistics:\n");
+    vga_printf("  Pages: %d / %d cached\n", cached, PAGECACHE_PAGES);
+    vga_printf("  Hits: %d\n", cache_hits);
+    vga_printf("  Misses: %d\n", cache_misses);
+    vga_printf("  Hit rate: %d%%\n", lookups ? cache_hits * 100 / lookups : 0);
+    vga_printf("  Evictions: %d\n", cache_evictions);
+    vga_printf("  Readahead: %d pages, %d used\n", readahead_pages, readahead_hits);
+}
@@ -0,0 +1,149 @@
+#include "kernel.h"
+#include "vga.h"
+#include "io.h"
+#include "pci.h"
+
+// Devices found by the bus scan
+static pci_device_t pci_devices[PCI_MAX_DEVICES];
+static u32 pci_device_count = 0;
+
+// Build a configuration address for bus/slot/function/register
+static u32 pci_address(u8 bus, u8 slot, u8 func, u8 offset) {
+    return 0x80000000 | ((u32)bus << 16) | ((u32)slot << 11) |
+           ((u32)func << 8) | (offset & 0xFC);
+}
+
+static u32 pci_read(u8 bus, u8 slot, u8 func, u8 offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+u32 pci_config_read(pci_device_t *dev, u8 offset) {
+    return pci_read(dev->bus, dev->slot, dev->func, offset);
+}
+
+u16 pci_config_read16(pci_device_t *dev, u8 offset) {
+    return (u16)(pci_config_read(dev, offset) >> ((offset & 2) * 8));
+}
+
+void pci_config_write(pci_device_t *dev, u8 offset, u32 value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev->bus, dev->slot, dev->func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_config_write16(pci_device_t *dev, u8 offset, u16 value) {
+    u32 shift = (offset & 2) * 8;
+    u32 dword = pci_config_read(dev, offset);
+    dword = (dword & ~(0xFFFF << shift)) | ((u32)value << shift);
+    pci_config_write(dev, offset, dword);
+}
+
+// Record one function in the device table
+static void pci_add_device(u8 bus, u8 slot, u8 func) {
+    if (pci_device_count >= PCI_MAX_DEVICES) return;
+
+    pci_device_t *dev = &pci_devices[pci_device_count++];
+    u32 id = pci_read(bus, slot, func, PCI_VENDOR_ID);
+    u32 class_reg = pci_read(bus, slot, func, 0x08);
+
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    dev->vendor_id = id & 0xFFFF;
+    dev->device_id = id >> 16;
+    dev->class_code = class_reg >> 24;
+    dev->subclass = (class_reg >> 16) & 0xFF;
+    dev->prog_if = (class_reg >> 8) & 0xFF;
+    dev->irq_line = pci_read(bus, slot, func, PCI_INTERRUPT_LINE) & 0xFF;
+    for (int i = 0; i < 6; i++) {
+        dev->bar[i] = pci_read(bus, slot, func, PCI_BAR0 + i * 4);
+    }
+}
+
+// Scan every bus/slot/function for devices
+void pci_init(void) {
+    pci_device_count = 0;
+    memset(pci_devices, 0, sizeof(pci_devices));
+
+    for (u32 bus = 0; bus < 256; bus++) {
+        for (u8 slot = 0; slot < 32; slot++) {
+            if ((pci_read(bus, slot, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) continue;
+
+            u8 header = (pci_read(bus, slot, 0, 0x0C) >> 16) & 0xFF;
+            u8 funcs = (header & 0x80) ? 8 : 1;
+            for (u8 func = 0; func < funcs; func++) {
+                if ((pci_read(bus, slot, func, PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF) {
+                    pci_add_device(bus, slot, func);
+                }
+            }
+        }
+    }
+
+    vga_printf("PCI bus scan found %d devices\n", pci_device_count);
+}
+
+// Find the first device of a class/subclass
+pci_device_t *pci_find_class(u8 class_code, u8 subclass) {
+    for (u32 i = 0; i < pci_device_count; i++) {
+        if (pci_devices[i].class_code == class_code && pci_devices[i].subclass == subclass) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Find the first device with a vendor/device ID
+pci_device_t *pci_find_device(u16 vendor_id, u16 device_id) {
+    for (u32 i = 0; i < pci_device_count; i++) {
+        if (pci_devices[i].vendor_id == vendor_id && pci_devices[i].device_id == device_id) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+int pci_bar_is_io(pci_device_t *dev, int bar) {
+    return dev->bar[bar] & 1;
+}
+
+// BAR base address with the type bits masked off
+u32 pci_bar_address(pci_device_t *dev, int bar) {
+    if (pci_bar_is_io(dev, bar)) {
+        return dev->bar[bar] & ~0x3;
+    }
+    return dev->bar[bar] & ~0xF;
+}
+
+// Enable I/O, memory and bus mastering so the device can do DMA
+void pci_enable_bus_master(pci_device_t *dev) {
+    u16 command = pci_config_read16(dev, PCI_COMMAND);
+    command |= PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+    pci_config_write16(dev, PCI_COMMAND, command);
+}
+
+// Human-readable name for common device classes
+static const char *pci_class_name(pci_device_t *dev) {
+    switch (dev->class_code) {
+        case 0x01:
+            if (dev->subclass == 0x01) return "IDE controller";
+            return "Storage controller";
+        case 0x02: return "Network controller";
+        case 0x03: return "Display controller";
+        case 0x06: return "Bridge";
+        default: return "Other";
+    }
+}
+
+// List devices found by the bus scan
+void pci_list_devices(void) {
+    vga_printf("PCI Devices:\n");
+    vga_printf("Bus:Slot.Fn\tVendor\tDevice\tIRQ\tClass\n");
+    vga_printf("-----------\t------\t------\t---\t-----\n");
+
+    for (u32 i = 0; i < pci_device_count; i++) {
+        pci_device_t *dev = &pci_devices[i];
+        vga_printf("%d:%d.%d\t\t%x\t%x\t%d\t%s\n", dev->bus, dev->slot, dev->func,
+                   dev->vendor_id, dev->device_id, dev->irq_line, pci_class_name(dev));
+    }
+    vga_printf("Total: %d devices\n", pci_device_count);
+}
@@ -0,0 +1,159 @@
+#include "kernel.h"
+#include "vga.h"
+#include "poll.h"
+#include "socket.h"
+
+// Pipes: a circular buffer from a write end to a read end. Reads wait
+// while the pipe is empty and a writer remains, and return 0 once none
+// does; writes wait while it is full, and fail with EPIPE once no reader
+// remains. MSG_DONTWAIT makes either call return EAGAIN instead of
+// waiting. Each end has its own poll head, so readers sleep on one and
+// writers on the other. Descriptors come in pairs from PIPE_FD_BASE, the
+// read end first.
+
+#define MAX_PIPES     64
+#define PIPE_FD_BASE  128
+#define PIPE_BUF_SIZE 4096   // Power of two
+
+#define PIPE_READ  0
+#define PIPE_WRITE 1
+
+typedef struct pipe {
+    u8 used;
+    u8 open[2];
+    u8 *buf;
+    u32 head;                // Oldest byte
+    u32 len;
+    poll_head_t poll[2];
+} pipe_t;
+
+static pipe_t pipes[MAX_PIPES];
+
+// The pipe behind a descriptor, and which end it is
+static pipe_t *pipe_get(int fd, int *end) {
+    if (fd < PIPE_FD_BASE || fd >= PIPE_FD_BASE + 2 * MAX_PIPES) return NULL;
+    pipe_t *pipe = &pipes[(fd - PIPE_FD_BASE) / 2];
+    *end = (fd - PIPE_FD_BASE) % 2;
+    return pipe->used && pipe->open[*end] ? pipe : NULL;
+}
+
+int pipe_create(int fds[2]) {
+    for (int i = 0; i < MAX_PIPES; i++) {
+        pipe_t *pipe = &pipes[i];
+        if (pipe->used) continue;
+
+        memset(pipe, 0, sizeof(pipe_t));
+        pipe->buf = (u8 *)kmalloc(PIPE_BUF_SIZE);
+        if (!pipe->buf) return -NET_ENOMEM;
+        pipe->used = 1;
+        pipe->open[PIPE_READ] = 1;
+        pipe->open[PIPE_WRITE] = 1;
+        fds[0] = PIPE_FD_BASE + 2 * i;
+        fds[1] = fds[0] + 1;
+        return 0;
+    }
+    return -NET_EMFILE;
+}
+
+static u32 pipe_events(pipe_t *pipe, int end) {
+    if (end == PIPE_READ) {
+        return (pipe->len ? POLLIN : 0) | (pipe->open[PIPE_WRITE] ? 0 : POLLIN | POLLHUP);
+    }
+    if (!pipe->open[PIPE_READ]) return POLLERR;
+    return pipe->len < PIPE_BUF_SIZE ? POLLOUT : 0;
+}
+
+// The poll head and current events of a pipe end; NULL if the descriptor
+// is not one
+poll_head_t *pipe_poll(int fd, u32 *events) {
+    int end;
+    pipe_t *pipe = pipe_get(fd, &end);
+    if (!pipe) return NULL;
+    *events = pipe_events(pipe, end);
+    return &pipe->poll[end];
+}
+
+static int pipe_readable(void *arg) {
+    pipe_t *pipe = (pipe_t *)arg;
+    return !pipe->open[PIPE_READ] || pipe_events(pipe, PIPE_READ);
+}
+
+static int pipe_writable(void *arg) {
+    pipe_t *pipe = (pipe_t *)arg;
+    return !pipe->open[PIPE_WRITE] || pipe_events(pipe, PIPE_WRITE);
+}
+
+int pipe_read(int fd, void *buf, u32 len, int flags) {
+    int end;
+    pipe_t *pipe = pipe_get(fd, &end);
+    if (!pipe || end != PIPE_READ) return -NET_EBADF;
+    if (!len) return 0;
+
+    if (!pipe_events(pipe, PIPE_READ)) {
+        if (flags & MSG_DONTWAIT) return -NET_EAGAIN;
+        wait_event(&pipe->poll[PIPE_READ].wait, pipe_readable, pipe, 0);
+        if (!pipe->open[PIPE_READ]) return -NET_EBADF;  // Closed by another thread
+    }
+
+    u32 count = len < pipe->len ? len : pipe->len;  // 0 at end of stream
+    u32 first = count < PIPE_BUF_SIZE - pipe->head ? count : PIPE_BUF_SIZE - pipe->head;
+    memcpy(buf, pipe->buf + pipe->head, first);
+    memcpy((u8 *)buf + first, pipe->buf, count - first);
+    pipe->head = (pipe->head + count) & (PIPE_BUF_SIZE - 1);
+    pipe->len -= count;
+
+    if (count) poll_wake(&pipe->poll[PIPE_WRITE], POLLOUT);
+    return count;
+}
+
+// Blocking writes return once everything is in the pipe; non-blocking
+// ones take what fits
+int pipe_write(int fd, const void *buf, u32 len, int flags) {
+    int end;
+    pipe_t *pipe = pipe_get(fd, &end);
+    if (!pipe || end != PIPE_WRITE) return -NET_EBADF;
+
+    u32 written = 0;
+    while (written < len) {
+        if (!pipe_events(pipe, PIPE_WRITE)) {
+            if (flags & MSG_DONTWAIT) return written ? (int)written : -NET_EAGAIN;
+            wait_event(&pipe->poll[PIPE_WRITE].wait, pipe_writable, pipe, 0);
+            if (!pipe->open[PIPE_WRITE]) return written ? (int)written : -NET_EBADF;
+        }
+        if (!pipe->open[PIPE_READ]) return written ? (int)written : -NET_EPIPE;
+
+        u32 tail = (pipe->head + pipe->len) & (PIPE_BUF_SIZE - 1);
+        u32 count = len - written;
+        if (count > PIPE_BUF_SIZE - pipe->len) count = PIPE_BUF_SIZE - pipe->len;
+        u32 first = count < PIPE_BUF_SIZE - tail ? count : PIPE_BUF_SIZE - tail;
+        memcpy(pipe->buf + tail, (const u8 *)buf + written, first);
+        memcpy(pipe->buf, (const u8 *)buf + written + first, count - first);
+        pipe->len += count;
+        written += count;
+        poll_wake(&pipe->poll[PIPE_READ], POLLIN);
+    }
+    return written;
+}
+
+// Close one end; the other sees end of stream or EPIPE. The pipe goes
+// once both ends are closed.
+int pipe_close(int fd) {
+    int end;
+    pipe_t *pipe = pipe_get(fd, &end);
+    if (!pipe) return -NET_EBADF;
+
+    pipe->open[end] = 0;
+    poll_release(&pipe->poll[end]);
+    if (end == PIPE_WRITE) {
+        poll_wake(&pipe->poll[PIPE_READ], POLLIN | POLLHUP);
+    } else {
+        poll_wake(&pipe->poll[PIPE_WRITE], POLLERR);
+    }
+
+    if (!pipe->open[PIPE_READ] && !pipe->open[PIPE_WRITE]) {
+        kfree(pipe->buf);
+        pipe->buf = NULL;
+        pipe->used = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,341 @@
+#include "kernel.h"
+#include "vga.h"
+#include "net.h"
+#include "bench.h"
+
+// IPv4 routing table: a path-compressed binary trie keyed by prefix.
+// Every node is either a route or a branch point where two subtrees
+// part ways, so the trie has fewer than two nodes per route and its
+// depth is bounded by both 33 and the number of routes on one path.
+// A lookup walks down from the root, remembering the last node that
+// carried a route: that is the longest matching prefix.
+
+typedef struct route_node {
+    u32 prefix;                  // Masked to 'bits'
+    u8 bits;                     // Prefix length
+    u8 has_route;
+    u32 gateway;                 // 0 for directly connected routes
+    network_interface_t *iface;
+    u32 uses;
+    struct route_node *child[2]; // By the bit after the prefix
+} route_node_t;
+
+// The root is the /0 node and always exists; it holds the default route
+static route_node_t route_root;
+static u32 route_count = 0;
+static u32 node_count = 1;
+
+static inline u32 route_mask(u32 bits) {
+    return bits ? 0xFFFFFFFF << (32 - bits) : 0;
+}
+
+// Bit 'index' counted from the most significant end
+static inline u32 route_bit(u32 key, u32 index) {
+    return (key >> (31 - index)) & 1;
+}
+
+u32 route_mask_len(u32 netmask) {
+    u32 bits = 0;
+    while (bits < 32 && (netmask & (0x80000000 >> bits))) bits++;
+    return bits;
+}
+
+static route_node_t *route_new_node(u32 prefix, u32 bits) {
+    route_node_t *node = (route_node_t *)kmalloc(sizeof(route_node_t));
+    if (!node) return NULL;
+    memset(node, 0, sizeof(route_node_t));
+    node->prefix = prefix;
+    node->bits = bits;
+    node_count++;
+    return node;
+}
+
+static void route_free_node(route_node_t *node) {
+    kfree(node);
+    node_count--;
+}
+
+// Add a route; returns -1 if it already exists or memory runs out
+int route_add(u32 prefix, u32 bits, u32 gateway, network_interface_t *iface) {
+    if (bits > 32 || !iface) return -1;
+    prefix &= route_mask(bits);
+
+    route_node_t *node = &route_root;
+    while (node->bits != bits) {
+        route_node_t **link = &node->child[route_bit(prefix, node->bits)];
+        route_node_t *child = *link;
+
+        if (!child) {
+            child = route_new_node(prefix, bits);
+            if (!child) return -1;
+            *link = child;
+            node = child;
+            break;
+        }
+
+        // How far the new prefix and the child's agree
+        u32 limit = bits < child->bits ? bits : child->bits;
+        u32 diff = prefix ^ child->prefix;
+        u32 common = diff ? (u32)__builtin_clz(diff) : 32;
+        if (common > limit) common = limit;
+
+        if (common == child->bits) {
+            node = child;  // The child is a prefix of the new route
+            continue;
+        }
+
+        // Split the edge: a new node at the common prefix takes the child
+        // and, unless it is the new route itself, the new route as well
+        route_node_t *split = route_new_node(prefix & route_mask(common), common);
+        if (!split) return -1;
+        split->child[route_bit(child->prefix, common)] = child;
+        *link = split;
+        if (common == bits) {
+            node = split;
+        } else {
+            node = route_new_node(prefix, bits);
+            if (!node) return -1;  // The split node stays, harmlessly
+            split->child[route_bit(prefix, common)] = node;
+        }
+        break;
+    }
+
+    if (node->has_route) return -1;
+    node->has_route = 1;
+    node->gateway = gateway;
+    node->iface = iface;
+    node->uses = 0;
+    route_count++;
+    return 0;
+}
+
+// Remove nodes that no longer carry a route or separate two subtrees
+static void route_compress(route_node_t **link) {
+    route_node_t *node = *link;
+    if (node->has_route) return;
+
+    if (!node->child[0] || !node->child[1]) {
+        *link = node->child[0] ? node->child[0] : node->child[1];
+        route_free_node(node);
+    }
+}
+
+static int route_remove(route_node_t **link, u32 prefix, u32 bits) {
+    route_node_t *node = *link;
+    if (!node || node->bits > bits || ((prefix ^ node->prefix) & route_mask(node->bits))) {
+        return -1;
+    }
+
+    if (node->bits == bits) {
+        if (!node->has_route) return -1;
+        node->has_route = 0;
+        route_count--;
+    } else if (route_remove(&node->child[route_bit(prefix, node->bits)], prefix, bits) != 0) {
+        return -1;
+    }
+
+    route_compress(link);
+    return 0;
+}
+
+int route_delete(u32 prefix, u32 bits) {
+    if (bits > 32) return -1;
+    prefix &= route_mask(bits);
+
+    if (bits == 0) {
+        if (!route_root.has_route) return -1;
+        route_root.has_route = 0;
+        route_count--;
+        return 0;
+    }
+
+    // The root is never compressed away, so start below it
+    return route_remove(&route_root.child[route_bit(prefix, 0)], prefix, bits);
+}
+
+// Longest prefix holding 'dst'; with 'up_only', the longest whose
+// interface is up, so a route over a downed interface falls back to a
+// shorter one such as the default
+static route_node_t *route_find(u32 dst, int up_only) {
+    route_node_t *best = NULL;
+    route_node_t *node = &route_root;
+
+    while (node && !((dst ^ node->prefix) & route_mask(node->bits))) {
+        if (node->has_route && (!up_only || node->iface->active)) best = node;
+        if (node->bits == 32) break;
+        node = node->child[route_bit(dst, node->bits)];
+    }
+    return best;
+}
+
+// Longest-prefix match over interfaces that are up: the interface for
+// 'dst', with the gateway (or 'dst' itself on a connected network) as
+// the next hop
+network_interface_t *route_lookup(u32 dst, u32 *next_hop) {
+    route_node_t *route = route_find(dst, 1);
+    if (!route) return NULL;
+
+    route->uses++;
+    *next_hop = route->gateway ? route->gateway : dst;
+    return route->iface;
+}
+
+static void route_print_ip(u32 ip) {
+    vga_printf("%d.%d.%d.%d", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+}
+
+// In-order walk, so shorter prefixes come before the ones they contain
+static void route_print(route_node_t *node) {
+    if (!node) return;
+
+    if (node->has_route) {
+        route_print_ip(node->prefix);
+        vga_printf("/%u\t", node->bits);
+        if (node->bits < 16) vga_printf("\t");
+        if (node->gateway) {
+            route_print_ip(node->gateway);
+        } else {
+            vga_printf("*\t");
+        }
+        vga_printf("\t%s\t%u\n", node->iface->name, node->uses);
+    }
+    route_print(node->child[0]);
+    route_print(node->child[1]);
+}
+
+void route_list(void) {
+    vga_printf("Destination\t\tGateway\t\tIface\tUses\n");
+    route_print(&route_root);
+    vga_printf("%u routes, %u trie nodes\n", route_count, node_count);
+}
+
+// Benchmark: lookups against a large table, compared with a linear scan
+// of the same routes. The benchmark routes come from 198.18.0.0/15, the
+// range set aside for network benchmarks, so they cannot collide with
+// real ones; lengths vary from /16 to /28.
+
+#define ROUTE_BENCH_MAX     16384
+#define ROUTE_BENCH_LOOKUPS 4096
+#define ROUTE_BENCH_NET     0xC6120000  // 198.18.0.0
+#define ROUTE_BENCH_BITS    15
+
+typedef struct route_bench_entry {
+    u32 prefix;
+    u8 bits;
+    u8 added;
+} route_bench_entry_t;
+
+static u32 route_bench_seed;
+
+static u32 route_bench_random(void) {
+    route_bench_seed = route_bench_seed * 1103515245 + 12345;
+    return route_bench_seed;
+}
+
+static u32 route_bench_address(void) {
+    u32 random = (route_bench_random() >> 8) ^ (route_bench_random() << 8);
+    return ROUTE_BENCH_NET | (random & ~route_mask(ROUTE_BENCH_BITS));
+}
+
+// The longest match by brute force, as a table without an index would
+static int route_linear_find(route_bench_entry_t *entries, u32 count, u32 dst) {
+    int best = -1;
+    for (u32 i = 0; i < count; i++) {
+        if (entries[i].added && !((dst ^ entries[i].prefix) & route_mask(entries[i].bits)) &&
+            (best < 0 || entries[i].bits > entries[best].bits)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void route_bench(u32 count, int machine) {
+    if (count < 1) count = 1;
+    if (count > ROUTE_BENCH_MAX) count = ROUTE_BENCH_MAX;
+
+    network_interface_t *iface = network_interface_at(0);
+    route_bench_entry_t *entries = (route_bench_entry_t *)kmalloc(sizeof(route_bench_entry_t) * count);
+    u32 *addresses = (u32 *)kmalloc(sizeof(u32) * ROUTE_BENCH_LOOKUPS);
+
+    bench_t insert, lookup, linear, del;
+    bench_t *results[] = { &insert, &lookup, &linear, &del };
+    u32 result_count = sizeof(results) / sizeof(results[0]);
+    for (u32 i = 0; i < result_count; i++) {
+        memset(results[i], 0, sizeof(bench_t));
+    }
+
+    int ok = entries && addresses;
+    ok = ok && bench_init(&insert, "route", "insert", count) == 0;
+    ok = ok && bench_init(&lookup, "route", "lookup", ROUTE_BENCH_LOOKUPS) == 0;
+    ok = ok && bench_init(&linear, "route", "linear", ROUTE_BENCH_LOOKUPS) == 0;
+    ok = ok && bench_init(&del, "route", "delete", count) == 0;
+    if (!ok) {
+        vga_printf("route: Out of memory\n");
+        for (u32 i = 0; i < result_count; i++) {
+            bench_free(results[i]);
+        }
+        if (entries) kfree(entries);
+        if (addresses) kfree(addresses);
+        return;
+    }
+
+    route_bench_seed = 0x2545F491;
+    for (u32 i = 0; i < count; i++) {
+        entries[i].bits = 16 + route_bench_random() % 13;
+        entries[i].prefix = route_bench_address() & route_mask(entries[i].bits);
+    }
+    for (u32 i = 0; i < ROUTE_BENCH_LOOKUPS; i++) {
+        addresses[i] = route_bench_address();
+    }
+
+    if (machine) {
+        vga_printf("BENCH-CONFIG suite=route routes=%u lookups=%u tsc_khz=%u\n",
+                   count, ROUTE_BENCH_LOOKUPS, timer_tsc_khz());
+    } else {
+        vga_printf("route bench: %u routes, %u lookups, TSC %u MHz\n",
+                   count, ROUTE_BENCH_LOOKUPS, timer_tsc_khz() / 1000);
+    }
+    bench_header(machine);
+
+    // Random prefixes repeat now and then; duplicates count as errors
+    for (u32 i = 0; i < count; i++) {
+        bench_begin(&insert);
+        int result = route_add(entries[i].prefix, entries[i].bits, 0, iface);
+        bench_end(&insert);
+        entries[i].added = result == 0;
+        if (result != 0) insert.errors++;
+    }
+
+    // Both methods must agree on the prefix length of every match
+    for (u32 i = 0; i < ROUTE_BENCH_LOOKUPS; i++) {
+        bench_begin(&lookup);
+        route_node_t *route = route_find(addresses[i], 0);
+        bench_end(&lookup);
+
+        bench_begin(&linear);
+        int best = route_linear_find(entries, count, addresses[i]);
+        bench_end(&linear);
+
+        // A miss in the benchmark routes falls through to a real route
+        // of at most /15
+        u32 trie_bits = route && route->bits > ROUTE_BENCH_BITS ? route->bits : 0;
+        u32 linear_bits = best >= 0 ? entries[best].bits : 0;
+        if (trie_bits != linear_bits) lookup.errors++;
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        if (!entries[i].added) continue;
+        bench_begin(&del);
+        int result = route_delete(entries[i].prefix, entries[i].bits);
+        bench_end(&del);
+        if (result != 0) del.errors++;
+    }
+
+    for (u32 i = 0; i < result_count; i++) {
+        bench_report(results[i], machine);
+        bench_free(results[i]);
+    }
+    if (!machine) vga_printf("%u routes, %u trie nodes remain\n", route_count, node_count);
+    kfree(entries);
+    kfree(addresses);
+}
@@ -0,0 +1,52 @@
+#include "kernel.h"
+#include "io.h"
+
+// COM1, 115200 baud 8N1, written by polling. Nothing reads from it and
+// the kernel console stays on VGA, so the port carries only what is
+// written to it on purpose (packet captures) and can be sent straight
+// to a file on the host.
+
+#define COM1          0x3F8
+#define UART_DATA     0
+#define UART_IER      1
+#define UART_DIVISOR  0      // With DLAB set
+#define UART_FCR      2
+#define UART_LCR      3
+#define UART_MCR      4
+#define UART_LSR      5
+
+#define UART_LCR_DLAB 0x80
+#define UART_LCR_8N1  0x03
+#define UART_MCR_LOOP 0x10
+#define UART_LSR_THRE 0x20   // Transmit holding register empty
+
+static u8 serial_found = 0;
+
+void serial_init(void) {
+    outb(COM1 + UART_IER, 0x00);              // No interrupts
+    outb(COM1 + UART_LCR, UART_LCR_DLAB);
+    outb(COM1 + UART_DIVISOR, 1);             // 115200 baud
+    outb(COM1 + UART_DIVISOR + 1, 0);
+    outb(COM1 + UART_LCR, UART_LCR_8N1);
+    outb(COM1 + UART_FCR, 0xC7);              // FIFOs on and cleared
+
+    // A UART in loopback mode reads back what it sends; without one
+    // the port floats
+    outb(COM1 + UART_MCR, UART_MCR_LOOP | 0x0E);
+    outb(COM1 + UART_DATA, 0xAE);
+    serial_found = inb(COM1 + UART_DATA) == 0xAE;
+    outb(COM1 + UART_MCR, 0x0F);              // Normal mode, DTR and RTS
+}
+
+int serial_present(void) {
+    return serial_found;
+}
+
+void serial_write(const void *data, u32 len) {
+    const u8 *bytes = (const u8 *)data;
+    if (!serial_found) return;
+    for (u32 i = 0; i < len; i++) {
+        while (!(inb(COM1 + UART_LSR) & UART_LSR_THRE));
+        outb(COM1 + UART_DATA, bytes[i]);
+    }
+}
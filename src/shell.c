@@ -1,5 +1,10 @@
 #include "kernel.h"
 #include "vga.h"
+#include "block.h"
+#include "pci.h"
+#include "ext2.h"
+#include "net.h"
+#include "socket.h"
 
 // Shell state
 static int shell_running = 1;
@@ -24,6 +29,16 @@ void cmd_uptime(int argc, char **argv);
 void cmd_ifconfig(int argc, char **argv);
 void cmd_ping(int argc, char **argv);
 void cmd_netstat(int argc, char **argv);
+void cmd_nettx(int argc, char **argv);
+void cmd_netpoll(int argc, char **argv);
+void cmd_arp(int argc, char **argv);
+void cmd_route(int argc, char **argv);
+void cmd_capture(int argc, char **argv);
+void cmd_udpbench(int argc, char **argv);
+void cmd_tcpbench(int argc, char **argv);
+void cmd_netperf(int argc, char **argv);
+void cmd_epollbench(int argc, char **argv);
+void cmd_csumbench(int argc, char **argv);
 void cmd_exit(int argc, char **argv);
 void cmd_reboot(int argc, char **argv);
 void cmd_about(int argc, char **argv);
@@ -35,6 +50,19 @@ void cmd_date(int argc, char **argv);
 void cmd_calc(int argc, char **argv);
 void cmd_whoami(int argc, char **argv);
 void cmd_edit(int argc, char **argv);
+void cmd_lsblk(int argc, char **argv);
+void cmd_cachestat(int argc, char **argv);
+void cmd_fsstat(int argc, char **argv);
+void cmd_compress(int argc, char **argv);
+void cmd_append(int argc, char **argv);
+void cmd_logmode(int argc, char **argv);
+void cmd_work(int argc, char **argv);
+void cmd_fsstress(int argc, char **argv);
+void cmd_fsbench(int argc, char **argv);
+void cmd_blkread(int argc, char **argv);
+void cmd_lspci(int argc, char **argv);
+void cmd_mount(int argc, char **argv);
+void cmd_umount(int argc, char **argv);
 
 // Command table
 static command_t commands[] = {
@@ -52,10 +80,33 @@ static command_t commands[] = {
     {"calc", "Basic calculator", cmd_calc},
     {"whoami", "Show current user", cmd_whoami},
     {"edit", "Simple text editor", cmd_edit},
+    {"lsblk", "List block devices", cmd_lsblk},
+    {"cachestat", "Show page cache statistics", cmd_cachestat},
+    {"fsstat", "Show file system statistics", cmd_fsstat},
+    {"compress", "Configure cold file compression", cmd_compress},
+    {"append", "Append a line to a file", cmd_append},
+    {"logmode", "Switch a file to log-structured mode", cmd_logmode},
+    {"work", "List background jobs", cmd_work},
+    {"fsstress", "Stress the file system from several threads", cmd_fsstress},
+    {"fsbench", "Benchmark file system operations", cmd_fsbench},
+    {"blkread", "Dump bytes from a block device", cmd_blkread},
+    {"lspci", "List PCI devices", cmd_lspci},
+    {"mount", "Mount an ext2 volume at /", cmd_mount},
+    {"umount", "Unmount the ext2 volume", cmd_umount},
     {"uptime", "Show system uptime", cmd_uptime},
     {"ifconfig", "Show network interfaces", cmd_ifconfig},
     {"ping", "Ping an IP address", cmd_ping},
     {"netstat", "Show network statistics", cmd_netstat},
+    {"nettx", "Measure transmit throughput", cmd_nettx},
+    {"netpoll", "Show or tune receive polling", cmd_netpoll},
+    {"arp", "Show the ARP cache", cmd_arp},
+    {"route", "Show or change the routing table", cmd_route},
+    {"capture", "Capture packets and dump them as pcap over serial", cmd_capture},
+    {"udpbench", "Benchmark UDP over loopback", cmd_udpbench},
+    {"tcpbench", "Benchmark a TCP bulk transfer", cmd_tcpbench},
+    {"netperf", "Generate UDP or TCP traffic and measure it", cmd_netperf},
+    {"epollbench", "Benchmark epoll waits against watched count", cmd_epollbench},
+    {"csumbench", "Benchmark the Internet checksum", cmd_csumbench},
     {"exit", "Exit the shell", cmd_exit},
     {"reboot", "Reboot the system", cmd_reboot},
     {"about", "About this kernel", cmd_about},
@@ -75,7 +126,7 @@ extern void list_processes(void);
 extern u32 timer_get_uptime(void);
 extern void network_list_interfaces(void);
 extern void network_stats(void);
-extern int network_ping(u32 target_ip);
+extern int network_ping(u32 target_ip, u32 count);
 extern void network_test_receive(void);
 
 // Parse command line into argc/argv
@@ -135,8 +186,14 @@ void cmd_meminfo(int argc, char **argv) {
 }
 
 void cmd_ls(int argc, char **argv) {
-    (void)argc; (void)argv;
-    fs_list_files();
+    if (argc < 2) {
+        fs_list_files();
+        return;
+    }
+    
+    if (fs_list_dir(argv[1]) != 0) {
+        vga_printf("ls: cannot access '%s': No such directory\n", argv[1]);
+    }
 }
 
 void cmd_cat(int argc, char **argv) {
@@ -171,14 +228,13 @@ void cmd_ifconfig(int argc, char **argv) {
 }
 
 void cmd_ping(int argc, char **argv) {
-    if (argc < 2) {
-        vga_puts("Usage: ping <ip_address>\n");
+    u32 ip;
+    if (argc < 2 || net_parse_ip(argv[1], &ip) != 0) {
+        vga_puts("Usage: ping <ip_address> [count]\n");
         return;
     }
-    
-    // Simple IP parsing (assume 192.168.0.1 format)
-    u32 ip = 0xC0A80001; // Default to 192.168.0.1
-    network_ping(ip);
+    u32 count = argc >= 3 ? (u32)simple_atoi(argv[2]) : 4;
+    network_ping(ip, count);
 }
 
 void cmd_netstat(int argc, char **argv) {
@@ -186,6 +242,266 @@ void cmd_netstat(int argc, char **argv) {
     network_stats();
 }
 
+void cmd_nettx(int argc, char **argv) {
+    if (argc < 2) {
+        vga_puts("Usage: nettx <interface> [frames] [size]\n");
+        return;
+    }
+    u32 count = argc >= 3 ? (u32)simple_atoi(argv[2]) : 10000;
+    u32 size = argc >= 4 ? (u32)simple_atoi(argv[3]) : NET_ETH_FRAME_MAX;
+    network_tx_test(argv[1], count, size);
+}
+
+void cmd_netpoll(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "budget") == 0) {
+        network_set_rx_budget((u32)simple_atoi(argv[2]));
+    } else if (argc >= 3 && strcmp(argv[1], "coalesce") == 0) {
+        network_set_rx_coalesce((u32)simple_atoi(argv[2]));
+    } else if (argc >= 2) {
+        vga_puts("Usage: netpoll [budget <frames> | coalesce <usecs>]\n");
+        return;
+    }
+    network_poll_stats();
+}
+
+void cmd_arp(int argc, char **argv) {
+    (void)argc; (void)argv;
+    arp_list();
+}
+
+// Parse "a.b.c.d/len"; a bare address is a /32
+static int parse_prefix(char *str, u32 *prefix, u32 *bits) {
+    char *slash = str;
+    while (*slash && *slash != '/') slash++;
+
+    *bits = 32;
+    if (*slash) {
+        *slash = '\0';
+        *bits = (u32)simple_atoi(slash + 1);
+        if (*bits > 32) return -1;
+    }
+    return net_parse_ip(str, prefix);
+}
+
+static void route_usage(void) {
+    vga_puts("Usage: route [add <net>/<len> [via <gateway>] [dev <iface>] | del <net>/<len> |\n"
+             "              get <address> | bench [routes] [-m]]\n");
+}
+
+void cmd_route(int argc, char **argv) {
+    if (argc < 2) {
+        route_list();
+        return;
+    }
+
+    u32 prefix, bits, next_hop;
+    if (strcmp(argv[1], "add") == 0 && argc >= 3 && parse_prefix(argv[2], &prefix, &bits) == 0) {
+        u32 gateway = 0;
+        network_interface_t *iface = NULL;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "via") == 0 && net_parse_ip(argv[i + 1], &gateway) != 0) {
+                route_usage();
+                return;
+            }
+            if (strcmp(argv[i], "dev") == 0 && !(iface = network_get_interface(argv[i + 1]))) {
+                vga_printf("route: %s: No such device\n", argv[i + 1]);
+                return;
+            }
+        }
+        // Without a device, use the one that reaches the gateway
+        if (!iface && gateway) iface = route_lookup(gateway, &next_hop);
+        if (!iface) {
+            vga_puts("route: Network is unreachable\n");
+        } else if (route_add(prefix, bits, gateway, iface) != 0) {
+            vga_puts("route: Route exists or out of memory\n");
+        }
+    } else if (strcmp(argv[1], "del") == 0 && argc >= 3 && parse_prefix(argv[2], &prefix, &bits) == 0) {
+        if (route_delete(prefix, bits) != 0) vga_puts("route: No such route\n");
+    } else if (strcmp(argv[1], "get") == 0 && argc >= 3 && net_parse_ip(argv[2], &prefix) == 0) {
+        network_interface_t *iface = route_lookup(prefix, &next_hop);
+        if (!iface) {
+            vga_puts("route: Network is unreachable\n");
+            return;
+        }
+        vga_printf("%s via %d.%d.%d.%d dev %s\n", argv[2],
+                   (next_hop >> 24) & 0xFF, (next_hop >> 16) & 0xFF,
+                   (next_hop >> 8) & 0xFF, next_hop & 0xFF, iface->name);
+    } else if (strcmp(argv[1], "bench") == 0) {
+        u32 count = 4096;
+        int machine = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-m") == 0) {
+                machine = 1;
+            } else {
+                count = (u32)simple_atoi(argv[i]);
+            }
+        }
+        route_bench(count, machine);
+    } else {
+        route_usage();
+    }
+}
+
+static void capture_usage(void) {
+    vga_puts("Usage: capture [start [-s snaplen] [-i iface] [filter...] | stop | dump | filter]\n"
+             "  filter: [src|dst] host <ip>, [src|dst] port <n>, ip, arp, icmp, tcp, udp; all must match\n");
+}
+
+void cmd_capture(int argc, char **argv) {
+    if (argc < 2) {
+        capture_status();
+        return;
+    }
+
+    if (strcmp(argv[1], "start") == 0) {
+        u32 snaplen = 128;
+        network_interface_t *iface = NULL;
+        int i = 2;
+        for (; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "-s") == 0) {
+                snaplen = (u32)simple_atoi(argv[i + 1]);
+            } else if (strcmp(argv[i], "-i") == 0) {
+                if (!(iface = network_get_interface(argv[i + 1]))) {
+                    vga_printf("capture: %s: No such device\n", argv[i + 1]);
+                    return;
+                }
+            } else {
+                break;
+            }
+        }
+        int result = capture_start(iface, snaplen, argc - i, argv + i);
+        if (result == -NET_ENOMEM) {
+            vga_puts("capture: Out of memory\n");
+        } else if (result != 0) {
+            capture_usage();
+        }
+    } else if (strcmp(argv[1], "stop") == 0) {
+        capture_stop();
+        capture_status();
+    } else if (strcmp(argv[1], "dump") == 0) {
+        int result = capture_dump();
+        if (result == -NET_ENODEV) {
+            vga_puts("capture: No serial port\n");
+        } else {
+            vga_printf("capture: %d frames written to COM1\n", result);
+        }
+    } else if (strcmp(argv[1], "filter") == 0) {
+        capture_print_filter();
+    } else {
+        capture_usage();
+    }
+}
+
+void cmd_udpbench(int argc, char **argv) {
+    u32 values[2] = { 10000, 64 };  // Datagrams, payload bytes
+    u32 count = 0;
+    int machine = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            machine = 1;
+        } else if (count < 2) {
+            values[count++] = (u32)simple_atoi(argv[i]);
+        }
+    }
+    udp_bench(values[0], values[1], machine);
+}
+
+// Over loopback unless given a peer to send to; with -f, a file is sent
+// with sendfile instead of a pattern with send
+void cmd_tcpbench(int argc, char **argv) {
+    u32 kbytes = 4096;
+    u32 addr = 0;
+    u32 port = 9;  // Discard
+    u32 count = 0;
+    const char *file = NULL;
+    int machine = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            machine = 1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            file = argv[++i];
+        } else if (count == 0) {
+            kbytes = (u32)simple_atoi(argv[i]);
+            count++;
+        } else if (count == 1) {
+            if (net_parse_ip(argv[i], &addr) != 0) {
+                vga_puts("Usage: tcpbench [kbytes] [ip [port]] [-f file] [-m]\n");
+                return;
+            }
+            count++;
+        } else if (count == 2) {
+            port = (u32)simple_atoi(argv[i]);
+            count++;
+        }
+    }
+    tcp_bench(kbytes, addr, (u16)port, file, machine);
+}
+
+// Over loopback unless given a peer; -l receives what a peer sends
+void cmd_netperf(int argc, char **argv) {
+    int tcp = 0;
+    u32 size = 64;
+    u32 count = 100000;
+    u32 rate = 0;   // Unlimited
+    u32 port = 0;   // Default
+    u32 addr = 0;
+    int receive = 0;
+    int machine = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-u") == 0) {
+            tcp = 0;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            tcp = 1;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            receive = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            machine = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            size = (u32)simple_atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = (u32)simple_atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rate = (u32)simple_atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = (u32)simple_atoi(argv[++i]);
+        } else if (addr == 0 && net_parse_ip(argv[i], &addr) == 0) {
+            continue;
+        } else {
+            vga_puts("Usage: netperf [-u|-t] [-s bytes] [-n count] [-r pps] [-p port] [-m] [ip | -l]\n");
+            return;
+        }
+    }
+    netperf_run(tcp, size, count, rate, addr, (u16)port, receive, machine);
+}
+
+void cmd_epollbench(int argc, char **argv) {
+    u32 values[2] = { 32, 10000 };  // Pipes watched, waits
+    u32 count = 0;
+    int machine = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            machine = 1;
+        } else if (count < 2) {
+            values[count++] = (u32)simple_atoi(argv[i]);
+        }
+    }
+    epoll_bench(values[0], values[1], machine);
+}
+
+void cmd_csumbench(int argc, char **argv) {
+    u32 values[2] = { 1500, 10000 };  // Bytes, iterations
+    u32 count = 0;
+    int machine = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            machine = 1;
+        } else if (count < 2) {
+            values[count++] = (u32)simple_atoi(argv[i]);
+        }
+    }
+    checksum_bench(values[0], values[1], machine);
+}
+
 void cmd_exit(int argc, char **argv) {
     (void)argc; (void)argv;
     shell_running = 0;
@@ -289,17 +605,14 @@ void cmd_cp(int argc, char **argv) {
         return;
     }
     
-    char buffer[4096];
-    int result = fs_read_file(argv[1], buffer, sizeof(buffer));
-    if (result >= 0) {
-        int write_result = fs_create_file(argv[2], buffer, result);
-        if (write_result == 0) {
-            vga_printf("'%s' copied to '%s'\n", argv[1], argv[2]);
-        } else {
-            vga_printf("cp: cannot create '%s'\n", argv[2]);
-        }
-    } else {
+    // Copy-on-write clone: the copy shares the source's data pages
+    int result = fs_clone_file(argv[1], argv[2]);
+    if (result == 0) {
+        vga_printf("'%s' copied to '%s'\n", argv[1], argv[2]);
+    } else if (result == -1) {
         vga_printf("cp: cannot access '%s': No such file\n", argv[1]);
+    } else {
+        vga_printf("cp: cannot create '%s'\n", argv[2]);
     }
 }
 
@@ -425,6 +738,171 @@ void cmd_edit(int argc, char **argv) {
     }
 }
 
+void cmd_lsblk(int argc, char **argv) {
+    (void)argc; (void)argv;
+    block_list_devices();
+}
+
+void cmd_lspci(int argc, char **argv) {
+    (void)argc; (void)argv;
+    pci_list_devices();
+}
+
+void cmd_mount(int argc, char **argv) {
+    if (argc < 2) {
+        ext2_stats();
+        return;
+    }
+    
+    block_device_t *dev = block_get(argv[1]);
+    if (!dev) {
+        vga_printf("mount: %s: No such device\n", argv[1]);
+        return;
+    }
+    
+    int result = ext2_mount(dev);
+    if (result == -2) {
+        vga_printf("mount: %s: Not an ext2 volume\n", argv[1]);
+    } else if (result == -5) {
+        vga_printf("mount: %s: Corrupt superblock\n", argv[1]);
+    } else if (result != 0) {
+        vga_printf("mount: %s: Cannot mount\n", argv[1]);
+    }
+}
+
+void cmd_umount(int argc, char **argv) {
+    (void)argc; (void)argv;
+    ext2_unmount();
+    vga_puts("Volume unmounted\n");
+}
+
+void cmd_cachestat(int argc, char **argv) {
+    (void)argc; (void)argv;
+    pagecache_stats();
+}
+
+void cmd_fsstat(int argc, char **argv) {
+    (void)argc; (void)argv;
+    fs_stats();
+}
+
+void cmd_compress(int argc, char **argv) {
+    if (argc < 2) {
+        vga_printf("Compression interval: %d s (0 = off)\n", fs_get_compress_interval());
+        vga_puts("Usage: compress interval <seconds> | now | <file> on|off\n");
+        return;
+    }
+
+    if (strcmp(argv[1], "now") == 0) {
+        fs_compress_now();
+        fs_stats();
+    } else if (strcmp(argv[1], "interval") == 0 && argc >= 3) {
+        fs_set_compress_interval((u32)simple_atoi(argv[2]));
+        vga_printf("Compression interval set to %d s\n", fs_get_compress_interval());
+    } else if (argc >= 3 && (strcmp(argv[2], "on") == 0 || strcmp(argv[2], "off") == 0)) {
+        if (fs_set_compression(argv[1], strcmp(argv[2], "on") == 0) != 0) {
+            vga_printf("compress: %s: No such file\n", argv[1]);
+        }
+    } else {
+        vga_puts("Usage: compress interval <seconds> | now | <file> on|off\n");
+    }
+}
+
+void cmd_append(int argc, char **argv) {
+    if (argc < 3) {
+        vga_puts("Usage: append <file> <text...>\n");
+        return;
+    }
+
+    // Join the words into one line, as echo prints them
+    char line[256];
+    line[0] = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strlen(line) + strlen(argv[i]) + 2 >= sizeof(line)) break;
+        strcat(line, argv[i]);
+        strcat(line, i < argc - 1 ? " " : "\n");
+    }
+
+    if (fs_append(argv[1], line, strlen(line)) != 0) {
+        vga_printf("append: %s: Cannot append\n", argv[1]);
+    }
+}
+
+void cmd_logmode(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "clean") == 0) {
+        fs_log_clean_now();
+        fs_stats();
+        return;
+    }
+    if (argc < 3 || (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0)) {
+        vga_puts("Usage: logmode <file> on|off | logmode clean\n");
+        return;
+    }
+
+    int result = fs_set_log_mode(argv[1], strcmp(argv[2], "on") == 0);
+    if (result == -1) {
+        vga_printf("logmode: %s: No such file\n", argv[1]);
+    } else if (result != 0) {
+        vga_printf("logmode: %s: Out of memory\n", argv[1]);
+    }
+}
+
+void cmd_work(int argc, char **argv) {
+    (void)argc; (void)argv;
+    work_list();
+}
+
+void cmd_fsstress(int argc, char **argv) {
+    u32 threads = argc >= 2 ? (u32)simple_atoi(argv[1]) : 4;
+    u32 iterations = argc >= 3 ? (u32)simple_atoi(argv[2]) : 200;
+    fs_stress(threads, iterations);
+}
+
+// fsbench [files] [size] [-m]; -m prints one BENCH line per operation
+void cmd_fsbench(int argc, char **argv) {
+    u32 values[2] = { 32, 4096 };
+    u32 count = 0;
+    int machine = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            machine = 1;
+        } else if (count < 2) {
+            values[count++] = (u32)simple_atoi(argv[i]);
+        }
+    }
+    fs_bench(values[0], values[1], machine);
+}
+
+void cmd_blkread(int argc, char **argv) {
+    if (argc < 3) {
+        vga_puts("Usage: blkread <device> <offset>\n");
+        return;
+    }
+    
+    block_device_t *dev = block_get(argv[1]);
+    if (!dev) {
+        vga_printf("blkread: %s: No such device\n", argv[1]);
+        return;
+    }
+    
+    u32 offset = (u32)simple_atoi(argv[2]);
+    u8 data[64];
+    int result = pagecache_read(dev, offset, data, sizeof(data));
+    if (result < 0) {
+        vga_printf("blkread: %s: I/O error\n", argv[1]);
+        return;
+    }
+    
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < result; i++) {
+        if (i % 16 == 0) vga_printf("%x: ", offset + i);
+        vga_putchar(hex[data[i] >> 4]);
+        vga_putchar(hex[data[i] & 0xF]);
+        vga_putchar(i % 16 == 15 ? '\n' : ' ');
+    }
+}
+
 // Helper function for calculator
 static int simple_atoi(const char *str) {
     int result = 0;
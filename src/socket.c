@@ -0,0 +1,292 @@
+#include "kernel.h"
+#include "vga.h"
+#include "socket.h"
+
+// Socket table and the protocol-independent half of the socket calls.
+// Descriptors start at SOCKET_FD_BASE so they never look like stdin,
+// stdout or stderr. Datagrams are queued on the socket by the net-rx
+// job and taken off by recvfrom; both run in thread context, never in
+// an interrupt handler, so the queue needs no locking. Stream sockets
+// hand most calls to TCP. Calls that may send flush the loopback path
+// before returning, so a local peer has the data by then.
+
+#define MAX_SOCKETS    64
+#define SOCKET_FD_BASE 3
+
+static socket_t sockets[MAX_SOCKETS];
+
+socket_t *socket_get(int fd) {
+    if (fd < SOCKET_FD_BASE || fd >= SOCKET_FD_BASE + MAX_SOCKETS) return NULL;
+    socket_t *sock = &sockets[fd - SOCKET_FD_BASE];
+    return sock->used ? sock : NULL;
+}
+
+// Take a free slot for a new socket; returns its descriptor
+int socket_alloc(int type) {
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        socket_t *sock = &sockets[i];
+        if (sock->used) continue;
+
+        memset(sock, 0, sizeof(socket_t));
+        sock->used = 1;
+        sock->type = type;
+        sock->rx_limit = SOCKET_RCVBUF_DEFAULT;
+        return i + SOCKET_FD_BASE;
+    }
+    return -NET_EMFILE;
+}
+
+int network_socket(int domain, int type, int protocol) {
+    if (domain != AF_INET) return -NET_EAFNOSUPPORT;
+
+    int nonblocking = (type & SOCK_NONBLOCK) != 0;
+    type &= ~SOCK_NONBLOCK;
+    if (type == SOCK_DGRAM) {
+        if (protocol != 0 && protocol != PROTO_UDP) return -NET_EPROTONOSUPPORT;
+    } else if (type == SOCK_STREAM) {
+        if (protocol != 0 && protocol != PROTO_TCP) return -NET_EPROTONOSUPPORT;
+    } else {
+        return -NET_EOPNOTSUPP;
+    }
+
+    int fd = socket_alloc(type);
+    if (fd >= 0) socket_get(fd)->nonblocking = nonblocking;
+    return fd;
+}
+
+// Bind to a local address (0 for any) and port (0 for an ephemeral one)
+int network_bind(int sockfd, u32 addr, u16 port) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+    if (sock->local_port || sock->tcb) return -NET_EINVAL;
+    if (addr && !ip_is_local(addr)) return -NET_EADDRNOTAVAIL;
+    return sock->type == SOCK_STREAM ? tcp_bind(sock, addr, port) : udp_bind(sock, addr, port);
+}
+
+int network_listen(int sockfd, int backlog) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+    if (sock->type != SOCK_STREAM) return -NET_EOPNOTSUPP;
+    return tcp_listen(sock, backlog > 0 ? backlog : 1);
+}
+
+// Take a connection off a listening socket's queue, as a new socket
+int network_accept(int sockfd, u32 *addr, u16 *port) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+    if (sock->type != SOCK_STREAM) return -NET_EOPNOTSUPP;
+
+    int result = socket_block(sock, 0, sock->rx_timeout_ms, tcp_accept_ready);
+    if (result != 0) return result;
+
+    int fd = socket_alloc(SOCK_STREAM);
+    if (fd < 0) return fd;
+    result = tcp_accept(sock, socket_get(fd), addr, port);
+    if (result != 0) {
+        socket_get(fd)->used = 0;
+        return result;
+    }
+    return fd;
+}
+
+int network_connect(int sockfd, u32 addr, u16 port) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+    if (sock->type != SOCK_STREAM) return -NET_EOPNOTSUPP;
+    if (!port) return -NET_EINVAL;
+
+    int result = tcp_connect(sock, addr, port);
+    network_loopback_flush();
+    return result;
+}
+
+int network_setsockopt(int sockfd, int option, u32 value) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+
+    switch (option) {
+        case SO_NONBLOCK:
+            sock->nonblocking = value != 0;
+            return 0;
+        case SO_RCVTIMEO:
+            sock->rx_timeout_ms = value;
+            return 0;
+        case SO_SNDTIMEO:
+            sock->tx_timeout_ms = value;
+            return 0;
+        case SO_RCVBUF:
+            if (value < 1 || value > SOCKET_RCVBUF_MAX) return -NET_EINVAL;
+            sock->rx_limit = value;
+            return 0;
+        default:
+            return -NET_EINVAL;
+    }
+}
+
+// Send one datagram; an unbound socket gets an ephemeral port first.
+// Stream sockets ignore the address.
+int network_sendto(int sockfd, const void *buf, u32 len, int flags, u32 addr, u16 port) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+
+    int result;
+    if (sock->type == SOCK_STREAM) {
+        result = tcp_send(sock, buf, len, flags);
+    } else {
+        if (!port) return -NET_EDESTADDRREQ;
+        if (!sock->local_port) {
+            result = udp_bind(sock, 0, 0);
+            if (result != 0) return result;
+        }
+        result = udp_sendto(sock, buf, len, addr, port);
+    }
+    network_loopback_flush();
+    return result;
+}
+
+// Queue a received datagram, taking over the caller's reference; drops
+// it if the queue is full
+int socket_deliver(socket_t *sock, netbuf_t *nb, u32 addr, u16 port) {
+    if (sock->rx_count >= sock->rx_limit) {
+        sock->rx_drops++;
+        netbuf_put(nb);
+        return -1;
+    }
+
+    nb->peer_addr = addr;
+    nb->peer_port = port;
+    nb->next = NULL;
+    if (sock->rx_tail) {
+        sock->rx_tail->next = nb;
+    } else {
+        sock->rx_head = nb;
+    }
+    sock->rx_tail = nb;
+    sock->rx_count++;
+    sock->rx_datagrams++;
+    poll_wake(&sock->poll, POLLIN);
+    return 0;
+}
+
+// Events for epoll
+u32 socket_poll(socket_t *sock) {
+    if (sock->type == SOCK_STREAM) return tcp_poll(sock);
+    return (sock->rx_head ? POLLIN : 0) | POLLOUT;  // Sending never blocks
+}
+
+typedef struct socket_wait {
+    socket_t *sock;
+    int (*ready)(socket_t *sock);
+} socket_wait_t;
+
+static int socket_wait_ready(void *arg) {
+    socket_wait_t *wait = (socket_wait_t *)arg;
+    return !wait->sock->used || wait->ready(wait->sock);
+}
+
+// Wait until 'ready' says the call can go on, sleeping on the socket's
+// wait queue, which the protocol wakes when data, room or a connection
+// arrives. Returns -NET_EAGAIN if the caller may not block or the timeout
+// passes first.
+int socket_block(socket_t *sock, int flags, u32 timeout_ms, int (*ready)(socket_t *sock)) {
+    if (ready(sock)) return 0;
+
+    if (sock->nonblocking || (flags & MSG_DONTWAIT)) {
+        work_run();  // Deliver what has already arrived
+        return ready(sock) ? 0 : -NET_EAGAIN;
+    }
+
+    socket_wait_t wait = { sock, ready };
+    int result = wait_event(&sock->poll.wait, socket_wait_ready, &wait, timeout_ms);
+    if (!sock->used) return -NET_EBADF;  // Closed by another thread
+    return result == 0 ? 0 : -NET_EAGAIN;
+}
+
+static int socket_has_datagram(socket_t *sock) {
+    return sock->rx_head != NULL;
+}
+
+// Receive one datagram, truncated to 'len' bytes like UDP does, or bytes
+// from a stream. Blocks unless the socket is non-blocking or
+// MSG_DONTWAIT is given, for at most the socket's receive timeout if it
+// has one.
+int network_recvfrom(int sockfd, void *buf, u32 len, int flags, u32 *addr, u16 *port) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+    if (sock->type == SOCK_STREAM) {
+        int result = tcp_recv(sock, buf, len, flags);
+        network_loopback_flush();  // Window updates
+        return result;
+    }
+
+    int result = socket_block(sock, flags, sock->rx_timeout_ms, socket_has_datagram);
+    if (result != 0) return result;
+
+    netbuf_t *nb = sock->rx_head;
+    sock->rx_head = nb->next;
+    if (!sock->rx_head) sock->rx_tail = NULL;
+    sock->rx_count--;
+
+    u32 copied = nb->len < len ? nb->len : len;
+    memcpy(buf, nb->data, copied);
+    if (addr) *addr = nb->peer_addr;
+    if (port) *port = nb->peer_port;
+    netbuf_put(nb);
+    return copied;
+}
+
+int network_send(int sockfd, const void *buf, u32 len, int flags) {
+    return network_sendto(sockfd, buf, len, flags, 0, 0);
+}
+
+int network_recv(int sockfd, void *buf, u32 len, int flags) {
+    return network_recvfrom(sockfd, buf, len, flags, NULL, NULL);
+}
+
+// Send part of a file over a connection, without copying it where the
+// file system allows; datagram sockets have no use for this
+int network_sendfile(int sockfd, const char *name, u32 offset, u32 count, int flags) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+    if (sock->type != SOCK_STREAM) return -NET_EOPNOTSUPP;
+    if (!name) return -NET_EINVAL;
+
+    int result = tcp_sendfile(sock, name, offset, count, flags);
+    network_loopback_flush();
+    return result;
+}
+
+int network_close(int sockfd) {
+    socket_t *sock = socket_get(sockfd);
+    if (!sock) return -NET_EBADF;
+
+    if (sock->type == SOCK_STREAM) {
+        tcp_close(sock);
+    } else {
+        udp_unbind(sock);
+    }
+    while (sock->rx_head) {
+        netbuf_t *nb = sock->rx_head;
+        sock->rx_head = nb->next;
+        netbuf_put(nb);
+    }
+    poll_release(&sock->poll);
+    sock->used = 0;
+    network_loopback_flush();
+    return 0;
+}
+
+// Open datagram sockets, for netstat; TCP lists its own
+void socket_list(void) {
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        socket_t *sock = &sockets[i];
+        if (!sock->used || sock->type != SOCK_DGRAM) continue;
+
+        u32 ip = sock->local_addr;
+        vga_printf("  fd %d udp %d.%d.%d.%d:%u  queued %u/%u, %u received, %u sent, %u dropped\n",
+                   i + SOCKET_FD_BASE, (ip >> 24) & 0xFF, (ip >> 16) & 0xFF,
+                   (ip >> 8) & 0xFF, ip & 0xFF, sock->local_port,
+                   sock->rx_count, sock->rx_limit, sock->rx_datagrams,
+                   sock->tx_datagrams, sock->rx_drops);
+    }
+}
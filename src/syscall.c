@@ -1,15 +1,37 @@
 #include "kernel.h"
 #include "vga.h"
+#include "socket.h"
 
 // System call numbers
-#define SYS_EXIT    1
-#define SYS_WRITE   2
-#define SYS_READ    3
-#define SYS_GETPID  4
-#define SYS_MALLOC  5
-#define SYS_FREE    6
-#define SYS_PS      7
-#define SYS_MEMINFO 8
+#define SYS_EXIT         1
+#define SYS_WRITE        2
+#define SYS_READ         3
+#define SYS_GETPID       4
+#define SYS_MALLOC       5
+#define SYS_FREE         6
+#define SYS_PS           7
+#define SYS_MEMINFO      8
+#define SYS_SOCKET       9
+#define SYS_BIND         10
+#define SYS_SENDTO       11
+#define SYS_RECVFROM     12
+#define SYS_CLOSE        13
+#define SYS_SETSOCKOPT   14
+#define SYS_LISTEN       15
+#define SYS_ACCEPT       16
+#define SYS_CONNECT      17
+#define SYS_SEND         18
+#define SYS_RECV         19
+#define SYS_TCP_INFO     20
+#define SYS_PIPE         21
+#define SYS_EPOLL_CREATE 22
+#define SYS_EPOLL_CTL    23
+#define SYS_EPOLL_WAIT   24
+#define SYS_SENDFILE     25
+
+// Descriptors below this are the console; sockets, pipes and epoll
+// instances come after
+#define SYSCALL_FIRST_FD 3
 
 // System call handler
 extern void syscall_handler(void);
@@ -26,7 +48,10 @@ static int sys_exit(int status) {
 }
 
 static int sys_write(int fd, const char *buf, int len) {
-    (void)fd; // Ignore file descriptor for now
+    if (fd >= SYSCALL_FIRST_FD) {
+        int result = pipe_write(fd, buf, len, 0);
+        return result != -NET_EBADF ? result : network_send(fd, buf, len, 0);
+    }
     if (buf && len > 0) {
         for (int i = 0; i < len; i++) {
             vga_putchar(buf[i]);
@@ -37,8 +62,18 @@ static int sys_write(int fd, const char *buf, int len) {
 }
 
 static int sys_read(int fd, char *buf, int len) {
-    (void)fd; (void)buf; (void)len; // Not implemented yet
-    return -1;
+    if (fd < SYSCALL_FIRST_FD) return -1;  // Console input is not implemented yet
+    int result = pipe_read(fd, buf, len, 0);
+    return result != -NET_EBADF ? result : network_recv(fd, buf, len, 0);
+}
+
+// Each kind of descriptor has its own range, so the first owner that
+// knows the descriptor closes it
+static int sys_close(int fd) {
+    int result = pipe_close(fd);
+    if (result == -NET_EBADF) result = epoll_close(fd);
+    if (result == -NET_EBADF) result = network_close(fd);
+    return result;
 }
 
 static int sys_getpid(void) {
@@ -65,6 +100,80 @@ static int sys_meminfo(void) {
     return 0;
 }
 
+static int sys_bind(int fd, const sockaddr_in_t *addr) {
+    if (!addr) return -NET_EINVAL;
+    if (addr->family != AF_INET) return -NET_EAFNOSUPPORT;
+    return network_bind(fd, addr->addr, addr->port);
+}
+
+// UDP sockets are never connected, so they need an address; stream
+// sockets ignore it
+static int sys_sendto(int fd, const socket_msg_t *msg, int flags) {
+    if (!msg) return -NET_EINVAL;
+    if (!msg->addr) return network_sendto(fd, msg->buf, msg->len, flags, 0, 0);
+    return network_sendto(fd, msg->buf, msg->len, flags, msg->addr->addr, msg->addr->port);
+}
+
+static int sys_recvfrom(int fd, socket_msg_t *msg, int flags) {
+    if (!msg) return -NET_EINVAL;
+    u32 addr;
+    u16 port;
+    int result = network_recvfrom(fd, msg->buf, msg->len, flags, &addr, &port);
+    if (result >= 0 && msg->addr) {
+        msg->addr->family = AF_INET;
+        msg->addr->port = port;
+        msg->addr->addr = addr;
+    }
+    return result;
+}
+
+static int sys_accept(int fd, sockaddr_in_t *addr) {
+    u32 peer_addr;
+    u16 peer_port;
+    int result = network_accept(fd, &peer_addr, &peer_port);
+    if (result >= 0 && addr) {
+        addr->family = AF_INET;
+        addr->port = peer_port;
+        addr->addr = peer_addr;
+    }
+    return result;
+}
+
+static int sys_connect(int fd, const sockaddr_in_t *addr) {
+    if (!addr) return -NET_EINVAL;
+    if (addr->family != AF_INET) return -NET_EAFNOSUPPORT;
+    return network_connect(fd, addr->addr, addr->port);
+}
+
+static int sys_pipe(int *fds) {
+    if (!fds) return -NET_EINVAL;
+    return pipe_create(fds);
+}
+
+static int sys_epoll_ctl(int epfd, int op, const epoll_msg_t *msg) {
+    if (!msg) return -NET_EINVAL;
+    return epoll_ctl(epfd, op, msg->fd, msg->events);
+}
+
+static int sys_epoll_wait(int epfd, const epoll_msg_t *msg) {
+    if (!msg) return -NET_EINVAL;
+    return epoll_wait(epfd, msg->events, msg->max_events, msg->timeout_ms);
+}
+
+static int sys_sendfile(int fd, sendfile_msg_t *msg, int flags) {
+    if (!msg) return -NET_EINVAL;
+    int result = network_sendfile(fd, msg->name, msg->offset, msg->count, flags);
+    if (result > 0) msg->offset += result;
+    return result;
+}
+
+static int sys_tcp_info(int fd, tcp_info_t *info) {
+    socket_t *sock = socket_get(fd);
+    if (!sock) return -NET_EBADF;
+    if (!info) return -NET_EINVAL;
+    return tcp_get_info(sock, info);
+}
+
 // Main system call dispatcher
 int syscall_dispatcher(int syscall_num, int arg1, int arg2, int arg3) {
     switch (syscall_num) {
@@ -84,6 +193,40 @@ int syscall_dispatcher(int syscall_num, int arg1, int arg2, int arg3) {
             return sys_ps();
         case SYS_MEMINFO:
             return sys_meminfo();
+        case SYS_SOCKET:
+            return network_socket(arg1, arg2, arg3);
+        case SYS_BIND:
+            return sys_bind(arg1, (const sockaddr_in_t *)arg2);
+        case SYS_SENDTO:
+            return sys_sendto(arg1, (const socket_msg_t *)arg2, arg3);
+        case SYS_RECVFROM:
+            return sys_recvfrom(arg1, (socket_msg_t *)arg2, arg3);
+        case SYS_CLOSE:
+            return sys_close(arg1);
+        case SYS_SETSOCKOPT:
+            return network_setsockopt(arg1, arg2, (u32)arg3);
+        case SYS_LISTEN:
+            return network_listen(arg1, arg2);
+        case SYS_ACCEPT:
+            return sys_accept(arg1, (sockaddr_in_t *)arg2);
+        case SYS_CONNECT:
+            return sys_connect(arg1, (const sockaddr_in_t *)arg2);
+        case SYS_SEND:
+            return network_send(arg1, (const void *)arg2, (u32)arg3, 0);
+        case SYS_RECV:
+            return network_recv(arg1, (void *)arg2, (u32)arg3, 0);
+        case SYS_TCP_INFO:
+            return sys_tcp_info(arg1, (tcp_info_t *)arg2);
+        case SYS_PIPE:
+            return sys_pipe((int *)arg1);
+        case SYS_EPOLL_CREATE:
+            return epoll_create();
+        case SYS_EPOLL_CTL:
+            return sys_epoll_ctl(arg1, arg2, (const epoll_msg_t *)arg3);
+        case SYS_EPOLL_WAIT:
+            return sys_epoll_wait(arg1, (const epoll_msg_t *)arg2);
+        case SYS_SENDFILE:
+            return sys_sendfile(arg1, (sendfile_msg_t *)arg2, arg3);
         default:
             vga_printf("Unknown system call: %d\n", syscall_num);
             return -1;
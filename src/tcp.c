@@ -0,0 +1,1966 @@
+#include "kernel.h"
+#include "vga.h"
+#include "net.h"
+#include "socket.h"
+
+// TCP (RFC 9293) with window scaling (RFC 7323), selective
+// acknowledgements (RFC 2018) and NewReno congestion control (RFC 5681,
+// RFC 6582), retransmission timers after RFC 6298.
+//
+// Each connection has a control block with fixed-size circular send and
+// receive buffers. Sent data stays in the send buffer until it is
+// acknowledged, so retransmissions copy it out again. Data queued by
+// sendfile is the exception: the send queue holds references to the
+// file's pages instead, and segments carry those pages as packet buffer
+// fragments, so file data reaches the device without a copy. Segments that
+// arrive out of order are kept in their packet buffers, sorted by
+// sequence number, and reported to the sender as SACK blocks. Like the
+// rest of the stack, all of this runs in thread context (the net-rx job,
+// the tcp-timer job and socket calls), so it needs no locking.
+
+#define TCP_HASH_BITS        6
+#define TCP_HASH_SIZE        (1 << TCP_HASH_BITS)
+#define TCP_MAX_CONNECTIONS  64
+#define TCP_SNDBUF           65536   // Powers of two
+#define TCP_RCVBUF           65536
+#define TCP_SNDPAGES         32      // File page pieces queued by sendfile
+#define TCP_OOO_MAX          64      // Out-of-order segments held per connection
+#define TCP_SACK_MAX         8       // Blocks remembered from the peer
+#define TCP_SACK_REPORT      4       // Blocks that fit in the options
+#define TCP_EPHEMERAL_FIRST  49152
+#define TCP_EPHEMERAL_LAST   65535
+
+#define TCP_MSS_DEFAULT      536     // When the peer sends no MSS option
+#define TCP_INIT_CWND        10      // Segments (RFC 6928)
+#define TCP_RTO_INITIAL_MS   1000
+#define TCP_RTO_MIN_MS       200
+#define TCP_RTO_MAX_MS       60000
+#define TCP_SYN_RETRIES      5
+#define TCP_RETRIES          8
+#define TCP_DELACK_MS        40
+#define TCP_FIN_TIMEOUT_MS   60000   // Orphaned connections in FIN-WAIT-2
+#define TCP_TIME_WAIT_MS     10000   // Well short of 2MSL, so that a benchmark
+                                     // opening many connections does not fill
+                                     // the table
+#define TCP_TIMER_PERIOD_MS  10
+
+#define SEQ_LT(a, b)  ((s32)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((s32)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((s32)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((s32)((a) - (b)) >= 0)
+
+#define TCP_OPT_EOL       0
+#define TCP_OPT_NOP       1
+#define TCP_OPT_MSS       2
+#define TCP_OPT_WSCALE    3
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK      5
+
+typedef struct tcp_sack_block {
+    u32 start;
+    u32 end;
+} tcp_sack_block_t;
+
+// A piece of a file page queued by sendfile, holding sequence numbers
+// seq to seq + len
+typedef struct tcp_page {
+    u32 seq;
+    u32 len;
+    const u8 *data;
+    void *page;                  // Referenced until the data is acknowledged
+} tcp_page_t;
+
+typedef struct tcp_options {
+    u16 mss;
+    u8 wscale;
+    u8 has_wscale;
+    u8 sack_ok;
+    u8 sack_count;
+    tcp_sack_block_t sack[TCP_SACK_REPORT];
+} tcp_options_t;
+
+typedef struct tcp_cb {
+    u8 state;
+    u8 wscale_ok;                // Both sides sent a window scale option
+    u8 sack_ok;                  // Both sides sent SACK-permitted
+    u8 snd_wscale;               // Shift for the peer's windows
+    u8 rcv_wscale;               // Shift for ours
+    u8 fin_queued;               // Closed: a FIN follows the queued data
+    u8 fin_received;
+    u8 in_recovery;
+    u8 ack_now;                  // Send an ACK once the segment is processed
+    u8 ack_pending;              // In-order segments not yet acknowledged
+    u8 dupacks;
+    u8 retries;                  // Timeouts since the last new ACK
+    u8 rtt_timing;
+    int error;                   // Negated errno for the socket
+
+    u32 local_addr;
+    u32 remote_addr;
+    u16 local_port;
+    u16 remote_port;
+    socket_t *sock;              // NULL once closed, or until accepted
+    struct tcp_cb *hash_next;    // Connection hash chain
+    struct tcp_cb *list_next;    // Every control block, for the timers
+    u8 hashed;
+    u8 loopback;                 // Peer is local: no checksums
+
+    // Listeners
+    struct tcp_cb *parent;       // Listener, until accepted
+    struct tcp_cb *accept_head;  // Established, not yet accepted
+    struct tcp_cb *accept_tail;
+    struct tcp_cb *accept_next;
+    u32 backlog;
+    u32 child_count;             // Handshaking or waiting to be accepted
+
+    // Send sequence space. The byte at snd_una is snd_buf[snd_head].
+    u32 iss;
+    u32 snd_una;
+    u32 snd_nxt;
+    u32 snd_max;                 // Highest sequence number sent
+    u32 snd_wnd;
+    u32 snd_wl1;
+    u32 snd_wl2;
+    u32 mss;
+    u8 *snd_buf;
+    u32 snd_head;
+    u32 snd_len;
+
+    // Pages queued by sendfile, in sequence order. Their bytes count in
+    // snd_len and keep their place in snd_buf, unwritten, so that
+    // sequence numbers map to the buffer the same way throughout.
+    tcp_page_t snd_pages[TCP_SNDPAGES];
+    u32 snd_page_head;
+    u32 snd_page_count;
+
+    // Receive sequence space. The byte at rcv_nxt - rcv_len is
+    // rcv_buf[rcv_head].
+    u32 irs;
+    u32 rcv_nxt;
+    u32 rcv_adv;                 // Right edge of the window last advertised
+    u8 *rcv_buf;
+    u32 rcv_head;
+    u32 rcv_len;
+    netbuf_t *ooo_head;          // Out of order, by sequence number
+    u32 ooo_count;
+    u32 ooo_last;                // Sequence number of the latest arrival
+
+    // Congestion control
+    u32 cwnd;
+    u32 ssthresh;
+    u32 ca_acked;                // Bytes acknowledged in congestion avoidance
+    u32 recover;                 // snd_max when recovery started
+    u32 high_rxt;                // Next sequence number to retransmit in recovery
+    tcp_sack_block_t sacked[TCP_SACK_MAX];
+    u32 sacked_count;
+
+    // Round-trip time
+    u32 srtt_us;                 // 0 until the first sample
+    u32 rttvar_us;
+    u32 rto_ms;
+    u32 rtt_seq;                 // Timed segment ends here
+    u64 rtt_tsc;
+
+    // Timers, as tick deadlines; 0 when stopped
+    u32 rtx_deadline;            // Retransmission, or window probe
+    u32 delack_deadline;
+    u32 state_deadline;          // TIME-WAIT or orphaned FIN-WAIT-2
+
+    // Statistics
+    u32 segs_in;
+    u32 segs_out;
+    u32 bytes_acked;
+    u32 bytes_received;
+    u32 retransmits;
+    u32 fast_retransmits;
+    u32 timeouts;
+    u32 dup_acks;
+    u32 sack_blocks;
+    u32 ooo_segments;
+} tcp_cb_t;
+
+static tcp_cb_t *tcp_conn_hash[TCP_HASH_SIZE];
+static socket_t *tcp_bind_hash[TCP_HASH_SIZE];
+static tcp_cb_t *tcp_cbs = NULL;
+static u32 tcp_count = 0;
+static u16 tcp_next_ephemeral = TCP_EPHEMERAL_FIRST;
+
+// Statistics, named after the TCP MIB (RFC 4022)
+static u32 tcp_active_opens = 0;
+static u32 tcp_passive_opens = 0;
+static u32 tcp_attempt_fails = 0;
+static u32 tcp_estab_resets = 0;
+static u32 tcp_in_segs = 0;
+static u32 tcp_out_segs = 0;
+static u32 tcp_retrans_segs = 0;
+static u32 tcp_in_errs = 0;
+static u32 tcp_out_rsts = 0;
+static u32 tcp_listen_drops = 0;
+static u32 tcp_sendfile_pages = 0;     // Bytes sendfile queued by reference
+static u32 tcp_sendfile_copied = 0;    // Bytes it had to copy
+static u32 tcp_zerocopy_segs = 0;      // Segments sent with page fragments
+
+static const char *tcp_state_names[] = {
+    "CLOSED", "LISTEN", "SYN-SENT", "SYN-RECEIVED", "ESTABLISHED", "FIN-WAIT-1",
+    "FIN-WAIT-2", "CLOSE-WAIT", "CLOSING", "LAST-ACK", "TIME-WAIT",
+};
+
+static void tcp_timer_work(void);
+static void tcp_output(tcp_cb_t *tcb);
+
+void tcp_init(void) {
+    memset(tcp_conn_hash, 0, sizeof(tcp_conn_hash));
+    memset(tcp_bind_hash, 0, sizeof(tcp_bind_hash));
+    work_register("tcp-timer", tcp_timer_work, TCP_TIMER_PERIOD_MS);
+}
+
+static inline u32 tcp_min(u32 a, u32 b) {
+    return a < b ? a : b;
+}
+
+static u32 tcp_deadline(u32 ms) {
+    u32 deadline = timer_get_ticks() + (ms * timer_get_frequency() + 999) / 1000;
+    return deadline ? deadline : 1;
+}
+
+static inline int tcp_expired(u32 deadline, u32 now) {
+    return deadline && (s32)(now - deadline) >= 0;
+}
+
+static inline u32 tcp_conn_bucket(u32 local_addr, u16 local_port, u32 remote_addr, u16 remote_port) {
+    u32 key = local_addr ^ remote_addr ^ ((u32)local_port << 16 | remote_port);
+    return (key * 2654435761u) >> (32 - TCP_HASH_BITS);
+}
+
+static inline u32 tcp_port_bucket(u16 port) {
+    return port & (TCP_HASH_SIZE - 1);
+}
+
+// Copy into and out of the circular buffers
+static void tcp_ring_write(u8 *ring, u32 size, u32 pos, const u8 *src, u32 len) {
+    pos &= size - 1;
+    u32 first = tcp_min(len, size - pos);
+    memcpy(ring + pos, src, first);
+    memcpy(ring, src + first, len - first);
+}
+
+static void tcp_ring_read(const u8 *ring, u32 size, u32 pos, u8 *dst, u32 len) {
+    pos &= size - 1;
+    u32 first = tcp_min(len, size - pos);
+    memcpy(dst, ring + pos, first);
+    memcpy(dst + first, ring, len - first);
+}
+
+static inline tcp_page_t *tcp_page_at(tcp_cb_t *tcb, u32 index) {
+    return &tcb->snd_pages[(tcb->snd_page_head + index) & (TCP_SNDPAGES - 1)];
+}
+
+// Index of the first queued page that holds 'seq' or data after it
+static u32 tcp_page_find(tcp_cb_t *tcb, u32 seq) {
+    u32 index = 0;
+    while (index < tcb->snd_page_count) {
+        tcp_page_t *page = tcp_page_at(tcb, index);
+        if (SEQ_GT(page->seq + page->len, seq)) break;
+        index++;
+    }
+    return index;
+}
+
+// Drop the pages whose data has all been acknowledged
+static void tcp_release_pages(tcp_cb_t *tcb) {
+    while (tcb->snd_page_count) {
+        tcp_page_t *page = tcp_page_at(tcb, 0);
+        if (SEQ_GT(page->seq + page->len, tcb->snd_una)) break;
+        fs_put_page(page->page);
+        tcb->snd_page_head = (tcb->snd_page_head + 1) & (TCP_SNDPAGES - 1);
+        tcb->snd_page_count--;
+    }
+}
+
+static inline int tcp_can_send(tcp_cb_t *tcb) {
+    return tcb->state == TCP_ESTABLISHED || tcb->state == TCP_CLOSE_WAIT ||
+           tcb->state == TCP_FIN_WAIT_1 || tcb->state == TCP_CLOSING ||
+           tcb->state == TCP_LAST_ACK;
+}
+
+static inline u32 tcp_rcv_space(tcp_cb_t *tcb) {
+    return tcb->rcv_buf ? TCP_RCVBUF - tcb->rcv_len : 0;
+}
+
+// Control blocks
+
+static tcp_cb_t *tcp_find(u32 local_addr, u16 local_port, u32 remote_addr, u16 remote_port) {
+    u32 bucket = tcp_conn_bucket(local_addr, local_port, remote_addr, remote_port);
+    for (tcp_cb_t *tcb = tcp_conn_hash[bucket]; tcb; tcb = tcb->hash_next) {
+        if (tcb->local_port == local_port && tcb->remote_port == remote_port &&
+            tcb->local_addr == local_addr && tcb->remote_addr == remote_addr) {
+            return tcb;
+        }
+    }
+    return NULL;
+}
+
+// The listener for a local address and port, preferring an exact address
+// match over a wildcard one
+static tcp_cb_t *tcp_find_listener(u32 addr, u16 port) {
+    tcp_cb_t *wildcard = NULL;
+    for (socket_t *sock = tcp_bind_hash[tcp_port_bucket(port)]; sock; sock = sock->hash_next) {
+        if (sock->local_port != port || !sock->tcb || sock->tcb->state != TCP_LISTEN) continue;
+        if (sock->local_addr == addr) return sock->tcb;
+        if (!sock->local_addr) wildcard = sock->tcb;
+    }
+    return wildcard;
+}
+
+static void tcp_hash_insert(tcp_cb_t *tcb) {
+    u32 bucket = tcp_conn_bucket(tcb->local_addr, tcb->local_port, tcb->remote_addr, tcb->remote_port);
+    tcb->hash_next = tcp_conn_hash[bucket];
+    tcp_conn_hash[bucket] = tcb;
+    tcb->hashed = 1;
+}
+
+static void tcp_hash_remove(tcp_cb_t *tcb) {
+    if (!tcb->hashed) return;
+
+    u32 bucket = tcp_conn_bucket(tcb->local_addr, tcb->local_port, tcb->remote_addr, tcb->remote_port);
+    tcp_cb_t **link = &tcp_conn_hash[bucket];
+    while (*link != tcb) link = &(*link)->hash_next;
+    *link = tcb->hash_next;
+    tcb->hashed = 0;
+}
+
+static tcp_cb_t *tcp_alloc(void) {
+    if (tcp_count >= TCP_MAX_CONNECTIONS) return NULL;
+    tcp_cb_t *tcb = (tcp_cb_t *)kmalloc(sizeof(tcp_cb_t));
+    if (!tcb) return NULL;
+
+    memset(tcb, 0, sizeof(tcp_cb_t));
+    tcb->mss = TCP_MSS_DEFAULT;
+    tcb->rto_ms = TCP_RTO_INITIAL_MS;
+    tcb->ssthresh = 0x7FFFFFFF;
+    while ((TCP_RCVBUF >> tcb->rcv_wscale) > 0xFFFF) tcb->rcv_wscale++;
+
+    tcb->list_next = tcp_cbs;
+    tcp_cbs = tcb;
+    tcp_count++;
+    return tcb;
+}
+
+static void tcp_free_buffers(tcp_cb_t *tcb) {
+    if (tcb->snd_buf) kfree(tcb->snd_buf);
+    if (tcb->rcv_buf) kfree(tcb->rcv_buf);
+    tcb->snd_buf = NULL;
+    tcb->rcv_buf = NULL;
+    tcb->snd_len = 0;
+    tcb->rcv_len = 0;
+
+    while (tcb->snd_page_count) {
+        fs_put_page(tcp_page_at(tcb, 0)->page);
+        tcb->snd_page_head = (tcb->snd_page_head + 1) & (TCP_SNDPAGES - 1);
+        tcb->snd_page_count--;
+    }
+
+    while (tcb->ooo_head) {
+        netbuf_t *nb = tcb->ooo_head;
+        tcb->ooo_head = nb->next;
+        netbuf_put(nb);
+    }
+    tcb->ooo_count = 0;
+}
+
+static int tcp_alloc_buffers(tcp_cb_t *tcb) {
+    tcb->snd_buf = (u8 *)kmalloc(TCP_SNDBUF);
+    tcb->rcv_buf = (u8 *)kmalloc(TCP_RCVBUF);
+    if (tcb->snd_buf && tcb->rcv_buf) return 0;
+    tcp_free_buffers(tcb);
+    return -1;
+}
+
+static void tcp_destroy(tcp_cb_t *tcb) {
+    tcp_hash_remove(tcb);
+    tcp_free_buffers(tcb);
+
+    tcp_cb_t **link = &tcp_cbs;
+    while (*link != tcb) link = &(*link)->list_next;
+    *link = tcb->list_next;
+    tcp_count--;
+    kfree(tcb);
+}
+
+static void tcp_accept_unlink(tcp_cb_t *parent, tcp_cb_t *tcb) {
+    tcp_cb_t *prev = NULL;
+    for (tcp_cb_t *child = parent->accept_head; child; prev = child, child = child->accept_next) {
+        if (child != tcb) continue;
+        if (prev) {
+            prev->accept_next = child->accept_next;
+        } else {
+            parent->accept_head = child->accept_next;
+        }
+        if (parent->accept_tail == child) parent->accept_tail = prev;
+        return;
+    }
+}
+
+// The connection is over. Its control block lives on, in CLOSED, only
+// while a socket still refers to it, to report 'error'.
+static void tcp_closed(tcp_cb_t *tcb, int error) {
+    tcp_hash_remove(tcb);
+    tcp_free_buffers(tcb);
+    tcb->state = TCP_CLOSED;
+    tcb->error = error;
+    tcb->rtx_deadline = 0;
+    tcb->delack_deadline = 0;
+    tcb->state_deadline = 0;
+
+    if (tcb->parent) {
+        tcp_accept_unlink(tcb->parent, tcb);
+        tcb->parent->child_count--;
+        tcb->parent = NULL;
+    }
+    if (tcb->sock) {
+        poll_wake(&tcb->sock->poll, POLLIN | POLLOUT | POLLHUP | (error ? POLLERR : 0));
+    } else {
+        tcp_destroy(tcb);
+    }
+}
+
+static void tcp_time_wait(tcp_cb_t *tcb) {
+    tcb->state = TCP_TIME_WAIT;
+    tcp_free_buffers(tcb);
+    tcb->rtx_deadline = 0;
+    tcb->state_deadline = tcp_deadline(TCP_TIME_WAIT_MS);
+}
+
+static u32 tcp_new_iss(tcp_cb_t *tcb) {
+    u32 key = tcb->remote_addr ^ ((u32)tcb->remote_port << 16 | tcb->local_port);
+    return (u32)(timer_read_tsc() >> 4) + key * 2654435761u;
+}
+
+// Segments out
+
+static inline void tcp_put32(u8 *p, u32 value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// The next run of contiguous out-of-order data at or after 'cursor'
+static netbuf_t *tcp_ooo_run(netbuf_t *cursor, tcp_sack_block_t *block) {
+    block->start = cursor->seq;
+    block->end = cursor->seq + cursor->len;
+    for (cursor = cursor->next; cursor && SEQ_LEQ(cursor->seq, block->end); cursor = cursor->next) {
+        if (SEQ_GT(cursor->seq + cursor->len, block->end)) block->end = cursor->seq + cursor->len;
+    }
+    return cursor;
+}
+
+// SACK option for the out-of-order data we hold: the block with the
+// latest arrival first (RFC 2018), then the others in order
+static u32 tcp_sack_option(tcp_cb_t *tcb, u8 *options) {
+    tcp_sack_block_t blocks[TCP_SACK_REPORT];
+    tcp_sack_block_t block;
+    u32 count = 0;
+
+    for (netbuf_t *cursor = tcb->ooo_head; cursor; ) {
+        cursor = tcp_ooo_run(cursor, &block);
+        if (SEQ_GEQ(tcb->ooo_last, block.start) && SEQ_LT(tcb->ooo_last, block.end)) {
+            blocks[count++] = block;
+            break;
+        }
+    }
+    for (netbuf_t *cursor = tcb->ooo_head; cursor && count < TCP_SACK_REPORT; ) {
+        cursor = tcp_ooo_run(cursor, &block);
+        if (!count || block.start != blocks[0].start) blocks[count++] = block;
+    }
+
+    options[0] = TCP_OPT_NOP;
+    options[1] = TCP_OPT_NOP;
+    options[2] = TCP_OPT_SACK;
+    options[3] = 2 + count * 8;
+    for (u32 i = 0; i < count; i++) {
+        tcp_put32(&options[4 + i * 8], blocks[i].start);
+        tcp_put32(&options[8 + i * 8], blocks[i].end);
+    }
+    return 4 + count * 8;
+}
+
+// Largest payload for a data segment: the MSS less the SACK option
+// tcp_transmit will add, so the frame still fits the MTU
+static u32 tcp_seg_max(tcp_cb_t *tcb) {
+    if (!tcb->sack_ok || !tcb->ooo_head) return tcb->mss;
+
+    tcp_sack_block_t block;
+    u32 count = 0;
+    for (netbuf_t *cursor = tcb->ooo_head; cursor && count < TCP_SACK_REPORT; count++) {
+        cursor = tcp_ooo_run(cursor, &block);
+    }
+    u32 options_len = 4 + count * 8;
+    return tcb->mss > options_len ? tcb->mss - options_len : tcb->mss;
+}
+
+// Copy 'len' bytes of queued data from 'seq': out of the pages sendfile
+// queued where it did, out of the send buffer everywhere else
+static void tcp_copy_out(tcp_cb_t *tcb, u32 seq, u8 *dst, u32 len) {
+    u32 index = tcp_page_find(tcb, seq);
+    while (len) {
+        tcp_page_t *page = index < tcb->snd_page_count ? tcp_page_at(tcb, index) : NULL;
+        u32 chunk;
+        if (page && SEQ_GEQ(seq, page->seq)) {
+            chunk = tcp_min(len, page->seq + page->len - seq);
+            memcpy(dst, page->data + (seq - page->seq), chunk);
+            index++;
+        } else {
+            chunk = page ? tcp_min(len, page->seq - seq) : len;
+            tcp_ring_read(tcb->snd_buf, TCP_SNDBUF, tcb->snd_head + (seq - tcb->snd_una), dst, chunk);
+        }
+        seq += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+}
+
+// Attach 'len' bytes from 'seq' to the buffer as page fragments, each
+// with its own page reference. Fails, attaching nothing, unless all of
+// it lies in queued pages and the fragments suffice.
+static int tcp_attach_pages(tcp_cb_t *tcb, netbuf_t *nb, u32 seq, u32 len) {
+    u32 first = tcp_page_find(tcb, seq);
+    u32 index = first;
+    for (u32 pos = seq, left = len; left; index++) {
+        if (index >= tcb->snd_page_count || index - first == NETBUF_MAX_FRAGS) return -1;
+        tcp_page_t *page = tcp_page_at(tcb, index);
+        if (SEQ_LT(pos, page->seq)) return -1;
+        u32 chunk = tcp_min(left, page->seq + page->len - pos);
+        pos += chunk;
+        left -= chunk;
+    }
+
+    for (index = first; len; index++) {
+        tcp_page_t *page = tcp_page_at(tcb, index);
+        u32 chunk = tcp_min(len, page->seq + page->len - seq);
+        fs_get_page(page->page);
+        netbuf_attach(nb, page->data + (seq - page->seq), chunk, page->page, fs_put_page);
+        seq += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Send one segment with 'len' bytes from the send buffer starting at
+// 'seq'. Every segment but the first SYN carries an ACK.
+static void tcp_transmit(tcp_cb_t *tcb, u32 seq, u8 flags, u32 len) {
+    netbuf_t *nb = netbuf_alloc();
+    if (!nb) return;  // As good as lost; the timers recover
+
+    u8 options[40];
+    u32 options_len = 0;
+    if (flags & TCP_SYN) {
+        options[0] = TCP_OPT_MSS;
+        options[1] = 4;
+        options[2] = TCP_MSS_MAX >> 8;
+        options[3] = TCP_MSS_MAX & 0xFF;
+        options_len = 4;
+        if (!(flags & TCP_ACK) || tcb->wscale_ok) {
+            options[options_len++] = TCP_OPT_NOP;
+            options[options_len++] = TCP_OPT_WSCALE;
+            options[options_len++] = 3;
+            options[options_len++] = tcb->rcv_wscale;
+        }
+        if (!(flags & TCP_ACK) || tcb->sack_ok) {
+            options[options_len++] = TCP_OPT_NOP;
+            options[options_len++] = TCP_OPT_NOP;
+            options[options_len++] = TCP_OPT_SACK_PERM;
+            options[options_len++] = 2;
+        }
+    } else if (tcb->sack_ok && tcb->ooo_head) {
+        options_len = tcp_sack_option(tcb, options);
+    }
+
+    tcp_header_t *tcp = (tcp_header_t *)netbuf_append(nb, sizeof(tcp_header_t) + options_len);
+    memcpy(tcp + 1, options, options_len);
+    if (len) {
+        if (tcp_attach_pages(tcb, nb, seq, len) == 0) {
+            tcp_zerocopy_segs++;
+        } else {
+            tcp_copy_out(tcb, seq, netbuf_append(nb, len), len);
+        }
+    }
+
+    // Windows in SYN segments are never scaled
+    u32 space = tcp_rcv_space(tcb);
+    u32 shift = (flags & TCP_SYN) ? 0 : tcb->rcv_wscale;
+    u32 window = tcp_min(space >> shift, 0xFFFF);
+
+    tcp->src_port = net_htons(tcb->local_port);
+    tcp->dst_port = net_htons(tcb->remote_port);
+    tcp->seq = net_htonl(seq);
+    tcp->ack = (flags & TCP_ACK) ? net_htonl(tcb->rcv_nxt) : 0;
+    tcp->data_offset = ((sizeof(tcp_header_t) + options_len) / 4) << 4;
+    tcp->flags = flags;
+    tcp->window = net_htons(window);
+    tcp->checksum = 0;
+    tcp->urgent = 0;
+    if (!tcb->loopback) {
+        tcp->checksum = ip_pseudo_checksum_netbuf(tcb->local_addr, tcb->remote_addr, PROTO_TCP, nb);
+    }
+
+    if (flags & TCP_ACK) {
+        tcb->rcv_adv = tcb->rcv_nxt + (window << shift);
+        tcb->ack_now = 0;
+        tcb->ack_pending = 0;
+        tcb->delack_deadline = 0;
+    }
+    tcb->segs_out++;
+    tcp_out_segs++;
+    ip_output(nb, tcb->local_addr, tcb->remote_addr, PROTO_TCP);
+}
+
+static void tcp_send_ack(tcp_cb_t *tcb) {
+    tcp_transmit(tcb, tcb->snd_nxt, TCP_ACK, 0);
+}
+
+static void tcp_abort(tcp_cb_t *tcb) {
+    tcp_transmit(tcb, tcb->snd_nxt, TCP_RST | TCP_ACK, 0);
+    tcp_out_rsts++;
+}
+
+// Answer a segment that belongs to no connection (RFC 9293 3.10.7.1)
+static void tcp_reset(u32 src, u32 dst, tcp_header_t *in, u32 seg_len) {
+    if (in->flags & TCP_RST) return;
+    netbuf_t *nb = netbuf_alloc();
+    if (!nb) return;
+
+    tcp_header_t *tcp = (tcp_header_t *)netbuf_append(nb, sizeof(tcp_header_t));
+    memset(tcp, 0, sizeof(tcp_header_t));
+    tcp->src_port = in->dst_port;
+    tcp->dst_port = in->src_port;
+    if (in->flags & TCP_ACK) {
+        tcp->seq = in->ack;
+        tcp->flags = TCP_RST;
+    } else {
+        tcp->ack = net_htonl(net_ntohl(in->seq) + seg_len);
+        tcp->flags = TCP_RST | TCP_ACK;
+    }
+    tcp->data_offset = (sizeof(tcp_header_t) / 4) << 4;
+    tcp->checksum = ip_pseudo_checksum(dst, src, PROTO_TCP, tcp, nb->len);
+
+    tcp_out_segs++;
+    tcp_out_rsts++;
+    ip_output(nb, dst, src, PROTO_TCP);
+}
+
+static void tcp_rtx_arm(tcp_cb_t *tcb) {
+    tcb->rtx_deadline = tcp_deadline(tcb->rto_ms);
+}
+
+// Send new data, and the FIN after it, as far as the congestion and
+// receive windows allow
+static void tcp_output(tcp_cb_t *tcb) {
+    if (!tcp_can_send(tcb)) return;
+
+    u32 window = tcp_min(tcb->cwnd, tcb->snd_wnd);
+    for (;;) {
+        u32 offset = tcb->snd_nxt - tcb->snd_una;
+        if (offset >= tcb->snd_len) {
+            if (tcb->fin_queued && offset == tcb->snd_len) {
+                if (SEQ_LT(tcb->snd_nxt, tcb->snd_max)) {
+                    tcb->retransmits++;
+                    tcp_retrans_segs++;
+                }
+                tcp_transmit(tcb, tcb->snd_nxt, TCP_FIN | TCP_ACK, 0);
+                tcb->snd_nxt++;
+                if (SEQ_GT(tcb->snd_nxt, tcb->snd_max)) tcb->snd_max = tcb->snd_nxt;
+                if (!tcb->rtx_deadline) tcp_rtx_arm(tcb);
+            }
+            return;
+        }
+
+        if (offset >= window) {
+            // A zero window is probed when the timer runs out
+            if (!tcb->snd_wnd && !tcb->rtx_deadline) tcp_rtx_arm(tcb);
+            return;
+        }
+
+        // Small segments only when they are all there is, or nothing
+        // else is in flight (sender-side silly window avoidance)
+        u32 seg_max = tcp_seg_max(tcb);
+        u32 len = tcp_min(tcp_min(tcb->snd_len - offset, seg_max), window - offset);
+        if (len < seg_max && len < tcb->snd_len - offset && offset > 0) return;
+
+        u8 flags = TCP_ACK;
+        if (offset + len == tcb->snd_len) flags |= TCP_PSH;
+        if (SEQ_LT(tcb->snd_nxt, tcb->snd_max)) {
+            tcb->retransmits++;
+            tcp_retrans_segs++;
+        } else if (!tcb->rtt_timing) {
+            tcb->rtt_timing = 1;
+            tcb->rtt_seq = tcb->snd_nxt + len;
+            tcb->rtt_tsc = timer_read_tsc();
+        }
+        tcp_transmit(tcb, tcb->snd_nxt, flags, len);
+        tcb->snd_nxt += len;
+        if (SEQ_GT(tcb->snd_nxt, tcb->snd_max)) tcb->snd_max = tcb->snd_nxt;
+        if (!tcb->rtx_deadline) tcp_rtx_arm(tcb);
+    }
+}
+
+// Retransmit up to one segment starting at 'seq', ending early at 'end'
+static u32 tcp_retransmit(tcp_cb_t *tcb, u32 seq, u32 end) {
+    u32 data_end = tcb->snd_una + tcb->snd_len;
+    if (SEQ_GT(end, data_end)) end = data_end;
+    if (SEQ_GEQ(seq, end)) return 0;
+
+    u32 len = tcp_min(end - seq, tcp_seg_max(tcb));
+    tcp_transmit(tcb, seq, TCP_ACK, len);
+    tcb->retransmits++;
+    tcp_retrans_segs++;
+    if (SEQ_GT(seq + len, tcb->high_rxt)) tcb->high_rxt = seq + len;
+    return len;
+}
+
+// Retransmit the first hole the peer's SACK blocks reveal: data below
+// the highest block that no block covers
+static u32 tcp_retransmit_hole(tcp_cb_t *tcb) {
+    u32 seq = SEQ_GT(tcb->high_rxt, tcb->snd_una) ? tcb->high_rxt : tcb->snd_una;
+    for (u32 i = 0; i < tcb->sacked_count; i++) {
+        tcp_sack_block_t *block = &tcb->sacked[i];
+        if (SEQ_LT(seq, block->start)) return tcp_retransmit(tcb, seq, block->start);
+        if (SEQ_LT(seq, block->end)) seq = block->end;
+    }
+    return 0;
+}
+
+// ACK processing
+
+static void tcp_rtt_sample(tcp_cb_t *tcb, u32 rtt_us) {
+    if (!rtt_us) rtt_us = 1;
+    if (!tcb->srtt_us) {
+        tcb->srtt_us = rtt_us;
+        tcb->rttvar_us = rtt_us / 2;
+    } else {
+        u32 delta = tcb->srtt_us > rtt_us ? tcb->srtt_us - rtt_us : rtt_us - tcb->srtt_us;
+        tcb->rttvar_us = (3 * tcb->rttvar_us + delta) / 4;
+        tcb->srtt_us = (7 * tcb->srtt_us + rtt_us) / 8;
+    }
+
+    // RTO = SRTT + max(G, 4 * RTTVAR), G being the timer granularity
+    u32 granularity_us = 1000000 / timer_get_frequency();
+    u32 variance_us = 4 * tcb->rttvar_us > granularity_us ? 4 * tcb->rttvar_us : granularity_us;
+    u32 rto_ms = (tcb->srtt_us + variance_us + 999) / 1000;
+    if (rto_ms < TCP_RTO_MIN_MS) rto_ms = TCP_RTO_MIN_MS;
+    if (rto_ms > TCP_RTO_MAX_MS) rto_ms = TCP_RTO_MAX_MS;
+    tcb->rto_ms = rto_ms;
+}
+
+// Merge a block the peer reported into the sorted scoreboard
+static void tcp_sack_add(tcp_cb_t *tcb, u32 start, u32 end) {
+    tcp_sack_block_t merged[TCP_SACK_MAX + 1];
+    u32 count = 0;
+    int placed = 0;
+
+    for (u32 i = 0; i < tcb->sacked_count; i++) {
+        tcp_sack_block_t block = tcb->sacked[i];
+        if (SEQ_LT(block.end, start)) {
+            merged[count++] = block;
+        } else if (SEQ_GT(block.start, end)) {
+            if (!placed) {
+                merged[count].start = start;
+                merged[count++].end = end;
+                placed = 1;
+            }
+            merged[count++] = block;
+        } else {
+            if (SEQ_LT(block.start, start)) start = block.start;
+            if (SEQ_GT(block.end, end)) end = block.end;
+        }
+    }
+    if (!placed) {
+        merged[count].start = start;
+        merged[count++].end = end;
+    }
+
+    // Losing the highest block only costs a hint
+    tcb->sacked_count = tcp_min(count, TCP_SACK_MAX);
+    memcpy(tcb->sacked, merged, tcb->sacked_count * sizeof(tcp_sack_block_t));
+}
+
+static u32 tcp_sacked_bytes(tcp_cb_t *tcb) {
+    u32 bytes = 0;
+    for (u32 i = 0; i < tcb->sacked_count; i++) bytes += tcb->sacked[i].end - tcb->sacked[i].start;
+    return bytes;
+}
+
+// Forget what the cumulative ACK now covers
+static void tcp_sack_trim(tcp_cb_t *tcb) {
+    u32 count = 0;
+    for (u32 i = 0; i < tcb->sacked_count; i++) {
+        tcp_sack_block_t block = tcb->sacked[i];
+        if (SEQ_LEQ(block.end, tcb->snd_una)) continue;
+        if (SEQ_LT(block.start, tcb->snd_una)) block.start = tcb->snd_una;
+        tcb->sacked[count++] = block;
+    }
+    tcb->sacked_count = count;
+}
+
+static void tcp_dupack(tcp_cb_t *tcb) {
+    tcb->dup_acks++;
+    tcb->dupacks++;
+
+    if (tcb->in_recovery) {
+        // Each duplicate means a segment left the network: fill the next
+        // hole SACK shows, or let the inflated window send new data
+        if (!tcp_retransmit_hole(tcb)) {
+            tcb->cwnd += tcb->mss;
+            tcp_output(tcb);
+        }
+        return;
+    }
+
+    // Three duplicates: fast retransmit, unless the loss predates the
+    // last recovery or timeout (RFC 6582 4.1)
+    if (tcb->dupacks < 3 || !SEQ_GT(tcb->snd_una, tcb->recover)) return;
+
+    u32 flight = tcb->snd_max - tcb->snd_una;
+    tcb->ssthresh = flight / 2 > 2 * tcb->mss ? flight / 2 : 2 * tcb->mss;
+    tcb->cwnd = tcb->ssthresh + 3 * tcb->mss;
+    tcb->recover = tcb->snd_max;
+    tcb->high_rxt = tcb->snd_una;
+    tcb->in_recovery = 1;
+    tcb->rtt_timing = 0;
+    tcb->fast_retransmits++;
+    tcp_retransmit(tcb, tcb->snd_una, tcb->snd_max);
+    tcp_rtx_arm(tcb);
+}
+
+// Process the acknowledgement in a segment. Returns -1 if it acknowledges
+// data never sent, 1 if it acknowledges our FIN, 0 otherwise.
+static int tcp_ack(tcp_cb_t *tcb, u32 seq, u32 ack, u32 window, u32 len, tcp_options_t *opt) {
+    if (SEQ_GT(ack, tcb->snd_max)) return -1;
+    if (SEQ_LT(ack, tcb->snd_una)) return 0;  // Old
+
+    u32 sacked_before = tcp_sacked_bytes(tcb);
+    for (u32 i = 0; i < opt->sack_count; i++) {
+        tcp_sack_block_t *block = &opt->sack[i];
+        if (SEQ_LT(block->start, block->end) && SEQ_GT(block->end, ack) &&
+            SEQ_LEQ(block->end, tcb->snd_max)) {
+            tcb->sack_blocks++;
+            tcp_sack_add(tcb, SEQ_LT(block->start, ack) ? ack : block->start, block->end);
+        }
+    }
+
+    u32 old_wnd = tcb->snd_wnd;
+    if (SEQ_LT(tcb->snd_wl1, seq) || (tcb->snd_wl1 == seq && SEQ_LEQ(tcb->snd_wl2, ack))) {
+        tcb->snd_wnd = window << tcb->snd_wscale;
+        tcb->snd_wl1 = seq;
+        tcb->snd_wl2 = ack;
+    }
+
+    u32 acked = ack - tcb->snd_una;
+    if (!acked) {
+        // A duplicate carries no data and leaves the window alone (RFC
+        // 5681), or reports newly SACKed data (RFC 6675), and comes while
+        // data is outstanding
+        int duplicate = (!len && tcb->snd_wnd == old_wnd) || tcp_sacked_bytes(tcb) > sacked_before;
+        if (duplicate && tcb->snd_max != tcb->snd_una) tcp_dupack(tcb);
+        if (tcb->snd_wnd && !old_wnd) tcp_output(tcb);
+        return 0;
+    }
+
+    u32 data_acked = tcp_min(acked, tcb->snd_len);
+    int fin_acked = acked > tcb->snd_len;
+    tcb->snd_head = (tcb->snd_head + data_acked) & (TCP_SNDBUF - 1);
+    tcb->snd_len -= data_acked;
+    tcb->snd_una = ack;
+    if (SEQ_LT(tcb->snd_nxt, tcb->snd_una)) tcb->snd_nxt = tcb->snd_una;
+    tcb->bytes_acked += data_acked;
+    tcb->retries = 0;
+    tcp_sack_trim(tcb);
+    tcp_release_pages(tcb);
+
+    if (tcb->rtt_timing && SEQ_GEQ(ack, tcb->rtt_seq)) {
+        tcb->rtt_timing = 0;
+        tcp_rtt_sample(tcb, timer_cycles_to_us(timer_read_tsc() - tcb->rtt_tsc));
+    }
+
+    if (tcb->in_recovery) {
+        if (SEQ_GEQ(ack, tcb->recover)) {
+            // Full acknowledgement: deflate the window and leave recovery
+            u32 flight = tcb->snd_max - tcb->snd_una;
+            tcb->cwnd = tcp_min(tcb->ssthresh, flight + tcb->mss);
+            tcb->in_recovery = 0;
+        } else {
+            // Partial: the next segment was lost too
+            tcp_retransmit(tcb, tcb->snd_una, tcb->snd_max);
+            tcb->cwnd = tcb->cwnd > acked ? tcb->cwnd - acked : 0;
+            tcb->cwnd += tcb->mss;
+        }
+    } else if (tcb->cwnd < tcb->ssthresh) {
+        tcb->cwnd += tcp_min(acked, tcb->mss);  // Slow start
+    } else {
+        tcb->ca_acked += acked;                 // Congestion avoidance
+        if (tcb->ca_acked >= tcb->cwnd) {
+            tcb->ca_acked -= tcb->cwnd;
+            tcb->cwnd += tcb->mss;
+        }
+    }
+    if (tcb->cwnd > 0x40000000) tcb->cwnd = 0x40000000;
+    tcb->dupacks = 0;
+
+    if (tcb->snd_una == tcb->snd_max) {
+        tcb->rtx_deadline = 0;
+    } else {
+        tcp_rtx_arm(tcb);
+    }
+    return fin_acked;
+}
+
+// The retransmission timer ran out
+static void tcp_rto_expired(tcp_cb_t *tcb) {
+    if (tcb->state == TCP_SYN_SENT || tcb->state == TCP_SYN_RECEIVED) {
+        if (++tcb->retries > TCP_SYN_RETRIES) {
+            if (tcb->state == TCP_SYN_SENT) tcp_attempt_fails++;
+            tcp_closed(tcb, -NET_ETIMEDOUT);
+            return;
+        }
+        tcb->timeouts++;
+        tcb->retransmits++;
+        tcp_retrans_segs++;
+        tcb->rtt_timing = 0;
+        tcb->rto_ms = tcp_min(tcb->rto_ms * 2, TCP_RTO_MAX_MS);
+        tcp_transmit(tcb, tcb->iss, tcb->state == TCP_SYN_SENT ? TCP_SYN : TCP_SYN | TCP_ACK, 0);
+        tcp_rtx_arm(tcb);
+        return;
+    }
+    if (!tcp_can_send(tcb)) return;
+
+    // Nothing outstanding: the timer was probing a zero window. A
+    // segment just below the window makes the peer answer with its
+    // current window (RFC 9293 3.8.6.1).
+    if (tcb->snd_una == tcb->snd_max) {
+        if (!tcb->snd_wnd && tcb->snd_len) {
+            tcp_transmit(tcb, tcb->snd_una - 1, TCP_ACK, 0);
+            tcb->rto_ms = tcp_min(tcb->rto_ms * 2, TCP_RTO_MAX_MS);
+            tcp_rtx_arm(tcb);
+        }
+        return;
+    }
+
+    if (++tcb->retries > TCP_RETRIES) {
+        tcp_abort(tcb);
+        tcp_closed(tcb, -NET_ETIMEDOUT);
+        return;
+    }
+
+    // Back off, collapse the window to one segment and go back to the
+    // first unacknowledged byte (RFC 5681 3.1)
+    u32 flight = tcb->snd_max - tcb->snd_una;
+    tcb->timeouts++;
+    tcb->ssthresh = flight / 2 > 2 * tcb->mss ? flight / 2 : 2 * tcb->mss;
+    tcb->cwnd = tcb->mss;
+    tcb->ca_acked = 0;
+    tcb->recover = tcb->snd_max;
+    tcb->in_recovery = 0;
+    tcb->dupacks = 0;
+    tcb->sacked_count = 0;
+    tcb->rtt_timing = 0;
+    tcb->rto_ms = tcp_min(tcb->rto_ms * 2, TCP_RTO_MAX_MS);
+    tcb->snd_nxt = tcb->snd_una;
+    tcb->rtx_deadline = 0;
+    tcp_output(tcb);
+    if (!tcb->rtx_deadline) tcp_rtx_arm(tcb);
+}
+
+static void tcp_timer_work(void) {
+    u32 now = timer_get_ticks();
+    tcp_cb_t *next;
+
+    for (tcp_cb_t *tcb = tcp_cbs; tcb; tcb = next) {
+        next = tcb->list_next;
+        if (tcp_expired(tcb->state_deadline, now)) {
+            tcp_closed(tcb, 0);
+            continue;
+        }
+        if (tcp_expired(tcb->delack_deadline, now)) tcp_send_ack(tcb);
+        if (tcp_expired(tcb->rtx_deadline, now)) {
+            tcb->rtx_deadline = 0;
+            tcp_rto_expired(tcb);
+        }
+    }
+}
+
+// Segments in
+
+static void tcp_parse_options(const u8 *p, u32 len, tcp_options_t *opt) {
+    memset(opt, 0, sizeof(tcp_options_t));
+    while (len > 0) {
+        u8 kind = p[0];
+        if (kind == TCP_OPT_EOL) return;
+        if (kind == TCP_OPT_NOP) {
+            p++;
+            len--;
+            continue;
+        }
+        if (len < 2 || p[1] < 2 || p[1] > len) return;
+
+        u8 size = p[1];
+        if (kind == TCP_OPT_MSS && size == 4) {
+            opt->mss = (p[2] << 8) | p[3];
+        } else if (kind == TCP_OPT_WSCALE && size == 3) {
+            opt->wscale = p[2] > 14 ? 14 : p[2];
+            opt->has_wscale = 1;
+        } else if (kind == TCP_OPT_SACK_PERM && size == 2) {
+            opt->sack_ok = 1;
+        } else if (kind == TCP_OPT_SACK && size >= 10 && (size - 2) % 8 == 0) {
+            for (u32 i = 0; i < (u32)(size - 2) / 8 && i < TCP_SACK_REPORT; i++) {
+                const u8 *b = p + 2 + i * 8;
+                opt->sack[i].start = (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+                opt->sack[i].end = (b[4] << 24) | (b[5] << 16) | (b[6] << 8) | b[7];
+                opt->sack_count = i + 1;
+            }
+        }
+        p += size;
+        len -= size;
+    }
+}
+
+// Settle what the SYN from the peer negotiates
+static void tcp_apply_syn_options(tcp_cb_t *tcb, tcp_options_t *opt) {
+    tcb->mss = opt->mss ? tcp_min(opt->mss, TCP_MSS_MAX) : TCP_MSS_DEFAULT;
+    tcb->wscale_ok = opt->has_wscale;
+    tcb->snd_wscale = opt->has_wscale ? opt->wscale : 0;
+    if (!opt->has_wscale) tcb->rcv_wscale = 0;
+    tcb->sack_ok = opt->sack_ok;
+    tcb->cwnd = TCP_INIT_CWND * tcb->mss;
+}
+
+static void tcp_append_rcv(tcp_cb_t *tcb, const u8 *data, u32 len) {
+    tcp_ring_write(tcb->rcv_buf, TCP_RCVBUF, tcb->rcv_head + tcb->rcv_len, data, len);
+    tcb->rcv_len += len;
+    tcb->rcv_nxt += len;
+    tcb->bytes_received += len;
+}
+
+// Queue a segment that arrived ahead of rcv_nxt; takes the reference
+static void tcp_ooo_insert(tcp_cb_t *tcb, netbuf_t *nb, u32 seq) {
+    netbuf_t **link = &tcb->ooo_head;
+    while (*link && SEQ_LT((*link)->seq, seq)) link = &(*link)->next;
+
+    if (tcb->ooo_count >= TCP_OOO_MAX ||
+        (*link && (*link)->seq == seq && (*link)->len >= nb->len)) {
+        netbuf_put(nb);
+        return;
+    }
+    nb->seq = seq;
+    nb->next = *link;
+    *link = nb;
+    tcb->ooo_count++;
+    tcb->ooo_last = seq;
+    tcb->ooo_segments++;
+}
+
+// Take the data in a segment: in order into the receive buffer, along
+// with whatever queued segments it makes contiguous; ahead of rcv_nxt
+// onto the out-of-order queue. Takes the reference.
+static void tcp_receive_data(tcp_cb_t *tcb, netbuf_t *nb, u32 seq) {
+    if (SEQ_LT(seq, tcb->rcv_nxt)) {
+        u32 duplicate = tcb->rcv_nxt - seq;
+        if (duplicate >= nb->len) {
+            tcb->ack_now = 1;
+            netbuf_put(nb);
+            return;
+        }
+        netbuf_pull(nb, duplicate);
+        seq = tcb->rcv_nxt;
+    }
+
+    u32 right_edge = tcb->rcv_nxt + tcp_rcv_space(tcb);
+    if (SEQ_GEQ(seq, right_edge)) {
+        tcb->ack_now = 1;
+        netbuf_put(nb);
+        return;
+    }
+    if (SEQ_GT(seq + nb->len, right_edge)) nb->len = right_edge - seq;
+
+    if (seq != tcb->rcv_nxt) {
+        tcp_ooo_insert(tcb, nb, seq);
+        tcb->ack_now = 1;  // A duplicate ACK with SACK tells the sender
+        return;
+    }
+
+    tcp_append_rcv(tcb, nb->data, nb->len);
+    netbuf_put(nb);
+
+    // The window's right edge never moves left, so queued data fits
+    int filled = tcb->ooo_head != NULL;
+    while (tcb->ooo_head && SEQ_LEQ(tcb->ooo_head->seq, tcb->rcv_nxt)) {
+        netbuf_t *next = tcb->ooo_head;
+        tcb->ooo_head = next->next;
+        tcb->ooo_count--;
+        u32 skip = tcb->rcv_nxt - next->seq;
+        if (skip < next->len) tcp_append_rcv(tcb, next->data + skip, next->len - skip);
+        netbuf_put(next);
+    }
+
+    // Acknowledge every second segment, and at once when a hole closes
+    if (filled || ++tcb->ack_pending >= 2) tcb->ack_now = 1;
+}
+
+static int tcp_acceptable(tcp_cb_t *tcb, u32 seq, u32 seg_len) {
+    u32 window = tcp_rcv_space(tcb);
+    u32 right_edge = tcb->rcv_nxt + window;
+    if (seq == tcb->rcv_nxt) return 1;
+    if (!window) return 0;
+    if (SEQ_GEQ(seq, tcb->rcv_nxt) && SEQ_LT(seq, right_edge)) return 1;
+    return seg_len && SEQ_GEQ(seq + seg_len - 1, tcb->rcv_nxt) && SEQ_LT(seq + seg_len - 1, right_edge);
+}
+
+static void tcp_passive_open(tcp_cb_t *listener, u32 dst, u16 dst_port, u32 src, u16 src_port,
+                             u32 seq, u32 window, tcp_options_t *opt) {
+    if (listener->child_count >= listener->backlog) {
+        tcp_listen_drops++;
+        return;
+    }
+    tcp_cb_t *tcb = tcp_alloc();
+    if (!tcb || tcp_alloc_buffers(tcb) != 0) {
+        if (tcb) tcp_destroy(tcb);
+        tcp_listen_drops++;
+        return;
+    }
+
+    tcb->local_addr = dst;
+    tcb->local_port = dst_port;
+    tcb->remote_addr = src;
+    tcb->loopback = ip_is_local(src);
+    tcb->remote_port = src_port;
+    tcb->parent = listener;
+    listener->child_count++;
+    tcp_apply_syn_options(tcb, opt);
+
+    tcb->irs = seq;
+    tcb->rcv_nxt = seq + 1;
+    tcb->snd_wnd = window;
+    tcb->snd_wl1 = seq;
+    tcb->iss = tcp_new_iss(tcb);
+    tcb->snd_una = tcb->iss;
+    tcb->snd_nxt = tcb->iss + 1;
+    tcb->snd_max = tcb->snd_nxt;
+    tcb->snd_wl2 = tcb->iss;
+    tcb->recover = tcb->iss;
+    tcb->state = TCP_SYN_RECEIVED;
+    tcp_hash_insert(tcb);
+    tcp_passive_opens++;
+
+    tcp_transmit(tcb, tcb->iss, TCP_SYN | TCP_ACK, 0);
+    tcp_rtx_arm(tcb);
+}
+
+static void tcp_syn_sent(tcp_cb_t *tcb, tcp_header_t *tcp, u32 src, u32 dst, u32 len, tcp_options_t *opt) {
+    u32 seq = net_ntohl(tcp->seq);
+    u32 ack = net_ntohl(tcp->ack);
+
+    if ((tcp->flags & TCP_ACK) && (SEQ_LEQ(ack, tcb->iss) || SEQ_GT(ack, tcb->snd_max))) {
+        tcp_reset(src, dst, tcp, len);
+        return;
+    }
+    if (tcp->flags & TCP_RST) {
+        if (tcp->flags & TCP_ACK) {
+            tcp_attempt_fails++;
+            tcp_closed(tcb, -NET_ECONNREFUSED);
+        }
+        return;
+    }
+    if (!(tcp->flags & TCP_SYN)) return;
+
+    tcb->irs = seq;
+    tcb->rcv_nxt = seq + 1;
+    tcb->snd_wl1 = seq;
+    tcp_apply_syn_options(tcb, opt);
+
+    if (!(tcp->flags & TCP_ACK)) {
+        // Simultaneous open
+        tcb->state = TCP_SYN_RECEIVED;
+        tcp_transmit(tcb, tcb->iss, TCP_SYN | TCP_ACK, 0);
+        return;
+    }
+
+    tcb->snd_una = ack;
+    tcb->snd_wnd = net_ntohs(tcp->window);
+    tcb->snd_wl2 = ack;
+    tcb->state = TCP_ESTABLISHED;
+    tcb->rtx_deadline = 0;
+    tcb->retries = 0;
+    if (tcb->rtt_timing) {
+        tcb->rtt_timing = 0;
+        tcp_rtt_sample(tcb, timer_cycles_to_us(timer_read_tsc() - tcb->rtt_tsc));
+    }
+    tcb->ack_now = 1;
+}
+
+// A segment for a connection past SYN-SENT (RFC 9293 3.10.7.4)
+static void tcp_segment(tcp_cb_t *tcb, tcp_header_t *tcp, netbuf_t *nb, tcp_options_t *opt) {
+    u32 seq = net_ntohl(tcp->seq);
+    u32 ack = net_ntohl(tcp->ack);
+    u8 flags = tcp->flags;
+    u32 len = nb->len;
+    u32 seg_len = len + ((flags & TCP_SYN) ? 1 : 0) + ((flags & TCP_FIN) ? 1 : 0);
+
+    if (!tcp_acceptable(tcb, seq, seg_len)) {
+        if (!(flags & TCP_RST)) tcp_send_ack(tcb);
+        if (tcb->state == TCP_TIME_WAIT && (flags & TCP_FIN)) {
+            tcb->state_deadline = tcp_deadline(TCP_TIME_WAIT_MS);
+        }
+        netbuf_put(nb);
+        return;
+    }
+
+    if (flags & TCP_RST) {
+        if (tcb->state != TCP_SYN_RECEIVED && tcb->state != TCP_TIME_WAIT) tcp_estab_resets++;
+        tcp_closed(tcb, tcb->state == TCP_CLOSE_WAIT || tcb->state == TCP_ESTABLISHED ||
+                        tcb->state == TCP_FIN_WAIT_1 || tcb->state == TCP_FIN_WAIT_2 ?
+                        -NET_ECONNRESET : 0);
+        netbuf_put(nb);
+        return;
+    }
+
+    // A SYN on a synchronized connection gets a challenge ACK (RFC 5961)
+    if ((flags & TCP_SYN) || !(flags & TCP_ACK)) {
+        if (flags & TCP_SYN) tcp_send_ack(tcb);
+        netbuf_put(nb);
+        return;
+    }
+
+    if (tcb->state == TCP_SYN_RECEIVED) {
+        if (SEQ_LEQ(ack, tcb->snd_una) || SEQ_GT(ack, tcb->snd_max)) {
+            tcp_reset(tcb->remote_addr, tcb->local_addr, tcp, seg_len);
+            netbuf_put(nb);
+            return;
+        }
+        tcb->snd_una = ack;
+        tcb->snd_wnd = net_ntohs(tcp->window) << tcb->snd_wscale;
+        tcb->snd_wl1 = seq;
+        tcb->snd_wl2 = ack;
+        tcb->state = TCP_ESTABLISHED;
+        tcb->rtx_deadline = 0;
+        tcb->retries = 0;
+
+        tcp_cb_t *parent = tcb->parent;
+        if (parent) {
+            tcb->accept_next = NULL;
+            if (parent->accept_tail) {
+                parent->accept_tail->accept_next = tcb;
+            } else {
+                parent->accept_head = tcb;
+            }
+            parent->accept_tail = tcb;
+            if (parent->sock) poll_wake(&parent->sock->poll, POLLIN);
+        }
+    } else {
+        int result = tcp_ack(tcb, seq, ack, net_ntohs(tcp->window), len, opt);
+        if (result < 0) {
+            tcp_send_ack(tcb);
+            netbuf_put(nb);
+            return;
+        }
+        if (result > 0) {
+            if (tcb->state == TCP_FIN_WAIT_1) {
+                tcb->state = TCP_FIN_WAIT_2;
+                if (!tcb->sock) tcb->state_deadline = tcp_deadline(TCP_FIN_TIMEOUT_MS);
+            } else if (tcb->state == TCP_CLOSING) {
+                tcp_time_wait(tcb);
+            } else if (tcb->state == TCP_LAST_ACK) {
+                tcp_closed(tcb, 0);
+                netbuf_put(nb);
+                return;
+            }
+        }
+    }
+
+    int receiving = tcb->state == TCP_ESTABLISHED || tcb->state == TCP_FIN_WAIT_1 ||
+                    tcb->state == TCP_FIN_WAIT_2;
+    if (len && receiving) {
+        // Nobody will read it: the application closed the socket
+        if (!tcb->sock && !tcb->parent) {
+            tcp_abort(tcb);
+            tcp_closed(tcb, 0);
+            netbuf_put(nb);
+            return;
+        }
+        tcp_receive_data(tcb, nb, seq);
+        nb = NULL;
+    }
+
+    if ((flags & TCP_FIN) && receiving && seq + len == tcb->rcv_nxt) {
+        tcb->rcv_nxt++;
+        tcb->fin_received = 1;
+        tcb->ack_now = 1;
+        if (tcb->state == TCP_ESTABLISHED) {
+            tcb->state = TCP_CLOSE_WAIT;
+        } else if (tcb->state == TCP_FIN_WAIT_1) {
+            tcb->state = TCP_CLOSING;
+        } else {
+            tcp_send_ack(tcb);
+            tcp_time_wait(tcb);
+        }
+    }
+
+    tcp_output(tcb);
+    if (tcb->ack_now) {
+        tcp_send_ack(tcb);
+    } else if (tcb->ack_pending && !tcb->delack_deadline) {
+        tcb->delack_deadline = tcp_deadline(TCP_DELACK_MS);
+    }
+    if (nb) netbuf_put(nb);
+}
+
+void tcp_input(netbuf_t *nb, ip_header_t *ip) {
+    tcp_header_t *tcp = (tcp_header_t *)nb->data;
+    u32 header_len = nb->len >= sizeof(tcp_header_t) ? (tcp->data_offset >> 4) * 4 : 0;
+    u32 src = net_ntohl(ip->src);
+    u32 dst = net_ntohl(ip->dst);
+
+    if (header_len < sizeof(tcp_header_t) || header_len > nb->len || !ip_is_local(dst) ||
+        (!(nb->flags & NETBUF_LOCAL) && ip_pseudo_checksum(src, dst, PROTO_TCP, tcp, nb->len) != 0)) {
+        tcp_in_errs++;
+        netbuf_put(nb);
+        return;
+    }
+    tcp_in_segs++;
+
+    tcp_options_t opt;
+    tcp_parse_options((const u8 *)(tcp + 1), header_len - sizeof(tcp_header_t), &opt);
+    netbuf_pull(nb, header_len);
+    u32 seg_len = nb->len + ((tcp->flags & TCP_SYN) ? 1 : 0) + ((tcp->flags & TCP_FIN) ? 1 : 0);
+    u16 src_port = net_ntohs(tcp->src_port);
+    u16 dst_port = net_ntohs(tcp->dst_port);
+
+    tcp_cb_t *tcb = tcp_find(dst, dst_port, src, src_port);
+    if (!tcb) {
+        tcp_cb_t *listener = tcp_find_listener(dst, dst_port);
+        if (listener && (tcp->flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN) {
+            tcp_passive_open(listener, dst, dst_port, src, src_port, net_ntohl(tcp->seq),
+                             net_ntohs(tcp->window), &opt);
+        } else {
+            tcp_reset(src, dst, tcp, seg_len);
+        }
+        netbuf_put(nb);
+        return;
+    }
+
+    // A control block with a socket outlives the segment, so it can be
+    // compared afterwards to see what the socket's waiters should hear
+    socket_t *sock = tcb->sock;
+    u32 events = sock ? tcp_poll(sock) : 0;
+    u32 received = tcb->bytes_received;
+    u32 acked = tcb->bytes_acked;
+
+    tcb->segs_in++;
+    if (tcb->state == TCP_SYN_SENT) {
+        tcp_syn_sent(tcb, tcp, src, dst, seg_len, &opt);
+        if (tcb->state != TCP_CLOSED && tcb->ack_now) {
+            tcp_output(tcb);
+            if (tcb->ack_now) tcp_send_ack(tcb);
+        }
+        netbuf_put(nb);
+    } else {
+        tcp_segment(tcb, tcp, nb, &opt);
+    }
+    if (!sock) return;
+
+    // Newly set events, and for edge-triggered waiters, more data or room
+    u32 now = tcp_poll(sock);
+    events = now & ~events;
+    if (tcb->bytes_received != received) events |= now & POLLIN;
+    if (tcb->bytes_acked != acked) events |= now & POLLOUT;
+    if (events) poll_wake(&sock->poll, events);
+}
+
+// Socket calls
+
+static int tcp_port_in_use(u32 addr, u16 port) {
+    for (socket_t *sock = tcp_bind_hash[tcp_port_bucket(port)]; sock; sock = sock->hash_next) {
+        if (sock->local_port == port && (!addr || !sock->local_addr || sock->local_addr == addr)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Bind a socket; port 0 picks a free ephemeral port
+int tcp_bind(socket_t *sock, u32 addr, u16 port) {
+    if (!port) {
+        for (u32 tries = TCP_EPHEMERAL_LAST - TCP_EPHEMERAL_FIRST + 1; tries > 0; tries--) {
+            u16 candidate = tcp_next_ephemeral;
+            tcp_next_ephemeral = candidate == TCP_EPHEMERAL_LAST ? TCP_EPHEMERAL_FIRST : candidate + 1;
+            if (!tcp_port_in_use(addr, candidate)) {
+                port = candidate;
+                break;
+            }
+        }
+        if (!port) return -NET_EADDRINUSE;
+    } else if (tcp_port_in_use(addr, port)) {
+        return -NET_EADDRINUSE;
+    }
+
+    sock->local_addr = addr;
+    sock->local_port = port;
+    u32 bucket = tcp_port_bucket(port);
+    sock->hash_next = tcp_bind_hash[bucket];
+    tcp_bind_hash[bucket] = sock;
+    return 0;
+}
+
+static void tcp_unbind(socket_t *sock) {
+    socket_t **link = &tcp_bind_hash[tcp_port_bucket(sock->local_port)];
+    while (*link && *link != sock) link = &(*link)->hash_next;
+    if (*link) *link = sock->hash_next;
+    sock->hash_next = NULL;
+    sock->local_port = 0;
+}
+
+int tcp_listen(socket_t *sock, u32 backlog) {
+    if (sock->tcb) {
+        if (sock->tcb->state != TCP_LISTEN) return -NET_EISCONN;
+        sock->tcb->backlog = backlog;
+        return 0;
+    }
+    if (!sock->local_port) {
+        int result = tcp_bind(sock, 0, 0);
+        if (result != 0) return result;
+    }
+
+    tcp_cb_t *tcb = tcp_alloc();
+    if (!tcb) return -NET_ENOMEM;
+    tcb->state = TCP_LISTEN;
+    tcb->local_addr = sock->local_addr;
+    tcb->local_port = sock->local_port;
+    tcb->backlog = backlog;
+    tcb->sock = sock;
+    sock->tcb = tcb;
+    return 0;
+}
+
+int tcp_accept_ready(socket_t *sock) {
+    return !sock->tcb || sock->tcb->state != TCP_LISTEN || sock->tcb->accept_head;
+}
+
+int tcp_accept(socket_t *listener, socket_t *sock, u32 *addr, u16 *port) {
+    tcp_cb_t *parent = listener->tcb;
+    if (!parent || parent->state != TCP_LISTEN) return -NET_EINVAL;
+
+    tcp_cb_t *tcb = parent->accept_head;
+    parent->accept_head = tcb->accept_next;
+    if (!parent->accept_head) parent->accept_tail = NULL;
+    parent->child_count--;
+
+    tcb->parent = NULL;
+    tcb->accept_next = NULL;
+    tcb->sock = sock;
+    sock->tcb = tcb;
+    sock->local_addr = tcb->local_addr;
+    sock->local_port = tcb->local_port;
+    if (addr) *addr = tcb->remote_addr;
+    if (port) *port = tcb->remote_port;
+    return 0;
+}
+
+static int tcp_connect_done(socket_t *sock) {
+    return sock->tcb->state != TCP_SYN_SENT && sock->tcb->state != TCP_SYN_RECEIVED;
+}
+
+int tcp_connect(socket_t *sock, u32 addr, u16 port) {
+    tcp_cb_t *tcb = sock->tcb;
+    if (tcb) {
+        if (tcb->state == TCP_LISTEN) return -NET_EINVAL;
+        if (tcb->state == TCP_CLOSED) return tcb->error ? tcb->error : -NET_EINVAL;
+        return tcp_connect_done(sock) ? -NET_EISCONN : -NET_EALREADY;
+    }
+
+    // The source address is part of the connection's identity, so settle
+    // it now the way ip_output would
+    u32 src = sock->local_addr;
+    if (!src) {
+        u32 next_hop;
+        network_interface_t *iface = ip_route(addr, &next_hop);
+        if (!iface) return -NET_ENETUNREACH;
+        src = iface->transmit ? iface->ip_address : addr;
+    }
+    if (!sock->local_port) {
+        int result = tcp_bind(sock, 0, 0);
+        if (result != 0) return result;
+    }
+    if (tcp_find(src, sock->local_port, addr, port)) return -NET_EADDRINUSE;
+
+    tcb = tcp_alloc();
+    if (!tcb || tcp_alloc_buffers(tcb) != 0) {
+        if (tcb) tcp_destroy(tcb);
+        return -NET_ENOMEM;
+    }
+    tcb->local_addr = src;
+    tcb->local_port = sock->local_port;
+    tcb->remote_addr = addr;
+    tcb->loopback = ip_is_local(addr);
+    tcb->remote_port = port;
+    tcb->iss = tcp_new_iss(tcb);
+    tcb->snd_una = tcb->iss;
+    tcb->snd_nxt = tcb->iss + 1;
+    tcb->snd_max = tcb->snd_nxt;
+    tcb->recover = tcb->iss;
+    tcb->state = TCP_SYN_SENT;
+    tcb->sock = sock;
+    sock->tcb = tcb;
+    tcp_hash_insert(tcb);
+    tcp_active_opens++;
+
+    tcb->rtt_timing = 1;
+    tcb->rtt_seq = tcb->snd_nxt;
+    tcb->rtt_tsc = timer_read_tsc();
+    tcp_transmit(tcb, tcb->iss, TCP_SYN, 0);
+    tcp_rtx_arm(tcb);
+    if (sock->nonblocking) return -NET_EINPROGRESS;
+
+    int result = socket_block(sock, 0, sock->rx_timeout_ms, tcp_connect_done);
+    if (result == 0 && tcb->state == TCP_CLOSED) result = tcb->error;
+    if (result != 0) {
+        // Leave the socket free for another attempt
+        sock->tcb = NULL;
+        tcb->sock = NULL;
+        if (tcb->state == TCP_CLOSED) {
+            tcp_destroy(tcb);
+        } else {
+            tcp_closed(tcb, 0);
+        }
+        return result == -NET_EAGAIN ? -NET_ETIMEDOUT : result;
+    }
+    return 0;
+}
+
+static int tcp_writable(socket_t *sock) {
+    tcp_cb_t *tcb = sock->tcb;
+    return tcb->state != TCP_ESTABLISHED && tcb->state != TCP_CLOSE_WAIT ?
+           tcp_connect_done(sock) : tcb->snd_len < TCP_SNDBUF;
+}
+
+// Queue data for sending. Blocking sockets wait until all of it is
+// queued; non-blocking ones take what fits.
+int tcp_send(socket_t *sock, const void *buf, u32 len, int flags) {
+    tcp_cb_t *tcb = sock->tcb;
+    if (!tcb || tcb->state == TCP_LISTEN) return -NET_ENOTCONN;
+
+    u32 sent = 0;
+    while (sent < len) {
+        int result = socket_block(sock, flags, sock->tx_timeout_ms, tcp_writable);
+        if (result == 0 && tcb->error) result = tcb->error;
+        if (result == 0 && tcb->state != TCP_ESTABLISHED && tcb->state != TCP_CLOSE_WAIT) {
+            result = -NET_EPIPE;
+        }
+        if (result != 0) return sent ? (int)sent : result;
+
+        u32 count = tcp_min(len - sent, TCP_SNDBUF - tcb->snd_len);
+        tcp_ring_write(tcb->snd_buf, TCP_SNDBUF, tcb->snd_head + tcb->snd_len,
+                       (const u8 *)buf + sent, count);
+        tcb->snd_len += count;
+        sent += count;
+        tcp_output(tcb);
+    }
+    return sent;
+}
+
+static int tcp_page_writable(socket_t *sock) {
+    return tcp_writable(sock) && sock->tcb->snd_page_count < TCP_SNDPAGES;
+}
+
+// Queue 'count' bytes of a file from 'offset' for sending. Whole runs of
+// plain file pages are queued by reference; whatever the file system
+// cannot lend out (compressed pages, log-mode files, the ext2 volume) is
+// read straight into the send buffer. Blocks like tcp_send; returns the
+// bytes queued, which stop short at the end of the file.
+int tcp_sendfile(socket_t *sock, const char *name, u32 offset, u32 count, int flags) {
+    tcp_cb_t *tcb = sock->tcb;
+    if (!tcb || tcb->state == TCP_LISTEN) return -NET_ENOTCONN;
+
+    u32 sent = 0;
+    while (sent < count) {
+        int result = socket_block(sock, flags, sock->tx_timeout_ms, tcp_page_writable);
+        if (result == 0 && tcb->error) result = tcb->error;
+        if (result == 0 && tcb->state != TCP_ESTABLISHED && tcb->state != TCP_CLOSE_WAIT) {
+            result = -NET_EPIPE;
+        }
+        if (result != 0) return sent ? (int)sent : result;
+
+        u32 room = tcp_min(count - sent, TCP_SNDBUF - tcb->snd_len);
+        fs_page_ref_t refs[TCP_SNDPAGES];
+        int pages = fs_get_pages(name, offset + sent, room, refs, TCP_SNDPAGES - tcb->snd_page_count);
+        if (pages < 0) return sent ? (int)sent : -NET_ENOENT;
+
+        for (int i = 0; i < pages; i++) {
+            tcp_page_t *page = tcp_page_at(tcb, tcb->snd_page_count++);
+            page->seq = tcb->snd_una + tcb->snd_len;
+            page->len = refs[i].len;
+            page->data = refs[i].data;
+            page->page = refs[i].page;
+            tcb->snd_len += refs[i].len;
+            sent += refs[i].len;
+            tcp_sendfile_pages += refs[i].len;
+        }
+
+        if (!pages) {
+            // Nothing to reference here: copy into the buffer, in two
+            // parts if it wraps
+            u32 pos = (tcb->snd_head + tcb->snd_len) & (TCP_SNDBUF - 1);
+            u32 first = tcp_min(room, TCP_SNDBUF - pos);
+            int copied = fs_read_at(name, offset + sent, (char *)tcb->snd_buf + pos, first);
+            if (copied == (int)first && room > first) {
+                int more = fs_read_at(name, offset + sent + first, (char *)tcb->snd_buf, room - first);
+                if (more > 0) copied += more;
+            }
+            if (copied < 0) return sent ? (int)sent : -NET_ENOENT;
+            if (copied == 0) break;  // End of file
+            tcb->snd_len += copied;
+            sent += copied;
+            tcp_sendfile_copied += copied;
+        }
+        tcp_output(tcb);
+    }
+    return sent;
+}
+
+static int tcp_readable(socket_t *sock) {
+    tcp_cb_t *tcb = sock->tcb;
+    return tcb->rcv_len || tcb->fin_received || tcb->state == TCP_CLOSED || tcb->state == TCP_LISTEN;
+}
+
+// Read what has arrived, up to 'len' bytes; 0 at end of stream
+int tcp_recv(socket_t *sock, void *buf, u32 len, int flags) {
+    tcp_cb_t *tcb = sock->tcb;
+    if (!tcb || tcb->state == TCP_LISTEN) return -NET_ENOTCONN;
+
+    int result = socket_block(sock, flags, sock->rx_timeout_ms, tcp_readable);
+    if (result != 0) return result;
+    if (!tcb->rcv_len) return tcb->error;
+
+    u32 count = tcp_min(len, tcb->rcv_len);
+    tcp_ring_read(tcb->rcv_buf, TCP_RCVBUF, tcb->rcv_head, (u8 *)buf, count);
+    tcb->rcv_head = (tcb->rcv_head + count) & (TCP_RCVBUF - 1);
+    tcb->rcv_len -= count;
+
+    // Tell the peer once the window has opened by two segments or half
+    // the buffer, not for every byte read (receiver-side silly window
+    // avoidance)
+    u32 opened = tcb->rcv_nxt + tcp_rcv_space(tcb) - tcb->rcv_adv;
+    if ((tcb->state == TCP_ESTABLISHED || tcb->state == TCP_FIN_WAIT_1 || tcb->state == TCP_FIN_WAIT_2) &&
+        (opened >= 2 * tcb->mss || opened >= TCP_RCVBUF / 2)) {
+        tcp_send_ack(tcb);
+    }
+    return count;
+}
+
+// The application is done with the socket. Queued data still goes out,
+// followed by a FIN; unread data makes it a reset instead (RFC 2525).
+void tcp_close(socket_t *sock) {
+    tcp_unbind(sock);
+    tcp_cb_t *tcb = sock->tcb;
+    if (!tcb) return;
+    sock->tcb = NULL;
+    tcb->sock = NULL;
+
+    switch (tcb->state) {
+        case TCP_LISTEN: {
+            tcp_cb_t *next;
+            for (tcp_cb_t *child = tcp_cbs; child; child = next) {
+                next = child->list_next;
+                if (child->parent != tcb) continue;
+                tcp_abort(child);
+                tcp_closed(child, 0);
+            }
+            tcp_destroy(tcb);
+            break;
+        }
+        case TCP_ESTABLISHED:
+        case TCP_CLOSE_WAIT:
+            if (tcb->rcv_len) {
+                tcp_abort(tcb);
+                tcp_closed(tcb, 0);
+                break;
+            }
+            tcb->fin_queued = 1;
+            tcb->state = tcb->state == TCP_ESTABLISHED ? TCP_FIN_WAIT_1 : TCP_LAST_ACK;
+            tcp_output(tcb);
+            break;
+        default:
+            tcp_closed(tcb, 0);
+            break;
+    }
+}
+
+// Events for epoll. A connecting socket becomes writable once connected.
+u32 tcp_poll(socket_t *sock) {
+    tcp_cb_t *tcb = sock->tcb;
+    if (!tcb) return POLLOUT | POLLHUP;
+    if (tcb->state == TCP_LISTEN) return tcb->accept_head ? POLLIN : 0;
+
+    u32 events = 0;
+    if (tcb->rcv_len || tcb->fin_received) events |= POLLIN;
+    if ((tcb->state == TCP_ESTABLISHED || tcb->state == TCP_CLOSE_WAIT) && tcb->snd_len < TCP_SNDBUF) {
+        events |= POLLOUT;
+    }
+    if (tcb->state == TCP_CLOSED) events |= POLLIN | POLLHUP | (tcb->error ? POLLERR : 0);
+    return events;
+}
+
+int tcp_get_info(socket_t *sock, tcp_info_t *info) {
+    tcp_cb_t *tcb = sock->tcb;
+    if (!tcb) return -NET_ENOTCONN;
+
+    memset(info, 0, sizeof(tcp_info_t));
+    info->state = tcb->state;
+    info->mss = tcb->mss;
+    info->cwnd = tcb->cwnd;
+    info->ssthresh = tcb->ssthresh;
+    info->srtt_us = tcb->srtt_us;
+    info->rttvar_us = tcb->rttvar_us;
+    info->rto_ms = tcb->rto_ms;
+    info->snd_wnd = tcb->snd_wnd;
+    info->rcv_wnd = tcp_rcv_space(tcb);
+    info->snd_wscale = tcb->snd_wscale;
+    info->rcv_wscale = tcb->rcv_wscale;
+    info->sack_ok = tcb->sack_ok;
+    info->unacked = tcb->snd_max - tcb->snd_una;
+    info->segs_in = tcb->segs_in;
+    info->segs_out = tcb->segs_out;
+    info->bytes_acked = tcb->bytes_acked;
+    info->bytes_received = tcb->bytes_received;
+    info->retransmits = tcb->retransmits;
+    info->fast_retransmits = tcb->fast_retransmits;
+    info->timeouts = tcb->timeouts;
+    info->dup_acks = tcb->dup_acks;
+    info->sack_blocks = tcb->sack_blocks;
+    info->ooo_segments = tcb->ooo_segments;
+    return 0;
+}
+
+void tcp_stats(void) {
+    vga_printf("  TCP: %u active opens, %u passive, %u failed, %u resets, %u connections\n",
+               tcp_active_opens, tcp_passive_opens, tcp_attempt_fails, tcp_estab_resets, tcp_count);
+    vga_printf("       %u segments in (%u errors), %u out, %u retransmitted, %u resets sent, "
+               "%u listen drops\n", tcp_in_segs, tcp_in_errs, tcp_out_segs, tcp_retrans_segs,
+               tcp_out_rsts, tcp_listen_drops);
+    vga_printf("       sendfile: %u bytes by reference, %u copied; %u segments sent from pages\n",
+               tcp_sendfile_pages, tcp_sendfile_copied, tcp_zerocopy_segs);
+}
+
+static void tcp_print_endpoint(u32 ip, u16 port) {
+    vga_printf("%d.%d.%d.%d:%u", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF,
+               (ip >> 8) & 0xFF, ip & 0xFF, port);
+}
+
+// Connections with their congestion and timer state, for tuning
+void tcp_list(void) {
+    for (tcp_cb_t *tcb = tcp_cbs; tcb; tcb = tcb->list_next) {
+        vga_printf("  tcp ");
+        tcp_print_endpoint(tcb->local_addr, tcb->local_port);
+        if (tcb->state == TCP_LISTEN) {
+            vga_printf("  LISTEN, %u/%u queued\n", tcb->child_count, tcb->backlog);
+            continue;
+        }
+        vga_printf(" -> ");
+        tcp_print_endpoint(tcb->remote_addr, tcb->remote_port);
+        vga_printf("  %s\n", tcp_state_names[tcb->state]);
+        if (tcb->state == TCP_TIME_WAIT || tcb->state == TCP_CLOSED) continue;
+
+        vga_printf("    mss %u cwnd %u ssthresh %u wnd %u/%u (scale %u/%u)%s rtt %u/%u us rto %u ms\n",
+                   tcb->mss, tcb->cwnd, tcb->ssthresh < 0x7FFFFFFF ? tcb->ssthresh : 0,
+                   tcb->snd_wnd, tcp_rcv_space(tcb), tcb->snd_wscale, tcb->rcv_wscale,
+                   tcb->sack_ok ? " sack" : "", tcb->srtt_us, tcb->rttvar_us, tcb->rto_ms);
+        vga_printf("    %u/%u segs in/out, %u retrans (%u fast, %u timeouts), %u dupacks, "
+                   "%u sack blocks, %u out of order\n",
+                   tcb->segs_in, tcb->segs_out, tcb->retransmits, tcb->fast_retransmits,
+                   tcb->timeouts, tcb->dup_acks, tcb->sack_blocks, tcb->ooo_segments);
+    }
+}
+
+// Benchmark: a bulk transfer, over loopback by default, where this side
+// both sends and receives and checks every byte; or to a remote sink
+// (a discard server, say), where it sends and waits for the last
+// acknowledgement. The data is a byte pattern copied in by send, or a
+// file sent over and over by sendfile.
+
+#define TCP_BENCH_PORT    5001
+#define TCP_BENCH_CHUNK   8192
+#define TCP_BENCH_TIMEOUT 5000    // ms without progress before giving up
+#define TCP_BENCH_FILE    65536   // Bytes of a file sent over and over
+
+static int tcp_all_acked(socket_t *sock) {
+    tcp_cb_t *tcb = sock->tcb;
+    return !tcb || tcb->snd_una == tcb->snd_max || !tcp_can_send(tcb);
+}
+
+static void tcp_bench_report(int fd, const char *op, u32 bytes, u32 elapsed_us, u32 errors,
+                             int machine) {
+    tcp_info_t info;
+    memset(&info, 0, sizeof(tcp_info_t));
+    tcp_get_info(socket_get(fd), &info);
+    u32 kbps = elapsed_us ? udiv64((u64)bytes * 8000, elapsed_us) : 0;
+
+    if (machine) {
+        vga_printf("BENCH suite=tcp op=%s bytes=%u total_us=%u kbit_per_sec=%u errors=%u "
+                   "segs_out=%u retransmits=%u fast_retransmits=%u timeouts=%u cwnd=%u srtt_us=%u\n",
+                   op, bytes, elapsed_us, kbps, errors, info.segs_out, info.retransmits,
+                   info.fast_retransmits, info.timeouts, info.cwnd, info.srtt_us);
+    } else {
+        vga_printf("%s: %u bytes in %u us: %u.%03u Mbit/s, %u errors\n",
+                   op, bytes, elapsed_us, kbps / 1000, kbps % 1000, errors);
+        vga_printf("sender: %u segments, %u retransmitted (%u fast, %u timeouts), cwnd %u, "
+                   "srtt %u us\n", info.segs_out, info.retransmits, info.fast_retransmits,
+                   info.timeouts, info.cwnd, info.srtt_us);
+    }
+}
+
+// Queue the next part of the stream: the pattern from 'pattern', or the
+// file, whose 'file_size' bytes repeat
+static int tcp_bench_send(int fd, const u8 *pattern, const char *file, u32 file_size,
+                          u32 sent, u32 total, int flags) {
+    u32 len = total - sent < TCP_BENCH_CHUNK ? total - sent : TCP_BENCH_CHUNK;
+    if (!file) return network_send(fd, pattern + (sent & 0xFF), len, flags);
+
+    u32 offset = sent % file_size;
+    if (len > file_size - offset) len = file_size - offset;
+    return network_sendfile(fd, file, offset, len, flags);
+}
+
+void tcp_bench(u32 kbytes, u32 addr, u16 port, const char *file, int machine) {
+    if (kbytes < 1) kbytes = 1;
+    u32 total = kbytes * 1024;
+    int loopback = !addr;
+    if (loopback) {
+        addr = IP_LOOPBACK;
+        port = TCP_BENCH_PORT;
+    }
+
+    // Byte n of the stream is (u8)n, sent from a buffer one pattern
+    // period longer than a chunk so any offset can start a send
+    u8 *pattern = (u8 *)kmalloc(TCP_BENCH_CHUNK + 256);
+    u8 *buf = (u8 *)kmalloc(TCP_BENCH_CHUNK);
+    u8 *contents = file ? (u8 *)kmalloc(TCP_BENCH_FILE + 1) : NULL;
+    u32 file_size = 0;
+    int listener = -1, server = -1;
+    int client = network_socket(AF_INET, SOCK_STREAM, 0);
+
+    int result = 0;
+    if (client < 0) {
+        result = client;
+    } else if (!pattern || !buf || (file && !contents)) {
+        result = -NET_ENOMEM;
+    } else if (file) {
+        // Kept to check what arrives over loopback
+        int size = fs_read_file(file, (char *)contents, TCP_BENCH_FILE + 1);
+        if (size <= 0) {
+            vga_printf("tcpbench: Cannot read %s\n", file);
+            goto out;
+        }
+        file_size = size;
+    }
+    if (result == 0 && loopback) {
+        listener = network_socket(AF_INET, SOCK_STREAM, 0);
+        result = listener < 0 ? listener : network_bind(listener, IP_LOOPBACK, TCP_BENCH_PORT);
+        if (result == 0) result = network_listen(listener, 1);
+    }
+    if (result != 0) {
+        vga_printf("tcpbench: Cannot set up sockets (error %d)\n", -result);
+        goto out;
+    }
+    for (u32 i = 0; i < TCP_BENCH_CHUNK + 256; i++) pattern[i] = (u8)i;
+
+    if (machine) {
+        vga_printf("BENCH-CONFIG suite=tcp bytes=%u peer=%d.%d.%d.%d:%u tsc_khz=%u\n", total,
+                   (addr >> 24) & 0xFF, (addr >> 16) & 0xFF, (addr >> 8) & 0xFF, addr & 0xFF,
+                   port, timer_tsc_khz());
+    } else {
+        vga_printf("tcp bench: %u KB to %d.%d.%d.%d:%u, TSC %u MHz\n", kbytes,
+                   (addr >> 24) & 0xFF, (addr >> 16) & 0xFF, (addr >> 8) & 0xFF, addr & 0xFF,
+                   port, timer_tsc_khz() / 1000);
+    }
+
+    network_setsockopt(client, SO_RCVTIMEO, TCP_BENCH_TIMEOUT);
+    network_setsockopt(client, SO_SNDTIMEO, TCP_BENCH_TIMEOUT);
+    if (listener >= 0) {
+        network_setsockopt(listener, SO_RCVTIMEO, TCP_BENCH_TIMEOUT);
+        network_setsockopt(client, SO_NONBLOCK, 1);
+        result = network_connect(client, addr, port);
+        if (result == -NET_EINPROGRESS) {
+            server = network_accept(listener, NULL, NULL);
+            result = server < 0 ? server : 0;
+        }
+    } else {
+        result = network_connect(client, addr, port);
+    }
+    if (result != 0) {
+        vga_printf("tcpbench: Cannot connect (error %d)\n", -result);
+        goto out;
+    }
+
+    u32 sent = 0, received = 0, errors = 0;
+    u64 start = timer_read_tsc();
+    if (server < 0) {
+        // Remote: blocking sends, then wait for everything to be acknowledged
+        while (sent < total) {
+            int count = tcp_bench_send(client, pattern, file, file_size, sent, total, 0);
+            if (count <= 0) {
+                errors++;
+                break;
+            }
+            sent += count;
+        }
+        socket_t *sock = socket_get(client);
+        socket_block(sock, 0, TCP_BENCH_TIMEOUT, tcp_all_acked);
+        received = sock->tcb ? sock->tcb->bytes_acked : 0;
+    } else {
+        // Loopback: send what the buffer takes, read what has arrived
+        u32 last_progress = timer_get_ticks();
+        u32 timeout = TCP_BENCH_TIMEOUT * timer_get_frequency() / 1000;
+        while (received < total) {
+            int progress = 0;
+            if (sent < total) {
+                int count = tcp_bench_send(client, pattern, file, file_size, sent, total,
+                                           MSG_DONTWAIT);
+                if (count > 0) {
+                    sent += count;
+                    progress = 1;
+                } else if (count != -NET_EAGAIN) {
+                    errors++;
+                    break;
+                }
+            }
+
+            int count = network_recv(server, buf, TCP_BENCH_CHUNK, MSG_DONTWAIT);
+            if (count > 0) {
+                for (int i = 0; i < count; i++) {
+                    u8 expected = file ? contents[(received + i) % file_size] : (u8)(received + i);
+                    if (buf[i] != expected) errors++;
+                }
+                received += count;
+                progress = 1;
+            } else if (count != -NET_EAGAIN) {
+                errors++;
+                break;
+            }
+
+            if (progress) {
+                last_progress = timer_get_ticks();
+            } else if (timer_get_ticks() - last_progress >= timeout) {
+                vga_printf("tcpbench: Stalled after %u bytes\n", received);
+                errors++;
+                break;
+            }
+        }
+    }
+    u32 elapsed_us = timer_cycles_to_us(timer_read_tsc() - start);
+    tcp_bench_report(client, file ? "sendfile" : "stream", received, elapsed_us, errors, machine);
+
+out:
+    if (server >= 0) network_close(server);
+    if (client >= 0) network_close(client);
+    if (listener >= 0) network_close(listener);
+    if (contents) kfree(contents);
+    if (buf) kfree(buf);
+    if (pattern) kfree(pattern);
+}
@@ -1,16 +1,24 @@
 #include "kernel.h"
 #include "vga.h"
+#include "io.h"
 
 // Timer state
 static u32 timer_ticks = 0;
 static u32 timer_frequency = 100; // 100 Hz default
 
+// Time stamp counter rate, calibrated against the PIT at boot
+static u32 tsc_khz = 0;
+
+#define PIT_HZ            1193180
+#define TSC_CALIBRATE_MS  10
+
 // External function declarations
 extern void register_interrupt_handler(u8 n, void (*handler)(void));
 
 // Timer interrupt handler
 void timer_handler(void) {
     timer_ticks++;
+    kthread_tick();
     
     // Simple scheduler trigger every 10 ticks (0.1 seconds at 100Hz)
     if (timer_ticks % 10 == 0) {
@@ -18,6 +26,52 @@ void timer_handler(void) {
     }
 }
 
+u64 timer_read_tsc(void) {
+    u32 lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
+// Count TSC cycles while PIT channel 2 counts down 10 ms. Channel 2 is
+// gated through port 0x61 and needs no interrupts, so this works
+// before interrupts are enabled.
+static void timer_calibrate_tsc(void) {
+    u8 saved = inb(0x61);
+    u32 count = PIT_HZ / (1000 / TSC_CALIBRATE_MS);
+
+    // Gate on, speaker off; channel 2, lobyte/hibyte, mode 0
+    outb(0x61, (saved & ~0x02) | 0x01);
+    outb(0x43, 0xB0);
+    outb(0x42, count & 0xFF);
+    outb(0x42, (count >> 8) & 0xFF);
+
+    u64 start = timer_read_tsc();
+    u32 spins = 0;
+    while (!(inb(0x61) & 0x20) && ++spins < 10000000) {
+        // Wait for the counter output to go high
+    }
+    u64 end = timer_read_tsc();
+    outb(0x61, saved);
+
+    tsc_khz = (u32)(end - start) / TSC_CALIBRATE_MS;
+    if (spins >= 10000000 || tsc_khz == 0) {
+        tsc_khz = 1000000;  // No usable PIT: assume 1 GHz
+    }
+}
+
+u32 timer_tsc_khz(void) {
+    return tsc_khz;
+}
+
+// Convert TSC cycles to nanoseconds or microseconds (saturating)
+u32 timer_cycles_to_ns(u64 cycles) {
+    return udiv64(cycles * 1000000, tsc_khz);
+}
+
+u32 timer_cycles_to_us(u64 cycles) {
+    return udiv64(cycles * 1000, tsc_khz);
+}
+
 // Initialize timer (Programmable Interval Timer)
 void timer_init(void) {
     // Register timer interrupt handler (IRQ0 = interrupt 32)
@@ -33,7 +87,8 @@ void timer_init(void) {
     __asm__ volatile ("outb %%al, $0x40" : : "a"((u8)(divisor & 0xFF)));
     __asm__ volatile ("outb %%al, $0x40" : : "a"((u8)((divisor >> 8) & 0xFF)));
     
-    vga_printf("Timer initialized at %d Hz\n", timer_frequency);
+    timer_calibrate_tsc();
+    vga_printf("Timer initialized at %d Hz, TSC %d MHz\n", timer_frequency, tsc_khz / 1000);
 }
 
 // Get current timer ticks
@@ -41,6 +96,11 @@ u32 timer_get_ticks(void) {
     return timer_ticks;
 }
 
+// Get the tick rate in Hz
+u32 timer_get_frequency(void) {
+    return timer_frequency;
+}
+
 // Get uptime in seconds
 u32 timer_get_uptime(void) {
     return timer_ticks / timer_frequency;
@@ -50,6 +110,7 @@ u32 timer_get_uptime(void) {
 void timer_sleep(u32 ticks) {
     u32 target = timer_ticks + ticks;
     while (timer_ticks < target) {
+        work_run();
         __asm__ volatile ("hlt");
     }
 }
@@ -0,0 +1,253 @@
+#include "kernel.h"
+#include "vga.h"
+#include "net.h"
+#include "socket.h"
+#include "bench.h"
+
+// UDP. Bound sockets sit in a hash table keyed by local port; a socket
+// bound to one address wins over a wildcard socket on the same port, so
+// a received datagram costs one short chain walk however many sockets
+// are open.
+
+#define UDP_HASH_BITS       6
+#define UDP_HASH_SIZE       (1 << UDP_HASH_BITS)
+#define UDP_EPHEMERAL_FIRST 49152
+#define UDP_EPHEMERAL_LAST  65535
+
+static socket_t *udp_hash[UDP_HASH_SIZE];
+static u16 udp_next_ephemeral = UDP_EPHEMERAL_FIRST;
+
+// Statistics, named after the UDP MIB (RFC 4113)
+static u32 udp_in_datagrams = 0;
+static u32 udp_no_ports = 0;
+static u32 udp_in_errors = 0;
+static u32 udp_rcvbuf_errors = 0;
+static u32 udp_out_datagrams = 0;
+
+static inline u32 udp_bucket(u16 port) {
+    return port & (UDP_HASH_SIZE - 1);
+}
+
+// The socket for a local address and port, preferring an exact address
+// match over a wildcard one
+static socket_t *udp_lookup(u32 addr, u16 port) {
+    socket_t *wildcard = NULL;
+    for (socket_t *sock = udp_hash[udp_bucket(port)]; sock; sock = sock->hash_next) {
+        if (sock->local_port != port) continue;
+        if (sock->local_addr == addr) return sock;
+        if (!sock->local_addr) wildcard = sock;
+    }
+    return wildcard;
+}
+
+// Whether a new binding would clash with an existing one
+static int udp_port_in_use(u32 addr, u16 port) {
+    for (socket_t *sock = udp_hash[udp_bucket(port)]; sock; sock = sock->hash_next) {
+        if (sock->local_port == port && (!addr || !sock->local_addr || sock->local_addr == addr)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Bind a socket; port 0 picks a free ephemeral port
+int udp_bind(socket_t *sock, u32 addr, u16 port) {
+    if (!port) {
+        for (u32 tries = UDP_EPHEMERAL_LAST - UDP_EPHEMERAL_FIRST + 1; tries > 0; tries--) {
+            u16 candidate = udp_next_ephemeral;
+            udp_next_ephemeral = candidate == UDP_EPHEMERAL_LAST ? UDP_EPHEMERAL_FIRST : candidate + 1;
+            if (!udp_port_in_use(addr, candidate)) {
+                port = candidate;
+                break;
+            }
+        }
+        if (!port) return -NET_EADDRINUSE;
+    } else if (udp_port_in_use(addr, port)) {
+        return -NET_EADDRINUSE;
+    }
+
+    sock->local_addr = addr;
+    sock->local_port = port;
+    u32 bucket = udp_bucket(port);
+    sock->hash_next = udp_hash[bucket];
+    udp_hash[bucket] = sock;
+    return 0;
+}
+
+void udp_unbind(socket_t *sock) {
+    if (!sock->local_port) return;
+
+    socket_t **link = &udp_hash[udp_bucket(sock->local_port)];
+    while (*link && *link != sock) link = &(*link)->hash_next;
+    if (*link) *link = sock->hash_next;
+    sock->hash_next = NULL;
+    sock->local_port = 0;
+}
+
+// Check a received datagram and queue its payload on the socket it is for
+void udp_input(netbuf_t *nb, ip_header_t *ip) {
+    udp_header_t *udp = (udp_header_t *)nb->data;
+    u32 length = nb->len >= sizeof(udp_header_t) ? net_ntohs(udp->length) : 0;
+    if (length < sizeof(udp_header_t) || length > nb->len) {
+        udp_in_errors++;
+        netbuf_put(nb);
+        return;
+    }
+    nb->len = length;
+
+    // A zero checksum means the sender did not compute one
+    u32 src = net_ntohl(ip->src);
+    u32 dst = net_ntohl(ip->dst);
+    if (udp->checksum && ip_pseudo_checksum(src, dst, PROTO_UDP, udp, length) != 0) {
+        udp_in_errors++;
+        netbuf_put(nb);
+        return;
+    }
+
+    u16 src_port = net_ntohs(udp->src_port);
+    socket_t *sock = udp_lookup(dst, net_ntohs(udp->dst_port));
+    if (!sock) {
+        udp_no_ports++;
+        netbuf_put(nb);
+        return;
+    }
+
+    udp_in_datagrams++;
+    netbuf_pull(nb, sizeof(udp_header_t));
+    if (socket_deliver(sock, nb, src, src_port) != 0) udp_rcvbuf_errors++;
+}
+
+// Send one datagram from a bound socket
+int udp_sendto(socket_t *sock, const void *buf, u32 len, u32 addr, u16 port) {
+    if (len > UDP_MAX_PAYLOAD) return -NET_EMSGSIZE;
+
+    // The checksum covers the source address, so settle it now the way
+    // ip_output would
+    u32 src = sock->local_addr;
+    if (!src) {
+        u32 next_hop;
+        network_interface_t *iface = ip_route(addr, &next_hop);
+        if (!iface) return -NET_ENETUNREACH;
+        src = iface->transmit ? iface->ip_address : addr;
+    }
+
+    netbuf_t *nb = netbuf_alloc();
+    if (!nb) return -NET_ENOMEM;
+
+    udp_header_t *udp = (udp_header_t *)netbuf_append(nb, sizeof(udp_header_t) + len);
+    memcpy(udp + 1, buf, len);
+    udp->src_port = net_htons(sock->local_port);
+    udp->dst_port = net_htons(port);
+    udp->length = net_htons(sizeof(udp_header_t) + len);
+    udp->checksum = 0;
+    if (!ip_is_local(addr)) {
+        // Looped-back datagrams go without, which zero allows
+        u16 checksum = ip_pseudo_checksum(src, addr, PROTO_UDP, udp, nb->len);
+        udp->checksum = checksum ? checksum : 0xFFFF;  // Zero would mean "none"
+    }
+
+    if (ip_output(nb, src, addr, PROTO_UDP) != 0) return -NET_ENETUNREACH;
+    udp_out_datagrams++;
+    sock->tx_datagrams++;
+    return len;
+}
+
+void udp_stats(void) {
+    vga_printf("  UDP: %u received, %u no port, %u errors, %u queue full, %u sent\n",
+               udp_in_datagrams, udp_no_ports, udp_in_errors, udp_rcvbuf_errors,
+               udp_out_datagrams);
+}
+
+// Benchmark over loopback. First a ping-pong between a client and an
+// echo socket, one datagram in flight, for the round-trip latency of the
+// whole send and receive path; then a stream where the client sends
+// back to back and the receiver drains whatever has arrived after each
+// batch, for throughput and drops.
+
+#define UDP_BENCH_PORT    7       // Echo
+#define UDP_BENCH_BATCH   32
+#define UDP_BENCH_TIMEOUT 1000    // ms to wait for an echo
+
+void udp_bench(u32 count, u32 size, int machine) {
+    if (count < 1) count = 1;
+    if (size > UDP_MAX_PAYLOAD) size = UDP_MAX_PAYLOAD;
+
+    u8 *buf = (u8 *)kmalloc(UDP_MAX_PAYLOAD);
+    int server = network_socket(AF_INET, SOCK_DGRAM, 0);
+    int client = network_socket(AF_INET, SOCK_DGRAM, 0);
+    bench_t rtt;
+    memset(&rtt, 0, sizeof(bench_t));
+
+    int result;
+    if (server < 0 || client < 0) {
+        result = server < 0 ? server : client;
+    } else if (!buf || bench_init(&rtt, "udp", "rtt", count) != 0) {
+        result = -NET_ENOMEM;
+    } else {
+        result = network_bind(server, IP_LOOPBACK, UDP_BENCH_PORT);
+    }
+    if (result != 0) {
+        vga_printf("udpbench: Cannot set up sockets (error %d)\n", -result);
+        goto out;
+    }
+    network_setsockopt(server, SO_RCVTIMEO, UDP_BENCH_TIMEOUT);
+    network_setsockopt(client, SO_RCVTIMEO, UDP_BENCH_TIMEOUT);
+    for (u32 i = 0; i < size; i++) buf[i] = (u8)i;
+
+    if (machine) {
+        vga_printf("BENCH-CONFIG suite=udp datagrams=%u size=%u tsc_khz=%u\n",
+                   count, size, timer_tsc_khz());
+    } else {
+        vga_printf("udp bench: %u datagrams of %u bytes over loopback, TSC %u MHz\n",
+                   count, size, timer_tsc_khz() / 1000);
+    }
+    bench_header(machine);
+
+    for (u32 i = 0; i < count; i++) {
+        u32 addr;
+        u16 port;
+        bench_begin(&rtt);
+        int ok = network_sendto(client, buf, size, 0, IP_LOOPBACK, UDP_BENCH_PORT) == (int)size;
+        int received = ok ? network_recvfrom(server, buf, UDP_MAX_PAYLOAD, 0, &addr, &port) : -1;
+        ok = ok && received == (int)size &&
+             network_sendto(server, buf, received, 0, addr, port) == received;
+        ok = ok && network_recvfrom(client, buf, UDP_MAX_PAYLOAD, 0, NULL, NULL) == (int)size;
+        bench_end(&rtt);
+        if (!ok) rtt.errors++;
+    }
+    bench_report(&rtt, machine);
+
+    // Stream: each send is delivered when its loopback flush runs, so only
+    // the socket's receive queue bounds what can be in flight; datagrams
+    // sent faster than they are drained are dropped there
+    socket_t *sock = socket_get(server);
+    u32 drops_before = sock->rx_drops;
+    u32 sent = 0, received = 0;
+    u64 start = timer_read_tsc();
+    for (u32 i = 0; i < count; i++) {
+        if (network_sendto(client, buf, size, 0, IP_LOOPBACK, UDP_BENCH_PORT) == (int)size) sent++;
+        if ((i + 1) % UDP_BENCH_BATCH == 0 || i + 1 == count) {
+            while (network_recvfrom(server, buf, UDP_MAX_PAYLOAD, MSG_DONTWAIT, NULL, NULL) >= 0) {
+                received++;
+            }
+        }
+    }
+    u32 elapsed_us = timer_cycles_to_us(timer_read_tsc() - start);
+    u32 dropped = sock->rx_drops - drops_before;
+    u32 pps = elapsed_us ? udiv64((u64)received * 1000000, elapsed_us) : 0;
+    u32 kbps = elapsed_us ? udiv64((u64)received * size * 8000, elapsed_us) : 0;
+
+    if (machine) {
+        vga_printf("BENCH suite=udp op=stream sent=%u received=%u dropped=%u total_us=%u "
+                   "pps=%u kbit_per_sec=%u\n", sent, received, dropped, elapsed_us, pps, kbps);
+    } else {
+        vga_printf("stream: %u sent, %u received, %u dropped in %u us: %u datagrams/s, %u.%03u Mbit/s\n",
+                   sent, received, dropped, elapsed_us, pps, kbps / 1000, kbps % 1000);
+    }
+
+out:
+    bench_free(&rtt);
+    if (server >= 0) network_close(server);
+    if (client >= 0) network_close(client);
+    if (buf) kfree(buf);
+}
@@ -119,7 +119,20 @@ void vga_puts(const char *str) {
     }
 }
 
-// Simple printf implementation
+// Print a formatted field, padded to 'width' on the left (or on the
+// right if 'left' is set)
+static void vga_put_field(const char *str, int len, int width, int left, char pad) {
+    if (!left) {
+        for (int i = len; i < width; i++) vga_putchar(pad);
+    }
+    for (int i = 0; i < len; i++) vga_putchar(str[i]);
+    if (left) {
+        for (int i = len; i < width; i++) vga_putchar(' ');
+    }
+}
+
+// Simple printf implementation: %s %d %u %x %c with optional '-' and
+// '0' flags and a field width
 void vga_printf(const char *format, ...) {
     char *str;
     int num;
@@ -132,58 +145,76 @@ void vga_printf(const char *format, ...) {
     while (*format) {
         if (*format == '%') {
             format++;
+
+            int left = 0;
+            char pad = ' ';
+            int width = 0;
+            while (*format == '-' || *format == '0') {
+                if (*format == '-') left = 1;
+                else pad = '0';
+                format++;
+            }
+            while (*format >= '0' && *format <= '9') {
+                width = width * 10 + (*format++ - '0');
+            }
+            if (left) pad = ' ';
+            if (!*format) break;
+
+            char numstr[16];
+            int i = 0;
             switch (*format) {
                 case 's':
                     str = (char *)args[arg_index++];
-                    vga_puts(str ? str : "(null)");
+                    if (!str) str = "(null)";
+                    vga_put_field(str, strlen(str), width, left, ' ');
                     break;
                     
                 case 'd':
+                case 'u':
                     num = (int)args[arg_index++];
-                    if (num < 0) {
-                        vga_putchar('-');
-                        num = -num;
+                    unum = (unsigned int)num;
+                    if (*format == 'd' && num < 0) {
+                        unum = -unum;
                     }
-                    // Convert to string and print
-                    {
-                        char numstr[16];
-                        int i = 0;
-                        if (num == 0) {
-                            numstr[i++] = '0';
+                    // Convert to string, least significant digit first
+                    do {
+                        numstr[i++] = '0' + (unum % 10);
+                        unum /= 10;
+                    } while (unum > 0);
+                    if (*format == 'd' && num < 0) {
+                        if (pad == '0') {
+                            vga_putchar('-');
+                            width--;
                         } else {
-                            while (num > 0) {
-                                numstr[i++] = '0' + (num % 10);
-                                num /= 10;
-                            }
-                        }
-                        // Reverse the string
-                        for (int j = i - 1; j >= 0; j--) {
-                            vga_putchar(numstr[j]);
+                            numstr[i++] = '-';
                         }
                     }
+                    // Reverse the string
+                    for (int j = 0; j < i / 2; j++) {
+                        char c = numstr[j];
+                        numstr[j] = numstr[i - 1 - j];
+                        numstr[i - 1 - j] = c;
+                    }
+                    vga_put_field(numstr, i, width, left, pad);
                     break;
                     
                 case 'x':
                     unum = args[arg_index++];
-                    vga_puts("0x");
-                    // Convert to hex string
-                    {
-                        char hexstr[16];
-                        int i = 0;
-                        if (unum == 0) {
-                            hexstr[i++] = '0';
-                        } else {
-                            while (unum > 0) {
-                                int digit = unum % 16;
-                                hexstr[i++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
-                                unum /= 16;
-                            }
-                        }
-                        // Reverse the string
-                        for (int j = i - 1; j >= 0; j--) {
-                            vga_putchar(hexstr[j]);
-                        }
+                    // A bare %x keeps its 0x prefix; %02x and friends
+                    // print just the digits
+                    if (!width) vga_puts("0x");
+                    do {
+                        int digit = unum % 16;
+                        numstr[i++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+                        unum /= 16;
+                    } while (unum > 0);
+                    // Reverse the string
+                    for (int j = 0; j < i / 2; j++) {
+                        char c = numstr[j];
+                        numstr[j] = numstr[i - 1 - j];
+                        numstr[i - 1 - j] = c;
                     }
+                    vga_put_field(numstr, i, width, left, pad);
                     break;
                     
                 case 'c':
@@ -0,0 +1,236 @@
+#include "kernel.h"
+#include "vga.h"
+#include "io.h"
+#include "pci.h"
+#include "virtio.h"
+
+// Used ring flag: the device does not need to be notified
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+// Reset the device and negotiate features with it (legacy interface)
+int virtio_init_device(virtio_device_t *vdev, pci_device_t *pci, u32 wanted_features) {
+    if (!pci_bar_is_io(pci, 0)) return -1;
+
+    vdev->pci = pci;
+    vdev->io_base = pci_bar_address(pci, 0);
+    pci_enable_bus_master(pci);
+
+    outb(vdev->io_base + VIRTIO_REG_DEVICE_STATUS, 0);
+    outb(vdev->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(vdev->io_base + VIRTIO_REG_DEVICE_STATUS,
+         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    u32 device_features = inl(vdev->io_base + VIRTIO_REG_DEVICE_FEATURES);
+    vdev->features = device_features & wanted_features;
+    outl(vdev->io_base + VIRTIO_REG_GUEST_FEATURES, vdev->features);
+    return 0;
+}
+
+// Tell the device the driver is ready; queues must be set up first
+void virtio_driver_ok(virtio_device_t *vdev) {
+    outb(vdev->io_base + VIRTIO_REG_DEVICE_STATUS,
+         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+
+// Reading the ISR status also acknowledges the interrupt
+u8 virtio_read_isr(virtio_device_t *vdev) {
+    return inb(vdev->io_base + VIRTIO_REG_ISR_STATUS);
+}
+
+u8 virtio_config_read8(virtio_device_t *vdev, u32 offset) {
+    return inb(vdev->io_base + VIRTIO_REG_CONFIG + offset);
+}
+
+u16 virtio_config_read16(virtio_device_t *vdev, u32 offset) {
+    return inw(vdev->io_base + VIRTIO_REG_CONFIG + offset);
+}
+
+u32 virtio_config_read32(virtio_device_t *vdev, u32 offset) {
+    return inl(vdev->io_base + VIRTIO_REG_CONFIG + offset);
+}
+
+// Allocate and register split virtqueue 'index'
+int virtqueue_init(virtio_device_t *vdev, virtqueue_t *vq, u16 index) {
+    outw(vdev->io_base + VIRTIO_REG_QUEUE_SELECT, index);
+    u16 size = inw(vdev->io_base + VIRTIO_REG_QUEUE_SIZE);
+    if (size == 0) return -1;
+
+    // Legacy layout: descriptors and avail ring, then the used ring on
+    // the next page boundary
+    u32 avail_end = sizeof(virtq_desc_t) * size + sizeof(u16) * (3 + size);
+    u32 used_offset = (avail_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    u32 used_size = sizeof(u16) * 3 + sizeof(virtq_used_elem_t) * size;
+    u32 total = used_offset + ((used_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+
+    u8 *mem = (u8 *)kmalloc_aligned(total, PAGE_SIZE);
+    if (!mem) return -4; // Out of memory
+    memset(mem, 0, total);
+
+    memset(vq, 0, sizeof(virtqueue_t));
+    vq->vdev = vdev;
+    vq->index = index;
+    vq->size = size;
+    vq->desc = (virtq_desc_t *)mem;
+    vq->avail = (virtq_avail_t *)(mem + sizeof(virtq_desc_t) * size);
+    vq->used = (virtq_used_t *)(mem + used_offset);
+
+    // With event indexes each side publishes, just past its ring, the
+    // index at which it next wants to hear from the other
+    vq->event_idx = (vdev->features & VIRTIO_F_RING_EVENT_IDX) != 0;
+    vq->used_event = (volatile u16 *)((u8 *)vq->avail + sizeof(u16) * (2 + size));
+    vq->avail_event = (volatile u16 *)&vq->used->ring[size];
+
+    vq->cookies = (void **)kmalloc(sizeof(void *) * size);
+    if (!vq->cookies) {
+        kfree(mem);
+        return -4; // Out of memory
+    }
+
+    // All descriptors start on the free list
+    for (u16 i = 0; i < size; i++) {
+        vq->desc[i].next = i + 1;
+        vq->cookies[i] = NULL;
+    }
+    vq->free_head = 0;
+    vq->num_free = size;
+
+    // Indirect tables let every request use a single ring slot
+    if (vdev->features & VIRTIO_F_RING_INDIRECT_DESC) {
+        vq->indirect_tables = (virtq_desc_t *)kmalloc_aligned(
+            sizeof(virtq_desc_t) * VIRTQ_INDIRECT_MAX * size, 16);
+        vq->indirect = vq->indirect_tables != NULL;
+    }
+
+    outl(vdev->io_base + VIRTIO_REG_QUEUE_ADDRESS, (u32)mem / PAGE_SIZE);
+    return 0;
+}
+
+// Queue a buffer chain: 'out_count' device-readable elements followed by
+// 'in_count' device-writable ones. The device is not notified until
+// virtqueue_kick, so several buffers can share one notification.
+int virtqueue_add(virtqueue_t *vq, virtq_buf_t *bufs, u32 out_count, u32 in_count, void *cookie) {
+    u32 total = out_count + in_count;
+    if (total == 0) return -1;
+
+    u16 head = vq->free_head;
+
+    if (vq->indirect && total > 1 && total <= VIRTQ_INDIRECT_MAX) {
+        if (vq->num_free < 1) return -1; // Ring full
+
+        virtq_desc_t *table = &vq->indirect_tables[head * VIRTQ_INDIRECT_MAX];
+        for (u32 i = 0; i < total; i++) {
+            table[i].addr = (u32)bufs[i].addr;
+            table[i].len = bufs[i].len;
+            table[i].flags = (i >= out_count ? VIRTQ_DESC_F_WRITE : 0) |
+                             (i + 1 < total ? VIRTQ_DESC_F_NEXT : 0);
+            table[i].next = i + 1;
+        }
+
+        vq->free_head = vq->desc[head].next;
+        vq->desc[head].addr = (u32)table;
+        vq->desc[head].len = sizeof(virtq_desc_t) * total;
+        vq->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+        vq->num_free--;
+    } else {
+        if (vq->num_free < total) return -1; // Ring full
+
+        // The chain follows the free list, so each descriptor's 'next'
+        // already points at the following element
+        u16 idx = head;
+        for (u32 i = 0; i < total; i++) {
+            virtq_desc_t *desc = &vq->desc[idx];
+            desc->addr = (u32)bufs[i].addr;
+            desc->len = bufs[i].len;
+            desc->flags = (i >= out_count ? VIRTQ_DESC_F_WRITE : 0) |
+                          (i + 1 < total ? VIRTQ_DESC_F_NEXT : 0);
+            vq->free_head = desc->next;
+            idx = desc->next;
+        }
+        vq->num_free -= total;
+    }
+
+    vq->cookies[head] = cookie;
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    vq->avail_idx++;
+    vq->pending++;
+    return 0;
+}
+
+// Publish added buffers and notify the device once for all of them.
+// Returns 1 if the device was notified, 0 if it asked not to be.
+int virtqueue_kick(virtqueue_t *vq) {
+    if (!vq->pending) return 0;
+
+    u16 old_idx = vq->avail->idx;
+    u16 new_idx = vq->avail_idx;
+
+    barrier();
+    vq->avail->idx = new_idx;
+    mb();
+    vq->pending = 0;
+
+    int notify;
+    if (vq->event_idx) {
+        // Notify only if avail_event lies in the range just published
+        notify = (u16)(new_idx - *vq->avail_event - 1) < (u16)(new_idx - old_idx);
+    } else {
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (!notify) {
+        vq->notifications_suppressed++;
+        return 0;
+    }
+    outw(vq->vdev->io_base + VIRTIO_REG_QUEUE_NOTIFY, vq->index);
+    vq->notifications++;
+    return 1;
+}
+
+// Ask the device not to interrupt for this queue. With event indexes
+// used_event is simply left behind, so at most one more interrupt comes.
+void virtqueue_disable_cb(virtqueue_t *vq) {
+    vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+// Ask for an interrupt when the next buffer is used. Returns 0 if
+// buffers were used meanwhile, in which case the caller should process
+// them instead of waiting for an interrupt that may not come.
+int virtqueue_enable_cb(virtqueue_t *vq) {
+    vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    if (vq->event_idx) {
+        *vq->used_event = vq->last_used;
+    }
+    mb();
+    return !virtqueue_has_used(vq);
+}
+
+int virtqueue_has_used(virtqueue_t *vq) {
+    barrier();
+    return vq->last_used != vq->used->idx;
+}
+
+// Take the next completed buffer chain; returns its cookie or NULL
+void *virtqueue_get(virtqueue_t *vq, u32 *len) {
+    if (!virtqueue_has_used(vq)) return NULL;
+
+    virtq_used_elem_t *elem = &vq->used->ring[vq->last_used % vq->size];
+    u16 head = (u16)elem->id;
+    if (len) *len = elem->len;
+    vq->last_used++;
+
+    void *cookie = vq->cookies[head];
+    vq->cookies[head] = NULL;
+
+    // Return the chain to the free list
+    u16 tail = head;
+    u16 count = 1;
+    while (vq->desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+        tail = vq->desc[tail].next;
+        count++;
+    }
+    vq->desc[tail].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += count;
+
+    return cookie;
+}
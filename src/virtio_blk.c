@@ -0,0 +1,182 @@
+#include "kernel.h"
+#include "vga.h"
+#include "io.h"
+#include "pci.h"
+#include "virtio.h"
+#include "block.h"
+
+// Legacy virtio-blk PCI device ID
+#define VIRTIO_BLK_DEVICE_ID 0x1001
+
+// Feature bits
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)
+
+// Device configuration offsets
+#define VIRTIO_BLK_CFG_CAPACITY 0x00
+#define VIRTIO_BLK_CFG_SEG_MAX  0x0C
+
+// Request types and status
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK  0
+
+// Request limits: merged requests carry up to 16 data buffers
+#define VIRTIO_BLK_MAX_SEGMENTS 16
+#define VIRTIO_BLK_MAX_SECTORS  256
+#define VIRTIO_BLK_MAX_DEPTH    64
+
+typedef struct virtio_blk_header {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+} __attribute__((packed)) virtio_blk_header_t;
+
+// Per-request state the device reads the header from and writes the
+// status byte to
+typedef struct virtio_blk_slot {
+    virtio_blk_header_t header;
+    u8 status;
+    block_request_t *req;
+    struct virtio_blk_slot *next_free;
+} virtio_blk_slot_t;
+
+typedef struct virtio_blk {
+    block_device_t dev;
+    virtio_device_t vdev;
+    virtqueue_t vq;
+    virtio_blk_slot_t *slots;
+    virtio_blk_slot_t *free_slots;
+    u32 interrupts;
+    u32 completions;
+} virtio_blk_t;
+
+static virtio_blk_t vblk;
+static u8 vblk_present = 0;
+
+// Block layer hook: place a (possibly merged) request on the virtqueue.
+// The device is notified once per batch in virtio_blk_commit.
+static void virtio_blk_start(block_device_t *dev, block_request_t *req) {
+    virtio_blk_t *blk = (virtio_blk_t *)dev->driver_data;
+    virtio_blk_slot_t *slot = blk->free_slots;
+    virtq_buf_t bufs[VIRTIO_BLK_MAX_SEGMENTS + 2];
+    u32 n = 0;
+
+    if (!slot) {
+        block_complete(req, 0);
+        return;
+    }
+    blk->free_slots = slot->next_free;
+
+    slot->header.type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    slot->header.reserved = 0;
+    slot->header.sector = req->lba;
+    slot->status = 0xFF;
+    slot->req = req;
+
+    bufs[n].addr = &slot->header;
+    bufs[n++].len = sizeof(virtio_blk_header_t);
+    for (block_request_t *r = req; r; r = r->merged) {
+        bufs[n].addr = r->buffer;
+        bufs[n++].len = r->count * BLOCK_SECTOR_SIZE;
+    }
+    bufs[n].addr = &slot->status;
+    bufs[n++].len = 1;
+
+    // Data buffers are device-readable for writes, writable for reads
+    u32 out_count = req->write ? n - 1 : 1;
+    if (virtqueue_add(&blk->vq, bufs, out_count, n - out_count, slot) != 0) {
+        slot->next_free = blk->free_slots;
+        blk->free_slots = slot;
+        block_complete(req, 0);
+    }
+}
+
+static void virtio_blk_commit(block_device_t *dev) {
+    virtio_blk_t *blk = (virtio_blk_t *)dev->driver_data;
+    virtqueue_kick(&blk->vq);
+}
+
+// Complete every request the device has finished
+static void virtio_blk_drain(virtio_blk_t *blk) {
+    virtio_blk_slot_t *slot;
+    while ((slot = (virtio_blk_slot_t *)virtqueue_get(&blk->vq, NULL)) != NULL) {
+        block_request_t *req = slot->req;
+        int ok = slot->status == VIRTIO_BLK_S_OK;
+
+        slot->req = NULL;
+        slot->next_free = blk->free_slots;
+        blk->free_slots = slot;
+        blk->completions++;
+
+        block_complete(req, ok);
+    }
+}
+
+static void virtio_blk_poll(block_device_t *dev) {
+    virtio_blk_drain((virtio_blk_t *)dev->driver_data);
+}
+
+// Interrupt handler; the line may be shared with other PCI devices
+static void virtio_blk_irq(void) {
+    if (!vblk_present) return;
+    if (!(virtio_read_isr(&vblk.vdev) & 1)) return;
+
+    vblk.interrupts++;
+    virtio_blk_drain(&vblk);
+}
+
+// Initialize the virtio-blk driver
+void virtio_blk_init(void) {
+    pci_device_t *pci = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID);
+    if (!pci) return;
+
+    memset(&vblk, 0, sizeof(vblk));
+    if (virtio_init_device(&vblk.vdev, pci, VIRTIO_F_RING_INDIRECT_DESC | VIRTIO_BLK_F_SEG_MAX) != 0) {
+        return;
+    }
+    if (virtqueue_init(&vblk.vdev, &vblk.vq, 0) != 0) {
+        vga_printf("virtio-blk: queue setup failed\n");
+        return;
+    }
+
+    // With indirect descriptors each request takes one ring slot;
+    // otherwise it takes a header, its data buffers and a status byte
+    u32 max_segments = VIRTIO_BLK_MAX_SEGMENTS;
+    if (vblk.vdev.features & VIRTIO_BLK_F_SEG_MAX) {
+        u32 seg_max = virtio_config_read32(&vblk.vdev, VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < max_segments) max_segments = seg_max;
+    }
+    u32 depth = vblk.vq.indirect ? vblk.vq.size : vblk.vq.size / (max_segments + 2);
+    if (depth > VIRTIO_BLK_MAX_DEPTH) depth = VIRTIO_BLK_MAX_DEPTH;
+    if (depth == 0) depth = 1;
+
+    vblk.slots = (virtio_blk_slot_t *)kmalloc(sizeof(virtio_blk_slot_t) * depth);
+    if (!vblk.slots) return;
+    for (u32 i = 0; i < depth; i++) {
+        vblk.slots[i].next_free = i + 1 < depth ? &vblk.slots[i + 1] : NULL;
+        vblk.slots[i].req = NULL;
+    }
+    vblk.free_slots = &vblk.slots[0];
+
+    block_device_t *dev = &vblk.dev;
+    strcpy(dev->name, "vda");
+    dev->sector_count = virtio_config_read32(&vblk.vdev, VIRTIO_BLK_CFG_CAPACITY);
+    if (virtio_config_read32(&vblk.vdev, VIRTIO_BLK_CFG_CAPACITY + 4)) {
+        dev->sector_count = 0xFFFFFFFF;  // Only the first 2TB are addressable
+    }
+    dev->max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    dev->max_segments = max_segments;
+    dev->queue_depth = depth;
+    dev->start = virtio_blk_start;
+    dev->commit = virtio_blk_commit;
+    dev->poll = virtio_blk_poll;
+    dev->driver_data = &vblk;
+
+    vblk_present = 1;
+    register_irq_handler(pci->irq_line, virtio_blk_irq);
+    virtio_driver_ok(&vblk.vdev);
+
+    vga_printf("virtio-blk %s: queue size %d, depth %d, %s descriptors\n",
+               dev->name, vblk.vq.size, depth, vblk.vq.indirect ? "indirect" : "direct");
+    block_register(dev);
+}
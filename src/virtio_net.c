@@ -0,0 +1,320 @@
+#include "kernel.h"
+#include "vga.h"
+#include "io.h"
+#include "pci.h"
+#include "virtio.h"
+#include "net.h"
+
+// Legacy virtio-net PCI device ID
+#define VIRTIO_NET_DEVICE_ID 0x1000
+
+// Feature bits
+#define VIRTIO_NET_F_MAC       (1 << 5)
+#define VIRTIO_NET_F_MRG_RXBUF (1 << 15)
+#define VIRTIO_NET_F_STATUS    (1 << 16)
+
+// Device configuration offsets
+#define VIRTIO_NET_CFG_MAC    0x00
+#define VIRTIO_NET_CFG_STATUS 0x06
+#define VIRTIO_NET_S_LINK_UP  1
+
+#define VIRTIO_NET_RX_QUEUE 0
+#define VIRTIO_NET_TX_QUEUE 1
+
+// Receive buffers are packet buffers posted in advance, one descriptor
+// each. They hold the header plus a full frame, so a frame normally
+// arrives in one buffer and goes up the stack without a copy; with
+// mergeable buffers the device may still split one across several,
+// and those frames are reassembled by copying.
+#define VIRTIO_NET_MAX_RX_BUFS     128
+#define VIRTIO_NET_MAX_TX_SLOTS    128
+
+// Header in front of every frame. num_buffers is only present (and
+// the header 12 bytes long) with mergeable RX buffers.
+typedef struct virtio_net_hdr {
+    u8 flags;
+    u8 gso_type;
+    u16 hdr_len;
+    u16 gso_size;
+    u16 csum_start;
+    u16 csum_offset;
+    u16 num_buffers;
+} __attribute__((packed)) virtio_net_hdr_t;
+
+// A transmit slot: the header and a reference to the frame's buffer,
+// handed to the device as two elements plus one per fragment (one ring
+// slot with indirect descriptors)
+typedef struct virtio_net_tx_slot {
+    virtio_net_hdr_t header;
+    netbuf_t *nb;
+    struct virtio_net_tx_slot *next_free;
+} virtio_net_tx_slot_t;
+
+typedef struct virtio_net {
+    network_interface_t *iface;
+    virtio_device_t vdev;
+    virtqueue_t rx;
+    virtqueue_t tx;
+    u32 header_size;
+    u32 rx_buf_count;
+    virtio_net_tx_slot_t *tx_slots;
+    virtio_net_tx_slot_t *free_tx_slots;
+
+    // Frame being reassembled from mergeable buffers
+    u8 frame[NET_ETH_FRAME_MAX];
+    u32 frame_len;
+    u32 buffers_left;
+
+    u32 merged_frames;
+} virtio_net_t;
+
+static virtio_net_t vnet;
+static u8 vnet_present = 0;
+
+// Post an empty receive buffer; the device is notified in the next kick
+static int virtio_net_post_rx(virtio_net_t *net, netbuf_t *nb) {
+    netbuf_reset(nb);
+    virtq_buf_t buf = { nb->data, NETBUF_DATA_SIZE };
+    return virtqueue_add(&net->rx, &buf, 0, 1, nb);
+}
+
+// Return completed TX slots to the free list, dropping their buffer
+// references. TX interrupts are off, so this runs whenever a slot is
+// needed.
+static void virtio_net_tx_reclaim(virtio_net_t *net) {
+    virtio_net_tx_slot_t *slot;
+    while ((slot = (virtio_net_tx_slot_t *)virtqueue_get(&net->tx, NULL)) != NULL) {
+        netbuf_put(slot->nb);
+        slot->nb = NULL;
+        slot->next_free = net->free_tx_slots;
+        net->free_tx_slots = slot;
+    }
+}
+
+// Interface hook: queue a frame behind a TX slot's header
+static int virtio_net_transmit(network_interface_t *iface, netbuf_t *nb) {
+    virtio_net_t *net = (virtio_net_t *)iface->driver_data;
+
+    u32 flags = irq_save();
+    if (!net->free_tx_slots) virtio_net_tx_reclaim(net);
+    virtio_net_tx_slot_t *slot = net->free_tx_slots;
+    if (!slot) {
+        irq_restore(flags);
+        return -1; // Ring full
+    }
+    net->free_tx_slots = slot->next_free;
+
+    memset(&slot->header, 0, sizeof(virtio_net_hdr_t));
+
+    virtq_buf_t bufs[2 + NETBUF_MAX_FRAGS] = {
+        { &slot->header, net->header_size },
+        { nb->data, nb->len },
+    };
+    for (u32 i = 0; i < nb->frag_count; i++) {
+        bufs[2 + i].addr = (void *)nb->frags[i].data;
+        bufs[2 + i].len = nb->frags[i].len;
+    }
+    if (virtqueue_add(&net->tx, bufs, 2 + nb->frag_count, 0, slot) != 0) {
+        slot->next_free = net->free_tx_slots;
+        net->free_tx_slots = slot;
+        irq_restore(flags);
+        return -1;
+    }
+    netbuf_get(nb);
+    slot->nb = nb;
+    irq_restore(flags);
+    return 0;
+}
+
+// Interface hook: publish the batch; with event indexes the device is
+// only notified if it is waiting for new buffers
+static void virtio_net_commit(network_interface_t *iface) {
+    virtio_net_t *net = (virtio_net_t *)iface->driver_data;
+
+    u32 flags = irq_save();
+    if (virtqueue_kick(&net->tx)) iface->tx_doorbells++;
+    irq_restore(flags);
+}
+
+// Consume one used RX buffer, completing a frame once all of its
+// buffers have arrived. Returns the buffer if it can be reposted, or
+// NULL if it went up the stack.
+static netbuf_t *virtio_net_rx_buffer(virtio_net_t *net, netbuf_t *nb, u32 len) {
+    u8 *buffer = nb->data;
+
+    if (net->buffers_left == 0) {
+        // First buffer of a frame: the header says how many follow
+        virtio_net_hdr_t *header = (virtio_net_hdr_t *)buffer;
+        net->buffers_left = net->header_size == sizeof(virtio_net_hdr_t) ? header->num_buffers : 1;
+        if (net->buffers_left == 0) net->buffers_left = 1;
+        if (net->buffers_left > 1) net->merged_frames++;
+
+        // The common case: the whole frame is in this buffer
+        if (net->buffers_left == 1 && len >= net->header_size) {
+            net->buffers_left = 0;
+            nb->len = len;
+            netbuf_pull(nb, net->header_size);
+            netbuf_t *fresh = netbuf_alloc();
+            if (!fresh) {
+                net->iface->rx_dropped++;
+                return nb;
+            }
+            network_receive_netbuf(net->iface, nb);
+            return fresh;
+        }
+
+        net->frame_len = 0;
+        buffer += net->header_size;
+        len = len > net->header_size ? len - net->header_size : 0;
+    }
+
+    if (net->frame_len + len <= NET_ETH_FRAME_MAX) {
+        memcpy(net->frame + net->frame_len, buffer, len);
+    } else {
+        net->frame_len = NET_ETH_FRAME_MAX + 1;  // Oversized; dropped below
+        len = 0;
+    }
+    net->frame_len += len;
+
+    if (--net->buffers_left == 0) {
+        if (net->frame_len <= NET_ETH_FRAME_MAX) {
+            network_receive(net->iface, net->frame, net->frame_len);
+        } else {
+            net->iface->rx_dropped++;
+        }
+    }
+    return nb;
+}
+
+// Interface hook: from the net-rx job with RX callbacks off, take up
+// to 'budget' used buffers, repost them, and notify the device once
+static u32 virtio_net_poll(network_interface_t *iface, u32 budget) {
+    virtio_net_t *net = (virtio_net_t *)iface->driver_data;
+    netbuf_t *nb;
+    u32 len, done = 0;
+
+    while (done < budget && (nb = (netbuf_t *)virtqueue_get(&net->rx, &len)) != NULL) {
+        virtio_net_post_rx(net, virtio_net_rx_buffer(net, nb, len));
+        done++;
+    }
+    if (done) virtqueue_kick(&net->rx);
+    return done;
+}
+
+// Interface hook: turn RX callbacks back on, unless buffers were used
+// while they were off
+static int virtio_net_poll_done(network_interface_t *iface) {
+    virtio_net_t *net = (virtio_net_t *)iface->driver_data;
+
+    // The interrupt handler also writes the avail flags
+    u32 flags = irq_save();
+    int pending = !virtqueue_enable_cb(&net->rx);
+    if (pending) virtqueue_disable_cb(&net->rx);
+    irq_restore(flags);
+    return pending;
+}
+
+// Interrupt handler; the line may be shared with other PCI devices.
+// It only starts a poll, leaving callbacks off until the poll is done.
+static void virtio_net_irq(void) {
+    if (!vnet_present) return;
+    if (!(virtio_read_isr(&vnet.vdev) & 1)) return;
+
+    vnet.iface->interrupts++;
+    virtqueue_disable_cb(&vnet.rx);
+    network_schedule_poll(vnet.iface);
+}
+
+// Interface hook: driver statistics for netstat
+static void virtio_net_stats(network_interface_t *iface) {
+    virtio_net_t *net = (virtio_net_t *)iface->driver_data;
+    vga_printf("    %u merged RX frames; notifications RX %u (%u suppressed), TX %u (%u suppressed)\n",
+               net->merged_frames,
+               net->rx.notifications, net->rx.notifications_suppressed,
+               net->tx.notifications, net->tx.notifications_suppressed);
+}
+
+// Initialize the virtio-net driver
+void virtio_net_init(void) {
+    pci_device_t *pci = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_DEVICE_ID);
+    if (!pci) return;
+
+    memset(&vnet, 0, sizeof(vnet));
+    u32 wanted = VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS |
+                 VIRTIO_F_RING_EVENT_IDX | VIRTIO_F_RING_INDIRECT_DESC;
+    if (virtio_init_device(&vnet.vdev, pci, wanted) != 0) return;
+
+    if (virtqueue_init(&vnet.vdev, &vnet.rx, VIRTIO_NET_RX_QUEUE) != 0 ||
+        virtqueue_init(&vnet.vdev, &vnet.tx, VIRTIO_NET_TX_QUEUE) != 0) {
+        vga_printf("virtio-net: queue setup failed\n");
+        return;
+    }
+
+    if (vnet.vdev.features & VIRTIO_NET_F_MRG_RXBUF) {
+        vnet.header_size = sizeof(virtio_net_hdr_t);
+    } else {
+        vnet.header_size = sizeof(virtio_net_hdr_t) - sizeof(u16);
+    }
+
+    vnet.rx_buf_count = vnet.rx.size < VIRTIO_NET_MAX_RX_BUFS ? vnet.rx.size : VIRTIO_NET_MAX_RX_BUFS;
+
+    // Two descriptors per frame unless indirect tables are available
+    u32 tx_count = vnet.tx.indirect ? vnet.tx.size : vnet.tx.size / 2;
+    if (tx_count > VIRTIO_NET_MAX_TX_SLOTS) tx_count = VIRTIO_NET_MAX_TX_SLOTS;
+    vnet.tx_slots = (virtio_net_tx_slot_t *)kmalloc(sizeof(virtio_net_tx_slot_t) * tx_count);
+    if (!vnet.tx_slots) {
+        vga_printf("virtio-net: out of memory for buffers\n");
+        return;
+    }
+    for (u32 i = 0; i < tx_count; i++) {
+        vnet.tx_slots[i].next_free = i + 1 < tx_count ? &vnet.tx_slots[i + 1] : NULL;
+    }
+    vnet.free_tx_slots = &vnet.tx_slots[0];
+
+    for (u32 i = 0; i < vnet.rx_buf_count; i++) {
+        netbuf_t *nb = netbuf_alloc();
+        if (!nb) {
+            vga_printf("virtio-net: out of packet buffers\n");
+            return;
+        }
+        virtio_net_post_rx(&vnet, nb);
+    }
+
+    u8 mac[6];
+    for (u32 i = 0; i < 6; i++) {
+        mac[i] = (vnet.vdev.features & VIRTIO_NET_F_MAC) ?
+                 virtio_config_read8(&vnet.vdev, VIRTIO_NET_CFG_MAC + i) : 0;
+    }
+    if (!(vnet.vdev.features & VIRTIO_NET_F_MAC)) {
+        mac[0] = 0x52; mac[1] = 0x54; mac[5] = 0x01;  // Locally administered
+    }
+
+    network_interface_t *iface = network_register_interface(NULL, mac);
+    if (!iface) return;
+    iface->transmit = virtio_net_transmit;
+    iface->commit = virtio_net_commit;
+    iface->stats = virtio_net_stats;
+    iface->poll = virtio_net_poll;
+    iface->poll_done = virtio_net_poll_done;
+    iface->driver_data = &vnet;
+    iface->gather = vnet.tx.indirect;  // Slots are sized for two direct descriptors
+    vnet.iface = iface;
+
+    // Completed transmits are reclaimed lazily, so TX needs no interrupts
+    virtqueue_disable_cb(&vnet.tx);
+    virtqueue_enable_cb(&vnet.rx);
+
+    vnet_present = 1;
+    register_irq_handler(pci->irq_line, virtio_net_irq);
+    virtio_driver_ok(&vnet.vdev);
+    virtqueue_kick(&vnet.rx);
+
+    int link_up = !(vnet.vdev.features & VIRTIO_NET_F_STATUS) ||
+                  (virtio_config_read16(&vnet.vdev, VIRTIO_NET_CFG_STATUS) & VIRTIO_NET_S_LINK_UP);
+    vga_printf("virtio-net %s: %02x:%02x:%02x:%02x:%02x:%02x, %d RX buffers of %d bytes%s%s, link %s\n",
+               iface->name, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+               vnet.rx_buf_count, NETBUF_DATA_SIZE,
+               vnet.header_size == sizeof(virtio_net_hdr_t) ? ", mergeable" : "",
+               vnet.rx.event_idx ? ", event idx" : "",
+               link_up ? "up" : "down");
+}
@@ -0,0 +1,80 @@
+#include "kernel.h"
+#include "vga.h"
+
+// Deferred work. There is no preemptive scheduler, so background jobs
+// and work raised by interrupt handlers run from the kernel's idle
+// loops (waiting for a key or sleeping) via work_run.
+
+#define MAX_WORK 8
+
+typedef struct work {
+    const char *name;
+    void (*fn)(void);
+    u32 period;          // Ticks between periodic runs, 0 if raised only
+    u32 next_run;
+    volatile u8 pending; // Raised from interrupt context
+    u32 runs;
+} work_t;
+
+static work_t works[MAX_WORK];
+static u32 work_count = 0;
+static u8 work_running = 0;
+
+// Register a job. A non-zero 'period_ms' makes it run periodically;
+// any job can also be raised with work_raise. Returns the job id.
+int work_register(const char *name, void (*fn)(void), u32 period_ms) {
+    if (work_count >= MAX_WORK) return -1;
+
+    work_t *work = &works[work_count];
+    work->name = name;
+    work->fn = fn;
+    work->period = period_ms ? (period_ms * timer_get_frequency() + 999) / 1000 : 0;
+    work->next_run = timer_get_ticks() + work->period;
+    work->pending = 0;
+    work->runs = 0;
+    return work_count++;
+}
+
+// Ask for a job to run at the next opportunity; safe from IRQ handlers
+void work_raise(int id) {
+    if (id >= 0 && (u32)id < work_count) {
+        works[id].pending = 1;
+    }
+}
+
+// Whether any job has been raised and not yet run; callers that are
+// about to halt until the next interrupt check this first
+int work_pending(void) {
+    for (u32 i = 0; i < work_count; i++) {
+        if (works[i].pending) return 1;
+    }
+    return 0;
+}
+
+// Run every raised or due job. Jobs never nest.
+void work_run(void) {
+    if (work_running) return;
+    work_running = 1;
+
+    u32 now = timer_get_ticks();
+    for (u32 i = 0; i < work_count; i++) {
+        work_t *work = &works[i];
+        int due = work->period && (s32)(now - work->next_run) >= 0;
+        if (!work->pending && !due) continue;
+
+        work->pending = 0;
+        if (due) work->next_run = now + work->period;
+        work->runs++;
+        work->fn();
+    }
+
+    work_running = 0;
+}
+
+// Show registered jobs
+void work_list(void) {
+    vga_printf("Name\t\t\tPeriod (ticks)\tRuns\n");
+    for (u32 i = 0; i < work_count; i++) {
+        vga_printf("%-20s\t%d\t\t%d\n", works[i].name, works[i].period, works[i].runs);
+    }
+}